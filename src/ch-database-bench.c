@@ -0,0 +1,981 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*-
+ *
+ * Copyright (C) 2011-2012 Richard Hughes <richard@hughsie.com>
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "config.h"
+
+#include <glib/gi18n.h>
+#include <glib/gstdio.h>
+#include <gio/gio.h>
+#include <locale.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ch-database.h"
+
+/* the number of rows to write in each transaction */
+#define CH_BENCH_BATCH_SIZE		1000
+
+typedef struct {
+	const gchar	*name;
+	GArray		*samples;	/* of gint64, in ns */
+} ChBenchTimer;
+
+typedef struct {
+	gchar		*uri;
+	gchar		*checksum;
+	gdouble		 elapsed;
+	GPtrArray	*timers;	/* of ChBenchTimer, in first-use order */
+} ChBenchRun;
+
+typedef struct {
+	ChDatabase	*database;
+	ChBenchRun	*run;
+	GRand		*rand;
+	guint		 devices;
+	guint		 orders;
+	guint		 iterations;
+	gboolean	 check;
+	guint32		 order_id_first;
+	guint32		 order_id_last;
+	guint32		 device_id_first;
+	guint32		 device_id_last;
+} ChBenchPrivate;
+
+/* the slowest an indexed lookup can be, in microseconds at the 99th
+ * percentile, before --check-latency fails; a full scan is far slower than
+ * this, but it depends on the machine so it is not part of --check */
+static const struct {
+	const gchar	*name;
+	gdouble		 p99;
+} ch_bench_budgets[] = {
+	{ "device_get_state",		1000 },
+	{ "order_get_comment",		1000 },
+	{ "order_get_device_ids",	1000 },
+	{ "device_get_number",		1000 },
+	{ "device_find_oldest",		1000 },
+	{ "get_inventory",		1000 },
+	{ "get_orders_generation",	1000 },
+	{ "get_orders(100)",		10000 },
+	{ "search_orders",		20000 },
+	{ NULL,				0 }
+};
+
+static const gchar *ch_bench_first_names[] = {
+	"Alice", "Bob", "Carol", "Dave", "Erin", "Frank", "Grace", "Heidi",
+	"Ivan", "Judy", "Mallory", "Niaj", "Olivia", "Peggy", "Rupert",
+	"Sybil", "Trent", "Victor", "Walter", "Yvonne", NULL };
+static const gchar *ch_bench_last_names[] = {
+	"Smith", "Jones", "Taylor", "Brown", "Williams", "Wilson", "Johnson",
+	"Davies", "Robinson", "Wright", "Thompson", "Evans", "Walker", "White",
+	"Roberts", "Green", "Hall", "Wood", "Jackson", "Clarke", "Müller",
+	"Dubois", "Rossi", "García", "Nowak", "Jensen", "Novák", NULL };
+static const gchar *ch_bench_towns[] = {
+	"London", "Manchester", "Leeds", "Berlin", "Paris", "Madrid", "Rome",
+	"Warsaw", "Copenhagen", "Prague", "New York", "Tokyo", NULL };
+
+static gint64
+ch_bench_now (void)
+{
+	struct timespec ts;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return (gint64) ts.tv_sec * G_GINT64_CONSTANT (1000000000) + ts.tv_nsec;
+}
+
+static void
+ch_bench_timer_free (ChBenchTimer *timer)
+{
+	g_array_unref (timer->samples);
+	g_free (timer);
+}
+
+static void
+ch_bench_run_free (ChBenchRun *run)
+{
+	g_ptr_array_unref (run->timers);
+	g_free (run->checksum);
+	g_free (run->uri);
+	g_free (run);
+}
+
+/* records how long since @start, where @name is a static string */
+static void
+ch_bench_sample (ChBenchPrivate *priv, const gchar *name, gint64 start)
+{
+	ChBenchTimer *timer = NULL;
+	gint64 elapsed;
+	guint i;
+
+	elapsed = ch_bench_now () - start;
+	for (i = 0; i < priv->run->timers->len; i++) {
+		timer = g_ptr_array_index (priv->run->timers, i);
+		if (g_strcmp0 (timer->name, name) == 0)
+			break;
+		timer = NULL;
+	}
+	if (timer == NULL) {
+		timer = g_new0 (ChBenchTimer, 1);
+		timer->name = name;
+		timer->samples = g_array_new (FALSE, FALSE, sizeof (gint64));
+		g_ptr_array_add (priv->run->timers, timer);
+	}
+	g_array_append_val (timer->samples, elapsed);
+}
+
+static const gchar *
+ch_bench_pick (ChBenchPrivate *priv, const gchar **strv)
+{
+	return strv[g_rand_int_range (priv->rand, 0, g_strv_length ((gchar **) strv))];
+}
+
+static guint32
+ch_bench_random_order (ChBenchPrivate *priv)
+{
+	return g_rand_int_range (priv->rand,
+				 priv->order_id_first,
+				 priv->order_id_last + 1);
+}
+
+static guint32
+ch_bench_random_device (ChBenchPrivate *priv)
+{
+	return g_rand_int_range (priv->rand,
+				 priv->device_id_first,
+				 priv->device_id_last + 1);
+}
+
+static gboolean
+ch_bench_add_devices (ChBenchPrivate *priv, GError **error)
+{
+	GArray *calibrated = NULL;
+	gboolean ret = TRUE;
+	gint64 start;
+	guint32 id;
+	guint hw_ver;
+	guint i;
+
+	/* about a third of the devices are the original ColorHug */
+	priv->device_id_first = G_MAXUINT32;
+	ret = ch_database_begin (priv->database, error);
+	if (!ret)
+		goto out;
+	for (i = 0; i < priv->devices; i++) {
+		hw_ver = g_rand_int_range (priv->rand, 0, 10) < 3 ? 1 : 2;
+		start = ch_bench_now ();
+		id = ch_database_add_device (priv->database, hw_ver, error);
+		ch_bench_sample (priv, "add_device", start);
+		if (id == G_MAXUINT32) {
+			ret = FALSE;
+			ch_database_rollback (priv->database, NULL);
+			goto out;
+		}
+		priv->device_id_first = MIN (priv->device_id_first, id);
+		priv->device_id_last = MAX (priv->device_id_last, id);
+		if (i % CH_BENCH_BATCH_SIZE == CH_BENCH_BATCH_SIZE - 1) {
+			ret = ch_database_commit (priv->database, error);
+			if (!ret)
+				goto out;
+			ret = ch_database_begin (priv->database, error);
+			if (!ret)
+				goto out;
+		}
+	}
+	ret = ch_database_commit (priv->database, error);
+	if (!ret)
+		goto out;
+
+	/* most have been through the calibration station */
+	calibrated = g_array_new (FALSE, FALSE, sizeof (guint32));
+	for (id = priv->device_id_first; id <= priv->device_id_last; id++) {
+		if (g_rand_int_range (priv->rand, 0, 10) == 0)
+			continue;
+
+		/* a few the slow way, as the factory does */
+		if (id - priv->device_id_first < priv->iterations) {
+			start = ch_bench_now ();
+			ret = ch_database_device_set_state (priv->database, id,
+							    CH_DEVICE_STATE_CALIBRATED,
+							    error);
+			ch_bench_sample (priv, "device_set_state", start);
+			if (!ret)
+				goto out;
+			continue;
+		}
+		g_array_append_val (calibrated, id);
+		if (calibrated->len == CH_BENCH_BATCH_SIZE) {
+			start = ch_bench_now ();
+			ret = ch_database_devices_set_state (priv->database, calibrated,
+							     CH_DEVICE_STATE_CALIBRATED,
+							     error);
+			ch_bench_sample (priv, "devices_set_state", start);
+			if (!ret)
+				goto out;
+			g_array_set_size (calibrated, 0);
+		}
+	}
+	if (calibrated->len > 0) {
+		start = ch_bench_now ();
+		ret = ch_database_devices_set_state (priv->database, calibrated,
+						     CH_DEVICE_STATE_CALIBRATED,
+						     error);
+		ch_bench_sample (priv, "devices_set_state", start);
+	}
+out:
+	if (calibrated != NULL)
+		g_array_unref (calibrated);
+	return ret;
+}
+
+static gboolean
+ch_bench_add_orders (ChBenchPrivate *priv, GError **error)
+{
+	ChShippingKind postage;
+	GArray *device_ids;
+	GArray *order_ids[CH_ORDER_STATE_LAST];
+	const gchar *first_name;
+	const gchar *last_name;
+	gboolean ret = TRUE;
+	gchar *address;
+	gchar *email;
+	gchar *name;
+	gchar *tracking;
+	gint64 start;
+	guint32 id;
+	guint i;
+
+	for (i = 0; i < CH_ORDER_STATE_LAST; i++)
+		order_ids[i] = g_array_new (FALSE, FALSE, sizeof (guint32));
+
+	/* customers are added in batches, as the shop export is imported */
+	priv->order_id_first = G_MAXUINT32;
+	ret = ch_database_begin (priv->database, error);
+	if (!ret)
+		goto out;
+	for (i = 0; i < priv->orders; i++) {
+		first_name = ch_bench_pick (priv, ch_bench_first_names);
+		last_name = ch_bench_pick (priv, ch_bench_last_names);
+		name = g_strdup_printf ("%s %s", first_name, last_name);
+		address = g_strdup_printf ("%i High Street\n%s\nAB%i %iCD",
+					   g_rand_int_range (priv->rand, 1, 200),
+					   ch_bench_pick (priv, ch_bench_towns),
+					   g_rand_int_range (priv->rand, 1, 99),
+					   g_rand_int_range (priv->rand, 1, 9));
+		email = g_strdup_printf ("%s.%s%i@example.com", first_name, last_name,
+					 g_rand_int_range (priv->rand, 1, 1000));
+		postage = g_rand_int_range (priv->rand,
+					    CH_SHIPPING_KIND_CH2_UK_SIGNED,
+					    CH_SHIPPING_KIND_LAST);
+		start = ch_bench_now ();
+		id = ch_database_add_order (priv->database, name, address,
+					    email, postage, error);
+		ch_bench_sample (priv, "add_order", start);
+		g_free (name);
+		g_free (address);
+		g_free (email);
+		if (id == G_MAXUINT32) {
+			ret = FALSE;
+			ch_database_rollback (priv->database, NULL);
+			goto out;
+		}
+		priv->order_id_first = MIN (priv->order_id_first, id);
+		priv->order_id_last = MAX (priv->order_id_last, id);
+		if (i % CH_BENCH_BATCH_SIZE == CH_BENCH_BATCH_SIZE - 1) {
+			ret = ch_database_commit (priv->database, error);
+			if (!ret)
+				goto out;
+			ret = ch_database_begin (priv->database, error);
+			if (!ret)
+				goto out;
+		}
+	}
+	ret = ch_database_commit (priv->database, error);
+	if (!ret)
+		goto out;
+
+	/* most orders are for devices, the rest are accessories */
+	for (id = priv->order_id_first; id <= priv->order_id_last; id++) {
+		if (g_rand_int_range (priv->rand, 0, 5) == 0)
+			continue;
+		start = ch_bench_now ();
+		device_ids = ch_database_allocate_devices (priv->database, id,
+							   g_rand_int_range (priv->rand, 0, 10) < 3 ? 1 : 2,
+							   g_rand_int_range (priv->rand, 1, 4),
+							   error);
+		ch_bench_sample (priv, "allocate_devices", start);
+		if (device_ids == NULL) {
+			ret = FALSE;
+			goto out;
+		}
+		g_array_unref (device_ids);
+	}
+
+	/* spread the orders over every state */
+	for (id = priv->order_id_first; id <= priv->order_id_last; id++) {
+		i = g_rand_int_range (priv->rand, 0, CH_ORDER_STATE_LAST);
+		g_array_append_val (order_ids[i], id);
+	}
+	for (i = 0; i < CH_ORDER_STATE_LAST; i++) {
+		if (order_ids[i]->len == 0)
+			continue;
+		start = ch_bench_now ();
+		ret = ch_database_orders_set_state (priv->database, order_ids[i], i, error);
+		ch_bench_sample (priv, "orders_set_state", start);
+		if (!ret)
+			goto out;
+	}
+
+	/* sent orders have a tracking number, and some have a comment */
+	ret = ch_database_begin (priv->database, error);
+	if (!ret)
+		goto out;
+	for (i = 0; i < order_ids[CH_ORDER_STATE_SENT]->len; i++) {
+		id = g_array_index (order_ids[CH_ORDER_STATE_SENT], guint32, i);
+		tracking = g_strdup_printf ("RR%09iGB", id);
+		start = ch_bench_now ();
+		ret = ch_database_order_set_tracking (priv->database, id, tracking, error);
+		ch_bench_sample (priv, "order_set_tracking", start);
+		g_free (tracking);
+		if (!ret) {
+			ch_database_rollback (priv->database, NULL);
+			goto out;
+		}
+		if (g_rand_int_range (priv->rand, 0, 10) != 0)
+			continue;
+		start = ch_bench_now ();
+		ret = ch_database_order_set_comment (priv->database, id,
+						     "Customer asked for a receipt",
+						     error);
+		ch_bench_sample (priv, "order_set_comment", start);
+		if (!ret) {
+			ch_database_rollback (priv->database, NULL);
+			goto out;
+		}
+	}
+	ret = ch_database_commit (priv->database, error);
+	if (!ret)
+		goto out;
+
+	/* and one by one, as the shipping tool does */
+	for (i = 0; i < priv->iterations; i++) {
+		id = ch_bench_random_order (priv);
+		start = ch_bench_now ();
+		ret = ch_database_order_set_state (priv->database, id,
+						   CH_ORDER_STATE_PRINTED, error);
+		ch_bench_sample (priv, "order_set_state", start);
+		if (!ret)
+			goto out;
+	}
+out:
+	for (i = 0; i < CH_ORDER_STATE_LAST; i++)
+		g_array_unref (order_ids[i]);
+	return ret;
+}
+
+static void
+ch_bench_checksum_orders (GChecksum *checksum, ChDatabaseOrderList *list)
+{
+	ChDatabaseOrder *order;
+	gchar *tmp;
+	guint i;
+	guint j;
+
+	/* the sent date is the time of the run, so only whether it is set */
+	for (i = 0; i < list->len; i++) {
+		order = &list->orders[i];
+		tmp = g_strdup_printf ("%i|%s|%s|%s|%s|%s|%i|%i|%i|",
+				       order->order_id,
+				       order->name,
+				       order->address,
+				       order->email,
+				       order->tracking_number,
+				       order->comment,
+				       order->postage,
+				       order->sent_date != 0,
+				       order->state);
+		g_checksum_update (checksum, (const guchar *) tmp, -1);
+		g_free (tmp);
+		for (j = 0; j < order->device_ids_len; j++) {
+			tmp = g_strdup_printf ("%i,", order->device_ids[j]);
+			g_checksum_update (checksum, (const guchar *) tmp, -1);
+			g_free (tmp);
+		}
+	}
+}
+
+/* pages through every order, which is also what is compared between runs */
+static gboolean
+ch_bench_list_orders (ChBenchPrivate *priv, GError **error)
+{
+	ChDatabaseInventory *item;
+	ChDatabaseOrderList *list;
+	GArray *inventory;
+	GChecksum *checksum;
+	gboolean ret = TRUE;
+	gchar *tmp;
+	gint64 start;
+	gint64 start_all;
+	guint32 before = G_MAXUINT32;
+	guint i;
+
+	checksum = g_checksum_new (G_CHECKSUM_SHA256);
+	start_all = ch_bench_now ();
+	do {
+		start = ch_bench_now ();
+		list = ch_database_get_orders (priv->database, before, 1500, error);
+		ch_bench_sample (priv, "get_orders(1500)", start);
+		if (list == NULL) {
+			ret = FALSE;
+			goto out;
+		}
+		ch_bench_checksum_orders (checksum, list);
+		if (list->len > 0)
+			before = list->orders[list->len - 1].order_id;
+		i = list->len;
+		ch_database_order_list_free (list);
+	} while (i > 0);
+	ch_bench_sample (priv, "list_all_orders", start_all);
+
+	/* the device states have to match too */
+	inventory = ch_database_get_inventory (priv->database, error);
+	if (inventory == NULL) {
+		ret = FALSE;
+		goto out;
+	}
+	for (i = 0; i < inventory->len; i++) {
+		item = &g_array_index (inventory, ChDatabaseInventory, i);
+		tmp = g_strdup_printf ("%i|%i|%i|", item->hw_ver, item->state, item->count);
+		g_checksum_update (checksum, (const guchar *) tmp, -1);
+		g_free (tmp);
+	}
+	g_array_unref (inventory);
+	priv->run->checksum = g_strdup (g_checksum_get_string (checksum));
+out:
+	g_checksum_free (checksum);
+	return ret;
+}
+
+static gboolean
+ch_bench_query (ChBenchPrivate *priv, GError **error)
+{
+	ChDatabaseOrderList *list;
+	ChDatabaseThroughput throughput;
+	ChDeviceState state;
+	GArray *array;
+	GOutputStream *stream;
+	gboolean ret = TRUE;
+	gchar *comment;
+	gint64 start;
+	guint64 generation = 0;
+	guint64 generation_tmp;
+	guint32 id;
+	guint i;
+
+	for (i = 0; i < priv->iterations; i++) {
+		start = ch_bench_now ();
+		list = ch_database_get_orders (priv->database,
+					       ch_bench_random_order (priv),
+					       100, error);
+		ch_bench_sample (priv, "get_orders(100)", start);
+		if (list == NULL) {
+			ret = FALSE;
+			goto out;
+		}
+		ch_database_order_list_free (list);
+
+		start = ch_bench_now ();
+		state = ch_database_device_get_state (priv->database,
+						      ch_bench_random_device (priv),
+						      error);
+		ch_bench_sample (priv, "device_get_state", start);
+		if (state == CH_DEVICE_STATE_LAST) {
+			ret = FALSE;
+			goto out;
+		}
+
+		start = ch_bench_now ();
+		comment = ch_database_order_get_comment (priv->database,
+							 ch_bench_random_order (priv),
+							 NULL);
+		ch_bench_sample (priv, "order_get_comment", start);
+		g_free (comment);
+
+		start = ch_bench_now ();
+		array = ch_database_order_get_device_ids (priv->database,
+							  ch_bench_random_order (priv),
+							  error);
+		ch_bench_sample (priv, "order_get_device_ids", start);
+		if (array == NULL) {
+			ret = FALSE;
+			goto out;
+		}
+		g_array_unref (array);
+
+		start = ch_bench_now ();
+		ch_database_device_get_number (priv->database,
+					       g_rand_int_range (priv->rand, 0, CH_DEVICE_STATE_LAST),
+					       g_rand_int_range (priv->rand, 1, 3),
+					       NULL);
+		ch_bench_sample (priv, "device_get_number", start);
+
+		start = ch_bench_now ();
+		id = ch_database_device_find_oldest (priv->database,
+						     CH_DEVICE_STATE_CALIBRATED,
+						     g_rand_int_range (priv->rand, 1, 3),
+						     NULL);
+		ch_bench_sample (priv, "device_find_oldest", start);
+		if (id == G_MAXUINT32)
+			g_debug ("no calibrated devices left");
+
+		start = ch_bench_now ();
+		array = ch_database_get_inventory (priv->database, error);
+		ch_bench_sample (priv, "get_inventory", start);
+		if (array == NULL) {
+			ret = FALSE;
+			goto out;
+		}
+		g_array_unref (array);
+
+		start = ch_bench_now ();
+		ret = ch_database_get_orders_generation (priv->database, &generation, error);
+		ch_bench_sample (priv, "get_orders_generation", start);
+		if (!ret)
+			goto out;
+
+		start = ch_bench_now ();
+		list = ch_database_get_orders_changed (priv->database,
+						       generation > 10 ? generation - 10 : 0,
+						       &generation_tmp, error);
+		ch_bench_sample (priv, "get_orders_changed", start);
+		if (list == NULL) {
+			ret = FALSE;
+			goto out;
+		}
+		ch_database_order_list_free (list);
+
+		start = ch_bench_now ();
+		list = ch_database_search_orders (priv->database,
+						  ch_bench_pick (priv, ch_bench_last_names),
+						  200, CH_DATABASE_SEARCH_FLAG_NONE,
+						  error);
+		ch_bench_sample (priv, "search_orders", start);
+		if (list == NULL) {
+			ret = FALSE;
+			goto out;
+		}
+		ch_database_order_list_free (list);
+	}
+
+	/* this is slow, so do fewer */
+	for (i = 0; i < MAX (priv->iterations / 100, 3); i++) {
+		start = ch_bench_now ();
+		list = ch_database_get_all_orders (priv->database, error);
+		ch_bench_sample (priv, "get_all_orders", start);
+		if (list == NULL) {
+			ret = FALSE;
+			goto out;
+		}
+		ch_database_order_list_free (list);
+
+		stream = g_memory_output_stream_new_resizable ();
+		start = ch_bench_now ();
+		ret = ch_database_export (priv->database,
+					  CH_DATABASE_REPORT_SALES,
+					  CH_DATABASE_FORMAT_CSV,
+					  stream, NULL, error);
+		ch_bench_sample (priv, "export_sales", start);
+		g_object_unref (stream);
+		if (!ret)
+			goto out;
+
+		stream = g_memory_output_stream_new_resizable ();
+		start = ch_bench_now ();
+		ret = ch_database_export (priv->database,
+					  CH_DATABASE_REPORT_ORDERS,
+					  CH_DATABASE_FORMAT_NDJSON,
+					  stream, NULL, error);
+		ch_bench_sample (priv, "export_orders", start);
+		g_object_unref (stream);
+		if (!ret)
+			goto out;
+
+		start = ch_bench_now ();
+		ret = ch_database_get_throughput (priv->database, 0,
+						  &throughput, error);
+		ch_bench_sample (priv, "get_throughput", start);
+		if (!ret)
+			goto out;
+	}
+out:
+	return ret;
+}
+
+static ChBenchRun *
+ch_bench_run (ChBenchPrivate *priv, const gchar *uri, guint32 seed, GError **error)
+{
+	ChBenchRun *run;
+	gboolean ret;
+	gint64 start;
+
+	/* each run sees exactly the same data */
+	run = g_new0 (ChBenchRun, 1);
+	run->uri = g_strdup (uri);
+	run->timers = g_ptr_array_new_with_free_func ((GDestroyNotify) ch_bench_timer_free);
+	priv->run = run;
+	priv->rand = g_rand_new_with_seed (seed);
+	priv->database = ch_database_new ();
+	ch_database_set_uri (priv->database, uri);
+
+	start = ch_bench_now ();
+	ret = ch_bench_add_devices (priv, error);
+	if (!ret)
+		goto out;
+	ret = ch_bench_add_orders (priv, error);
+	if (!ret)
+		goto out;
+	if (priv->check) {
+		ret = ch_database_check_plans (priv->database, error);
+		if (!ret)
+			goto out;
+	}
+	ret = ch_bench_list_orders (priv, error);
+	if (!ret)
+		goto out;
+	ret = ch_bench_query (priv, error);
+	if (!ret)
+		goto out;
+	run->elapsed = (gdouble) (ch_bench_now () - start) / 1e9;
+out:
+	g_object_unref (priv->database);
+	g_rand_free (priv->rand);
+	priv->database = NULL;
+	priv->rand = NULL;
+	priv->run = NULL;
+	if (!ret) {
+		ch_bench_run_free (run);
+		return NULL;
+	}
+	return run;
+}
+
+static gint
+ch_bench_sort_cb (gconstpointer a, gconstpointer b)
+{
+	gint64 tmp = *((const gint64 *) a) - *((const gint64 *) b);
+	if (tmp < 0)
+		return -1;
+	if (tmp > 0)
+		return 1;
+	return 0;
+}
+
+/* in microseconds */
+static gdouble
+ch_bench_timer_percentile (ChBenchTimer *timer, guint percentile)
+{
+	guint idx;
+	idx = ((timer->samples->len - 1) * percentile + 50) / 100;
+	return (gdouble) g_array_index (timer->samples, gint64, idx) / 1e3;
+}
+
+static gdouble
+ch_bench_timer_throughput (ChBenchTimer *timer)
+{
+	gint64 total = 0;
+	guint i;
+
+	for (i = 0; i < timer->samples->len; i++)
+		total += g_array_index (timer->samples, gint64, i);
+	if (total == 0)
+		return 0.f;
+	return (gdouble) timer->samples->len * 1e9 / (gdouble) total;
+}
+
+static void
+ch_bench_print_text (GPtrArray *runs, gboolean identical)
+{
+	ChBenchRun *run;
+	ChBenchTimer *timer;
+	guint i;
+	guint j;
+
+	for (i = 0; i < runs->len; i++) {
+		run = g_ptr_array_index (runs, i);
+		g_print ("%s: %.1fs, checksum %s\n", run->uri, run->elapsed, run->checksum);
+		g_print ("  %-24s %8s %12s %12s %12s\n",
+			 "call", "count", "p50/us", "p99/us", "ops/s");
+		for (j = 0; j < run->timers->len; j++) {
+			timer = g_ptr_array_index (run->timers, j);
+			g_print ("  %-24s %8i %12.1f %12.1f %12.0f\n",
+				 timer->name,
+				 timer->samples->len,
+				 ch_bench_timer_percentile (timer, 50),
+				 ch_bench_timer_percentile (timer, 99),
+				 ch_bench_timer_throughput (timer));
+		}
+	}
+	if (runs->len > 1)
+		g_print ("results %s\n", identical ? "identical" : "DIFFER");
+}
+
+static void
+ch_bench_print_json (GPtrArray *runs,
+		     gboolean identical,
+		     guint32 seed,
+		     guint devices,
+		     guint orders)
+{
+	ChBenchRun *run;
+	ChBenchTimer *timer;
+	GString *str;
+	gchar *tmp;
+	guint i;
+	guint j;
+
+	str = g_string_new ("{\n");
+	g_string_append_printf (str, "  \"seed\": %u,\n", seed);
+	g_string_append_printf (str, "  \"devices\": %u,\n", devices);
+	g_string_append_printf (str, "  \"orders\": %u,\n", orders);
+	g_string_append_printf (str, "  \"identical\": %s,\n", identical ? "true" : "false");
+	g_string_append (str, "  \"runs\": [\n");
+	for (i = 0; i < runs->len; i++) {
+		run = g_ptr_array_index (runs, i);
+		tmp = g_strescape (run->uri, NULL);
+		g_string_append_printf (str, "    {\n      \"uri\": \"%s\",\n", tmp);
+		g_free (tmp);
+		g_string_append_printf (str, "      \"checksum\": \"%s\",\n", run->checksum);
+		g_string_append_printf (str, "      \"elapsed\": %.3f,\n", run->elapsed);
+		g_string_append (str, "      \"calls\": [\n");
+		for (j = 0; j < run->timers->len; j++) {
+			timer = g_ptr_array_index (run->timers, j);
+			g_string_append_printf (str,
+						"        { \"name\": \"%s\", \"count\": %u, "
+						"\"p50_us\": %.1f, \"p99_us\": %.1f, "
+						"\"ops_per_sec\": %.0f }%s\n",
+						timer->name,
+						timer->samples->len,
+						ch_bench_timer_percentile (timer, 50),
+						ch_bench_timer_percentile (timer, 99),
+						ch_bench_timer_throughput (timer),
+						j < run->timers->len - 1 ? "," : "");
+		}
+		g_string_append_printf (str, "      ]\n    }%s\n",
+					i < runs->len - 1 ? "," : "");
+	}
+	g_string_append (str, "  ]\n}\n");
+	g_print ("%s", str->str);
+	g_string_free (str, TRUE);
+}
+
+/* fails if any lookup took longer than its budget */
+static gboolean
+ch_bench_check_budgets (GPtrArray *runs)
+{
+	ChBenchRun *run;
+	ChBenchTimer *timer;
+	gboolean ret = TRUE;
+	gdouble p99;
+	guint i;
+	guint j;
+	guint k;
+
+	for (i = 0; i < runs->len; i++) {
+		run = g_ptr_array_index (runs, i);
+		for (j = 0; j < run->timers->len; j++) {
+			timer = g_ptr_array_index (run->timers, j);
+			for (k = 0; ch_bench_budgets[k].name != NULL; k++) {
+				if (g_strcmp0 (ch_bench_budgets[k].name, timer->name) == 0)
+					break;
+			}
+			if (ch_bench_budgets[k].name == NULL)
+				continue;
+			p99 = ch_bench_timer_percentile (timer, 99);
+			if (p99 <= ch_bench_budgets[k].p99)
+				continue;
+			g_printerr ("%s: %s took %.1fus, over the budget of %.0fus\n",
+				    run->uri, timer->name, p99,
+				    ch_bench_budgets[k].p99);
+			ret = FALSE;
+		}
+	}
+	return ret;
+}
+
+static void
+ch_bench_remove_database (const gchar *filename)
+{
+	gchar *tmp;
+
+	g_unlink (filename);
+	tmp = g_strdup_printf ("%s-wal", filename);
+	g_unlink (tmp);
+	g_free (tmp);
+	tmp = g_strdup_printf ("%s-shm", filename);
+	g_unlink (tmp);
+	g_free (tmp);
+}
+
+static void
+ch_bench_ignore_cb (const gchar *log_domain, GLogLevelFlags log_level,
+		    const gchar *message, gpointer user_data)
+{
+}
+
+/**
+ * main:
+ **/
+int
+main (int argc, char **argv)
+{
+	ChBenchPrivate *priv;
+	ChBenchRun *first;
+	ChBenchRun *run;
+	ChBenchTimer *timer;
+	GError *error = NULL;
+	GOptionContext *context;
+	GPtrArray *runs;
+	gboolean check = FALSE;
+	gboolean check_latency = FALSE;
+	gboolean identical = TRUE;
+	gboolean json = FALSE;
+	gboolean keep = FALSE;
+	gboolean ret;
+	gboolean verbose = FALSE;
+	gchar *filename = NULL;
+	gint fd;
+	gint retval = EXIT_FAILURE;
+	gint seed = 42;
+	gint devices = 200000;
+	gint orders = 50000;
+	gint iterations = 1000;
+	guint i;
+	guint j;
+	const GOptionEntry options[] = {
+		{ "verbose", 'v', 0, G_OPTION_ARG_NONE, &verbose,
+			/* TRANSLATORS: command line option */
+			_("Show extra debugging information"), NULL },
+		{ "json", '\0', 0, G_OPTION_ARG_NONE, &json,
+			/* TRANSLATORS: command line option */
+			_("Output the results as JSON"), NULL },
+		{ "seed", '\0', 0, G_OPTION_ARG_INT, &seed,
+			/* TRANSLATORS: command line option */
+			_("Seed for the generated data"), NULL },
+		{ "devices", '\0', 0, G_OPTION_ARG_INT, &devices,
+			/* TRANSLATORS: command line option */
+			_("Number of devices to generate"), NULL },
+		{ "orders", '\0', 0, G_OPTION_ARG_INT, &orders,
+			/* TRANSLATORS: command line option */
+			_("Number of orders to generate"), NULL },
+		{ "iterations", '\0', 0, G_OPTION_ARG_INT, &iterations,
+			/* TRANSLATORS: command line option */
+			_("Number of times to run each query"), NULL },
+		{ "check", '\0', 0, G_OPTION_ARG_NONE, &check,
+			/* TRANSLATORS: command line option */
+			_("Fail if a query is not indexed"), NULL },
+		{ "check-latency", '\0', 0, G_OPTION_ARG_NONE, &check_latency,
+			/* TRANSLATORS: command line option */
+			_("Fail if a lookup is slower than its budget"), NULL },
+		{ "filename", '\0', 0, G_OPTION_ARG_FILENAME, &filename,
+			/* TRANSLATORS: command line option */
+			_("On-disk database to create, which is kept afterwards"), NULL },
+		{ NULL}
+	};
+
+	setlocale (LC_ALL, "");
+
+	bindtextdomain (GETTEXT_PACKAGE, LOCALEDIR);
+	bind_textdomain_codeset (GETTEXT_PACKAGE, "UTF-8");
+	textdomain (GETTEXT_PACKAGE);
+
+	/* TRANSLATORS: A program to time the database */
+	context = g_option_context_new (_("ColorHug database benchmark"));
+	g_option_context_add_main_entries (context, options, NULL);
+	ret = g_option_context_parse (context, &argc, &argv, &error);
+	g_option_context_free (context);
+	if (!ret) {
+		g_warning ("%s: %s",
+			   _("Failed to parse command line options"),
+			   error->message);
+		g_error_free (error);
+		goto out;
+	}
+	if (!verbose) {
+		g_log_set_handler (G_LOG_DOMAIN, G_LOG_LEVEL_DEBUG,
+				   ch_bench_ignore_cb, NULL);
+	}
+
+	/* the same data is written to memory and to disk */
+	if (filename != NULL) {
+		keep = TRUE;
+		ch_bench_remove_database (filename);
+	} else {
+		fd = g_file_open_tmp ("ch-database-bench-XXXXXX.db", &filename, &error);
+		if (fd < 0) {
+			g_warning ("failed to create database: %s", error->message);
+			g_error_free (error);
+			goto out;
+		}
+		close (fd);
+		g_unlink (filename);
+	}
+	priv = g_new0 (ChBenchPrivate, 1);
+	priv->devices = devices;
+	priv->orders = orders;
+	priv->iterations = iterations;
+	priv->check = check;
+	runs = g_ptr_array_new_with_free_func ((GDestroyNotify) ch_bench_run_free);
+	run = ch_bench_run (priv, ":memory:", seed, &error);
+	if (run != NULL) {
+		g_ptr_array_add (runs, run);
+		run = ch_bench_run (priv, filename, seed, &error);
+	}
+	if (!keep)
+		ch_bench_remove_database (filename);
+	if (run == NULL) {
+		g_warning ("failed to run benchmark: %s", error->message);
+		g_error_free (error);
+		goto out_runs;
+	}
+	g_ptr_array_add (runs, run);
+
+	/* sort the samples for the percentiles */
+	first = g_ptr_array_index (runs, 0);
+	for (i = 0; i < runs->len; i++) {
+		run = g_ptr_array_index (runs, i);
+		for (j = 0; j < run->timers->len; j++) {
+			timer = g_ptr_array_index (run->timers, j);
+			g_array_sort (timer->samples, ch_bench_sort_cb);
+		}
+		if (g_strcmp0 (first->checksum, run->checksum) != 0)
+			identical = FALSE;
+	}
+	if (json)
+		ch_bench_print_json (runs, identical, seed, devices, orders);
+	else
+		ch_bench_print_text (runs, identical);
+	if (identical && (!check_latency || ch_bench_check_budgets (runs)))
+		retval = EXIT_SUCCESS;
+out_runs:
+	g_ptr_array_unref (runs);
+	g_free (priv);
+out:
+	g_free (filename);
+	return retval;
+}
@@ -0,0 +1,574 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*-
+ *
+ * Copyright (C) 2011-2012 Richard Hughes <richard@hughsie.com>
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "config.h"
+
+#include <glib/gi18n.h>
+#include <glib/gstdio.h>
+#include <locale.h>
+#include <stdlib.h>
+
+#include "ch-database.h"
+
+/* what automake expects from a test that cannot run here */
+#define CH_REPLICATE_SKIP		77
+
+typedef struct {
+	gchar		*dirname;
+	gchar		*spool_dir;
+	ChDatabase	*database_a;
+	ChDatabase	*database_b;
+} ChReplicatePrivate;
+
+static ChDatabase *
+ch_replicate_database_new (ChReplicatePrivate *priv, const gchar *station)
+{
+	ChDatabase *database;
+	gchar *basename;
+	gchar *filename;
+
+	basename = g_strdup_printf ("%s.db", station);
+	filename = g_build_filename (priv->dirname, basename, NULL);
+	database = ch_database_new ();
+	ch_database_set_uri (database, filename);
+	ch_database_set_replication (database, priv->spool_dir, station, 0);
+	g_free (basename);
+	g_free (filename);
+	return database;
+}
+
+/* everything the stations have to agree on, as text */
+static gchar *
+ch_replicate_describe (ChDatabase *database, GError **error)
+{
+	ChDatabaseInventory *item;
+	ChDatabaseOrder *order;
+	ChDatabaseOrderList *list;
+	GArray *inventory;
+	GString *str;
+	guint i;
+	guint j;
+
+	list = ch_database_get_all_orders (database, error);
+	if (list == NULL)
+		return NULL;
+	inventory = ch_database_get_inventory (database, error);
+	if (inventory == NULL) {
+		ch_database_order_list_free (list);
+		return NULL;
+	}
+	str = g_string_new ("");
+	for (i = 0; i < list->len; i++) {
+		order = &list->orders[i];
+		g_string_append_printf (str, "order %i %s %s '%s' '%s':",
+					order->order_id, order->name,
+					ch_shipping_order_state_to_string (order->state),
+					order->tracking_number != NULL ? order->tracking_number : "",
+					order->comment != NULL ? order->comment : "");
+		for (j = 0; j < order->device_ids_len; j++)
+			g_string_append_printf (str, " %i", order->device_ids[j]);
+		g_string_append (str, "\n");
+	}
+	for (i = 0; i < inventory->len; i++) {
+		item = &g_array_index (inventory, ChDatabaseInventory, i);
+		g_string_append_printf (str, "hw%i %s %i\n",
+					item->hw_ver,
+					ch_database_state_to_string (item->state),
+					item->count);
+	}
+	ch_database_order_list_free (list);
+	g_array_unref (inventory);
+	return g_string_free (str, FALSE);
+}
+
+/* both stations have the same devices and orders */
+static gboolean
+ch_replicate_check_same (ChReplicatePrivate *priv, GError **error)
+{
+	gboolean ret = FALSE;
+	gchar *a = NULL;
+	gchar *b = NULL;
+
+	a = ch_replicate_describe (priv->database_a, error);
+	if (a == NULL)
+		goto out;
+	b = ch_replicate_describe (priv->database_b, error);
+	if (b == NULL)
+		goto out;
+	if (g_strcmp0 (a, b) != 0) {
+		g_set_error (error, 1, 0,
+			     "stations differ:\na:\n%sb:\n%s", a, b);
+		goto out;
+	}
+	ret = TRUE;
+out:
+	g_free (a);
+	g_free (b);
+	return ret;
+}
+
+static gboolean
+ch_replicate_sync (ChReplicatePrivate *priv, guint *applied, GError **error)
+{
+	guint applied_a = 0;
+	guint applied_b = 0;
+
+	if (!ch_database_replicate (priv->database_a, &applied_a, NULL, error))
+		return FALSE;
+	if (!ch_database_replicate (priv->database_b, &applied_b, NULL, error))
+		return FALSE;
+	if (!ch_database_replicate (priv->database_a, NULL, NULL, error))
+		return FALSE;
+	if (applied != NULL)
+		*applied = applied_a + applied_b;
+	return TRUE;
+}
+
+/* station b is started from a copy of station a, with changes that station
+ * a has not sent yet, and none of them are applied again */
+static gboolean
+ch_replicate_test_bootstrap (ChReplicatePrivate *priv,
+			     guint32 *order_ids,
+			     GError **error)
+{
+	GArray *device_ids;
+	gchar *filename;
+	gboolean ret;
+	guint32 id;
+	guint applied = 0;
+	guint i;
+
+	priv->database_a = ch_replicate_database_new (priv, "a");
+	device_ids = g_array_new (FALSE, FALSE, sizeof (guint32));
+	for (i = 0; i < 4; i++) {
+		id = ch_database_add_device (priv->database_a, 2, error);
+		if (id == G_MAXUINT32) {
+			ret = FALSE;
+			goto out;
+		}
+		g_array_append_val (device_ids, id);
+	}
+	ret = ch_database_devices_set_state (priv->database_a, device_ids,
+					     CH_DEVICE_STATE_CALIBRATED, error);
+	if (!ret)
+		goto out;
+	for (i = 0; i < 2; i++) {
+		order_ids[i] = ch_database_add_order (priv->database_a,
+						      i == 0 ? "First" : "Second",
+						      "1 High Street|London",
+						      "customer@example.com",
+						      CH_SHIPPING_KIND_CH2_UK_SIGNED,
+						      error);
+		if (order_ids[i] == G_MAXUINT32) {
+			ret = FALSE;
+			goto out;
+		}
+	}
+
+	filename = g_build_filename (priv->dirname, "b.db", NULL);
+	ret = ch_database_backup (priv->database_a, filename, NULL, error);
+	g_free (filename);
+	if (!ret)
+		goto out;
+	priv->database_b = ch_replicate_database_new (priv, "b");
+	ret = ch_replicate_sync (priv, &applied, error);
+	if (!ret)
+		goto out;
+	if (applied != 0) {
+		ret = FALSE;
+		g_set_error (error, 1, 0,
+			     "%i changesets applied to the copy", applied);
+		goto out;
+	}
+
+	/* changes made at the new station are sent from the start */
+	g_array_unref (device_ids);
+	device_ids = ch_database_allocate_devices (priv->database_b, order_ids[0],
+						   2, 1, error);
+	if (device_ids == NULL) {
+		ret = FALSE;
+		goto out;
+	}
+	ret = ch_replicate_sync (priv, &applied, error);
+	if (!ret)
+		goto out;
+	if (applied == 0) {
+		ret = FALSE;
+		g_set_error_literal (error, 1, 0,
+				     "nothing applied from the new station");
+		goto out;
+	}
+	ret = ch_replicate_check_same (priv, error);
+out:
+	if (device_ids != NULL)
+		g_array_unref (device_ids);
+	return ret;
+}
+
+/* both stations change the same orders, and the state furthest along wins
+ * whichever station made it */
+static gboolean
+ch_replicate_test_state_rank (ChReplicatePrivate *priv,
+			      guint32 *order_ids,
+			      GError **error)
+{
+	ChDatabaseOrderList *list = NULL;
+	gboolean ret;
+	guint i;
+
+	ret = ch_database_order_set_state (priv->database_a, order_ids[0],
+					   CH_ORDER_STATE_PRINTED, error);
+	if (!ret)
+		goto out;
+	ret = ch_database_order_set_state (priv->database_b, order_ids[0],
+					   CH_ORDER_STATE_SENT, error);
+	if (!ret)
+		goto out;
+	ret = ch_database_order_set_state (priv->database_a, order_ids[1],
+					   CH_ORDER_STATE_SENT, error);
+	if (!ret)
+		goto out;
+	ret = ch_database_order_set_state (priv->database_b, order_ids[1],
+					   CH_ORDER_STATE_PRINTED, error);
+	if (!ret)
+		goto out;
+	ret = ch_replicate_sync (priv, NULL, error);
+	if (!ret)
+		goto out;
+	ret = ch_replicate_check_same (priv, error);
+	if (!ret)
+		goto out;
+
+	list = ch_database_get_all_orders (priv->database_a, error);
+	if (list == NULL) {
+		ret = FALSE;
+		goto out;
+	}
+	for (i = 0; i < list->len; i++) {
+		if (list->orders[i].state != CH_ORDER_STATE_SENT) {
+			ret = FALSE;
+			g_set_error (error, 1, 0,
+				     "order %i is %s, not sent",
+				     list->orders[i].order_id,
+				     ch_shipping_order_state_to_string (list->orders[i].state));
+			goto out;
+		}
+	}
+out:
+	if (list != NULL)
+		ch_database_order_list_free (list);
+	return ret;
+}
+
+static gint
+ch_replicate_sort_cb (gconstpointer a, gconstpointer b)
+{
+	return g_strcmp0 (*((const gchar **) a), *((const gchar **) b));
+}
+
+/* lists the changesets a station has written so far */
+static GPtrArray *
+ch_replicate_get_changesets (ChReplicatePrivate *priv,
+			     const gchar *station,
+			     GError **error)
+{
+	GDir *dir;
+	GPtrArray *names;
+	const gchar *name;
+	gchar *dirname;
+
+	dirname = g_build_filename (priv->spool_dir, station, NULL);
+	dir = g_dir_open (dirname, 0, error);
+	g_free (dirname);
+	if (dir == NULL)
+		return NULL;
+	names = g_ptr_array_new_with_free_func (g_free);
+	while ((name = g_dir_read_name (dir)) != NULL)
+		g_ptr_array_add (names, g_strdup (name));
+	g_dir_close (dir);
+	g_ptr_array_sort (names, ch_replicate_sort_cb);
+	return names;
+}
+
+/* the same changes arriving again, as from a spool restored from a backup,
+ * are applied without changing anything */
+static gboolean
+ch_replicate_test_reapply (ChReplicatePrivate *priv,
+			   guint32 *order_ids,
+			   GError **error)
+{
+	GPtrArray *after = NULL;
+	GPtrArray *before = NULL;
+	gboolean ret = FALSE;
+	gchar *data = NULL;
+	gchar *filename;
+	gchar *name;
+	gchar *state_after = NULL;
+	gchar *state_before = NULL;
+	gsize size;
+	guint applied = 0;
+	guint i;
+	guint j = 0;
+
+	before = ch_replicate_get_changesets (priv, "a", error);
+	if (before == NULL)
+		goto out;
+	if (!ch_database_order_set_tracking (priv->database_a, order_ids[0],
+					     "TRACK0001", error))
+		goto out;
+	if (!ch_database_order_set_comment (priv->database_a, order_ids[1],
+					    "fragile", error))
+		goto out;
+	if (!ch_replicate_sync (priv, NULL, error))
+		goto out;
+	if (!ch_replicate_check_same (priv, error))
+		goto out;
+	state_before = ch_replicate_describe (priv->database_b, error);
+	if (state_before == NULL)
+		goto out;
+
+	/* copy the new ones, numbered from the start for another station */
+	after = ch_replicate_get_changesets (priv, "a", error);
+	if (after == NULL)
+		goto out;
+	filename = g_build_filename (priv->spool_dir, "a-again", NULL);
+	g_mkdir_with_parents (filename, 0755);
+	g_free (filename);
+	for (i = before->len; i < after->len; i++) {
+		filename = g_build_filename (priv->spool_dir, "a",
+					     g_ptr_array_index (after, i), NULL);
+		ret = g_file_get_contents (filename, &data, &size, error);
+		g_free (filename);
+		if (!ret)
+			goto out;
+		name = g_strdup_printf ("%020i.changeset", ++j);
+		filename = g_build_filename (priv->spool_dir, "a-again", name, NULL);
+		ret = g_file_set_contents (filename, data, size, error);
+		g_free (filename);
+		g_free (name);
+		g_free (data);
+		data = NULL;
+		if (!ret)
+			goto out;
+	}
+	ret = FALSE;
+
+	if (!ch_database_replicate (priv->database_b, &applied, NULL, error))
+		goto out;
+	if (applied != j) {
+		g_set_error (error, 1, 0,
+			     "expected %i changesets applied again, got %i",
+			     j, applied);
+		goto out;
+	}
+	state_after = ch_replicate_describe (priv->database_b, error);
+	if (state_after == NULL)
+		goto out;
+	if (g_strcmp0 (state_before, state_after) != 0) {
+		g_set_error (error, 1, 0,
+			     "applying again changed the database:\n%s\n%s",
+			     state_before, state_after);
+		goto out;
+	}
+	ret = TRUE;
+out:
+	if (before != NULL)
+		g_ptr_array_unref (before);
+	if (after != NULL)
+		g_ptr_array_unref (after);
+	g_free (state_before);
+	g_free (state_after);
+	return ret;
+}
+
+/* a device added at both stations with the same ID cannot be resolved, so
+ * the changeset is refused and nothing here is changed */
+static gboolean
+ch_replicate_test_insert_conflict (ChReplicatePrivate *priv, GError **error)
+{
+	GError *error_local = NULL;
+	gboolean ret = FALSE;
+	gchar *state_after = NULL;
+	gchar *state_before = NULL;
+	guint32 id_a;
+	guint32 id_b;
+
+	id_a = ch_database_add_device (priv->database_a, 1, error);
+	if (id_a == G_MAXUINT32)
+		goto out;
+	id_b = ch_database_add_device (priv->database_b, 2, error);
+	if (id_b == G_MAXUINT32)
+		goto out;
+	if (id_a != id_b) {
+		g_set_error (error, 1, 0,
+			     "expected the same ID, got %i and %i", id_a, id_b);
+		goto out;
+	}
+	if (!ch_database_replicate (priv->database_a, NULL, NULL, error))
+		goto out;
+	state_before = ch_replicate_describe (priv->database_b, error);
+	if (state_before == NULL)
+		goto out;
+	if (ch_database_replicate (priv->database_b, NULL, NULL, &error_local)) {
+		g_set_error (error, 1, 0,
+			     "device %i added at both stations was accepted",
+			     id_a);
+		goto out;
+	}
+	g_debug ("refused as expected: %s", error_local->message);
+	g_error_free (error_local);
+	state_after = ch_replicate_describe (priv->database_b, error);
+	if (state_after == NULL)
+		goto out;
+	if (g_strcmp0 (state_before, state_after) != 0) {
+		g_set_error (error, 1, 0,
+			     "the refused changes were applied:\n%s\n%s",
+			     state_before, state_after);
+		goto out;
+	}
+	ret = TRUE;
+out:
+	g_free (state_before);
+	g_free (state_after);
+	return ret;
+}
+
+static void
+ch_replicate_remove_dir (const gchar *dirname)
+{
+	GDir *dir;
+	const gchar *name;
+	gchar *filename;
+
+	dir = g_dir_open (dirname, 0, NULL);
+	if (dir != NULL) {
+		while ((name = g_dir_read_name (dir)) != NULL) {
+			filename = g_build_filename (dirname, name, NULL);
+			if (g_file_test (filename, G_FILE_TEST_IS_DIR))
+				ch_replicate_remove_dir (filename);
+			else
+				g_unlink (filename);
+			g_free (filename);
+		}
+		g_dir_close (dir);
+	}
+	g_rmdir (dirname);
+}
+
+static void
+ch_replicate_ignore_cb (const gchar *log_domain, GLogLevelFlags log_level,
+			const gchar *message, gpointer user_data)
+{
+}
+
+/**
+ * main:
+ **/
+int
+main (int argc, char **argv)
+{
+	ChReplicatePrivate *priv;
+	GError *error = NULL;
+	GOptionContext *context;
+	gboolean ret;
+	gboolean verbose = FALSE;
+	gint retval = EXIT_FAILURE;
+	guint32 order_ids[2];
+	const GOptionEntry options[] = {
+		{ "verbose", 'v', 0, G_OPTION_ARG_NONE, &verbose,
+			/* TRANSLATORS: command line option */
+			_("Show extra debugging information"), NULL },
+		{ NULL}
+	};
+
+	setlocale (LC_ALL, "");
+
+	bindtextdomain (GETTEXT_PACKAGE, LOCALEDIR);
+	bind_textdomain_codeset (GETTEXT_PACKAGE, "UTF-8");
+	textdomain (GETTEXT_PACKAGE);
+
+	/* TRANSLATORS: A program to copy changes between two databases */
+	context = g_option_context_new (_("ColorHug database replication test"));
+	g_option_context_add_main_entries (context, options, NULL);
+	ret = g_option_context_parse (context, &argc, &argv, &error);
+	g_option_context_free (context);
+	if (!ret) {
+		g_warning ("%s: %s",
+			   _("Failed to parse command line options"),
+			   error->message);
+		g_error_free (error);
+		goto out;
+	}
+	if (!verbose) {
+		g_log_set_handler (G_LOG_DOMAIN, G_LOG_LEVEL_DEBUG,
+				   ch_replicate_ignore_cb, NULL);
+	}
+#ifndef HAVE_SQLITE_SESSION
+	g_print ("SQLite has no session extension, skipping\n");
+	retval = CH_REPLICATE_SKIP;
+	goto out;
+#endif
+
+	priv = g_new0 (ChReplicatePrivate, 1);
+	priv->dirname = g_dir_make_tmp ("ch-database-replicate-XXXXXX", &error);
+	if (priv->dirname == NULL) {
+		g_warning ("failed to create directory: %s", error->message);
+		g_error_free (error);
+		goto out_priv;
+	}
+	priv->spool_dir = g_build_filename (priv->dirname, "spool", NULL);
+
+	/* each one carries on from where the last one left the stations */
+	if (!ch_replicate_test_bootstrap (priv, order_ids, &error)) {
+		g_printerr ("bootstrap: %s\n", error->message);
+		g_error_free (error);
+		goto out_priv;
+	}
+	if (!ch_replicate_test_state_rank (priv, order_ids, &error)) {
+		g_printerr ("state rank: %s\n", error->message);
+		g_error_free (error);
+		goto out_priv;
+	}
+	if (!ch_replicate_test_reapply (priv, order_ids, &error)) {
+		g_printerr ("apply again: %s\n", error->message);
+		g_error_free (error);
+		goto out_priv;
+	}
+	if (!ch_replicate_test_insert_conflict (priv, &error)) {
+		g_printerr ("insert conflict: %s\n", error->message);
+		g_error_free (error);
+		goto out_priv;
+	}
+	g_print ("both stations agree\n");
+	retval = EXIT_SUCCESS;
+out_priv:
+	if (priv->database_a != NULL)
+		g_object_unref (priv->database_a);
+	if (priv->database_b != NULL)
+		g_object_unref (priv->database_b);
+	if (priv->dirname != NULL)
+		ch_replicate_remove_dir (priv->dirname);
+	g_free (priv->dirname);
+	g_free (priv->spool_dir);
+	g_free (priv);
+out:
+	return retval;
+}
@@ -0,0 +1,436 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*-
+ *
+ * Copyright (C) 2011-2012 Richard Hughes <richard@hughsie.com>
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "config.h"
+
+#include <glib/gi18n.h>
+#include <glib/gstdio.h>
+#include <locale.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "ch-database.h"
+
+/* the hardware version every device in the test is made as */
+#define CH_STRESS_HW_VER		2
+
+typedef struct {
+	gchar		*filename;
+	gchar		*stop_filename;
+	gchar		*journal_mode;
+	guint		 processes;
+	guint		 iterations;
+	guint		 busy_timeout;
+} ChStressPrivate;
+
+static ChDatabase *
+ch_stress_database_new (ChStressPrivate *priv)
+{
+	ChDatabase *database;
+	database = ch_database_new ();
+	ch_database_set_uri (database, priv->filename);
+	ch_database_set_journal_mode (database, priv->journal_mode);
+	ch_database_set_busy_timeout (database, priv->busy_timeout);
+	return database;
+}
+
+/* enough calibrated devices that no worker ever runs out */
+static gboolean
+ch_stress_prime (ChStressPrivate *priv, GError **error)
+{
+	ChDatabase *database;
+	GArray *device_ids;
+	gboolean ret;
+	guint32 id;
+	guint i;
+
+	database = ch_stress_database_new (priv);
+	device_ids = g_array_new (FALSE, FALSE, sizeof (guint32));
+	ret = ch_database_begin (database, error);
+	if (!ret)
+		goto out;
+	for (i = 0; i < priv->processes * priv->iterations; i++) {
+		id = ch_database_add_device (database, CH_STRESS_HW_VER, error);
+		if (id == G_MAXUINT32) {
+			ret = FALSE;
+			ch_database_rollback (database, NULL);
+			goto out;
+		}
+		g_array_append_val (device_ids, id);
+	}
+	ret = ch_database_commit (database, error);
+	if (!ret)
+		goto out;
+	ret = ch_database_devices_set_state (database, device_ids,
+					     CH_DEVICE_STATE_CALIBRATED,
+					     error);
+out:
+	g_array_unref (device_ids);
+	g_object_unref (database);
+	return ret;
+}
+
+/* what one station does: calibrate a device, and ship one to a customer */
+static gboolean
+ch_stress_worker (ChStressPrivate *priv, guint worker, GError **error)
+{
+	ChDatabase *database;
+	GArray *device_ids;
+	GArray *inventory;
+	gboolean ret = TRUE;
+	gchar *name;
+	guint32 id;
+	guint i;
+
+	database = ch_stress_database_new (priv);
+	for (i = 0; i < priv->iterations; i++) {
+		id = ch_database_add_device (database, CH_STRESS_HW_VER, error);
+		if (id == G_MAXUINT32) {
+			ret = FALSE;
+			goto out;
+		}
+		ret = ch_database_device_set_state (database, id,
+						    CH_DEVICE_STATE_CALIBRATED,
+						    error);
+		if (!ret)
+			goto out;
+
+		name = g_strdup_printf ("Worker %i order %i", worker, i);
+		id = ch_database_add_order (database, name, "1 High Street|London",
+					    "worker@example.com",
+					    CH_SHIPPING_KIND_CH2_UK_SIGNED,
+					    error);
+		g_free (name);
+		if (id == G_MAXUINT32) {
+			ret = FALSE;
+			goto out;
+		}
+		device_ids = ch_database_allocate_devices (database, id,
+							   CH_STRESS_HW_VER, 1,
+							   error);
+		if (device_ids == NULL) {
+			ret = FALSE;
+			goto out;
+		}
+		g_array_unref (device_ids);
+
+		inventory = ch_database_get_inventory (database, error);
+		if (inventory == NULL) {
+			ret = FALSE;
+			goto out;
+		}
+		g_array_unref (inventory);
+	}
+out:
+	g_object_unref (database);
+	return ret;
+}
+
+/* what the shipping tool does, reading every order while the stations
+ * write, until the writers have all finished */
+static gboolean
+ch_stress_reader (ChStressPrivate *priv, guint *reads, GError **error)
+{
+	ChDatabase *database;
+	ChDatabaseOrderList *list;
+	gboolean ret = TRUE;
+
+	database = ch_stress_database_new (priv);
+	do {
+		list = ch_database_get_all_orders (database, error);
+		if (list == NULL) {
+			ret = FALSE;
+			break;
+		}
+		ch_database_order_list_free (list);
+		(*reads)++;
+	} while (!g_file_test (priv->stop_filename, G_FILE_TEST_EXISTS));
+	g_object_unref (database);
+	return ret;
+}
+
+/* every order got exactly one device, and no device went to two orders */
+static gboolean
+ch_stress_verify (ChStressPrivate *priv, GError **error)
+{
+	ChDatabase *database;
+	ChDatabaseInventory *item;
+	ChDatabaseOrderList *list = NULL;
+	GArray *device_ids;
+	GArray *inventory = NULL;
+	GHashTable *seen;
+	gboolean ret = FALSE;
+	guint32 device_id;
+	guint allocated = 0;
+	guint expected;
+	guint i;
+	guint total = 0;
+
+	database = ch_stress_database_new (priv);
+	seen = g_hash_table_new (g_direct_hash, g_direct_equal);
+	expected = priv->processes * priv->iterations;
+	list = ch_database_get_all_orders (database, error);
+	if (list == NULL)
+		goto out;
+	if (list->len != expected) {
+		g_set_error (error, 1, 0,
+			     "expected %i orders, got %i",
+			     expected, list->len);
+		goto out;
+	}
+	for (i = 0; i < list->len; i++) {
+		device_ids = ch_database_order_get_device_ids (database,
+							       list->orders[i].order_id,
+							       error);
+		if (device_ids == NULL)
+			goto out;
+		if (device_ids->len != 1) {
+			g_set_error (error, 1, 0,
+				     "order %i has %i devices",
+				     list->orders[i].order_id,
+				     device_ids->len);
+			g_array_unref (device_ids);
+			goto out;
+		}
+		device_id = g_array_index (device_ids, guint32, 0);
+		g_array_unref (device_ids);
+		if (g_hash_table_contains (seen, GUINT_TO_POINTER (device_id))) {
+			g_set_error (error, 1, 0,
+				     "device %i allocated twice", device_id);
+			goto out;
+		}
+		g_hash_table_add (seen, GUINT_TO_POINTER (device_id));
+	}
+
+	/* the trigger-maintained counts have to agree */
+	inventory = ch_database_get_inventory (database, error);
+	if (inventory == NULL)
+		goto out;
+	for (i = 0; i < inventory->len; i++) {
+		item = &g_array_index (inventory, ChDatabaseInventory, i);
+		total += item->count;
+		if (item->state == CH_DEVICE_STATE_ALLOCATED)
+			allocated += item->count;
+	}
+	if (total != expected * 2 || allocated != expected) {
+		g_set_error (error, 1, 0,
+			     "expected %i devices with %i allocated, got %i with %i",
+			     expected * 2, expected, total, allocated);
+		goto out;
+	}
+	ret = TRUE;
+out:
+	if (list != NULL)
+		ch_database_order_list_free (list);
+	if (inventory != NULL)
+		g_array_unref (inventory);
+	g_hash_table_unref (seen);
+	g_object_unref (database);
+	return ret;
+}
+
+static void
+ch_stress_remove_database (const gchar *filename)
+{
+	gchar *tmp;
+
+	g_unlink (filename);
+	tmp = g_strdup_printf ("%s-wal", filename);
+	g_unlink (tmp);
+	g_free (tmp);
+	tmp = g_strdup_printf ("%s-shm", filename);
+	g_unlink (tmp);
+	g_free (tmp);
+}
+
+static void
+ch_stress_ignore_cb (const gchar *log_domain, GLogLevelFlags log_level,
+		     const gchar *message, gpointer user_data)
+{
+}
+
+/**
+ * main:
+ **/
+int
+main (int argc, char **argv)
+{
+	ChStressPrivate *priv;
+	GError *error = NULL;
+	GOptionContext *context;
+	GPtrArray *pids = NULL;
+	gboolean failed = FALSE;
+	gboolean ret;
+	gboolean verbose = FALSE;
+	gchar *journal_mode = NULL;
+	gint fd;
+	gint processes = 4;
+	gint iterations = 200;
+	gint busy_timeout = 30000;
+	gint retval = EXIT_FAILURE;
+	gint status;
+	guint i;
+	guint reads = 0;
+	pid_t pid;
+	pid_t reader = -1;
+	const GOptionEntry options[] = {
+		{ "verbose", 'v', 0, G_OPTION_ARG_NONE, &verbose,
+			/* TRANSLATORS: command line option */
+			_("Show extra debugging information"), NULL },
+		{ "processes", '\0', 0, G_OPTION_ARG_INT, &processes,
+			/* TRANSLATORS: command line option */
+			_("Number of stations writing at the same time"), NULL },
+		{ "iterations", '\0', 0, G_OPTION_ARG_INT, &iterations,
+			/* TRANSLATORS: command line option */
+			_("Number of devices each station ships"), NULL },
+		{ "busy-timeout", '\0', 0, G_OPTION_ARG_INT, &busy_timeout,
+			/* TRANSLATORS: command line option */
+			_("Time in ms to wait for another station"), NULL },
+		{ "journal-mode", '\0', 0, G_OPTION_ARG_STRING, &journal_mode,
+			/* TRANSLATORS: command line option */
+			_("SQLite journal mode, e.g. 'wal' or 'delete'"), NULL },
+		{ NULL}
+	};
+
+	setlocale (LC_ALL, "");
+
+	bindtextdomain (GETTEXT_PACKAGE, LOCALEDIR);
+	bind_textdomain_codeset (GETTEXT_PACKAGE, "UTF-8");
+	textdomain (GETTEXT_PACKAGE);
+
+	/* TRANSLATORS: A program to write to the database from many processes */
+	context = g_option_context_new (_("ColorHug database contention test"));
+	g_option_context_add_main_entries (context, options, NULL);
+	ret = g_option_context_parse (context, &argc, &argv, &error);
+	g_option_context_free (context);
+	if (!ret) {
+		g_warning ("%s: %s",
+			   _("Failed to parse command line options"),
+			   error->message);
+		g_error_free (error);
+		goto out;
+	}
+	if (!verbose) {
+		g_log_set_handler (G_LOG_DOMAIN, G_LOG_LEVEL_DEBUG,
+				   ch_stress_ignore_cb, NULL);
+	}
+
+	priv = g_new0 (ChStressPrivate, 1);
+	priv->processes = processes;
+	priv->iterations = iterations;
+	priv->busy_timeout = busy_timeout;
+	priv->journal_mode = journal_mode != NULL ? journal_mode : g_strdup ("wal");
+	fd = g_file_open_tmp ("ch-database-stress-XXXXXX.db", &priv->filename, &error);
+	if (fd < 0) {
+		g_warning ("failed to create database: %s", error->message);
+		g_error_free (error);
+		goto out_priv;
+	}
+	close (fd);
+	g_unlink (priv->filename);
+	priv->stop_filename = g_strdup_printf ("%s-stop", priv->filename);
+	if (!ch_stress_prime (priv, &error)) {
+		g_warning ("failed to add devices: %s", error->message);
+		g_error_free (error);
+		goto out_priv;
+	}
+
+	/* each worker is a separate process with its own connection, and
+	 * nothing is open in this one when they are forked */
+	reader = fork ();
+	if (reader < 0) {
+		g_warning ("failed to fork reader");
+		goto out_priv;
+	}
+	if (reader == 0) {
+		if (!ch_stress_reader (priv, &reads, &error)) {
+			g_printerr ("reader failed: %s\n", error->message);
+			g_error_free (error);
+			_exit (EXIT_FAILURE);
+		}
+		g_debug ("read every order %i times", reads);
+		_exit (EXIT_SUCCESS);
+	}
+	pids = g_ptr_array_new ();
+	for (i = 0; i < priv->processes; i++) {
+		pid = fork ();
+		if (pid < 0) {
+			g_warning ("failed to fork worker %i", i);
+			failed = TRUE;
+			break;
+		}
+		if (pid == 0) {
+			if (!ch_stress_worker (priv, i, &error)) {
+				g_printerr ("worker %i failed: %s\n", i, error->message);
+				g_error_free (error);
+				_exit (EXIT_FAILURE);
+			}
+			_exit (EXIT_SUCCESS);
+		}
+		g_ptr_array_add (pids, GINT_TO_POINTER (pid));
+	}
+	for (i = 0; i < pids->len; i++) {
+		pid = GPOINTER_TO_INT (g_ptr_array_index (pids, i));
+		if (waitpid (pid, &status, 0) < 0 ||
+		    !WIFEXITED (status) ||
+		    WEXITSTATUS (status) != EXIT_SUCCESS)
+			failed = TRUE;
+	}
+
+	/* the reader stops once there is nothing more to wait for */
+	g_file_set_contents (priv->stop_filename, "", 0, NULL);
+	if (waitpid (reader, &status, 0) < 0 ||
+	    !WIFEXITED (status) ||
+	    WEXITSTATUS (status) != EXIT_SUCCESS)
+		failed = TRUE;
+	reader = -1;
+	if (failed)
+		goto out_priv;
+
+	/* nothing was lost or done twice */
+	if (!ch_stress_verify (priv, &error)) {
+		g_printerr ("%s\n", error->message);
+		g_error_free (error);
+		goto out_priv;
+	}
+	g_print ("%i stations shipped %i devices each while another read every order\n",
+		 processes, iterations);
+	retval = EXIT_SUCCESS;
+out_priv:
+	if (reader > 0) {
+		g_file_set_contents (priv->stop_filename, "", 0, NULL);
+		waitpid (reader, &status, 0);
+	}
+	if (pids != NULL)
+		g_ptr_array_unref (pids);
+	if (priv->filename != NULL)
+		ch_stress_remove_database (priv->filename);
+	if (priv->stop_filename != NULL)
+		g_unlink (priv->stop_filename);
+	g_free (priv->filename);
+	g_free (priv->stop_filename);
+	g_free (priv->journal_mode);
+	g_free (priv);
+out:
+	return retval;
+}
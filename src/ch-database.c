@@ -21,10 +21,20 @@
 
 #include "config.h"
 
+#include <errno.h>
 #include <gio/gio.h>
 #include <glib-object.h>
+#include <glib-unix.h>
+#include <glib/gstdio.h>
+#include <signal.h>
 #include <stdlib.h>
+#ifdef HAVE_SQLITE_SESSION
+#define SQLITE_ENABLE_SESSION
+#define SQLITE_ENABLE_PREUPDATE_HOOK
+#endif
 #include <sqlite3.h>
+#include <string.h>
+#include <unistd.h>
 
 #include "ch-database.h"
 
@@ -32,13 +42,441 @@ static void     ch_database_finalize	(GObject     *object);
 
 #define CH_DATABASE_GET_PRIVATE(o) (G_TYPE_INSTANCE_GET_PRIVATE ((o), CH_TYPE_DATABASE, ChDatabasePrivate))
 
+/* these are stored in the events table, so only ever append */
+typedef enum {
+	CH_DATABASE_EVENT_KIND_DEVICE,
+	CH_DATABASE_EVENT_KIND_ORDER,
+	CH_DATABASE_EVENT_KIND_LAST
+} ChDatabaseEventKind;
+
+typedef enum {
+	CH_DATABASE_STMT_ADD_DEVICE,
+	CH_DATABASE_STMT_DEVICE_SET_STATE,
+	CH_DATABASE_STMT_DEVICE_GET_STATE,
+	CH_DATABASE_STMT_DEVICE_SET_ORDER_ID,
+	CH_DATABASE_STMT_DEVICE_GET_NUMBER,
+	CH_DATABASE_STMT_DEVICE_FIND_OLDEST,
+	CH_DATABASE_STMT_ORDER_SET_TRACKING,
+	CH_DATABASE_STMT_ORDER_SET_COMMENT,
+	CH_DATABASE_STMT_ORDER_SET_STATE,
+	CH_DATABASE_STMT_ORDER_GET_COMMENT,
+	CH_DATABASE_STMT_ORDER_GET_DEVICE_IDS,
+	CH_DATABASE_STMT_GET_ORDERS,
+	CH_DATABASE_STMT_GET_ORDERS_CHANGED,
+	CH_DATABASE_STMT_GET_ORDERS_GENERATION,
+	CH_DATABASE_STMT_ADD_ORDER,
+	CH_DATABASE_STMT_GET_INVENTORY,
+	CH_DATABASE_STMT_BEGIN,
+	CH_DATABASE_STMT_COMMIT,
+	CH_DATABASE_STMT_ROLLBACK,
+	CH_DATABASE_STMT_DEVICE_FIND_AVAILABLE,
+	CH_DATABASE_STMT_DEVICE_ALLOCATE,
+	CH_DATABASE_STMT_ORDERS_GET_DEVICE_IDS,
+	CH_DATABASE_STMT_DATA_VERSION,
+	CH_DATABASE_STMT_GET_GENERATIONS,
+	CH_DATABASE_STMT_SEARCH_ORDERS,
+	CH_DATABASE_STMT_SEARCH_ORDERS_LIKE,
+	CH_DATABASE_STMT_ADD_EMAIL,
+	CH_DATABASE_STMT_GET_QUEUED_EMAILS,
+	CH_DATABASE_STMT_EMAIL_SET_SENT,
+	CH_DATABASE_STMT_REPORT_SALES,
+	CH_DATABASE_STMT_REPORT_CALIBRATIONS,
+	CH_DATABASE_STMT_REPORT_ORDERS,
+	CH_DATABASE_STMT_ARCHIVE_GET_CUTOFF,
+	CH_DATABASE_STMT_ARCHIVE_COPY_ORDERS,
+	CH_DATABASE_STMT_ARCHIVE_COPY_DEVICES,
+	CH_DATABASE_STMT_ARCHIVE_DELETE_DEVICES,
+	CH_DATABASE_STMT_ARCHIVE_DELETE_ORDERS,
+	CH_DATABASE_STMT_ARCHIVE_GET_DEVICE_IDS,
+	CH_DATABASE_STMT_SEARCH_ARCHIVE,
+	CH_DATABASE_STMT_SEARCH_ARCHIVE_LIKE,
+	CH_DATABASE_STMT_ADD_EVENT,
+	CH_DATABASE_STMT_REPORT_CALIBRATION_RATE,
+	CH_DATABASE_STMT_GET_ORDER_LEAD_TIME,
+	CH_DATABASE_STMT_GET_SHIPPING_TIME,
+	CH_DATABASE_STMT_ADD_CHANGESET,
+	CH_DATABASE_STMT_GET_CHANGESETS,
+	CH_DATABASE_STMT_DELETE_CHANGESETS,
+	CH_DATABASE_STMT_GET_APPLIED,
+	CH_DATABASE_STMT_SET_APPLIED,
+	CH_DATABASE_STMT_BUMP_ORDERS_GENERATION,
+	CH_DATABASE_STMT_ORDER_TOUCH,
+	CH_DATABASE_STMT_GET_METADATA,
+	CH_DATABASE_STMT_SET_METADATA,
+	CH_DATABASE_STMT_ADD_CALIBRATION,
+	CH_DATABASE_STMT_GET_CALIBRATION,
+	CH_DATABASE_STMT_GET_CALIBRATIONS,
+	CH_DATABASE_STMT_LAST
+} ChDatabaseStmt;
+
+/* the orders that are finished with: ?1 and ?2 are the states, ?3 the
+ * cutoff date and ?4 the newest order that was sent before the cutoff */
+#define CH_DATABASE_ARCHIVE_WHERE \
+	"state IN (?1, ?2) AND sent_date < ?3 AND order_id <= ?4"
+
+/* ?1 is a LIKE pattern escaped with '\' */
+#define CH_DATABASE_SEARCH_LIKE_WHERE \
+	"name LIKE ?1 ESCAPE '\\' " \
+	"OR email LIKE ?1 ESCAPE '\\' " \
+	"OR address LIKE ?1 ESCAPE '\\' " \
+	"OR comment LIKE ?1 ESCAPE '\\' " \
+	"OR tracking_number LIKE ?1 ESCAPE '\\' "
+
+/* the address as parsed by ch_database_address_cb() when it was added */
+#define CH_DATABASE_ADDRESS_COLUMNS \
+	"address_lines, postcode, country, address_latex "
+
+/* each operation has exactly one statement, prepared on first use */
+static const gchar *ch_database_stmt_sql[CH_DATABASE_STMT_LAST] = {
+	[CH_DATABASE_STMT_ADD_DEVICE] =
+		"INSERT INTO devices (calibrated_date, order_id, hw_ver, state) "
+		"VALUES (?1, 0, ?2, ?3);",
+	[CH_DATABASE_STMT_DEVICE_SET_STATE] =
+		"UPDATE devices SET state = ?1 WHERE device_id = ?2 "
+		"AND state IS NOT ?1;",
+	[CH_DATABASE_STMT_DEVICE_GET_STATE] =
+		"SELECT state FROM devices WHERE device_id = ?1;",
+	[CH_DATABASE_STMT_DEVICE_SET_ORDER_ID] =
+		"UPDATE devices SET order_id = ?1 WHERE device_id = ?2;",
+	[CH_DATABASE_STMT_DEVICE_GET_NUMBER] =
+		"SELECT count FROM inventory WHERE state = ?1 AND hw_ver = ?2;",
+	[CH_DATABASE_STMT_DEVICE_FIND_OLDEST] =
+		"SELECT device_id FROM devices WHERE state = ?1 AND hw_ver = ?2 "
+		"ORDER BY device_id ASC LIMIT 1;",
+	[CH_DATABASE_STMT_ORDER_SET_TRACKING] =
+		"UPDATE orders SET tracking_number = ?1, sent_date = ?2 "
+		"WHERE order_id = ?3;",
+	[CH_DATABASE_STMT_ORDER_SET_COMMENT] =
+		"UPDATE orders SET comment = ?1 WHERE order_id = ?2;",
+	[CH_DATABASE_STMT_ORDER_SET_STATE] =
+		"UPDATE orders SET state = ?1 WHERE order_id = ?2 "
+		"AND state IS NOT ?1;",
+	[CH_DATABASE_STMT_ORDER_GET_COMMENT] =
+		"SELECT comment FROM orders WHERE order_id = ?1;",
+	[CH_DATABASE_STMT_ORDER_GET_DEVICE_IDS] =
+		"SELECT device_id FROM devices WHERE order_id = ?1 "
+		"ORDER BY device_id DESC;",
+	[CH_DATABASE_STMT_GET_ORDERS] =
+		"SELECT order_id, name, address, email, postage, "
+		"tracking_number, sent_date, comment, state, "
+		CH_DATABASE_ADDRESS_COLUMNS
+		"FROM orders WHERE order_id < ?1 "
+		"ORDER BY order_id DESC LIMIT ?2;",
+	[CH_DATABASE_STMT_GET_ORDERS_CHANGED] =
+		"SELECT order_id, name, address, email, postage, "
+		"tracking_number, sent_date, comment, state, "
+		CH_DATABASE_ADDRESS_COLUMNS
+		"FROM orders WHERE changed > ?1 "
+		"ORDER BY changed;",
+	[CH_DATABASE_STMT_GET_ORDERS_GENERATION] =
+		"SELECT value FROM metadata WHERE key = 'orders_generation';",
+	[CH_DATABASE_STMT_ORDERS_GET_DEVICE_IDS] =
+		"SELECT order_id, device_id FROM devices "
+		"WHERE order_id BETWEEN ?1 AND ?2 "
+		"ORDER BY order_id DESC, device_id DESC;",
+	[CH_DATABASE_STMT_ADD_ORDER] =
+		"INSERT INTO orders (name, address, email, postage, "
+		"tracking_number, sent_date, address_lines, postcode, country, "
+		"address_latex) VALUES (?1, ?2, ?3, ?4, '', 0, "
+		"ch_address_lines(?2), ch_address_postcode(?2), "
+		"ch_address_country(?2), ch_address_latex(?2));",
+	[CH_DATABASE_STMT_GET_INVENTORY] =
+		"SELECT hw_ver, state, count FROM inventory "
+		"ORDER BY hw_ver, state;",
+	[CH_DATABASE_STMT_BEGIN] =
+		"BEGIN IMMEDIATE;",
+	[CH_DATABASE_STMT_COMMIT] =
+		"COMMIT;",
+	[CH_DATABASE_STMT_ROLLBACK] =
+		"ROLLBACK;",
+	[CH_DATABASE_STMT_DEVICE_FIND_AVAILABLE] =
+		"SELECT device_id FROM devices WHERE state = ?1 AND hw_ver = ?2 "
+		"ORDER BY device_id ASC LIMIT ?3;",
+	[CH_DATABASE_STMT_DEVICE_ALLOCATE] =
+		"UPDATE devices SET order_id = ?1, state = ?2 WHERE device_id = ?3;",
+	[CH_DATABASE_STMT_DATA_VERSION] =
+		"PRAGMA data_version;",
+	[CH_DATABASE_STMT_GET_GENERATIONS] =
+		"SELECT key, value FROM metadata "
+		"WHERE key IN ('orders_generation', 'devices_generation');",
+	[CH_DATABASE_STMT_SEARCH_ORDERS] =
+		"SELECT orders.order_id, orders.name, orders.address, "
+		"orders.email, orders.postage, orders.tracking_number, "
+		"orders.sent_date, orders.comment, orders.state, "
+		"orders.address_lines, orders.postcode, orders.country, "
+		"orders.address_latex "
+		"FROM orders_fts JOIN orders ON orders.order_id = orders_fts.rowid "
+		"WHERE orders_fts MATCH ?1 "
+		"ORDER BY orders_fts.rowid DESC LIMIT ?2;",
+	[CH_DATABASE_STMT_SEARCH_ORDERS_LIKE] =
+		"SELECT order_id, name, address, email, postage, "
+		"tracking_number, sent_date, comment, state, "
+		CH_DATABASE_ADDRESS_COLUMNS
+		"FROM orders WHERE " CH_DATABASE_SEARCH_LIKE_WHERE
+		"ORDER BY order_id DESC LIMIT ?2;",
+	[CH_DATABASE_STMT_ADD_EMAIL] =
+		"INSERT INTO emails (order_id, recipient, subject, body, "
+		"created, sent) VALUES (?1, ?2, ?3, ?4, ?5, 0);",
+	[CH_DATABASE_STMT_GET_QUEUED_EMAILS] =
+		"SELECT email_id, order_id, recipient, subject, body "
+		"FROM emails WHERE sent = 0 ORDER BY email_id;",
+	[CH_DATABASE_STMT_EMAIL_SET_SENT] =
+		"UPDATE emails SET sent = ?1 WHERE email_id = ?2;",
+	[CH_DATABASE_STMT_REPORT_SALES] =
+		"SELECT strftime('%Y-%m', sent_date / 1000000, 'unixepoch') AS month, "
+		"ch_postage_name(postage) AS kind, COUNT(*) AS orders, "
+		"SUM(ch_postage_price(postage) + ch_device_price(postage) * "
+		"MAX(1, IFNULL(allocated.devices, 0))) AS revenue "
+		"FROM all_orders LEFT JOIN (SELECT order_id, COUNT(*) AS devices "
+		"FROM all_devices GROUP BY order_id) AS allocated USING (order_id) "
+		"WHERE sent_date > 0 AND state IS NOT ?1 "
+		"GROUP BY 1, postage ORDER BY 1, postage;",
+	[CH_DATABASE_STMT_REPORT_CALIBRATIONS] =
+		"SELECT strftime('%Y-%W', calibrated_date / 1000000, 'unixepoch') AS week, "
+		"hw_ver, COUNT(*) AS devices "
+		"FROM all_devices GROUP BY 1, 2 ORDER BY 1, 2;",
+	[CH_DATABASE_STMT_REPORT_ORDERS] =
+		"SELECT order_id, name, address, email, "
+		"ch_postage_name(postage) AS postage, "
+		"IFNULL(allocated.devices, 0) AS devices, "
+		"tracking_number, sent_date / 1000000 AS sent, comment, state "
+		"FROM all_orders LEFT JOIN (SELECT order_id, COUNT(*) AS devices "
+		"FROM all_devices GROUP BY order_id) AS allocated USING (order_id) "
+		"ORDER BY order_id;",
+	[CH_DATABASE_STMT_ARCHIVE_GET_CUTOFF] =
+		"SELECT MAX(order_id) FROM orders "
+		"WHERE sent_date > 0 AND sent_date < ?1;",
+	[CH_DATABASE_STMT_ARCHIVE_COPY_ORDERS] =
+		"INSERT OR IGNORE INTO archive.orders (order_id, name, address, "
+		"email, tracking_number, comment, state, postage, sent_date, "
+		"address_lines, postcode, country, address_latex) "
+		"SELECT order_id, name, address, email, tracking_number, comment, "
+		"state, postage, sent_date, address_lines, postcode, country, "
+		"address_latex FROM main.orders "
+		"WHERE " CH_DATABASE_ARCHIVE_WHERE ";",
+	[CH_DATABASE_STMT_ARCHIVE_COPY_DEVICES] =
+		"INSERT OR IGNORE INTO archive.devices (device_id, hw_ver, "
+		"calibrated_date, state, order_id) "
+		"SELECT device_id, hw_ver, calibrated_date, state, order_id "
+		"FROM main.devices WHERE order_id IN (SELECT order_id "
+		"FROM main.orders WHERE " CH_DATABASE_ARCHIVE_WHERE ");",
+	[CH_DATABASE_STMT_ARCHIVE_DELETE_DEVICES] =
+		"DELETE FROM main.devices WHERE order_id IN (SELECT order_id "
+		"FROM main.orders WHERE " CH_DATABASE_ARCHIVE_WHERE ") "
+		"AND EXISTS (SELECT 1 FROM archive.devices AS archived "
+		"WHERE archived.device_id = devices.device_id);",
+	[CH_DATABASE_STMT_ARCHIVE_DELETE_ORDERS] =
+		"DELETE FROM main.orders WHERE " CH_DATABASE_ARCHIVE_WHERE " "
+		"AND EXISTS (SELECT 1 FROM archive.orders AS archived "
+		"WHERE archived.order_id = orders.order_id) "
+		"AND NOT EXISTS (SELECT 1 FROM main.devices "
+		"WHERE devices.order_id = orders.order_id);",
+	[CH_DATABASE_STMT_ARCHIVE_GET_DEVICE_IDS] =
+		"SELECT device_id FROM archive.devices WHERE order_id = ?1 "
+		"ORDER BY device_id DESC;",
+	[CH_DATABASE_STMT_SEARCH_ARCHIVE] =
+		"SELECT orders.order_id, orders.name, orders.address, "
+		"orders.email, orders.postage, orders.tracking_number, "
+		"orders.sent_date, orders.comment, orders.state, "
+		"orders.address_lines, orders.postcode, orders.country, "
+		"orders.address_latex, 0 "
+		"FROM orders_fts JOIN orders ON orders.order_id = orders_fts.rowid "
+		"WHERE orders_fts MATCH ?1 "
+		"UNION ALL "
+		"SELECT archived.order_id, archived.name, archived.address, "
+		"archived.email, archived.postage, archived.tracking_number, "
+		"archived.sent_date, archived.comment, archived.state, "
+		"archived.address_lines, archived.postcode, archived.country, "
+		"archived.address_latex, 1 "
+		"FROM archive.orders_fts AS archived_fts "
+		"JOIN archive.orders AS archived ON archived.order_id = archived_fts.rowid "
+		"WHERE archived_fts.orders_fts MATCH ?1 "
+		"ORDER BY 1 DESC LIMIT ?2;",
+	[CH_DATABASE_STMT_SEARCH_ARCHIVE_LIKE] =
+		"SELECT order_id, name, address, email, postage, "
+		"tracking_number, sent_date, comment, state, "
+		"address_lines, postcode, country, address_latex, 0 "
+		"FROM main.orders WHERE " CH_DATABASE_SEARCH_LIKE_WHERE
+		"UNION ALL "
+		"SELECT order_id, name, address, email, postage, "
+		"tracking_number, sent_date, comment, state, "
+		"address_lines, postcode, country, address_latex, 1 "
+		"FROM archive.orders WHERE " CH_DATABASE_SEARCH_LIKE_WHERE
+		"ORDER BY 1 DESC LIMIT ?2;",
+	[CH_DATABASE_STMT_ADD_EVENT] =
+		"INSERT INTO events (created, kind, id, state, station) "
+		"VALUES (?1, ?2, ?3, ?4, ?5);",
+	[CH_DATABASE_STMT_REPORT_CALIBRATION_RATE] =
+		"SELECT strftime('%Y-%m-%d %H:00', created / 1000000, 'unixepoch') AS hour, "
+		"station, COUNT(*) AS devices FROM events "
+		"WHERE kind = ?1 AND state = ?2 "
+		"GROUP BY 1, 2 ORDER BY 1, 2;",
+	[CH_DATABASE_STMT_GET_ORDER_LEAD_TIME] =
+		"WITH durations AS (SELECT sent.created - placed.created AS duration "
+		"FROM events AS sent JOIN events AS placed "
+		"ON placed.kind = sent.kind AND placed.id = sent.id AND placed.state = ?3 "
+		"WHERE sent.kind = ?1 AND sent.state = ?2 AND sent.created >= ?4) "
+		"SELECT COUNT(*), (SELECT duration FROM durations ORDER BY duration "
+		"LIMIT 1 OFFSET (SELECT COUNT(*) FROM durations) / 2) FROM durations;",
+	[CH_DATABASE_STMT_GET_SHIPPING_TIME] =
+		"WITH durations AS (SELECT sent.created - calibrated.created AS duration "
+		"FROM events AS sent JOIN devices ON devices.order_id = sent.id "
+		"JOIN events AS calibrated ON calibrated.kind = ?3 "
+		"AND calibrated.id = devices.device_id AND calibrated.state = ?4 "
+		"WHERE sent.kind = ?1 AND sent.state = ?2 AND sent.created >= ?5) "
+		"SELECT COUNT(*), (SELECT duration FROM durations ORDER BY duration "
+		"LIMIT 1 OFFSET (SELECT COUNT(*) FROM durations) / 2) FROM durations;",
+	[CH_DATABASE_STMT_ADD_CHANGESET] =
+		"INSERT INTO changesets (data) VALUES (?1);",
+	[CH_DATABASE_STMT_GET_CHANGESETS] =
+		"SELECT changeset_id, data FROM changesets ORDER BY changeset_id;",
+	[CH_DATABASE_STMT_DELETE_CHANGESETS] =
+		"DELETE FROM changesets WHERE changeset_id <= ?1;",
+	[CH_DATABASE_STMT_GET_APPLIED] =
+		"SELECT applied FROM replication WHERE station = ?1;",
+	[CH_DATABASE_STMT_SET_APPLIED] =
+		"INSERT OR REPLACE INTO replication (station, applied) VALUES (?1, ?2);",
+	[CH_DATABASE_STMT_BUMP_ORDERS_GENERATION] =
+		"UPDATE metadata SET value = value + 1 WHERE key = 'orders_generation';",
+	[CH_DATABASE_STMT_ORDER_TOUCH] =
+		"UPDATE orders SET changed = (SELECT value FROM metadata "
+		"WHERE key = 'orders_generation') WHERE order_id = ?1;",
+	[CH_DATABASE_STMT_GET_METADATA] =
+		"SELECT value FROM metadata WHERE key = ?1;",
+	[CH_DATABASE_STMT_SET_METADATA] =
+		"INSERT OR REPLACE INTO metadata (key, value) VALUES (?1, ?2);",
+	[CH_DATABASE_STMT_ADD_CALIBRATION] =
+		"INSERT OR REPLACE INTO calibrations (device_id, hw_ver, "
+		"created, determinant, ti3, ccmx) "
+		"VALUES (?1, ?2, ?3, ?4, ?5, ?6);",
+	[CH_DATABASE_STMT_GET_CALIBRATION] =
+		"SELECT device_id, hw_ver, created, determinant, ti3, ccmx "
+		"FROM calibrations WHERE device_id = ?1;",
+	[CH_DATABASE_STMT_GET_CALIBRATIONS] =
+		"SELECT device_id, hw_ver, created, determinant, ti3, ccmx "
+		"FROM calibrations WHERE device_id > ?1 AND (?2 = 0 OR hw_ver = ?2) "
+		"ORDER BY device_id LIMIT ?3;",
+};
+
+/* the statements that are expected to read a whole table, and what they read */
+static const struct {
+	ChDatabaseStmt	 id;
+	const gchar	*scan;
+} ch_database_stmt_scans[] = {
+	/* one row for each hardware version and state */
+	{ CH_DATABASE_STMT_GET_INVENTORY,	"SCAN inventory" },
+	/* everything in the outbox is exported at once */
+	{ CH_DATABASE_STMT_GET_CHANGESETS,	"SCAN changesets" },
+	/* the fallback when there is no full text search */
+	{ CH_DATABASE_STMT_SEARCH_ORDERS_LIKE,	"SCAN orders" },
+	{ CH_DATABASE_STMT_SEARCH_ARCHIVE_LIKE,	"SCAN orders" },
+	{ CH_DATABASE_STMT_SEARCH_ARCHIVE_LIKE,	"SCAN archive.orders" },
+	/* the reports are over the whole history */
+	{ CH_DATABASE_STMT_REPORT_SALES,	"SCAN orders" },
+	{ CH_DATABASE_STMT_REPORT_SALES,	"SCAN devices" },
+	{ CH_DATABASE_STMT_REPORT_SALES,	"SCAN archive.orders" },
+	{ CH_DATABASE_STMT_REPORT_SALES,	"SCAN archive.devices" },
+	{ CH_DATABASE_STMT_REPORT_SALES,	"SCAN all_orders" },
+	{ CH_DATABASE_STMT_REPORT_SALES,	"SCAN all_devices" },
+	{ CH_DATABASE_STMT_REPORT_CALIBRATIONS,	"SCAN devices" },
+	{ CH_DATABASE_STMT_REPORT_CALIBRATIONS,	"SCAN archive.devices" },
+	{ CH_DATABASE_STMT_REPORT_CALIBRATIONS,	"SCAN all_devices" },
+	{ CH_DATABASE_STMT_REPORT_ORDERS,	"SCAN orders" },
+	{ CH_DATABASE_STMT_REPORT_ORDERS,	"SCAN devices" },
+	{ CH_DATABASE_STMT_REPORT_ORDERS,	"SCAN archive.orders" },
+	{ CH_DATABASE_STMT_REPORT_ORDERS,	"SCAN archive.devices" },
+	{ CH_DATABASE_STMT_REPORT_ORDERS,	"SCAN all_devices" },
+	/* the durations are found with an index, then sorted for the median */
+	{ CH_DATABASE_STMT_GET_ORDER_LEAD_TIME,	"SCAN durations" },
+	{ CH_DATABASE_STMT_GET_SHIPPING_TIME,	"SCAN durations" },
+	{ CH_DATABASE_STMT_LAST,		NULL }
+};
+
 struct _ChDatabasePrivate
 {
 	sqlite3				*db;
 	gchar				*uri;
 	GFileMonitor			*file_monitor;
+	GFileMonitor			*file_monitor_wal;
+	guint				 changed_id;
+	guint				 poll_id;
+	gboolean			 changed_pending;
+	gboolean			 changed_valid;
+	gint64				 data_version;
+	gint64				 orders_generation;
+	gint64				 devices_generation;
+	sqlite3_stmt			*stmts[CH_DATABASE_STMT_LAST];
+	guint				 transaction_depth;
+	gchar				*journal_mode;
+	guint				 busy_timeout;
+	gint64				 busy_start;
+	gint64				 step_start;
+	GRecMutex			 mutex;
+	GThreadPool			*pool;
+	GHashTable			*profile;
+	guint				 profile_signal_id;
+	gchar				*backup_filename;
+	guint				 backup_id;
+	gchar				*archive_uri;
+	gboolean			 archive_attached;
+	gboolean			 fts;
+	gboolean			 archive_fts;
+	gchar				*station;
+	gboolean			 backup_running;
+	gchar				*spool_dir;
+	guint				 replicate_id;
+	gboolean			 replicate_running;
+	gchar				*replicate_error;
+	guint				 maintenance_id;
+	guint				 maintenance_idle;
+	gboolean			 maintenance_pending;
+	gboolean			 maintaining;
+	gint64				 maintained;
+	gint64				 used;
+#ifdef HAVE_SQLITE_SESSION
+	sqlite3_session			*session;
+#endif
+};
+
+/* upper bounds of the latency histogram, in us */
+static const gint64 ch_database_profile_buckets[] = {
+	10, 100, 1000, 10000, 100000, G_MAXINT64 };
+#define CH_DATABASE_PROFILE_BUCKETS	G_N_ELEMENTS (ch_database_profile_buckets)
+
+typedef struct {
+	gchar		*sql;
+	guint		 count;
+	gint64		 total;		/* ns */
+	gint64		 max;		/* ns */
+	guint		 histogram[CH_DATABASE_PROFILE_BUCKETS];
+	gboolean	 plan_checked;
+	gchar		*full_scan;
+} ChDatabaseProfile;
+
+enum {
+	SIGNAL_CHANGED,
+	SIGNAL_LAST
 };
 
+static guint signals[SIGNAL_LAST] = { 0 };
+
+/* the backup copies this many pages at a time, then lets others in */
+#define CH_DATABASE_BACKUP_PAGES	64
+#define CH_DATABASE_BACKUP_DELAY	5 /* ms */
+
+/* the number of calibrations read at a time when exporting */
+#define CH_DATABASE_CALIBRATION_BATCH	100
+
+/* how often to check for changes where file monitors do not work */
+#define CH_DATABASE_POLL_INTERVAL	10 /* s */
+
+/* each maintenance step is small, so a station is never kept waiting */
+#define CH_DATABASE_MAINTENANCE_INTERVAL	5 /* s */
+#define CH_DATABASE_ANALYZE_INTERVAL		(G_GINT64_CONSTANT (24) * 60 * 60 * G_USEC_PER_SEC)
+#define CH_DATABASE_ANALYZE_LIMIT		"400" /* rows for each index */
+#define CH_DATABASE_VACUUM_PAGES		"256"
+#define CH_DATABASE_JOURNAL_SIZE_LIMIT		"4194304" /* bytes */
+
 G_DEFINE_TYPE (ChDatabase, ch_database, G_TYPE_OBJECT)
 
 const gchar *
@@ -53,747 +491,6316 @@ ch_database_state_to_string (ChDeviceState state)
 	return NULL;
 }
 
-void
-ch_database_set_uri (ChDatabase *database, const gchar *uri)
+ChDeviceState
+ch_database_state_from_string (const gchar *state)
 {
-	g_return_if_fail (CH_IS_DATABASE (database));
-	g_return_if_fail (uri != NULL);
-	g_return_if_fail (database->priv->uri == NULL);
-	database->priv->uri = g_strdup (uri);
+	guint i;
+	for (i = 0; i < CH_DEVICE_STATE_LAST; i++) {
+		if (g_strcmp0 (state, ch_database_state_to_string (i)) == 0)
+			return i;
+	}
+	return CH_DEVICE_STATE_LAST;
 }
 
+static void ch_database_check_changed (ChDatabase *database);
+
 static gboolean
-ch_database_load (ChDatabase *database, GError **error)
+ch_database_changed_timeout_cb (gpointer user_data)
+{
+	ChDatabase *database = CH_DATABASE (user_data);
+	database->priv->changed_id = 0;
+	ch_database_check_changed (database);
+	return G_SOURCE_REMOVE;
+}
+
+static gboolean
+ch_database_poll_cb (gpointer user_data)
+{
+	ChDatabase *database = CH_DATABASE (user_data);
+	ch_database_check_changed (database);
+	return G_SOURCE_CONTINUE;
+}
+
+static void
+ch_database_file_monitor_changed_cb (GFileMonitor *monitor,
+				     GFile *file,
+				     GFile *other_file,
+				     GFileMonitorEvent event_type,
+				     ChDatabase *database)
 {
 	ChDatabasePrivate *priv = database->priv;
-	const gchar *statement;
-	gboolean ret = TRUE;
-	gchar *error_msg = NULL;
-	gint rc;
 
-	/* already open */
-	if (priv->db != NULL)
-		goto out;
+	/* a commit is several writes, so wait for them all */
+	if (priv->changed_id != 0)
+		return;
+	priv->changed_id = g_timeout_add (100, ch_database_changed_timeout_cb, database);
+}
 
-	/* open database */
-	g_debug ("trying to open database '%s'", database->priv->uri);
-	rc = sqlite3_open (database->priv->uri, &priv->db);
-	if (rc != SQLITE_OK) {
-		ret = FALSE;
-		g_set_error (error, 1, 0,
-			     "can't open calibration database: %s",
-			     sqlite3_errmsg (priv->db));
-		goto out;
-	}
+static GFileMonitor *
+ch_database_watch_file (ChDatabase *database, const gchar *filename)
+{
+	GError *error = NULL;
+	GFile *file;
+	GFileMonitor *monitor;
 
-	/* create if required */
-	rc = sqlite3_exec (priv->db, "SELECT * FROM devices LIMIT 1",
-			   NULL, NULL, &error_msg);
-	if (rc != SQLITE_OK) {
-		g_debug ("creating table to repair: %s", error_msg);
-		sqlite3_free (error_msg);
-		statement = "CREATE TABLE devices ("
-			    "device_id INTEGER PRIMARY KEY AUTOINCREMENT,"
-			    "hw_ver INTEGER DEFAULT 0,"
-			    "calibrated_date INTEGER,"
-			    "state INTEGER,"
-			    "order_id INTEGER);";
-		sqlite3_exec (priv->db, statement, NULL, NULL, NULL);
-		statement = "CREATE TABLE orders ("
-			    "order_id INTEGER PRIMARY KEY AUTOINCREMENT,"
-			    "name STRING,"
-			    "address STRING,"
-			    "email STRING,"
-			    "tracking_number STRING,"
-			    "comment STRING,"
-			    "state INTEGER,"
-			    "postage INTEGER,"
-			    "sent_date INTEGER);";
-		sqlite3_exec (priv->db, statement, NULL, NULL, NULL);
-	}
-
-	/* check devices has hw_ver */
-	rc = sqlite3_exec (priv->db,
-			   "SELECT hw_ver FROM devices LIMIT 1",
-			   NULL, NULL, &error_msg);
-	if (rc != SQLITE_OK) {
-		g_debug ("altering table to repair: %s", error_msg);
-		sqlite3_free (error_msg);
-		statement = "ALTER TABLE devices ADD COLUMN hw_ver INTEGER DEFAULT 0;";
-		sqlite3_exec (priv->db, statement, NULL, NULL, NULL);
+	file = g_file_new_for_path (filename);
+	monitor = g_file_monitor_file (file, G_FILE_MONITOR_NONE, NULL, &error);
+	if (monitor == NULL) {
+		g_warning ("failed to watch %s: %s", filename, error->message);
+		g_error_free (error);
+		goto out;
 	}
-
-	/* turn off fsync */
-	sqlite3_exec (priv->db, "PRAGMA synchronous=NORMAL", NULL, NULL, NULL);
+	g_signal_connect (monitor, "changed",
+			  G_CALLBACK (ch_database_file_monitor_changed_cb),
+			  database);
 out:
-	return ret;
+	g_object_unref (file);
+	return monitor;
 }
 
 /**
- * ch_database_add_device:
+ * ch_database_watch:
  * @database: a valid #ChDatabase instance
- * @error: A #GError or %NULL
- *
- * Add a new device to the database
  *
- * Return value: The new device serial number or G_MAXUINT32 for error
+ * Watches for changes made by other processes, emitting ::changed when
+ * one is seen. This uses file monitors and a poll, so is only wanted by
+ * tools that show the data for a long time; the URI has to be set first.
  **/
-guint32
-ch_database_add_device (ChDatabase *database, guint hw_ver, GError **error)
+void
+ch_database_watch (ChDatabase *database)
 {
 	ChDatabasePrivate *priv = database->priv;
-	gboolean ret;
-	gchar *error_msg = NULL;
-	gchar *statement = NULL;
-	gint rc;
-	guint32 id = G_MAXUINT32;
+	gchar *filename_wal;
 
-	/* ensure db is loaded */
-	ret = ch_database_load (database, error);
-	if (!ret)
-		goto out;
+	g_return_if_fail (CH_IS_DATABASE (database));
+	g_return_if_fail (priv->uri != NULL);
 
-	/* add newest */
-	statement = g_strdup_printf ("INSERT INTO devices (calibrated_date, order_id, hw_ver, state) "
-				     "VALUES ('%" G_GINT64_FORMAT "', '', %i, %i);",
-				     g_get_real_time (),
-				     hw_ver,
-				     CH_DEVICE_STATE_INIT);
-	rc = sqlite3_exec (priv->db, statement, NULL, NULL, &error_msg);
-	if (rc != SQLITE_OK) {
-		g_set_error (error, 1, 0,
-			     "failed to add entry: %s",
-			     sqlite3_errmsg (priv->db));
-		goto out;
-	}
+	/* already watching, or private to this process */
+	if (priv->poll_id != 0)
+		return;
+	if (g_strcmp0 (priv->uri, ":memory:") == 0)
+		return;
 
-	/* yay, atomic serial number */
-	id = sqlite3_last_insert_rowid (priv->db);
-out:
-	g_free (statement);
-	return id;
+	/* in WAL mode commits only touch the -wal file */
+	priv->file_monitor = ch_database_watch_file (database, priv->uri);
+	filename_wal = g_strdup_printf ("%s-wal", priv->uri);
+	priv->file_monitor_wal = ch_database_watch_file (database, filename_wal);
+	g_free (filename_wal);
+
+	/* file monitors do not see writes from another host */
+	priv->poll_id = g_timeout_add_seconds (CH_DATABASE_POLL_INTERVAL,
+					       ch_database_poll_cb,
+					       database);
+}
+
+void
+ch_database_set_uri (ChDatabase *database, const gchar *uri)
+{
+	g_return_if_fail (CH_IS_DATABASE (database));
+	g_return_if_fail (uri != NULL);
+	g_return_if_fail (database->priv->uri == NULL);
+	database->priv->uri = g_strdup (uri);
 }
 
 /**
- * ch_database_device_set_state:
+ * ch_database_set_archive_uri:
  * @database: a valid #ChDatabase instance
- * @id: the device serial number
- * @state: the #ChDeviceState
- * @error: A #GError or %NULL
+ * @uri: the archive database filename, or "" for none
  *
- * Changes the state on a device
+ * Sets the database that old orders are moved into by
+ * ch_database_archive_orders(). This has to be set before the database
+ * is first used.
+ **/
+void
+ch_database_set_archive_uri (ChDatabase *database, const gchar *uri)
+{
+	g_return_if_fail (CH_IS_DATABASE (database));
+	g_return_if_fail (database->priv->db == NULL);
+	g_free (database->priv->archive_uri);
+	database->priv->archive_uri = NULL;
+	if (uri != NULL && uri[0] != '\0')
+		database->priv->archive_uri = g_strdup (uri);
+}
+
+/**
+ * ch_database_set_journal_mode:
+ * @database: a valid #ChDatabase instance
+ * @journal_mode: a SQLite journal mode, e.g. "wal" or "delete"
  *
- * Return value: %TRUE if the new state was set
+ * Sets the journal mode to use when the database is opened. The default
+ * is "delete". Using "wal" allows one station to write while another is
+ * reading, but needs shared memory between the processes, and so is
+ * ignored if the database is on a network filesystem.
  **/
-gboolean
-ch_database_device_set_state (ChDatabase *database,
-			      guint32 id,
-			      ChDeviceState state,
-			      GError **error)
+void
+ch_database_set_journal_mode (ChDatabase *database, const gchar *journal_mode)
+{
+	g_return_if_fail (CH_IS_DATABASE (database));
+	g_return_if_fail (journal_mode != NULL);
+	g_return_if_fail (database->priv->db == NULL);
+	g_free (database->priv->journal_mode);
+	database->priv->journal_mode = g_ascii_strdown (journal_mode, -1);
+}
+
+/**
+ * ch_database_set_busy_timeout:
+ * @database: a valid #ChDatabase instance
+ * @busy_timeout: the time in ms to wait for another process
+ *
+ * Sets how long to keep retrying when the database is locked by another
+ * station before failing with an error.
+ **/
+void
+ch_database_set_busy_timeout (ChDatabase *database, guint busy_timeout)
+{
+	g_return_if_fail (CH_IS_DATABASE (database));
+	database->priv->busy_timeout = busy_timeout;
+}
+
+/**
+ * ch_database_backoff:
+ * @database: a valid #ChDatabase instance
+ * @start: the monotonic time the first attempt was made
+ * @count: the number of previous attempts
+ *
+ * Sleeps for an exponentially increasing time, with some jitter so that
+ * two stations do not retry in lockstep.
+ *
+ * Return value: %TRUE to try again, %FALSE if the busy timeout has expired
+ **/
+static gboolean
+ch_database_backoff (ChDatabase *database, gint64 start, guint count)
 {
+	gint64 elapsed;
+	gulong delay;
+
+	elapsed = g_get_monotonic_time () - start;
+	if (elapsed >= (gint64) database->priv->busy_timeout * 1000)
+		return FALSE;
+
+	/* 1ms, 2ms, 4ms ... up to 100ms */
+	delay = MIN (1000ul << MIN (count, 7), 100000ul);
+	delay = g_random_int_range (delay / 2, delay + 1);
+	g_usleep (delay);
+	return TRUE;
+}
+
+/* shares the deadline of ch_database_step() so the two never add up */
+static gint
+ch_database_busy_cb (gpointer user_data, gint count)
+{
+	ChDatabase *database = CH_DATABASE (user_data);
 	ChDatabasePrivate *priv = database->priv;
-	gboolean ret;
-	gchar *error_msg = NULL;
-	gchar *statement = NULL;
-	gint rc;
 
-	/* ensure db is loaded */
-	ret = ch_database_load (database, error);
-	if (!ret)
-		goto out;
+	if (priv->step_start != 0)
+		return ch_database_backoff (database, priv->step_start, count);
+	if (count == 0)
+		priv->busy_start = g_get_monotonic_time ();
+	return ch_database_backoff (database, priv->busy_start, count);
+}
 
-	/* set state */
-	statement = g_strdup_printf ("UPDATE devices SET state = '%i' WHERE device_id = '%i'",
-				     state, id);
-	rc = sqlite3_exec (priv->db, statement, NULL, NULL, &error_msg);
+static void
+ch_database_profile_free (ChDatabaseProfile *profile)
+{
+	g_free (profile->sql);
+	g_free (profile->full_scan);
+	g_free (profile);
+}
+
+static ChDatabaseProfile *
+ch_database_profile_get (ChDatabase *database, const gchar *sql)
+{
+	ChDatabaseProfile *profile;
+
+	profile = g_hash_table_lookup (database->priv->profile, sql);
+	if (profile != NULL)
+		return profile;
+	profile = g_new0 (ChDatabaseProfile, 1);
+	profile->sql = g_strdup (sql);
+	g_hash_table_insert (database->priv->profile, profile->sql, profile);
+	return profile;
+}
+
+/* adds each table that @sql would read from start to end to @scans */
+static gboolean
+ch_database_get_full_scans (ChDatabase *database,
+			    const gchar *sql,
+			    GPtrArray *scans,
+			    GError **error)
+{
+	const gchar *detail;
+	const gchar *table;
+	gboolean ret = TRUE;
+	gchar *statement;
+	gint rc;
+	sqlite3_stmt *stmt = NULL;
+
+	/* this is not run for real, so nothing needs to be bound */
+	statement = g_strdup_printf ("EXPLAIN QUERY PLAN %s", sql);
+	rc = sqlite3_prepare_v2 (database->priv->db, statement, -1, &stmt, NULL);
 	if (rc != SQLITE_OK) {
 		ret = FALSE;
 		g_set_error (error, 1, 0,
-			     "failed to update entry: %s",
-			     sqlite3_errmsg (priv->db));
+			     "failed to plan '%s': %s",
+			     sql, sqlite3_errmsg (database->priv->db));
 		goto out;
 	}
+	while (sqlite3_step (stmt) == SQLITE_ROW) {
+		detail = (const gchar *) sqlite3_column_text (stmt, 3);
+		if (detail == NULL || !g_str_has_prefix (detail, "SCAN "))
+			continue;
+
+		/* the full text index is searched, not scanned */
+		if (g_strstr_len (detail, -1, "VIRTUAL TABLE") != NULL)
+			continue;
+
+		/* walking an index is how rows are read in order */
+		if (g_strstr_len (detail, -1, " USING INDEX ") != NULL ||
+		    g_strstr_len (detail, -1, " USING COVERING INDEX ") != NULL)
+			continue;
+
+		/* older versions of SQLite say "SCAN TABLE devices" */
+		table = detail + 5;
+		if (g_str_has_prefix (table, "TABLE "))
+			table += 6;
+
+		/* results that were already worked out, not tables */
+		if (g_str_has_prefix (table, "SUBQUERY ") ||
+		    g_str_has_prefix (table, "CONSTANT ROW"))
+			continue;
+
+		/* the views are temporary, so the main tables are qualified */
+		if (g_str_has_prefix (table, "main.") ||
+		    g_str_has_prefix (table, "temp."))
+			table += 5;
+		g_ptr_array_add (scans, g_strdup_printf ("SCAN %s", table));
+	}
 out:
+	if (stmt != NULL)
+		sqlite3_finalize (stmt);
 	g_free (statement);
 	return ret;
 }
 
+/* finds tables that are read from start to end, as an index is missing */
+static void
+ch_database_profile_check_plan (ChDatabase *database, ChDatabaseProfile *profile)
+{
+	GPtrArray *scans;
+
+	if (profile->plan_checked)
+		return;
+	profile->plan_checked = TRUE;
+
+	scans = g_ptr_array_new_with_free_func (g_free);
+	if (!ch_database_get_full_scans (database, profile->sql, scans, NULL))
+		goto out;
+	if (scans->len > 0) {
+		g_ptr_array_add (scans, NULL);
+		profile->full_scan = g_strjoinv (", ", (gchar **) scans->pdata);
+		g_message ("full scan (%s) in '%s'", profile->full_scan, profile->sql);
+	}
+out:
+	g_ptr_array_unref (scans);
+}
+
+/* called by SQLite when each statement has finished running */
+static int
+ch_database_profile_cb (unsigned type, void *user_data, void *p, void *x)
+{
+	ChDatabase *database = CH_DATABASE (user_data);
+	ChDatabaseProfile *profile;
+	const gchar *sql;
+	gint64 elapsed;
+	guint i;
+
+	/* ignore the query plans we asked for */
+	sql = sqlite3_sql ((sqlite3_stmt *) p);
+	if (sql == NULL || g_str_has_prefix (sql, "EXPLAIN "))
+		return 0;
+	elapsed = *((sqlite3_int64 *) x);
+	profile = ch_database_profile_get (database, sql);
+	profile->count++;
+	profile->total += elapsed;
+	profile->max = MAX (profile->max, elapsed);
+	for (i = 0; i < CH_DATABASE_PROFILE_BUCKETS; i++) {
+		if (elapsed / 1000 < ch_database_profile_buckets[i]) {
+			profile->histogram[i]++;
+			break;
+		}
+	}
+	return 0;
+}
+
 static gint
-ch_database_device_get_state_cb (void *data, gint argc, gchar **argv, gchar **col_name)
+ch_database_profile_sort_cb (gconstpointer a, gconstpointer b)
 {
-	ChDeviceState *state = (ChDeviceState *) data;
-	*state = atoi (argv[0]);
+	ChDatabaseProfile *profile_a = *((ChDatabaseProfile **) a);
+	ChDatabaseProfile *profile_b = *((ChDatabaseProfile **) b);
+	if (profile_a->total < profile_b->total)
+		return 1;
+	if (profile_a->total > profile_b->total)
+		return -1;
 	return 0;
 }
 
-ChDeviceState
-ch_database_device_get_state (ChDatabase *database,
-			      guint32 device_id,
-			      GError **error)
+/* logs where the time went, slowest statement first */
+static void
+ch_database_profile_dump (ChDatabase *database)
 {
 	ChDatabasePrivate *priv = database->priv;
-	gboolean ret;
-	gchar *error_msg = NULL;
-	gchar *statement = NULL;
-	gint rc;
-	ChDeviceState state = CH_DEVICE_STATE_LAST;
+	ChDatabaseProfile *profile;
+	GHashTableIter hash_iter;
+	GPtrArray *array;
+	GString *str;
+	guint i;
+	guint j;
 
-	/* ensure db is loaded */
-	ret = ch_database_load (database, error);
-	if (!ret)
+	g_rec_mutex_lock (&priv->mutex);
+	if (priv->profile == NULL || priv->db == NULL)
 		goto out;
 
-	/* find */
-	statement = g_strdup_printf ("SELECT state "
-				     "FROM devices WHERE device_id = '%i';",
-				     device_id);
-	rc = sqlite3_exec (priv->db,
-			   statement,
-			   ch_database_device_get_state_cb,
-			   &state,
-			   &error_msg);
-	if (rc != SQLITE_OK) {
-		g_set_error (error, 1, 0,
-			     "failed to find entry: %s",
-			     sqlite3_errmsg (priv->db));
-		goto out;
+	array = g_ptr_array_new ();
+	g_hash_table_iter_init (&hash_iter, priv->profile);
+	while (g_hash_table_iter_next (&hash_iter, NULL, (gpointer *) &profile)) {
+		ch_database_profile_check_plan (database, profile);
+		g_ptr_array_add (array, profile);
 	}
-	if (state == CH_DEVICE_STATE_LAST) {
-		g_set_error (error, 1, 0,
-			     "No devices for id %i", device_id);
-		goto out;
+	g_ptr_array_sort (array, ch_database_profile_sort_cb);
+
+	str = g_string_new ("database profile:\n");
+	g_string_append_printf (str, "%8s %10s %10s %10s  %s\n",
+				"count", "total/ms", "mean/us", "max/us",
+				"<10us <100us <1ms <10ms <100ms >100ms");
+	for (i = 0; i < array->len; i++) {
+		profile = g_ptr_array_index (array, i);
+		g_string_append_printf (str, "%8u %10.1f %10.1f %10.1f ",
+					profile->count,
+					(gdouble) profile->total / 1e6,
+					(gdouble) profile->total / 1e3 / MAX (profile->count, 1),
+					(gdouble) profile->max / 1e3);
+		for (j = 0; j < CH_DATABASE_PROFILE_BUCKETS; j++)
+			g_string_append_printf (str, " %5u", profile->histogram[j]);
+		g_string_append_printf (str, "\n\t%s\n", profile->sql);
+		if (profile->full_scan != NULL)
+			g_string_append_printf (str, "\tFULL SCAN: %s\n", profile->full_scan);
 	}
+	g_message ("%s", str->str);
+	g_string_free (str, TRUE);
+	g_ptr_array_unref (array);
 out:
-	g_free (statement);
-	return state;
+	g_rec_mutex_unlock (&priv->mutex);
+}
+
+static gboolean
+ch_database_profile_signal_cb (gpointer user_data)
+{
+	ChDatabase *database = CH_DATABASE (user_data);
+	ch_database_profile_dump (database);
+	return G_SOURCE_CONTINUE;
+}
+
+/* set COLORHUG_VERBOSE, or use --verbose, to find slow statements */
+static void
+ch_database_profile_setup (ChDatabase *database)
+{
+	ChDatabasePrivate *priv = database->priv;
+
+	if (g_getenv ("CH_DATABASE_PROFILE") == NULL &&
+	    g_getenv ("COLORHUG_VERBOSE") == NULL)
+		return;
+	if (priv->profile == NULL) {
+		priv->profile = g_hash_table_new_full (g_str_hash, g_str_equal,
+						       NULL, (GDestroyNotify) ch_database_profile_free);
+		priv->profile_signal_id = g_unix_signal_add (SIGUSR1,
+							     ch_database_profile_signal_cb,
+							     database);
+	}
+	sqlite3_trace_v2 (priv->db, SQLITE_TRACE_PROFILE,
+			  ch_database_profile_cb, database);
 }
+
 /**
- * ch_database_order_set_tracking:
+ * ch_database_get_stmt:
  * @database: a valid #ChDatabase instance
- * @id: the device serial number
- * @state: the #ChDeviceState
+ * @id: a #ChDatabaseStmt
  * @error: A #GError or %NULL
  *
- * Changes the state on a device
+ * Gets the cached prepared statement for an operation, preparing it if this
+ * is the first use. The statement is rewound and has no bound parameters.
  *
- * Return value: %TRUE if the new state was set
+ * Return value: a sqlite3_stmt owned by @database, or %NULL for error
  **/
-gboolean
-ch_database_order_set_tracking (ChDatabase *database,
-				guint32 order_id,
-				const gchar *tracking,
-				GError **error)
+static sqlite3_stmt *
+ch_database_get_stmt (ChDatabase *database, ChDatabaseStmt id, GError **error)
 {
 	ChDatabasePrivate *priv = database->priv;
-	gboolean ret;
-	gchar *error_msg = NULL;
-	gchar *statement = NULL;
 	gint rc;
 
-	/* ensure db is loaded */
-	ret = ch_database_load (database, error);
-	if (!ret)
-		goto out;
+	/* polling for changes does not stop the database being idle */
+	if (id != CH_DATABASE_STMT_DATA_VERSION && !priv->maintaining)
+		priv->used = g_get_monotonic_time ();
 
-	/* set state */
-	statement = sqlite3_mprintf ("UPDATE orders SET tracking_number = '%q', sent_date = '%" G_GINT64_FORMAT "' WHERE order_id = '%i'",
-				     tracking,
-				     g_get_real_time (),
-				     order_id);
-	rc = sqlite3_exec (priv->db, statement, NULL, NULL, &error_msg);
+	/* already prepared */
+	if (priv->stmts[id] != NULL) {
+		sqlite3_reset (priv->stmts[id]);
+		sqlite3_clear_bindings (priv->stmts[id]);
+		return priv->stmts[id];
+	}
+
+	/* parse and plan once */
+	rc = sqlite3_prepare_v2 (priv->db,
+				 ch_database_stmt_sql[id], -1,
+				 &priv->stmts[id], NULL);
 	if (rc != SQLITE_OK) {
-		ret = FALSE;
 		g_set_error (error, 1, 0,
-			     "failed to update order: %s",
+			     "failed to prepare statement: %s",
 			     sqlite3_errmsg (priv->db));
-		goto out;
+		return NULL;
 	}
-out:
-	sqlite3_free (statement);
-	return ret;
+
+	/* warn as soon as a slow plan is chosen */
+	if (priv->profile != NULL) {
+		ch_database_profile_check_plan (database,
+						ch_database_profile_get (database,
+									 ch_database_stmt_sql[id]));
+	}
+	return priv->stmts[id];
 }
 
 /**
- * ch_database_order_set_comment:
+ * ch_database_step:
  * @database: a valid #ChDatabase instance
- * @id: the device serial number
- * @comment: the #ChDeviceState
+ * @stmt: a prepared statement
+ *
+ * Steps a statement, retrying if another station holds the lock. SQLite
+ * only calls the busy handler when waiting could succeed, so this also
+ * catches the case where a WAL snapshot went stale before the write.
+ * Only statements that have not yet returned a row are retried, and only
+ * outside of an explicit transaction, as anything else would have to be
+ * restarted by the caller. The busy handler counts against the same busy
+ * timeout, so a contended call never waits longer than that in total.
+ *
+ * Return value: the SQLite result code
+ **/
+static gint
+ch_database_step (ChDatabase *database, sqlite3_stmt *stmt)
+{
+	ChDatabasePrivate *priv = database->priv;
+	gboolean can_retry;
+	gint64 start;
+	gint rc;
+	guint count = 0;
+
+	can_retry = priv->transaction_depth == 0 &&
+		    !sqlite3_stmt_busy (stmt);
+	start = g_get_monotonic_time ();
+	priv->step_start = start;
+	for (;;) {
+		rc = sqlite3_step (stmt);
+		if ((rc & 0xff) != SQLITE_BUSY || !can_retry)
+			break;
+		if (!ch_database_backoff (database, start, count++))
+			break;
+		g_debug ("database busy, retrying");
+		sqlite3_reset (stmt);
+	}
+	priv->step_start = 0;
+	return rc;
+}
+
+/**
+ * ch_database_exec:
+ * @database: a valid #ChDatabase instance
+ * @sql: one or more SQL statements that return no rows
  * @error: A #GError or %NULL
  *
- * Changes the state on a device
+ * Runs SQL that is not worth caching, for instance schema changes.
  *
- * Return value: %TRUE if the new state was set
+ * Return value: %TRUE for success
  **/
-gboolean
-ch_database_order_set_comment (ChDatabase *database,
-			       guint32 order_id,
-			       const gchar *comment,
-			       GError **error)
+static gboolean
+ch_database_exec (ChDatabase *database, const gchar *sql, GError **error)
+{
+	gchar *error_msg = NULL;
+	gint rc;
+
+	rc = sqlite3_exec (database->priv->db, sql, NULL, NULL, &error_msg);
+	if (rc != SQLITE_OK) {
+		g_set_error (error, 1, 0, "failed to run '%s': %s", sql, error_msg);
+		sqlite3_free (error_msg);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/* databases created before hw_ver was added need the column adding */
+static gboolean
+ch_database_migrate_hw_ver (ChDatabase *database, GError **error)
+{
+	gint rc;
+	sqlite3_stmt *stmt = NULL;
+
+	rc = sqlite3_prepare_v2 (database->priv->db,
+				 "SELECT hw_ver FROM devices LIMIT 1",
+				 -1, &stmt, NULL);
+	sqlite3_finalize (stmt);
+	if (rc == SQLITE_OK)
+		return TRUE;
+	g_debug ("altering table to add hw_ver");
+	return ch_database_exec (database,
+				 "ALTER TABLE devices ADD COLUMN hw_ver INTEGER DEFAULT 0;",
+				 error);
+}
+
+/* full text search is optional in SQLite, so carry on without it */
+static gboolean
+ch_database_migrate_fts (ChDatabase *database, GError **error)
+{
+	gchar *error_msg = NULL;
+	gint rc;
+
+	rc = sqlite3_exec (database->priv->db,
+			   "CREATE VIRTUAL TABLE orders_fts USING fts5("
+			   "name, email, address, comment, tracking_number, "
+			   "content='orders', content_rowid='order_id');",
+			   NULL, NULL, &error_msg);
+	if (rc != SQLITE_OK) {
+		g_warning ("no full text search, searching will be slow: %s",
+			   error_msg);
+		sqlite3_free (error_msg);
+		return TRUE;
+	}
+	return ch_database_exec (database,
+		"INSERT INTO orders_fts (orders_fts) VALUES ('rebuild');"
+		"CREATE TRIGGER orders_fts_insert AFTER INSERT ON orders "
+		"BEGIN "
+		"INSERT INTO orders_fts (rowid, name, email, address, comment, tracking_number) "
+		"VALUES (NEW.order_id, NEW.name, NEW.email, NEW.address, NEW.comment, NEW.tracking_number);"
+		"END;"
+		"CREATE TRIGGER orders_fts_delete AFTER DELETE ON orders "
+		"BEGIN "
+		"INSERT INTO orders_fts (orders_fts, rowid, name, email, address, comment, tracking_number) "
+		"VALUES ('delete', OLD.order_id, OLD.name, OLD.email, OLD.address, OLD.comment, OLD.tracking_number);"
+		"END;"
+		"CREATE TRIGGER orders_fts_update AFTER UPDATE OF name, email, address, comment, tracking_number ON orders "
+		"BEGIN "
+		"INSERT INTO orders_fts (orders_fts, rowid, name, email, address, comment, tracking_number) "
+		"VALUES ('delete', OLD.order_id, OLD.name, OLD.email, OLD.address, OLD.comment, OLD.tracking_number);"
+		"INSERT INTO orders_fts (rowid, name, email, address, comment, tracking_number) "
+		"VALUES (NEW.order_id, NEW.name, NEW.email, NEW.address, NEW.comment, NEW.tracking_number);"
+		"END;",
+		error);
+}
+
+typedef gboolean (*ChDatabaseMigrationFunc)	(ChDatabase	*database,
+						 GError		**error);
+
+typedef struct {
+	const gchar			*sql;
+	ChDatabaseMigrationFunc		 func;
+} ChDatabaseMigration;
+
+/* the schema version is the index of the migration plus one; only ever
+ * append to this list as existing databases have already run the others */
+static const ChDatabaseMigration ch_database_migrations[] = {
+	/* 1: the original tables */
+	{ "CREATE TABLE IF NOT EXISTS devices ("
+	  "device_id INTEGER PRIMARY KEY AUTOINCREMENT,"
+	  "hw_ver INTEGER DEFAULT 0,"
+	  "calibrated_date INTEGER,"
+	  "state INTEGER,"
+	  "order_id INTEGER);"
+	  "CREATE TABLE IF NOT EXISTS orders ("
+	  "order_id INTEGER PRIMARY KEY AUTOINCREMENT,"
+	  "name STRING,"
+	  "address STRING,"
+	  "email STRING,"
+	  "tracking_number STRING,"
+	  "comment STRING,"
+	  "state INTEGER,"
+	  "postage INTEGER,"
+	  "sent_date INTEGER);",
+	  ch_database_migrate_hw_ver },
+	/* 2: secondary indexes for the stock and order lookups */
+	{ "CREATE INDEX IF NOT EXISTS devices_state_hw_ver "
+	  "ON devices (state, hw_ver, device_id);"
+	  "CREATE INDEX IF NOT EXISTS devices_order_id "
+	  "ON devices (order_id);"
+	  "CREATE INDEX IF NOT EXISTS orders_state "
+	  "ON orders (state);",
+	  NULL },
+	/* 3: device counts per hardware version and state */
+	{ "CREATE TABLE inventory ("
+	  "hw_ver INTEGER NOT NULL,"
+	  "state INTEGER NOT NULL,"
+	  "count INTEGER NOT NULL DEFAULT 0,"
+	  "PRIMARY KEY (hw_ver, state)) WITHOUT ROWID;"
+	  "INSERT INTO inventory (hw_ver, state, count) "
+	  "SELECT IFNULL(hw_ver, 0), IFNULL(state, 0), COUNT(*) "
+	  "FROM devices GROUP BY 1, 2;"
+	  "CREATE TRIGGER devices_inventory_insert AFTER INSERT ON devices "
+	  "BEGIN "
+	  "INSERT OR IGNORE INTO inventory (hw_ver, state) "
+	  "VALUES (IFNULL(NEW.hw_ver, 0), IFNULL(NEW.state, 0));"
+	  "UPDATE inventory SET count = count + 1 "
+	  "WHERE hw_ver = IFNULL(NEW.hw_ver, 0) AND state = IFNULL(NEW.state, 0);"
+	  "END;"
+	  "CREATE TRIGGER devices_inventory_delete AFTER DELETE ON devices "
+	  "BEGIN "
+	  "UPDATE inventory SET count = count - 1 "
+	  "WHERE hw_ver = IFNULL(OLD.hw_ver, 0) AND state = IFNULL(OLD.state, 0);"
+	  "END;"
+	  "CREATE TRIGGER devices_inventory_update AFTER UPDATE OF hw_ver, state ON devices "
+	  "WHEN OLD.hw_ver IS NOT NEW.hw_ver OR OLD.state IS NOT NEW.state "
+	  "BEGIN "
+	  "UPDATE inventory SET count = count - 1 "
+	  "WHERE hw_ver = IFNULL(OLD.hw_ver, 0) AND state = IFNULL(OLD.state, 0);"
+	  "INSERT OR IGNORE INTO inventory (hw_ver, state) "
+	  "VALUES (IFNULL(NEW.hw_ver, 0), IFNULL(NEW.state, 0));"
+	  "UPDATE inventory SET count = count + 1 "
+	  "WHERE hw_ver = IFNULL(NEW.hw_ver, 0) AND state = IFNULL(NEW.state, 0);"
+	  "END;",
+	  NULL },
+	/* 4: a generation number so clients can fetch changed orders */
+	{ "CREATE TABLE metadata ("
+	  "key TEXT PRIMARY KEY,"
+	  "value INTEGER) WITHOUT ROWID;"
+	  "INSERT INTO metadata (key, value) VALUES ('orders_generation', 0);"
+	  "ALTER TABLE orders ADD COLUMN changed INTEGER DEFAULT 0;"
+	  "CREATE INDEX orders_changed ON orders (changed);"
+	  "CREATE TRIGGER orders_changed_insert AFTER INSERT ON orders "
+	  "BEGIN "
+	  "UPDATE metadata SET value = value + 1 WHERE key = 'orders_generation';"
+	  "UPDATE orders SET changed = (SELECT value FROM metadata "
+	  "WHERE key = 'orders_generation') WHERE order_id = NEW.order_id;"
+	  "END;"
+	  "CREATE TRIGGER orders_changed_update AFTER UPDATE ON orders "
+	  "WHEN NEW.changed IS OLD.changed "
+	  "BEGIN "
+	  "UPDATE metadata SET value = value + 1 WHERE key = 'orders_generation';"
+	  "UPDATE orders SET changed = (SELECT value FROM metadata "
+	  "WHERE key = 'orders_generation') WHERE order_id = NEW.order_id;"
+	  "END;"
+	  "CREATE TRIGGER devices_changed_order AFTER UPDATE OF order_id ON devices "
+	  "WHEN NEW.order_id IS NOT OLD.order_id "
+	  "BEGIN "
+	  "UPDATE metadata SET value = value + 1 WHERE key = 'orders_generation';"
+	  "UPDATE orders SET changed = (SELECT value FROM metadata "
+	  "WHERE key = 'orders_generation') "
+	  "WHERE order_id IN (OLD.order_id, NEW.order_id);"
+	  "END;",
+	  NULL },
+	/* 5: a generation number so clients can tell when devices change */
+	{ "INSERT INTO metadata (key, value) VALUES ('devices_generation', 0);"
+	  "CREATE TRIGGER devices_changed_insert AFTER INSERT ON devices "
+	  "BEGIN "
+	  "UPDATE metadata SET value = value + 1 WHERE key = 'devices_generation';"
+	  "END;"
+	  "CREATE TRIGGER devices_changed_update AFTER UPDATE ON devices "
+	  "BEGIN "
+	  "UPDATE metadata SET value = value + 1 WHERE key = 'devices_generation';"
+	  "END;"
+	  "CREATE TRIGGER devices_changed_delete AFTER DELETE ON devices "
+	  "BEGIN "
+	  "UPDATE metadata SET value = value + 1 WHERE key = 'devices_generation';"
+	  "END;",
+	  NULL },
+	/* 6: full text search over orders */
+	{ NULL,
+	  ch_database_migrate_fts },
+	/* 7: emails waiting to be sent */
+	{ "CREATE TABLE emails ("
+	  "email_id INTEGER PRIMARY KEY AUTOINCREMENT,"
+	  "order_id INTEGER DEFAULT 0,"
+	  "recipient TEXT,"
+	  "subject TEXT,"
+	  "body TEXT,"
+	  "created INTEGER DEFAULT 0,"
+	  "sent INTEGER DEFAULT 0);"
+	  "CREATE INDEX emails_queued ON emails (email_id) WHERE sent = 0;",
+	  NULL },
+	/* 8: every state change, for working out throughput */
+	{ "CREATE TABLE events ("
+	  "event_id INTEGER PRIMARY KEY,"
+	  "created INTEGER NOT NULL,"
+	  "kind INTEGER NOT NULL,"
+	  "id INTEGER NOT NULL,"
+	  "state INTEGER NOT NULL,"
+	  "station TEXT);"
+	  "CREATE INDEX events_kind_state ON events (kind, state, created);"
+	  "CREATE INDEX events_kind_id ON events (kind, id, state);",
+	  NULL },
+	/* 9: changes waiting to be sent to, and applied from, other stations,
+	 * and which station this database belongs to */
+	{ "CREATE TABLE changesets ("
+	  "changeset_id INTEGER PRIMARY KEY AUTOINCREMENT,"
+	  "data BLOB NOT NULL);"
+	  "CREATE TABLE replication ("
+	  "station TEXT PRIMARY KEY,"
+	  "applied INTEGER NOT NULL DEFAULT 0,"
+	  "local INTEGER NOT NULL DEFAULT 0) WITHOUT ROWID;",
+	  NULL },
+	/* 10: the measurements and matrix for each calibrated device */
+	{ "CREATE TABLE calibrations ("
+	  "device_id INTEGER PRIMARY KEY,"
+	  "hw_ver INTEGER NOT NULL,"
+	  "created INTEGER NOT NULL,"
+	  "determinant REAL,"
+	  "ti3 BLOB,"
+	  "ccmx BLOB);",
+	  NULL },
+	/* 11: the address split up once, rather than on every print */
+	{ "ALTER TABLE orders ADD COLUMN address_lines TEXT;"
+	  "ALTER TABLE orders ADD COLUMN postcode TEXT;"
+	  "ALTER TABLE orders ADD COLUMN country TEXT;"
+	  "ALTER TABLE orders ADD COLUMN address_latex TEXT;"
+	  "UPDATE orders SET address_lines = ch_address_lines(address), "
+	  "postcode = ch_address_postcode(address), "
+	  "country = ch_address_country(address), "
+	  "address_latex = ch_address_latex(address);",
+	  NULL },
+};
+
+static gboolean
+ch_database_get_user_version (ChDatabase *database,
+			      const gchar *schema,
+			      guint *version,
+			      GError **error)
 {
 	ChDatabasePrivate *priv = database->priv;
+	gchar *sql;
+	gint rc;
+	sqlite3_stmt *stmt = NULL;
+
+	sql = g_strdup_printf ("PRAGMA %s.user_version;", schema);
+	rc = sqlite3_prepare_v2 (priv->db, sql, -1, &stmt, NULL);
+	g_free (sql);
+	if (rc == SQLITE_OK)
+		rc = ch_database_step (database, stmt);
+	if (rc != SQLITE_ROW) {
+		g_set_error (error, 1, 0,
+			     "failed to get %s schema version: %s",
+			     schema, sqlite3_errmsg (priv->db));
+		sqlite3_finalize (stmt);
+		return FALSE;
+	}
+	*version = sqlite3_column_int (stmt, 0);
+	sqlite3_finalize (stmt);
+	return TRUE;
+}
+
+/* the index might never have been created, or this SQLite cannot read it */
+static gboolean
+ch_database_has_fts (ChDatabase *database, const gchar *schema)
+{
+	gchar *sql;
+	gint rc;
+	sqlite3_stmt *stmt = NULL;
+
+	sql = g_strdup_printf ("SELECT rowid FROM %s.orders_fts LIMIT 0;", schema);
+	rc = sqlite3_prepare_v2 (database->priv->db, sql, -1, &stmt, NULL);
+	sqlite3_finalize (stmt);
+	g_free (sql);
+	if (rc != SQLITE_OK) {
+		g_debug ("no full text search in %s, using LIKE", schema);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/**
+ * ch_database_migrate:
+ * @database: a valid #ChDatabase instance
+ * @error: A #GError or %NULL
+ *
+ * Brings the schema up to date. This is a single read when the database is
+ * already current; otherwise all the pending migrations are run in one
+ * write transaction so that two stations opening the database at the same
+ * time cannot both apply them.
+ *
+ * Return value: %TRUE for success
+ **/
+static gboolean
+ch_database_migrate (ChDatabase *database, GError **error)
+{
+	const ChDatabaseMigration *migration;
 	gboolean ret;
-	gchar *error_msg = NULL;
 	gchar *statement = NULL;
-	gint rc;
+	guint i;
+	guint version = 0;
 
-	/* ensure db is loaded */
-	ret = ch_database_load (database, error);
+	/* fast path */
+	ret = ch_database_get_user_version (database, "main", &version, error);
 	if (!ret)
 		goto out;
+	if (version >= G_N_ELEMENTS (ch_database_migrations))
+		goto out;
 
-	/* set state */
-	statement = sqlite3_mprintf ("UPDATE orders SET comment = '%q' WHERE order_id = '%i'",
-				     comment,
-				     order_id);
-	rc = sqlite3_exec (priv->db, statement, NULL, NULL, &error_msg);
-	if (rc != SQLITE_OK) {
+	/* check again now we hold the write lock */
+	ret = ch_database_exec (database, "BEGIN IMMEDIATE;", error);
+	if (!ret)
+		goto out;
+	ret = ch_database_get_user_version (database, "main", &version, error);
+	if (!ret)
+		goto out;
+	for (i = version; i < G_N_ELEMENTS (ch_database_migrations); i++) {
+		g_debug ("migrating database to version %i", i + 1);
+		migration = &ch_database_migrations[i];
+		if (migration->sql != NULL) {
+			ret = ch_database_exec (database, migration->sql, error);
+			if (!ret)
+				goto out;
+		}
+		if (migration->func != NULL) {
+			ret = migration->func (database, error);
+			if (!ret)
+				goto out;
+		}
+	}
+	statement = g_strdup_printf ("PRAGMA user_version = %i;", i);
+	ret = ch_database_exec (database, statement, error);
+	if (!ret)
+		goto out;
+	ret = ch_database_exec (database, "COMMIT;", error);
+out:
+	if (!ret && !sqlite3_get_autocommit (database->priv->db))
+		sqlite3_exec (database->priv->db, "ROLLBACK;", NULL, NULL, NULL);
+	g_free (statement);
+	return ret;
+}
+
+/* the shared memory WAL needs is not shared between hosts */
+static gboolean
+ch_database_is_remote (ChDatabase *database)
+{
+	GFile *file;
+	GFile *parent;
+	GFileInfo *info;
+	GError *error = NULL;
+	gboolean ret = FALSE;
+
+	/* the database might not have been created yet */
+	file = g_file_new_for_path (database->priv->uri);
+	parent = g_file_get_parent (file);
+	if (parent == NULL)
+		goto out;
+	info = g_file_query_filesystem_info (parent,
+					     G_FILE_ATTRIBUTE_FILESYSTEM_REMOTE,
+					     NULL, &error);
+	if (info == NULL) {
+		g_debug ("failed to get filesystem: %s", error->message);
+		g_error_free (error);
+		goto out;
+	}
+	ret = g_file_info_get_attribute_boolean (info, G_FILE_ATTRIBUTE_FILESYSTEM_REMOTE);
+	g_object_unref (info);
+out:
+	if (parent != NULL)
+		g_object_unref (parent);
+	g_object_unref (file);
+	return ret;
+}
+
+static gboolean
+ch_database_set_journal_mode_internal (ChDatabase *database, GError **error)
+{
+	ChDatabasePrivate *priv = database->priv;
+	const gchar *journal_mode = priv->journal_mode;
+	const gchar *modes[] = { "delete", "truncate", "persist", "wal", NULL };
+	gboolean ret = TRUE;
+	gchar *statement = NULL;
+	gint rc;
+	sqlite3_stmt *stmt = NULL;
+
+	/* this cannot be a bound parameter */
+	if (!g_strv_contains (modes, journal_mode)) {
 		ret = FALSE;
 		g_set_error (error, 1, 0,
-			     "failed to update order: %s",
+			     "invalid journal mode '%s'",
+			     journal_mode);
+		goto out;
+	}
+
+	/* two hosts using WAL over a network mount corrupt the database */
+	if (g_strcmp0 (journal_mode, "wal") == 0 &&
+	    ch_database_is_remote (database)) {
+		g_warning ("%s is on a network filesystem, not using WAL",
+			   priv->uri);
+		journal_mode = "delete";
+	}
+
+	/* the new mode is returned, which is unchanged if unsupported */
+	statement = g_strdup_printf ("PRAGMA journal_mode=%s;", journal_mode);
+	rc = sqlite3_prepare_v2 (priv->db, statement, -1, &stmt, NULL);
+	if (rc == SQLITE_OK)
+		rc = ch_database_step (database, stmt);
+	if (rc != SQLITE_ROW) {
+		ret = FALSE;
+		g_set_error (error, 1, 0,
+			     "failed to set journal mode: %s",
 			     sqlite3_errmsg (priv->db));
 		goto out;
 	}
+	if (g_strcmp0 ((const gchar *) sqlite3_column_text (stmt, 0),
+		       journal_mode) != 0) {
+		g_warning ("journal mode %s not supported, using %s",
+			   journal_mode,
+			   sqlite3_column_text (stmt, 0));
+	}
 out:
-	sqlite3_free (statement);
+	if (stmt != NULL)
+		sqlite3_finalize (stmt);
+	g_free (statement);
 	return ret;
 }
 
+/* the price of the postage, see ch_shipping_kind_to_price() */
+static void
+ch_database_postage_price_cb (sqlite3_context *ctx, gint argc, sqlite3_value **argv)
+{
+	gint postage = sqlite3_value_int (argv[0]);
+	if (postage < 0 || postage >= CH_SHIPPING_KIND_LAST) {
+		sqlite3_result_null (ctx);
+		return;
+	}
+	sqlite3_result_double (ctx, ch_shipping_kind_to_price (postage));
+}
+
+/* the price of each device, see ch_shipping_device_to_price() */
+static void
+ch_database_device_price_cb (sqlite3_context *ctx, gint argc, sqlite3_value **argv)
+{
+	gint postage = sqlite3_value_int (argv[0]);
+	if (postage < 0 || postage >= CH_SHIPPING_KIND_LAST) {
+		sqlite3_result_null (ctx);
+		return;
+	}
+	sqlite3_result_int (ctx, ch_shipping_device_to_price (postage));
+}
+
+/* the same name as shown in the order list, e.g. "CH2-UK-S" */
+static void
+ch_database_postage_name_cb (sqlite3_context *ctx, gint argc, sqlite3_value **argv)
+{
+	gint postage = sqlite3_value_int (argv[0]);
+	if (postage < 0 || postage >= CH_SHIPPING_KIND_LAST) {
+		sqlite3_result_null (ctx);
+		return;
+	}
+	sqlite3_result_text (ctx, ch_shipping_kind_to_string (postage), -1, SQLITE_STATIC);
+}
+
+/* which part of the address is wanted from ch_database_address_cb() */
+typedef enum {
+	CH_DATABASE_ADDRESS_LINES,
+	CH_DATABASE_ADDRESS_POSTCODE,
+	CH_DATABASE_ADDRESS_COUNTRY,
+	CH_DATABASE_ADDRESS_LATEX,
+	CH_DATABASE_ADDRESS_LAST
+} ChDatabaseAddress;
+
+/* splits the '|' separated address as entered, see ch_shipping_address_parse() */
+static void
+ch_database_address_cb (sqlite3_context *ctx, gint argc, sqlite3_value **argv)
+{
+	ChDatabaseAddress kind = GPOINTER_TO_INT (sqlite3_user_data (ctx));
+	const gchar *address;
+	gchar *tmp = NULL;
+
+	address = (const gchar *) sqlite3_value_text (argv[0]);
+	if (address == NULL) {
+		sqlite3_result_null (ctx);
+		return;
+	}
+	switch (kind) {
+	case CH_DATABASE_ADDRESS_LINES:
+		ch_shipping_address_parse (address, &tmp, NULL, NULL);
+		break;
+	case CH_DATABASE_ADDRESS_POSTCODE:
+		ch_shipping_address_parse (address, NULL, &tmp, NULL);
+		break;
+	case CH_DATABASE_ADDRESS_COUNTRY:
+		ch_shipping_address_parse (address, NULL, NULL, &tmp);
+		break;
+	case CH_DATABASE_ADDRESS_LATEX:
+		tmp = ch_shipping_address_to_latex (address);
+		break;
+	default:
+		break;
+	}
+	if (tmp == NULL) {
+		sqlite3_result_null (ctx);
+		return;
+	}
+	sqlite3_result_text (ctx, tmp, -1, g_free);
+}
+
+/* the archive has its own version as it can be swapped for a new file */
+static const gchar *ch_database_archive_migrations[] = {
+	/* 1: the same columns as the hot tables, without the triggers */
+	"CREATE TABLE archive.orders ("
+	"order_id INTEGER PRIMARY KEY,"
+	"name STRING,"
+	"address STRING,"
+	"email STRING,"
+	"tracking_number STRING,"
+	"comment STRING,"
+	"state INTEGER,"
+	"postage INTEGER,"
+	"sent_date INTEGER);"
+	"CREATE TABLE archive.devices ("
+	"device_id INTEGER PRIMARY KEY,"
+	"hw_ver INTEGER DEFAULT 0,"
+	"calibrated_date INTEGER,"
+	"state INTEGER,"
+	"order_id INTEGER);"
+	"CREATE INDEX archive.devices_order_id "
+	"ON devices (order_id, device_id);",
+	/* 2: the parsed address, as in the hot table */
+	"ALTER TABLE archive.orders ADD COLUMN address_lines TEXT;"
+	"ALTER TABLE archive.orders ADD COLUMN postcode TEXT;"
+	"ALTER TABLE archive.orders ADD COLUMN country TEXT;"
+	"ALTER TABLE archive.orders ADD COLUMN address_latex TEXT;"
+	"UPDATE archive.orders SET address_lines = ch_address_lines(address), "
+	"postcode = ch_address_postcode(address), "
+	"country = ch_address_country(address), "
+	"address_latex = ch_address_latex(address);",
+};
+
+/* archived orders are never changed, so only inserts are indexed */
+static void
+ch_database_migrate_archive_fts (ChDatabase *database)
+{
+	gchar *error_msg = NULL;
+	gint rc;
+
+	rc = sqlite3_exec (database->priv->db,
+			   "CREATE VIRTUAL TABLE archive.orders_fts USING fts5("
+			   "name, email, address, comment, tracking_number, "
+			   "content='orders', content_rowid='order_id');"
+			   "INSERT INTO archive.orders_fts (orders_fts) VALUES ('rebuild');"
+			   "CREATE TRIGGER archive.orders_fts_insert AFTER INSERT ON orders "
+			   "BEGIN "
+			   "INSERT INTO orders_fts (rowid, name, email, address, comment, tracking_number) "
+			   "VALUES (NEW.order_id, NEW.name, NEW.email, NEW.address, NEW.comment, NEW.tracking_number);"
+			   "END;",
+			   NULL, NULL, &error_msg);
+	if (rc != SQLITE_OK) {
+		g_warning ("no full text search of the archive: %s", error_msg);
+		sqlite3_free (error_msg);
+	}
+}
+
 /**
- * ch_database_order_set_state:
+ * ch_database_attach_archive:
  * @database: a valid #ChDatabase instance
- * @id: the device serial number
- * @comment: the #ChDeviceState
  * @error: A #GError or %NULL
  *
- * Changes the state on an order.
+ * Attaches the archive as the "archive" schema, creating it if required.
  *
- * Return value: %TRUE if the new state was set
+ * Return value: %TRUE for success
  **/
-gboolean
-ch_database_order_set_state (ChDatabase *database,
-			     guint32 order_id,
-			     ChOrderState state,
-			     GError **error)
+static gboolean
+ch_database_attach_archive (ChDatabase *database, GError **error)
 {
 	ChDatabasePrivate *priv = database->priv;
 	gboolean ret;
-	gchar *error_msg = NULL;
 	gchar *statement = NULL;
-	gint rc;
+	guint i;
+	guint version = 0;
 
-	/* ensure db is loaded */
-	ret = ch_database_load (database, error);
+	statement = sqlite3_mprintf ("ATTACH DATABASE %Q AS archive;", priv->archive_uri);
+	ret = ch_database_exec (database, statement, error);
+	sqlite3_free (statement);
+	statement = NULL;
 	if (!ret)
 		goto out;
+	priv->archive_attached = TRUE;
 
-	/* set state */
-	statement = sqlite3_mprintf ("UPDATE orders SET state = '%i' WHERE order_id = '%i'",
-				     state,
-				     order_id);
-	rc = sqlite3_exec (priv->db, statement, NULL, NULL, &error_msg);
-	if (rc != SQLITE_OK) {
-		ret = FALSE;
-		g_set_error (error, 1, 0,
-			     "failed to update order: %s",
-			     sqlite3_errmsg (priv->db));
+	/* fast path */
+	ret = ch_database_get_user_version (database, "archive", &version, error);
+	if (!ret)
 		goto out;
+	if (version >= G_N_ELEMENTS (ch_database_archive_migrations))
+		goto out;
+
+	/* check again now we hold the write lock */
+	ret = ch_database_exec (database, "BEGIN IMMEDIATE;", error);
+	if (!ret)
+		goto out;
+	ret = ch_database_get_user_version (database, "archive", &version, error);
+	if (!ret)
+		goto out;
+	for (i = version; i < G_N_ELEMENTS (ch_database_archive_migrations); i++) {
+		g_debug ("migrating archive to version %i", i + 1);
+		ret = ch_database_exec (database, ch_database_archive_migrations[i], error);
+		if (!ret)
+			goto out;
 	}
+	if (version == 0)
+		ch_database_migrate_archive_fts (database);
+	statement = g_strdup_printf ("PRAGMA archive.user_version = %i;", i);
+	ret = ch_database_exec (database, statement, error);
+	if (!ret)
+		goto out;
+	ret = ch_database_exec (database, "COMMIT;", error);
 out:
-	sqlite3_free (statement);
+	if (!ret && !sqlite3_get_autocommit (priv->db))
+		sqlite3_exec (priv->db, "ROLLBACK;", NULL, NULL, NULL);
+	g_free (statement);
 	return ret;
 }
 
+/* the whole history, for reports that are not interested in what is hot */
+static gboolean
+ch_database_create_views (ChDatabase *database, GError **error)
+{
+	if (!database->priv->archive_attached) {
+		return ch_database_exec (database,
+			"CREATE TEMP VIEW IF NOT EXISTS all_orders AS "
+			"SELECT order_id, name, address, email, postage, "
+			"tracking_number, sent_date, comment, state FROM main.orders;"
+			"CREATE TEMP VIEW IF NOT EXISTS all_devices AS "
+			"SELECT device_id, hw_ver, calibrated_date, state, order_id "
+			"FROM main.devices;",
+			error);
+	}
+	return ch_database_exec (database,
+		"CREATE TEMP VIEW IF NOT EXISTS all_orders AS "
+		"SELECT order_id, name, address, email, postage, "
+		"tracking_number, sent_date, comment, state FROM main.orders "
+		"UNION ALL "
+		"SELECT order_id, name, address, email, postage, "
+		"tracking_number, sent_date, comment, state FROM archive.orders;"
+		"CREATE TEMP VIEW IF NOT EXISTS all_devices AS "
+		"SELECT device_id, hw_ver, calibrated_date, state, order_id "
+		"FROM main.devices "
+		"UNION ALL "
+		"SELECT device_id, hw_ver, calibrated_date, state, order_id "
+		"FROM archive.devices;",
+		error);
+}
+
 /**
- * ch_database_device_set_order_id:
+ * ch_database_create_functions:
  * @database: a valid #ChDatabase instance
- * @id: the device serial number
- * @state: the #ChDeviceState
- * @error: A #GError or %NULL
- *
- * Changes the order-id on a device
  *
- * Return value: %TRUE if the new state was set
+ * Adds the SQL functions used by the reports, so that orders can be
+ * aggregated in SQL rather than being read back one by one, and the
+ * functions that parse the address when an order is added. These are
+ * only added to this connection and are never used by the schema, so
+ * other tools can still open the database.
  **/
-gboolean
-ch_database_device_set_order_id (ChDatabase *database,
-				 guint32 device_id,
-				 guint32 order_id,
-				 GError **error)
+static void
+ch_database_create_functions (ChDatabase *database)
 {
 	ChDatabasePrivate *priv = database->priv;
-	gboolean ret;
-	gchar *error_msg = NULL;
+	sqlite3_create_function (priv->db, "ch_postage_price", 1,
+				 SQLITE_UTF8 | SQLITE_DETERMINISTIC, NULL,
+				 ch_database_postage_price_cb, NULL, NULL);
+	sqlite3_create_function (priv->db, "ch_device_price", 1,
+				 SQLITE_UTF8 | SQLITE_DETERMINISTIC, NULL,
+				 ch_database_device_price_cb, NULL, NULL);
+	sqlite3_create_function (priv->db, "ch_postage_name", 1,
+				 SQLITE_UTF8 | SQLITE_DETERMINISTIC, NULL,
+				 ch_database_postage_name_cb, NULL, NULL);
+	sqlite3_create_function (priv->db, "ch_address_lines", 1,
+				 SQLITE_UTF8 | SQLITE_DETERMINISTIC,
+				 GINT_TO_POINTER (CH_DATABASE_ADDRESS_LINES),
+				 ch_database_address_cb, NULL, NULL);
+	sqlite3_create_function (priv->db, "ch_address_postcode", 1,
+				 SQLITE_UTF8 | SQLITE_DETERMINISTIC,
+				 GINT_TO_POINTER (CH_DATABASE_ADDRESS_POSTCODE),
+				 ch_database_address_cb, NULL, NULL);
+	sqlite3_create_function (priv->db, "ch_address_country", 1,
+				 SQLITE_UTF8 | SQLITE_DETERMINISTIC,
+				 GINT_TO_POINTER (CH_DATABASE_ADDRESS_COUNTRY),
+				 ch_database_address_cb, NULL, NULL);
+	sqlite3_create_function (priv->db, "ch_address_latex", 1,
+				 SQLITE_UTF8 | SQLITE_DETERMINISTIC,
+				 GINT_TO_POINTER (CH_DATABASE_ADDRESS_LATEX),
+				 ch_database_address_cb, NULL, NULL);
+}
+
+#ifdef HAVE_SQLITE_SESSION
+/* only these are shared, everything else is local to the station */
+static gint
+ch_database_replication_filter_cb (gpointer user_data, const gchar *table)
+{
+	return g_strcmp0 (table, "devices") == 0 ||
+	       g_strcmp0 (table, "orders") == 0;
+}
+
+/* a database copied from another station has that station's changes in
+ * it already, so they are marked as applied rather than sent on again
+ * under the name of this station */
+static gboolean
+ch_database_replication_adopt (ChDatabase *database, GError **error)
+{
+	ChDatabasePrivate *priv = database->priv;
+	gboolean ret = TRUE;
+	gchar *origin = NULL;
 	gchar *statement = NULL;
 	gint rc;
+	sqlite3_stmt *stmt = NULL;
 
-	/* ensure db is loaded */
-	ret = ch_database_load (database, error);
+	rc = sqlite3_prepare_v2 (priv->db,
+				 "SELECT station FROM replication WHERE local = 1;",
+				 -1, &stmt, NULL);
+	if (rc == SQLITE_OK)
+		rc = ch_database_step (database, stmt);
+	if (rc == SQLITE_ROW)
+		origin = g_strdup ((const gchar *) sqlite3_column_text (stmt, 0));
+	sqlite3_finalize (stmt);
+	if (rc != SQLITE_ROW && rc != SQLITE_DONE) {
+		ret = FALSE;
+		g_set_error (error, 1, 0,
+			     "failed to get station: %s",
+			     sqlite3_errmsg (priv->db));
+		goto out;
+	}
+	if (g_strcmp0 (origin, priv->station) == 0)
+		goto out;
+
+	ret = ch_database_begin (database, error);
 	if (!ret)
 		goto out;
+	if (origin != NULL) {
+		g_debug ("starting %s from a copy of %s", priv->station, origin);
+		ret = ch_database_exec (database,
+					"INSERT OR REPLACE INTO replication (station, applied) "
+					"SELECT station, IFNULL((SELECT seq FROM sqlite_sequence "
+					"WHERE name = 'changesets'), 0) FROM replication "
+					"WHERE local = 1;"
+					"DELETE FROM changesets;"
+					"DELETE FROM sqlite_sequence WHERE name = 'changesets';",
+					error);
+	}
+	if (ret) {
+		statement = sqlite3_mprintf ("INSERT OR REPLACE INTO replication "
+					     "(station, applied, local) "
+					     "VALUES (%Q, 0, 1);",
+					     priv->station);
+		ret = ch_database_exec (database, statement, error);
+	}
+	if (!ret) {
+		ch_database_rollback (database, NULL);
+		goto out;
+	}
+	ret = ch_database_commit (database, error);
+out:
+	sqlite3_free (statement);
+	g_free (origin);
+	return ret;
+}
 
-	/* set state */
-	statement = g_strdup_printf ("UPDATE devices SET order_id = '%i' WHERE device_id = '%i'",
-				     order_id, device_id);
-	rc = sqlite3_exec (priv->db, statement, NULL, NULL, &error_msg);
+/* starts recording changes for the next changeset */
+static gboolean
+ch_database_session_start (ChDatabase *database, GError **error)
+{
+	ChDatabasePrivate *priv = database->priv;
+	gint rc;
+
+	if (priv->session != NULL)
+		sqlite3session_delete (priv->session);
+	rc = sqlite3session_create (priv->db, "main", &priv->session);
+	if (rc == SQLITE_OK)
+		rc = sqlite3session_attach (priv->session, NULL);
 	if (rc != SQLITE_OK) {
+		g_set_error (error, 1, 0,
+			     "failed to start recording changes: %s",
+			     sqlite3_errstr (rc));
+		return FALSE;
+	}
+	sqlite3session_table_filter (priv->session,
+				     ch_database_replication_filter_cb,
+				     NULL);
+	return TRUE;
+}
+#endif
+
+/**
+ * ch_database_session_flush:
+ * @database: a valid #ChDatabase instance
+ * @error: A #GError or %NULL
+ *
+ * Saves what the current transaction changed so it can be sent to the
+ * other stations. This has to be called just before the outermost commit,
+ * so the changeset is only kept if the changes themselves are.
+ *
+ * Return value: %TRUE for success
+ **/
+static gboolean
+ch_database_session_flush (ChDatabase *database, GError **error)
+{
+#ifdef HAVE_SQLITE_SESSION
+	ChDatabasePrivate *priv = database->priv;
+	gboolean ret = TRUE;
+	gint rc;
+	gint size = 0;
+	sqlite3_stmt *stmt = NULL;
+	void *data = NULL;
+
+	if (priv->session == NULL || sqlite3session_isempty (priv->session))
+		goto out;
+
+	/* rolled back changes are dropped here */
+	rc = sqlite3session_changeset (priv->session, &size, &data);
+	if (rc != SQLITE_OK) {
+		ret = FALSE;
+		g_set_error (error, 1, 0,
+			     "failed to get changes: %s",
+			     sqlite3_errstr (rc));
+		goto out;
+	}
+	if (size == 0)
+		goto out;
+	stmt = ch_database_get_stmt (database, CH_DATABASE_STMT_ADD_CHANGESET, error);
+	if (stmt == NULL) {
+		ret = FALSE;
+		goto out;
+	}
+	sqlite3_bind_blob (stmt, 1, data, size, SQLITE_STATIC);
+	rc = ch_database_step (database, stmt);
+	if (rc != SQLITE_DONE) {
+		ret = FALSE;
+		g_set_error (error, 1, 0,
+			     "failed to save changes: %s",
+			     sqlite3_errmsg (priv->db));
+		goto out;
+	}
+
+	/* each changeset only has the changes since the last one */
+	ret = ch_database_session_start (database, error);
+out:
+	if (stmt != NULL)
+		sqlite3_reset (stmt);
+	sqlite3_free (data);
+	return ret;
+#else
+	return TRUE;
+#endif
+}
+
+static gboolean
+ch_database_load (ChDatabase *database, GError **error)
+{
+	ChDatabasePrivate *priv = database->priv;
+	gboolean ret = TRUE;
+	gint rc;
+
+	/* already open */
+	if (priv->db != NULL)
+		goto out;
+
+	/* open database */
+	g_debug ("trying to open database '%s'", database->priv->uri);
+	rc = sqlite3_open (database->priv->uri, &priv->db);
+	if (rc != SQLITE_OK) {
+		ret = FALSE;
+		g_set_error (error, 1, 0,
+			     "can't open calibration database: %s",
+			     sqlite3_errmsg (priv->db));
+		goto out;
+	}
+
+	/* wait for the other station rather than failing straight away */
+	sqlite3_busy_handler (priv->db, ch_database_busy_cb, database);
+
+	/* let the reports do the pricing in SQL */
+	ch_database_create_functions (database);
+
+	/* time every statement */
+	ch_database_profile_setup (database);
+
+	/* let maintenance give back free pages, which only works if this is
+	 * set before the first table is created or the database is rebuilt */
+	ret = ch_database_exec (database, "PRAGMA auto_vacuum=INCREMENTAL;", error);
+	if (!ret)
+		goto out;
+
+	/* WAL allows readers and a writer at the same time */
+	if (g_strcmp0 (priv->uri, ":memory:") != 0) {
+		ret = ch_database_set_journal_mode_internal (database, error);
+		if (!ret)
+			goto out;
+		ret = ch_database_exec (database,
+					"PRAGMA journal_size_limit="
+					CH_DATABASE_JOURNAL_SIZE_LIMIT ";",
+					error);
+		if (!ret)
+			goto out;
+	}
+
+	/* create or upgrade the schema */
+	ret = ch_database_migrate (database, error);
+	if (!ret)
+		goto out;
+
+	/* old orders are kept in another file */
+	if (priv->archive_uri != NULL) {
+		ret = ch_database_attach_archive (database, error);
+		if (!ret)
+			goto out;
+	}
+	ret = ch_database_create_views (database, error);
+	if (!ret)
+		goto out;
+
+	/* only check once, rather than failing to prepare on every search */
+	priv->fts = ch_database_has_fts (database, "main");
+	if (priv->archive_attached)
+		priv->archive_fts = ch_database_has_fts (database, "archive");
+
+	/* record changes for the other stations */
+	if (priv->spool_dir != NULL) {
+#ifdef HAVE_SQLITE_SESSION
+		ret = ch_database_replication_adopt (database, error);
+		if (!ret)
+			goto out;
+		ret = ch_database_session_start (database, error);
+		if (!ret)
+			goto out;
+#else
+		ret = FALSE;
+		g_set_error_literal (error, 1, 0,
+				     "replication needs SQLite built with "
+				     "the session extension");
+		goto out;
+#endif
+	}
+
+	/* turn off fsync */
+	sqlite3_exec (priv->db, "PRAGMA synchronous=NORMAL", NULL, NULL, NULL);
+out:
+	/* try again next time rather than using a half-set-up database */
+	if (!ret && priv->db != NULL) {
+#ifdef HAVE_SQLITE_SESSION
+		if (priv->session != NULL) {
+			sqlite3session_delete (priv->session);
+			priv->session = NULL;
+		}
+#endif
+		sqlite3_close (priv->db);
+		priv->db = NULL;
+		priv->archive_attached = FALSE;
+		priv->archive_fts = FALSE;
+		priv->fts = FALSE;
+	}
+	return ret;
+}
+
+/* runs a cached statement that returns no rows */
+static gboolean
+ch_database_step_stmt (ChDatabase *database, ChDatabaseStmt id, GError **error)
+{
+	gint rc;
+	sqlite3_stmt *stmt;
+
+	stmt = ch_database_get_stmt (database, id, error);
+	if (stmt == NULL)
+		return FALSE;
+	rc = ch_database_step (database, stmt);
+	sqlite3_reset (stmt);
+	if (rc != SQLITE_DONE) {
+		g_set_error (error, 1, 0,
+			     "failed to run '%s': %s",
+			     ch_database_stmt_sql[id],
+			     sqlite3_errmsg (database->priv->db));
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/**
+ * ch_database_begin:
+ * @database: a valid #ChDatabase instance
+ * @error: A #GError or %NULL
+ *
+ * Starts a transaction, taking the write lock straight away so that a
+ * read-then-write sequence cannot race with another station. Transactions
+ * may be nested, in which case the inner ones become savepoints.
+ *
+ * Other threads, including the database thread used by the async
+ * functions, cannot use @database until the matching commit or rollback.
+ *
+ * Any mutators called before the matching ch_database_commit() are
+ * written to disk in one go, which is much faster than letting each one
+ * run in its own implicit transaction.
+ *
+ * Return value: %TRUE for success
+ **/
+gboolean
+ch_database_begin (ChDatabase *database, GError **error)
+{
+	ChDatabasePrivate *priv = database->priv;
+	gboolean ret;
+	gchar *statement = NULL;
+
+	/* held until the matching commit or rollback */
+	g_rec_mutex_lock (&priv->mutex);
+
+	/* ensure db is loaded */
+	ret = ch_database_load (database, error);
+	if (!ret)
+		goto out;
+
+	if (priv->transaction_depth == 0) {
+		ret = ch_database_step_stmt (database, CH_DATABASE_STMT_BEGIN, error);
+	} else {
+		statement = g_strdup_printf ("SAVEPOINT ch_%i;", priv->transaction_depth);
+		ret = ch_database_exec (database, statement, error);
+	}
+	if (!ret)
+		goto out;
+	priv->transaction_depth++;
+out:
+	if (!ret)
+		g_rec_mutex_unlock (&priv->mutex);
+	g_free (statement);
+	return ret;
+}
+
+/**
+ * ch_database_commit:
+ * @database: a valid #ChDatabase instance
+ * @error: A #GError or %NULL
+ *
+ * Commits the innermost transaction started with ch_database_begin().
+ * If the outermost commit fails the transaction is rolled back.
+ *
+ * When replicating, everything the outermost transaction changed is saved
+ * as one changeset in the same commit.
+ *
+ * Return value: %TRUE for success
+ **/
+gboolean
+ch_database_commit (ChDatabase *database, GError **error)
+{
+	ChDatabasePrivate *priv = database->priv;
+	gboolean ret;
+	gchar *statement = NULL;
+
+	g_return_val_if_fail (priv->transaction_depth > 0, FALSE);
+
+	priv->transaction_depth--;
+	if (priv->transaction_depth == 0) {
+		ret = ch_database_session_flush (database, error);
+		if (ret)
+			ret = ch_database_step_stmt (database, CH_DATABASE_STMT_COMMIT, error);
+		if (!ret && !sqlite3_get_autocommit (priv->db))
+			ch_database_step_stmt (database, CH_DATABASE_STMT_ROLLBACK, NULL);
+	} else {
+		statement = g_strdup_printf ("RELEASE ch_%i;", priv->transaction_depth);
+		ret = ch_database_exec (database, statement, error);
+	}
+	g_free (statement);
+	g_rec_mutex_unlock (&priv->mutex);
+	return ret;
+}
+
+/**
+ * ch_database_rollback:
+ * @database: a valid #ChDatabase instance
+ * @error: A #GError or %NULL
+ *
+ * Abandons the innermost transaction started with ch_database_begin().
+ *
+ * Return value: %TRUE for success
+ **/
+gboolean
+ch_database_rollback (ChDatabase *database, GError **error)
+{
+	ChDatabasePrivate *priv = database->priv;
+	gboolean ret;
+	gchar *statement = NULL;
+
+	g_return_val_if_fail (priv->transaction_depth > 0, FALSE);
+
+	priv->transaction_depth--;
+	if (priv->transaction_depth == 0) {
+		ret = ch_database_step_stmt (database, CH_DATABASE_STMT_ROLLBACK, error);
+	} else {
+		statement = g_strdup_printf ("ROLLBACK TO ch_%i; RELEASE ch_%i;",
+					     priv->transaction_depth,
+					     priv->transaction_depth);
+		ret = ch_database_exec (database, statement, error);
+	}
+	g_free (statement);
+	g_rec_mutex_unlock (&priv->mutex);
+	return ret;
+}
+
+/**
+ * ch_database_add_event:
+ * @database: a valid #ChDatabase instance
+ * @kind: a #ChDatabaseEventKind
+ * @id: the device or order ID
+ * @state: the new #ChDeviceState or #ChOrderState
+ * @error: A #GError or %NULL
+ *
+ * Records a state change. The caller has to hold a transaction, so the
+ * event is only written if the change itself is.
+ *
+ * Return value: %TRUE for success
+ **/
+static gboolean
+ch_database_add_event (ChDatabase *database,
+		       ChDatabaseEventKind kind,
+		       guint32 id,
+		       guint state,
+		       GError **error)
+{
+	ChDatabasePrivate *priv = database->priv;
+	gboolean ret = TRUE;
+	gint rc;
+	sqlite3_stmt *stmt;
+
+	g_return_val_if_fail (priv->transaction_depth > 0, FALSE);
+
+	stmt = ch_database_get_stmt (database, CH_DATABASE_STMT_ADD_EVENT, error);
+	if (stmt == NULL)
+		return FALSE;
+	sqlite3_bind_int64 (stmt, 1, g_get_real_time ());
+	sqlite3_bind_int (stmt, 2, kind);
+	sqlite3_bind_int64 (stmt, 3, id);
+	sqlite3_bind_int (stmt, 4, state);
+	sqlite3_bind_text (stmt, 5, priv->station, -1, SQLITE_STATIC);
+	rc = ch_database_step (database, stmt);
+	if (rc != SQLITE_DONE) {
 		ret = FALSE;
+		g_set_error (error, 1, 0,
+			     "failed to add event: %s",
+			     sqlite3_errmsg (priv->db));
+	}
+	sqlite3_reset (stmt);
+	return ret;
+}
+
+/* sets the state and records the event, in a transaction held by the caller */
+static gboolean
+ch_database_device_set_state_internal (ChDatabase *database,
+				       guint32 id,
+				       ChDeviceState state,
+				       GError **error)
+{
+	ChDatabasePrivate *priv = database->priv;
+	gint rc;
+	sqlite3_stmt *stmt;
+
+	stmt = ch_database_get_stmt (database, CH_DATABASE_STMT_DEVICE_SET_STATE, error);
+	if (stmt == NULL)
+		return FALSE;
+	sqlite3_bind_int (stmt, 1, state);
+	sqlite3_bind_int64 (stmt, 2, id);
+	rc = ch_database_step (database, stmt);
+	sqlite3_reset (stmt);
+	if (rc != SQLITE_DONE) {
 		g_set_error (error, 1, 0,
 			     "failed to update entry: %s",
 			     sqlite3_errmsg (priv->db));
+		return FALSE;
+	}
+
+	/* only a real change is an event */
+	if (sqlite3_changes (priv->db) == 0)
+		return TRUE;
+	return ch_database_add_event (database, CH_DATABASE_EVENT_KIND_DEVICE,
+				      id, state, error);
+}
+
+static gboolean
+ch_database_order_set_state_internal (ChDatabase *database,
+				      guint32 order_id,
+				      ChOrderState state,
+				      GError **error)
+{
+	ChDatabasePrivate *priv = database->priv;
+	gint rc;
+	sqlite3_stmt *stmt;
+
+	stmt = ch_database_get_stmt (database, CH_DATABASE_STMT_ORDER_SET_STATE, error);
+	if (stmt == NULL)
+		return FALSE;
+	sqlite3_bind_int (stmt, 1, state);
+	sqlite3_bind_int64 (stmt, 2, order_id);
+	rc = ch_database_step (database, stmt);
+	sqlite3_reset (stmt);
+	if (rc != SQLITE_DONE) {
+		g_set_error (error, 1, 0,
+			     "failed to update order: %s",
+			     sqlite3_errmsg (priv->db));
+		return FALSE;
+	}
+	if (sqlite3_changes (priv->db) == 0)
+		return TRUE;
+	return ch_database_add_event (database, CH_DATABASE_EVENT_KIND_ORDER,
+				      order_id, state, error);
+}
+
+/**
+ * ch_database_add_device:
+ * @database: a valid #ChDatabase instance
+ * @error: A #GError or %NULL
+ *
+ * Add a new device to the database
+ *
+ * Return value: The new device serial number or G_MAXUINT32 for error
+ **/
+guint32
+ch_database_add_device (ChDatabase *database, guint hw_ver, GError **error)
+{
+	ChDatabasePrivate *priv = database->priv;
+	gboolean in_transaction = FALSE;
+	gboolean ret;
+	gint rc;
+	guint32 id = G_MAXUINT32;
+	guint32 id_tmp;
+	sqlite3_stmt *stmt = NULL;
+
+	/* the event is written in the same transaction */
+	ret = ch_database_begin (database, error);
+	if (!ret)
+		goto out;
+	in_transaction = TRUE;
+
+	/* add newest */
+	stmt = ch_database_get_stmt (database, CH_DATABASE_STMT_ADD_DEVICE, error);
+	if (stmt == NULL)
+		goto out;
+	sqlite3_bind_int64 (stmt, 1, g_get_real_time ());
+	sqlite3_bind_int (stmt, 2, hw_ver);
+	sqlite3_bind_int (stmt, 3, CH_DEVICE_STATE_INIT);
+	rc = ch_database_step (database, stmt);
+	if (rc != SQLITE_DONE) {
+		g_set_error (error, 1, 0,
+			     "failed to add entry: %s",
+			     sqlite3_errmsg (priv->db));
+		goto out;
+	}
+
+	/* yay, atomic serial number */
+	id_tmp = sqlite3_last_insert_rowid (priv->db);
+	sqlite3_reset (stmt);
+	stmt = NULL;
+	ret = ch_database_add_event (database, CH_DATABASE_EVENT_KIND_DEVICE,
+				     id_tmp, CH_DEVICE_STATE_INIT, error);
+	if (!ret)
+		goto out;
+	in_transaction = FALSE;
+	ret = ch_database_commit (database, error);
+	if (!ret)
+		goto out;
+	id = id_tmp;
+out:
+	if (stmt != NULL)
+		sqlite3_reset (stmt);
+	if (in_transaction)
+		ch_database_rollback (database, NULL);
+	return id;
+}
+
+/**
+ * ch_database_device_set_state:
+ * @database: a valid #ChDatabase instance
+ * @id: the device serial number
+ * @state: the #ChDeviceState
+ * @error: A #GError or %NULL
+ *
+ * Changes the state on a device
+ *
+ * Return value: %TRUE if the new state was set
+ **/
+gboolean
+ch_database_device_set_state (ChDatabase *database,
+			      guint32 id,
+			      ChDeviceState state,
+			      GError **error)
+{
+	gboolean ret;
+
+	/* the event is written in the same transaction */
+	ret = ch_database_begin (database, error);
+	if (!ret)
+		goto out;
+	ret = ch_database_device_set_state_internal (database, id, state, error);
+	if (!ret) {
+		ch_database_rollback (database, NULL);
+		goto out;
+	}
+	ret = ch_database_commit (database, error);
+out:
+	return ret;
+}
+
+ChDeviceState
+ch_database_device_get_state (ChDatabase *database,
+			      guint32 device_id,
+			      GError **error)
+{
+	ChDatabasePrivate *priv = database->priv;
+	gboolean ret;
+	gint rc;
+	ChDeviceState state = CH_DEVICE_STATE_LAST;
+	sqlite3_stmt *stmt = NULL;
+
+	g_rec_mutex_lock (&database->priv->mutex);
+
+	/* ensure db is loaded */
+	ret = ch_database_load (database, error);
+	if (!ret)
+		goto out;
+
+	/* find */
+	stmt = ch_database_get_stmt (database, CH_DATABASE_STMT_DEVICE_GET_STATE, error);
+	if (stmt == NULL)
+		goto out;
+	sqlite3_bind_int64 (stmt, 1, device_id);
+	rc = ch_database_step (database, stmt);
+	if (rc == SQLITE_ROW)
+		state = sqlite3_column_int (stmt, 0);
+	if (rc != SQLITE_ROW && rc != SQLITE_DONE) {
+		g_set_error (error, 1, 0,
+			     "failed to find entry: %s",
+			     sqlite3_errmsg (priv->db));
+		goto out;
+	}
+	if (state == CH_DEVICE_STATE_LAST) {
+		g_set_error (error, 1, 0,
+			     "No devices for id %i", device_id);
+		goto out;
+	}
+out:
+	if (stmt != NULL)
+		sqlite3_reset (stmt);
+	g_rec_mutex_unlock (&database->priv->mutex);
+	return state;
+}
+/**
+ * ch_database_order_set_tracking:
+ * @database: a valid #ChDatabase instance
+ * @id: the device serial number
+ * @state: the #ChDeviceState
+ * @error: A #GError or %NULL
+ *
+ * Changes the state on a device
+ *
+ * Return value: %TRUE if the new state was set
+ **/
+gboolean
+ch_database_order_set_tracking (ChDatabase *database,
+				guint32 order_id,
+				const gchar *tracking,
+				GError **error)
+{
+	ChDatabasePrivate *priv = database->priv;
+	gboolean in_transaction = FALSE;
+	gboolean ret;
+	gint rc;
+	sqlite3_stmt *stmt = NULL;
+
+	/* so it is sent to the other stations when committed */
+	ret = ch_database_begin (database, error);
+	if (!ret)
+		goto out;
+	in_transaction = TRUE;
+
+	/* set state */
+	stmt = ch_database_get_stmt (database, CH_DATABASE_STMT_ORDER_SET_TRACKING, error);
+	if (stmt == NULL) {
+		ret = FALSE;
+		goto out;
+	}
+	sqlite3_bind_text (stmt, 1, tracking, -1, SQLITE_TRANSIENT);
+	sqlite3_bind_int64 (stmt, 2, g_get_real_time ());
+	sqlite3_bind_int64 (stmt, 3, order_id);
+	rc = ch_database_step (database, stmt);
+	if (rc != SQLITE_DONE) {
+		ret = FALSE;
+		g_set_error (error, 1, 0,
+			     "failed to update order: %s",
+			     sqlite3_errmsg (priv->db));
+		goto out;
+	}
+	sqlite3_reset (stmt);
+	stmt = NULL;
+	in_transaction = FALSE;
+	ret = ch_database_commit (database, error);
+out:
+	if (stmt != NULL)
+		sqlite3_reset (stmt);
+	if (in_transaction)
+		ch_database_rollback (database, NULL);
+	return ret;
+}
+
+/**
+ * ch_database_order_set_comment:
+ * @database: a valid #ChDatabase instance
+ * @id: the device serial number
+ * @comment: the #ChDeviceState
+ * @error: A #GError or %NULL
+ *
+ * Changes the state on a device
+ *
+ * Return value: %TRUE if the new state was set
+ **/
+gboolean
+ch_database_order_set_comment (ChDatabase *database,
+			       guint32 order_id,
+			       const gchar *comment,
+			       GError **error)
+{
+	ChDatabasePrivate *priv = database->priv;
+	gboolean in_transaction = FALSE;
+	gboolean ret;
+	gint rc;
+	sqlite3_stmt *stmt = NULL;
+
+	/* so it is sent to the other stations when committed */
+	ret = ch_database_begin (database, error);
+	if (!ret)
+		goto out;
+	in_transaction = TRUE;
+
+	/* set state */
+	stmt = ch_database_get_stmt (database, CH_DATABASE_STMT_ORDER_SET_COMMENT, error);
+	if (stmt == NULL) {
+		ret = FALSE;
+		goto out;
+	}
+	sqlite3_bind_text (stmt, 1, comment, -1, SQLITE_TRANSIENT);
+	sqlite3_bind_int64 (stmt, 2, order_id);
+	rc = ch_database_step (database, stmt);
+	if (rc != SQLITE_DONE) {
+		ret = FALSE;
+		g_set_error (error, 1, 0,
+			     "failed to update order: %s",
+			     sqlite3_errmsg (priv->db));
+		goto out;
+	}
+	sqlite3_reset (stmt);
+	stmt = NULL;
+	in_transaction = FALSE;
+	ret = ch_database_commit (database, error);
+out:
+	if (stmt != NULL)
+		sqlite3_reset (stmt);
+	if (in_transaction)
+		ch_database_rollback (database, NULL);
+	return ret;
+}
+
+/**
+ * ch_database_order_set_state:
+ * @database: a valid #ChDatabase instance
+ * @id: the device serial number
+ * @comment: the #ChDeviceState
+ * @error: A #GError or %NULL
+ *
+ * Changes the state on an order.
+ *
+ * Return value: %TRUE if the new state was set
+ **/
+gboolean
+ch_database_order_set_state (ChDatabase *database,
+			     guint32 order_id,
+			     ChOrderState state,
+			     GError **error)
+{
+	gboolean ret;
+
+	/* the event is written in the same transaction */
+	ret = ch_database_begin (database, error);
+	if (!ret)
+		goto out;
+	ret = ch_database_order_set_state_internal (database, order_id, state, error);
+	if (!ret) {
+		ch_database_rollback (database, NULL);
+		goto out;
+	}
+	ret = ch_database_commit (database, error);
+out:
+	return ret;
+}
+
+/**
+ * ch_database_devices_set_state:
+ * @database: a valid #ChDatabase instance
+ * @device_ids: an array of #guint32 device serial numbers
+ * @state: the #ChDeviceState
+ * @error: A #GError or %NULL
+ *
+ * Changes the state on many devices in one transaction. If any device
+ * cannot be updated then none of them are.
+ *
+ * Return value: %TRUE if the new state was set
+ **/
+gboolean
+ch_database_devices_set_state (ChDatabase *database,
+			       GArray *device_ids,
+			       ChDeviceState state,
+			       GError **error)
+{
+	gboolean ret;
+	guint i;
+
+	ret = ch_database_begin (database, error);
+	if (!ret)
+		goto out;
+	for (i = 0; i < device_ids->len; i++) {
+		ret = ch_database_device_set_state_internal (database,
+							     g_array_index (device_ids, guint32, i),
+							     state,
+							     error);
+		if (!ret) {
+			ch_database_rollback (database, NULL);
+			goto out;
+		}
+	}
+	ret = ch_database_commit (database, error);
+out:
+	return ret;
+}
+
+/**
+ * ch_database_orders_set_state:
+ * @database: a valid #ChDatabase instance
+ * @order_ids: an array of #guint32 order numbers
+ * @state: the #ChOrderState
+ * @error: A #GError or %NULL
+ *
+ * Changes the state on many orders in one transaction. If any order
+ * cannot be updated then none of them are.
+ *
+ * Return value: %TRUE if the new state was set
+ **/
+gboolean
+ch_database_orders_set_state (ChDatabase *database,
+			      GArray *order_ids,
+			      ChOrderState state,
+			      GError **error)
+{
+	gboolean ret;
+	guint i;
+
+	ret = ch_database_begin (database, error);
+	if (!ret)
+		goto out;
+	for (i = 0; i < order_ids->len; i++) {
+		ret = ch_database_order_set_state_internal (database,
+							    g_array_index (order_ids, guint32, i),
+							    state,
+							    error);
+		if (!ret) {
+			ch_database_rollback (database, NULL);
+			goto out;
+		}
+	}
+	ret = ch_database_commit (database, error);
+out:
+	return ret;
+}
+
+/**
+ * ch_database_device_set_order_id:
+ * @database: a valid #ChDatabase instance
+ * @id: the device serial number
+ * @state: the #ChDeviceState
+ * @error: A #GError or %NULL
+ *
+ * Changes the order-id on a device
+ *
+ * Return value: %TRUE if the new state was set
+ **/
+gboolean
+ch_database_device_set_order_id (ChDatabase *database,
+				 guint32 device_id,
+				 guint32 order_id,
+				 GError **error)
+{
+	ChDatabasePrivate *priv = database->priv;
+	gboolean in_transaction = FALSE;
+	gboolean ret;
+	gint rc;
+	sqlite3_stmt *stmt = NULL;
+
+	/* so it is sent to the other stations when committed */
+	ret = ch_database_begin (database, error);
+	if (!ret)
+		goto out;
+	in_transaction = TRUE;
+
+	/* set state */
+	stmt = ch_database_get_stmt (database, CH_DATABASE_STMT_DEVICE_SET_ORDER_ID, error);
+	if (stmt == NULL) {
+		ret = FALSE;
+		goto out;
+	}
+	sqlite3_bind_int64 (stmt, 1, order_id);
+	sqlite3_bind_int64 (stmt, 2, device_id);
+	rc = ch_database_step (database, stmt);
+	if (rc != SQLITE_DONE) {
+		ret = FALSE;
+		g_set_error (error, 1, 0,
+			     "failed to update entry: %s",
+			     sqlite3_errmsg (priv->db));
+		goto out;
+	}
+	sqlite3_reset (stmt);
+	stmt = NULL;
+	in_transaction = FALSE;
+	ret = ch_database_commit (database, error);
+out:
+	if (stmt != NULL)
+		sqlite3_reset (stmt);
+	if (in_transaction)
+		ch_database_rollback (database, NULL);
+	return ret;
+}
+
+/**
+ * ch_database_device_get_number:
+ * @database: a valid #ChDatabase instance
+ * @state: A #ChDeviceState
+ * @error: A #GError or %NULL
+ *
+ * Gets the number of devices of a known state, read from the inventory
+ * counters rather than by counting the devices.
+ *
+ * Return value: The number of devices or G_MAXUINT32 for error
+ **/
+guint
+ch_database_device_get_number (ChDatabase *database,
+			       ChDeviceState state,
+			       guint hw_ver,
+			       GError **error)
+{
+	ChDatabasePrivate *priv = database->priv;
+	gboolean ret;
+	gint rc;
+	guint len = G_MAXUINT32;
+	sqlite3_stmt *stmt = NULL;
+
+	g_rec_mutex_lock (&database->priv->mutex);
+
+	/* ensure db is loaded */
+	ret = ch_database_load (database, error);
+	if (!ret)
+		goto out;
+
+	/* find */
+	stmt = ch_database_get_stmt (database, CH_DATABASE_STMT_DEVICE_GET_NUMBER, error);
+	if (stmt == NULL)
+		goto out;
+	sqlite3_bind_int (stmt, 1, state);
+	sqlite3_bind_int (stmt, 2, hw_ver);
+	rc = ch_database_step (database, stmt);
+	if (rc != SQLITE_ROW && rc != SQLITE_DONE) {
+		g_set_error (error, 1, 0,
+			     "failed to find entry: %s",
+			     sqlite3_errmsg (priv->db));
+		goto out;
+	}
+	len = rc == SQLITE_ROW ? sqlite3_column_int (stmt, 0) : 0;
+out:
+	if (stmt != NULL)
+		sqlite3_reset (stmt);
+	g_rec_mutex_unlock (&database->priv->mutex);
+	return len;
+}
+
+/**
+ * ch_database_get_inventory:
+ * @database: a valid #ChDatabase instance
+ * @error: A #GError or %NULL
+ *
+ * Gets the number of devices for every hardware version and state. The
+ * counts are kept up to date by the database itself and so this does not
+ * depend on how many devices have ever been made.
+ *
+ * Return value: An array of #ChDatabaseInventory, or %NULL for error
+ **/
+GArray *
+ch_database_get_inventory (ChDatabase *database, GError **error)
+{
+	ChDatabaseInventory item;
+	ChDatabasePrivate *priv = database->priv;
+	GArray *array = NULL;
+	GArray *array_tmp = NULL;
+	gboolean ret;
+	gint rc;
+	sqlite3_stmt *stmt = NULL;
+
+	g_rec_mutex_lock (&database->priv->mutex);
+
+	/* ensure db is loaded */
+	ret = ch_database_load (database, error);
+	if (!ret)
+		goto out;
+
+	/* find */
+	stmt = ch_database_get_stmt (database, CH_DATABASE_STMT_GET_INVENTORY, error);
+	if (stmt == NULL)
+		goto out;
+	array_tmp = g_array_new (FALSE, FALSE, sizeof (ChDatabaseInventory));
+	while ((rc = ch_database_step (database, stmt)) == SQLITE_ROW) {
+		item.hw_ver = sqlite3_column_int (stmt, 0);
+		item.state = sqlite3_column_int (stmt, 1);
+		item.count = sqlite3_column_int (stmt, 2);
+		g_array_append_val (array_tmp, item);
+	}
+	if (rc != SQLITE_DONE) {
+		g_set_error (error, 1, 0,
+			     "failed to get inventory: %s",
+			     sqlite3_errmsg (priv->db));
+		goto out;
+	}
+	array = g_array_ref (array_tmp);
+out:
+	if (stmt != NULL)
+		sqlite3_reset (stmt);
+	if (array_tmp != NULL)
+		g_array_unref (array_tmp);
+	g_rec_mutex_unlock (&database->priv->mutex);
+	return array;
+}
+
+/**
+ * ch_database_device_find_oldest:
+ * @database: a valid #ChDatabase instance
+ * @state: A #ChDeviceState
+ * @error: A #GError or %NULL
+ *
+ * Finds the oldest device of a known state
+ *
+ * Return value: The device serial number or G_MAXUINT32 for error
+ **/
+guint32
+ch_database_device_find_oldest (ChDatabase *database,
+				ChDeviceState state,
+				guint hw_ver,
+				GError **error)
+{
+	ChDatabasePrivate *priv = database->priv;
+	gboolean ret;
+	gint rc;
+	guint32 id = G_MAXUINT32;
+	sqlite3_stmt *stmt = NULL;
+
+	g_rec_mutex_lock (&database->priv->mutex);
+
+	/* ensure db is loaded */
+	ret = ch_database_load (database, error);
+	if (!ret)
+		goto out;
+
+	/* find */
+	stmt = ch_database_get_stmt (database, CH_DATABASE_STMT_DEVICE_FIND_OLDEST, error);
+	if (stmt == NULL)
+		goto out;
+	sqlite3_bind_int (stmt, 1, state);
+	sqlite3_bind_int (stmt, 2, hw_ver);
+	rc = ch_database_step (database, stmt);
+	if (rc == SQLITE_ROW)
+		id = sqlite3_column_int64 (stmt, 0);
+	if (rc != SQLITE_ROW && rc != SQLITE_DONE) {
+		g_set_error (error, 1, 0,
+			     "failed to find entry: %s",
+			     sqlite3_errmsg (priv->db));
+		goto out;
+	}
+	if (id == G_MAXUINT32) {
+		g_set_error (error, 1, 0,
+			     "No devices in state %s",
+			     ch_database_state_to_string (state));
+		goto out;
+	}
+out:
+	if (stmt != NULL)
+		sqlite3_reset (stmt);
+	g_rec_mutex_unlock (&database->priv->mutex);
+	return id;
+}
+
+/**
+ * ch_database_allocate_devices:
+ * @database: a valid #ChDatabase instance
+ * @order_id: the order to allocate devices to
+ * @hw_ver: the hardware version, e.g. 2
+ * @count: the number of devices required
+ * @error: A #GError or %NULL
+ *
+ * Allocates the oldest calibrated devices to an order. This is done in one
+ * write transaction, so either all @count devices are claimed or none are,
+ * and two stations can never be given the same device.
+ *
+ * Return value: An array of device serial numbers, or %NULL for error
+ **/
+GArray *
+ch_database_allocate_devices (ChDatabase *database,
+			      guint32 order_id,
+			      guint hw_ver,
+			      guint count,
+			      GError **error)
+{
+	ChDatabasePrivate *priv = database->priv;
+	GArray *array = NULL;
+	GArray *array_tmp = NULL;
+	gboolean in_transaction = FALSE;
+	gboolean ret;
+	gint rc;
+	guint32 tmp;
+	guint i;
+	sqlite3_stmt *stmt = NULL;
+
+	/* take the write lock before looking */
+	ret = ch_database_begin (database, error);
+	if (!ret)
+		goto out;
+	in_transaction = TRUE;
+
+	/* find the oldest */
+	array_tmp = g_array_sized_new (FALSE, FALSE, sizeof (guint32), count);
+	stmt = ch_database_get_stmt (database, CH_DATABASE_STMT_DEVICE_FIND_AVAILABLE, error);
+	if (stmt == NULL)
+		goto out;
+	sqlite3_bind_int (stmt, 1, CH_DEVICE_STATE_CALIBRATED);
+	sqlite3_bind_int (stmt, 2, hw_ver);
+	sqlite3_bind_int (stmt, 3, count);
+	while ((rc = ch_database_step (database, stmt)) == SQLITE_ROW) {
+		tmp = sqlite3_column_int64 (stmt, 0);
+		g_array_append_val (array_tmp, tmp);
+	}
+	sqlite3_reset (stmt);
+	if (rc != SQLITE_DONE) {
+		g_set_error (error, 1, 0,
+			     "failed to find devices: %s",
+			     sqlite3_errmsg (priv->db));
+		goto out;
+	}
+	if (array_tmp->len < count) {
+		g_set_error (error, 1, 0,
+			     "Only %i devices of ColorHug%i in state %s",
+			     array_tmp->len, hw_ver,
+			     ch_database_state_to_string (CH_DEVICE_STATE_CALIBRATED));
+		goto out;
+	}
+
+	/* claim them */
+	stmt = ch_database_get_stmt (database, CH_DATABASE_STMT_DEVICE_ALLOCATE, error);
+	if (stmt == NULL)
+		goto out;
+	for (i = 0; i < array_tmp->len; i++) {
+		sqlite3_reset (stmt);
+		sqlite3_bind_int64 (stmt, 1, order_id);
+		sqlite3_bind_int (stmt, 2, CH_DEVICE_STATE_ALLOCATED);
+		sqlite3_bind_int64 (stmt, 3, g_array_index (array_tmp, guint32, i));
+		rc = ch_database_step (database, stmt);
+		if (rc != SQLITE_DONE) {
+			g_set_error (error, 1, 0,
+				     "failed to allocate device: %s",
+				     sqlite3_errmsg (priv->db));
+			goto out;
+		}
+		if (!ch_database_add_event (database,
+					    CH_DATABASE_EVENT_KIND_DEVICE,
+					    g_array_index (array_tmp, guint32, i),
+					    CH_DEVICE_STATE_ALLOCATED,
+					    error))
+			goto out;
+	}
+	sqlite3_reset (stmt);
+	stmt = NULL;
+	in_transaction = FALSE;
+	ret = ch_database_commit (database, error);
+	if (!ret)
+		goto out;
+	array = g_array_ref (array_tmp);
+out:
+	if (stmt != NULL)
+		sqlite3_reset (stmt);
+	if (in_transaction)
+		ch_database_rollback (database, NULL);
+	if (array_tmp != NULL)
+		g_array_unref (array_tmp);
+	return array;
+}
+
+GArray *
+ch_database_order_get_device_ids (ChDatabase *database,
+				 guint32 order_id,
+				 GError **error)
+{
+	ChDatabasePrivate *priv = database->priv;
+	GArray *array = NULL;
+	GArray *array_tmp = NULL;
+	gboolean ret;
+	gint rc;
+	guint32 tmp;
+	sqlite3_stmt *stmt = NULL;
+
+	g_rec_mutex_lock (&database->priv->mutex);
+
+	/* ensure db is loaded */
+	ret = ch_database_load (database, error);
+	if (!ret)
+		goto out;
+
+	/* find */
+	stmt = ch_database_get_stmt (database, CH_DATABASE_STMT_ORDER_GET_DEVICE_IDS, error);
+	if (stmt == NULL)
+		goto out;
+	sqlite3_bind_int64 (stmt, 1, order_id);
+	array_tmp = g_array_new (FALSE, FALSE, sizeof (guint32));
+	while ((rc = ch_database_step (database, stmt)) == SQLITE_ROW) {
+		tmp = sqlite3_column_int64 (stmt, 0);
+		g_array_append_val (array_tmp, tmp);
+	}
+	if (rc != SQLITE_DONE) {
+		g_set_error (error, 1, 0,
+			     "failed to find entry: %s",
+			     sqlite3_errmsg (priv->db));
+		goto out;
+	}
+	if (array_tmp->len == 0) {
+		g_set_error (error, 1, 0,
+			     "No devices for order %i", order_id);
+		goto out;
+	}
+	array = g_array_ref (array_tmp);
+out:
+	if (stmt != NULL)
+		sqlite3_reset (stmt);
+	if (array_tmp != NULL)
+		g_array_unref (array_tmp);
+	g_rec_mutex_unlock (&database->priv->mutex);
+	return array;
+}
+
+gchar *
+ch_database_order_get_comment (ChDatabase *database,
+				guint32 order_id,
+				GError **error)
+{
+	ChDatabasePrivate *priv = database->priv;
+	gboolean ret;
+	gint rc;
+	gchar *comment = NULL;
+	sqlite3_stmt *stmt = NULL;
+
+	g_rec_mutex_lock (&database->priv->mutex);
+
+	/* ensure db is loaded */
+	ret = ch_database_load (database, error);
+	if (!ret)
+		goto out;
+
+	/* find */
+	stmt = ch_database_get_stmt (database, CH_DATABASE_STMT_ORDER_GET_COMMENT, error);
+	if (stmt == NULL)
+		goto out;
+	sqlite3_bind_int64 (stmt, 1, order_id);
+	rc = ch_database_step (database, stmt);
+	if (rc == SQLITE_ROW)
+		comment = g_strdup ((const gchar *) sqlite3_column_text (stmt, 0));
+	if (rc != SQLITE_ROW && rc != SQLITE_DONE) {
+		g_set_error (error, 1, 0,
+			     "failed to find entry: %s",
+			     sqlite3_errmsg (priv->db));
+		goto out;
+	}
+
+	/* don't return NULL for success */
+	if (comment == NULL)
+		comment = g_strdup ("");
+out:
+	if (stmt != NULL)
+		sqlite3_reset (stmt);
+	g_rec_mutex_unlock (&database->priv->mutex);
+	return comment;
+}
+
+/**
+ * ch_database_order_list_free:
+ * @list: a #ChDatabaseOrderList
+ *
+ * Frees an order list, including all the orders and strings in it.
+ **/
+void
+ch_database_order_list_free (ChDatabaseOrderList *list)
+{
+	if (list == NULL)
+		return;
+	g_array_unref (list->orders_array);
+	g_array_unref (list->device_ids);
+	g_string_chunk_free (list->strings);
+	g_free (list);
+}
+
+static ChDatabaseOrderList *
+ch_database_order_list_new (void)
+{
+	ChDatabaseOrderList *list;
+	list = g_new0 (ChDatabaseOrderList, 1);
+	list->orders_array = g_array_new (FALSE, TRUE, sizeof (ChDatabaseOrder));
+	list->device_ids = g_array_new (FALSE, FALSE, sizeof (guint32));
+	list->strings = g_string_chunk_new (64 * 1024);
+	return list;
+}
+
+/* copies a text column into the list, keeping NULL as NULL */
+static const gchar *
+ch_database_order_list_add_text (ChDatabaseOrderList *list,
+				 sqlite3_stmt *stmt,
+				 gint column)
+{
+	const gchar *text;
+	text = (const gchar *) sqlite3_column_text (stmt, column);
+	if (text == NULL)
+		return NULL;
+	return g_string_chunk_insert_len (list->strings, text,
+					  sqlite3_column_bytes (stmt, column));
+}
+
+/* adds the device IDs for every order; these are appended to one shared
+ * array in the same order as the orders themselves */
+static gboolean
+ch_database_order_list_add_device_ids (ChDatabase *database,
+				       ChDatabaseOrderList *list,
+				       gboolean is_page,
+				       GError **error)
+{
+	ChDatabaseOrder *order;
+	ChDatabaseOrder *orders = (ChDatabaseOrder *) list->orders_array->data;
+	ChDatabasePrivate *priv = database->priv;
+	gboolean ret = TRUE;
+	gint rc;
+	guint32 device_id;
+	guint32 order_id;
+	guint i;
+	guint j = 0;
+	sqlite3_stmt *stmt = NULL;
+	sqlite3_stmt *stmt_archive = NULL;
+	sqlite3_stmt *stmt_hot = NULL;
+
+	if (list->len == 0)
+		goto out;
+
+	/* a page is one range scan of the index, merged in order */
+	if (is_page) {
+		stmt = ch_database_get_stmt (database, CH_DATABASE_STMT_ORDERS_GET_DEVICE_IDS, error);
+		if (stmt == NULL) {
+			ret = FALSE;
+			goto out;
+		}
+		sqlite3_bind_int64 (stmt, 1, orders[list->len - 1].order_id);
+		sqlite3_bind_int64 (stmt, 2, orders[0].order_id);
+		while ((rc = ch_database_step (database, stmt)) == SQLITE_ROW) {
+			order_id = sqlite3_column_int64 (stmt, 0);
+			while (j < list->len && orders[j].order_id > order_id)
+				j++;
+			if (j == list->len || orders[j].order_id != order_id)
+				continue;
+			device_id = sqlite3_column_int64 (stmt, 1);
+			g_array_append_val (list->device_ids, device_id);
+			orders[j].device_ids_len++;
+		}
+		if (rc != SQLITE_DONE) {
+			ret = FALSE;
+			g_set_error (error, 1, 0,
+				     "failed to find devices: %s",
+				     sqlite3_errmsg (priv->db));
+			goto out;
+		}
+		goto fixup;
+	}
+
+	/* a few scattered orders are cheaper to look up one at a time */
+	stmt_hot = ch_database_get_stmt (database, CH_DATABASE_STMT_ORDER_GET_DEVICE_IDS, error);
+	if (stmt_hot == NULL) {
+		ret = FALSE;
+		goto out;
+	}
+	for (i = 0; i < list->len; i++) {
+		order = &orders[i];
+
+		/* archived orders have their devices archived too */
+		if (order->archived && stmt_archive == NULL) {
+			stmt_archive = ch_database_get_stmt (database,
+							     CH_DATABASE_STMT_ARCHIVE_GET_DEVICE_IDS,
+							     error);
+			if (stmt_archive == NULL) {
+				ret = FALSE;
+				goto out;
+			}
+		}
+		stmt = order->archived ? stmt_archive : stmt_hot;
+		sqlite3_reset (stmt);
+		sqlite3_bind_int64 (stmt, 1, order->order_id);
+		while ((rc = ch_database_step (database, stmt)) == SQLITE_ROW) {
+			device_id = sqlite3_column_int64 (stmt, 0);
+			g_array_append_val (list->device_ids, device_id);
+			order->device_ids_len++;
+		}
+		if (rc != SQLITE_DONE) {
+			ret = FALSE;
+			g_set_error (error, 1, 0,
+				     "failed to find devices: %s",
+				     sqlite3_errmsg (priv->db));
+			goto out;
+		}
+	}
+fixup:
+	/* the array will not be reallocated now */
+	j = 0;
+	for (i = 0; i < list->len; i++) {
+		order = &orders[i];
+		if (order->device_ids_len == 0)
+			continue;
+		order->device_ids = &g_array_index (list->device_ids, guint32, j);
+		j += order->device_ids_len;
+	}
+out:
+	if (stmt != NULL)
+		sqlite3_reset (stmt);
+	if (stmt_hot != NULL)
+		sqlite3_reset (stmt_hot);
+	if (stmt_archive != NULL)
+		sqlite3_reset (stmt_archive);
+	return ret;
+}
+
+/* runs a bound statement returning order rows, and adds the devices */
+static ChDatabaseOrderList *
+ch_database_get_orders_for_stmt (ChDatabase *database,
+				 sqlite3_stmt *stmt,
+				 gboolean is_page,
+				 GError **error)
+{
+	ChDatabaseOrder *order;
+	ChDatabaseOrderList *list;
+	ChDatabasePrivate *priv = database->priv;
+	gint rc;
+
+	list = ch_database_order_list_new ();
+	while ((rc = ch_database_step (database, stmt)) == SQLITE_ROW) {
+		g_array_set_size (list->orders_array, list->orders_array->len + 1);
+		order = &g_array_index (list->orders_array,
+					ChDatabaseOrder,
+					list->orders_array->len - 1);
+		order->order_id = sqlite3_column_int64 (stmt, 0);
+		order->name = ch_database_order_list_add_text (list, stmt, 1);
+		order->address = ch_database_order_list_add_text (list, stmt, 2);
+		order->email = ch_database_order_list_add_text (list, stmt, 3);
+		order->postage = sqlite3_column_int (stmt, 4);
+		order->tracking_number = ch_database_order_list_add_text (list, stmt, 5);
+		order->sent_date = sqlite3_column_int64 (stmt, 6);
+		order->comment = ch_database_order_list_add_text (list, stmt, 7);
+		order->state = sqlite3_column_int (stmt, 8);
+		order->address_lines = ch_database_order_list_add_text (list, stmt, 9);
+		order->postcode = ch_database_order_list_add_text (list, stmt, 10);
+		order->country = ch_database_order_list_add_text (list, stmt, 11);
+		order->address_latex = ch_database_order_list_add_text (list, stmt, 12);
+		if (sqlite3_column_count (stmt) > 13)
+			order->archived = sqlite3_column_int (stmt, 13);
+	}
+	sqlite3_reset (stmt);
+	if (rc != SQLITE_DONE) {
+		g_set_error (error, 1, 0,
+			     "failed to find entry: %s",
+			     sqlite3_errmsg (priv->db));
+		ch_database_order_list_free (list);
+		return NULL;
+	}
+	list->orders = (ChDatabaseOrder *) list->orders_array->data;
+	list->len = list->orders_array->len;
+
+	/* add the devices for all the orders in one go */
+	if (!ch_database_order_list_add_device_ids (database, list, is_page, error)) {
+		ch_database_order_list_free (list);
+		return NULL;
+	}
+	return list;
+}
+
+/**
+ * ch_database_get_orders:
+ * @database: a valid #ChDatabase instance
+ * @before: only return orders older than this order ID, or %G_MAXUINT32
+ * @limit: the maximum number of orders to return
+ * @error: A #GError or %NULL
+ *
+ * Gets a page of orders, newest first. To get the next page pass the
+ * oldest order ID from the previous page as @before.
+ *
+ * Return value: a #ChDatabaseOrderList, or %NULL for error
+ **/
+ChDatabaseOrderList *
+ch_database_get_orders (ChDatabase *database,
+			guint32 before,
+			guint limit,
+			GError **error)
+{
+	ChDatabaseOrderList *orders = NULL;
+	sqlite3_stmt *stmt;
+
+	g_rec_mutex_lock (&database->priv->mutex);
+
+	/* ensure db is loaded */
+	if (!ch_database_load (database, error))
+		goto out;
+
+	stmt = ch_database_get_stmt (database, CH_DATABASE_STMT_GET_ORDERS, error);
+	if (stmt == NULL)
+		goto out;
+	sqlite3_bind_int64 (stmt, 1, before);
+	sqlite3_bind_int64 (stmt, 2, limit);
+	orders = ch_database_get_orders_for_stmt (database, stmt, TRUE, error);
+out:
+	g_rec_mutex_unlock (&database->priv->mutex);
+	return orders;
+}
+
+/**
+ * ch_database_get_all_orders:
+ * @database: a valid #ChDatabase instance
+ * @error: A #GError or %NULL
+ *
+ * Gets the most recent orders, newest first.
+ *
+ * Return value: a #ChDatabaseOrderList, or %NULL for error
+ **/
+ChDatabaseOrderList *
+ch_database_get_all_orders (ChDatabase *database,
+			    GError **error)
+{
+	return ch_database_get_orders (database, G_MAXUINT32, 1500, error);
+}
+
+/**
+ * ch_database_get_orders_generation:
+ * @database: a valid #ChDatabase instance
+ * @generation: (out): the current generation
+ * @error: A #GError or %NULL
+ *
+ * Gets a token that increases every time any order is changed. Get this
+ * before fetching the orders and then pass it to
+ * ch_database_get_orders_changed() to fetch only what changed since.
+ *
+ * Return value: %TRUE for success
+ **/
+gboolean
+ch_database_get_orders_generation (ChDatabase *database,
+				   guint64 *generation,
+				   GError **error)
+{
+	ChDatabasePrivate *priv = database->priv;
+	gboolean ret;
+	gint rc;
+	sqlite3_stmt *stmt = NULL;
+
+	g_rec_mutex_lock (&database->priv->mutex);
+
+	/* ensure db is loaded */
+	ret = ch_database_load (database, error);
+	if (!ret)
+		goto out;
+
+	stmt = ch_database_get_stmt (database, CH_DATABASE_STMT_GET_ORDERS_GENERATION, error);
+	if (stmt == NULL) {
+		ret = FALSE;
+		goto out;
+	}
+	rc = ch_database_step (database, stmt);
+	if (rc != SQLITE_ROW) {
+		ret = FALSE;
+		g_set_error (error, 1, 0,
+			     "failed to get generation: %s",
+			     sqlite3_errmsg (priv->db));
+		goto out;
+	}
+	*generation = sqlite3_column_int64 (stmt, 0);
+out:
+	if (stmt != NULL)
+		sqlite3_reset (stmt);
+	g_rec_mutex_unlock (&database->priv->mutex);
+	return ret;
+}
+
+/**
+ * ch_database_get_orders_changed:
+ * @database: a valid #ChDatabase instance
+ * @since: a generation from ch_database_get_orders_generation()
+ * @generation: (out): the generation to use next time
+ * @error: A #GError or %NULL
+ *
+ * Gets the orders that have been added or changed since @since, including
+ * orders that had devices allocated or removed. The orders are returned
+ * least recently changed first. An order changed while this runs may be
+ * returned again next time, but is never missed.
+ *
+ * Return value: a #ChDatabaseOrderList, or %NULL for error
+ **/
+ChDatabaseOrderList *
+ch_database_get_orders_changed (ChDatabase *database,
+				guint64 since,
+				guint64 *generation,
+				GError **error)
+{
+	ChDatabaseOrderList *orders = NULL;
+	sqlite3_stmt *stmt;
+
+	g_rec_mutex_lock (&database->priv->mutex);
+
+	/* get this first so nothing can be missed */
+	if (!ch_database_get_orders_generation (database, generation, error))
+		goto out;
+
+	stmt = ch_database_get_stmt (database, CH_DATABASE_STMT_GET_ORDERS_CHANGED, error);
+	if (stmt == NULL)
+		goto out;
+	sqlite3_bind_int64 (stmt, 1, since);
+	orders = ch_database_get_orders_for_stmt (database, stmt, FALSE, error);
+out:
+	g_rec_mutex_unlock (&database->priv->mutex);
+	return orders;
+}
+
+/**
+ * ch_database_add_order:
+ * @database: a valid #ChDatabase instance
+ * @error: A #GError or %NULL
+ *
+ * Add a new order to the database
+ *
+ * Return value: The new device serial number or 0 for error
+ **/
+guint32
+ch_database_add_order (ChDatabase *database,
+		       const gchar *name,
+		       const gchar *address,
+		       const gchar *email,
+		       ChShippingKind postage,
+		       GError **error)
+{
+	ChDatabasePrivate *priv = database->priv;
+	gboolean in_transaction = FALSE;
+	gboolean ret;
+	gint rc;
+	guint32 id = G_MAXUINT32;
+	guint32 id_tmp;
+	sqlite3_stmt *stmt = NULL;
+
+	/* the event is written in the same transaction */
+	ret = ch_database_begin (database, error);
+	if (!ret)
+		goto out;
+	in_transaction = TRUE;
+
+	/* add newest */
+	stmt = ch_database_get_stmt (database, CH_DATABASE_STMT_ADD_ORDER, error);
+	if (stmt == NULL)
+		goto out;
+	sqlite3_bind_text (stmt, 1, name, -1, SQLITE_TRANSIENT);
+	sqlite3_bind_text (stmt, 2, address, -1, SQLITE_TRANSIENT);
+	sqlite3_bind_text (stmt, 3, email, -1, SQLITE_TRANSIENT);
+	sqlite3_bind_int (stmt, 4, postage);
+	rc = ch_database_step (database, stmt);
+	if (rc != SQLITE_DONE) {
+		g_set_error (error, 1, 0,
+			     "failed to add entry: %s",
+			     sqlite3_errmsg (priv->db));
+		goto out;
+	}
+
+	/* yay, atomic serial number */
+	id_tmp = sqlite3_last_insert_rowid (priv->db);
+	sqlite3_reset (stmt);
+	stmt = NULL;
+	ret = ch_database_add_event (database, CH_DATABASE_EVENT_KIND_ORDER,
+				     id_tmp, CH_ORDER_STATE_NEW, error);
+	if (!ret)
+		goto out;
+	in_transaction = FALSE;
+	ret = ch_database_commit (database, error);
+	if (!ret)
+		goto out;
+	id = id_tmp;
+out:
+	if (stmt != NULL)
+		sqlite3_reset (stmt);
+	if (in_transaction)
+		ch_database_rollback (database, NULL);
+	return id;
+}
+
+/**
+ * ch_database_add_email:
+ * @database: a valid #ChDatabase instance
+ * @order_id: the order the email is about
+ * @recipient: the email address to send to
+ * @subject: the email subject
+ * @body: the email body
+ * @error: A #GError or %NULL
+ *
+ * Queues an email to be sent later, so that it is only sent if the
+ * transaction that created the order is committed.
+ *
+ * Return value: The new email ID or G_MAXUINT32 for error
+ **/
+guint32
+ch_database_add_email (ChDatabase *database,
+		       guint32 order_id,
+		       const gchar *recipient,
+		       const gchar *subject,
+		       const gchar *body,
+		       GError **error)
+{
+	ChDatabasePrivate *priv = database->priv;
+	gboolean ret;
+	gint rc;
+	guint32 id = G_MAXUINT32;
+	sqlite3_stmt *stmt = NULL;
+
+	g_rec_mutex_lock (&database->priv->mutex);
+
+	/* ensure db is loaded */
+	ret = ch_database_load (database, error);
+	if (!ret)
+		goto out;
+
+	stmt = ch_database_get_stmt (database, CH_DATABASE_STMT_ADD_EMAIL, error);
+	if (stmt == NULL)
+		goto out;
+	sqlite3_bind_int64 (stmt, 1, order_id);
+	sqlite3_bind_text (stmt, 2, recipient, -1, SQLITE_TRANSIENT);
+	sqlite3_bind_text (stmt, 3, subject, -1, SQLITE_TRANSIENT);
+	sqlite3_bind_text (stmt, 4, body, -1, SQLITE_TRANSIENT);
+	sqlite3_bind_int64 (stmt, 5, g_get_real_time ());
+	rc = ch_database_step (database, stmt);
+	if (rc != SQLITE_DONE) {
+		g_set_error (error, 1, 0,
+			     "failed to add email: %s",
+			     sqlite3_errmsg (priv->db));
+		goto out;
+	}
+	id = sqlite3_last_insert_rowid (priv->db);
+out:
+	if (stmt != NULL)
+		sqlite3_reset (stmt);
+	g_rec_mutex_unlock (&database->priv->mutex);
+	return id;
+}
+
+/**
+ * ch_database_email_free:
+ * @email: a #ChDatabaseEmail
+ *
+ * Frees a queued email.
+ **/
+void
+ch_database_email_free (ChDatabaseEmail *email)
+{
+	g_free (email->recipient);
+	g_free (email->subject);
+	g_free (email->body);
+	g_free (email);
+}
+
+/**
+ * ch_database_get_queued_emails:
+ * @database: a valid #ChDatabase instance
+ * @error: A #GError or %NULL
+ *
+ * Gets the emails that have not been sent yet, oldest first.
+ *
+ * Return value: An array of #ChDatabaseEmail, or %NULL for error
+ **/
+GPtrArray *
+ch_database_get_queued_emails (ChDatabase *database, GError **error)
+{
+	ChDatabaseEmail *email;
+	ChDatabasePrivate *priv = database->priv;
+	GPtrArray *array = NULL;
+	GPtrArray *array_tmp = NULL;
+	gint rc;
+	sqlite3_stmt *stmt = NULL;
+
+	g_rec_mutex_lock (&database->priv->mutex);
+
+	/* ensure db is loaded */
+	if (!ch_database_load (database, error))
+		goto out;
+
+	stmt = ch_database_get_stmt (database, CH_DATABASE_STMT_GET_QUEUED_EMAILS, error);
+	if (stmt == NULL)
+		goto out;
+	array_tmp = g_ptr_array_new_with_free_func ((GDestroyNotify) ch_database_email_free);
+	while ((rc = ch_database_step (database, stmt)) == SQLITE_ROW) {
+		email = g_new0 (ChDatabaseEmail, 1);
+		email->email_id = sqlite3_column_int64 (stmt, 0);
+		email->order_id = sqlite3_column_int64 (stmt, 1);
+		email->recipient = g_strdup ((const gchar *) sqlite3_column_text (stmt, 2));
+		email->subject = g_strdup ((const gchar *) sqlite3_column_text (stmt, 3));
+		email->body = g_strdup ((const gchar *) sqlite3_column_text (stmt, 4));
+		g_ptr_array_add (array_tmp, email);
+	}
+	if (rc != SQLITE_DONE) {
+		g_set_error (error, 1, 0,
+			     "failed to get emails: %s",
+			     sqlite3_errmsg (priv->db));
+		goto out;
+	}
+	array = g_ptr_array_ref (array_tmp);
+out:
+	if (stmt != NULL)
+		sqlite3_reset (stmt);
+	if (array_tmp != NULL)
+		g_ptr_array_unref (array_tmp);
+	g_rec_mutex_unlock (&database->priv->mutex);
+	return array;
+}
+
+/**
+ * ch_database_email_set_sent:
+ * @database: a valid #ChDatabase instance
+ * @email_id: the email ID
+ * @error: A #GError or %NULL
+ *
+ * Marks a queued email as sent, so it is not sent again.
+ *
+ * Return value: %TRUE for success
+ **/
+gboolean
+ch_database_email_set_sent (ChDatabase *database,
+			    guint32 email_id,
+			    GError **error)
+{
+	ChDatabasePrivate *priv = database->priv;
+	gboolean ret;
+	gint rc;
+	sqlite3_stmt *stmt = NULL;
+
+	g_rec_mutex_lock (&database->priv->mutex);
+
+	/* ensure db is loaded */
+	ret = ch_database_load (database, error);
+	if (!ret)
+		goto out;
+
+	stmt = ch_database_get_stmt (database, CH_DATABASE_STMT_EMAIL_SET_SENT, error);
+	if (stmt == NULL) {
+		ret = FALSE;
+		goto out;
+	}
+	sqlite3_bind_int64 (stmt, 1, g_get_real_time ());
+	sqlite3_bind_int64 (stmt, 2, email_id);
+	rc = ch_database_step (database, stmt);
+	if (rc != SQLITE_DONE) {
+		ret = FALSE;
+		g_set_error (error, 1, 0,
+			     "failed to update email: %s",
+			     sqlite3_errmsg (priv->db));
+		goto out;
+	}
+out:
+	if (stmt != NULL)
+		sqlite3_reset (stmt);
+	g_rec_mutex_unlock (&database->priv->mutex);
+	return ret;
+}
+
+/* makes user input safe to use as a FTS5 query, where every word
+ * has to match the start of a word in the order */
+static gchar *
+ch_database_search_to_fts (const gchar *search)
+{
+	GString *str;
+	gchar **tokens;
+	guint i;
+	guint j;
+
+	str = g_string_new ("");
+	tokens = g_strsplit_set (search, " \t\n", -1);
+	for (i = 0; tokens[i] != NULL; i++) {
+		if (tokens[i][0] == '\0')
+			continue;
+		g_string_append_c (str, '"');
+		for (j = 0; tokens[i][j] != '\0'; j++) {
+			if (tokens[i][j] == '"')
+				g_string_append_c (str, '"');
+			g_string_append_c (str, tokens[i][j]);
+		}
+		g_string_append (str, "\"* ");
+	}
+	g_strfreev (tokens);
+	if (str->len > 0)
+		g_string_truncate (str, str->len - 1);
+	return g_string_free (str, FALSE);
+}
+
+/* the fallback when there is no FTS5, where the input is a substring */
+static gchar *
+ch_database_search_to_like (const gchar *search)
+{
+	GString *str;
+	guint i;
+
+	str = g_string_new ("%");
+	for (i = 0; search[i] != '\0'; i++) {
+		if (search[i] == '%' || search[i] == '_' || search[i] == '\\')
+			g_string_append_c (str, '\\');
+		g_string_append_c (str, search[i]);
+	}
+	g_string_append_c (str, '%');
+	return g_string_free (str, FALSE);
+}
+
+/**
+ * ch_database_search_orders:
+ * @database: a valid #ChDatabase instance
+ * @search: the text to search for
+ * @limit: the maximum number of orders to return
+ * @flags: a #ChDatabaseSearchFlags, e.g. %CH_DATABASE_SEARCH_FLAG_ARCHIVE
+ * @error: A #GError or %NULL
+ *
+ * Finds orders where every word in @search matches the start of a word in
+ * the name, email, address, comment or tracking number. All orders are
+ * searched, not just the most recent ones, and archived orders are also
+ * searched if %CH_DATABASE_SEARCH_FLAG_ARCHIVE is set.
+ *
+ * Return value: a #ChDatabaseOrderList, newest first, or %NULL for error
+ **/
+ChDatabaseOrderList *
+ch_database_search_orders (ChDatabase *database,
+			   const gchar *search,
+			   guint limit,
+			   ChDatabaseSearchFlags flags,
+			   GError **error)
+{
+	ChDatabaseOrderList *orders = NULL;
+	ChDatabasePrivate *priv = database->priv;
+	ChDatabaseStmt stmt_fts = CH_DATABASE_STMT_SEARCH_ORDERS;
+	ChDatabaseStmt stmt_like = CH_DATABASE_STMT_SEARCH_ORDERS_LIKE;
+	gboolean fts;
+	gchar *query = NULL;
+	sqlite3_stmt *stmt;
+
+	g_rec_mutex_lock (&database->priv->mutex);
+
+	/* ensure db is loaded */
+	if (!ch_database_load (database, error))
+		goto out;
+
+	/* there might not be an archive */
+	fts = priv->fts;
+	if ((flags & CH_DATABASE_SEARCH_FLAG_ARCHIVE) > 0 &&
+	    priv->archive_attached) {
+		stmt_fts = CH_DATABASE_STMT_SEARCH_ARCHIVE;
+		stmt_like = CH_DATABASE_STMT_SEARCH_ARCHIVE_LIKE;
+		fts = priv->fts && priv->archive_fts;
+	}
+
+	/* use the index if it exists, and there is a word to search for */
+	query = ch_database_search_to_fts (search);
+	stmt = NULL;
+	if (fts && query[0] != '\0')
+		stmt = ch_database_get_stmt (database, stmt_fts, NULL);
+	if (stmt == NULL) {
+		g_free (query);
+		query = ch_database_search_to_like (search);
+		stmt = ch_database_get_stmt (database, stmt_like, error);
+		if (stmt == NULL)
+			goto out;
+	}
+	sqlite3_bind_text (stmt, 1, query, -1, SQLITE_TRANSIENT);
+	sqlite3_bind_int64 (stmt, 2, limit);
+	orders = ch_database_get_orders_for_stmt (database, stmt, FALSE, error);
+out:
+	g_rec_mutex_unlock (&database->priv->mutex);
+	g_free (query);
+	return orders;
+}
+
+/**
+ * ch_database_archive_orders:
+ * @database: a valid #ChDatabase instance
+ * @age: the number of days since the order was sent
+ * @archived: (out) (allow-none): the number of orders archived
+ * @error: A #GError or %NULL
+ *
+ * Moves orders that were sent or refunded more than @age days ago, and
+ * their devices, into the archive set with ch_database_set_archive_uri().
+ * This keeps the tables used by the order list small however many years
+ * of orders there are.
+ *
+ * Archived orders are only included in ch_database_search_orders() when
+ * asked for, and are always included in ch_database_export(). Refunded
+ * orders that were never sent are archived with the orders around them.
+ *
+ * Devices that are archived are no longer included in the inventory.
+ *
+ * Return value: %TRUE for success
+ **/
+gboolean
+ch_database_archive_orders (ChDatabase *database,
+			    guint age,
+			    guint *archived,
+			    GError **error)
+{
+	ChDatabasePrivate *priv = database->priv;
+	gboolean in_transaction = FALSE;
+	gboolean ret;
+	gint64 cutoff;
+	gint64 newest = 0;
+	guint i;
+	sqlite3_stmt *stmt = NULL;
+	const ChDatabaseStmt stmts[] = {
+		CH_DATABASE_STMT_ARCHIVE_COPY_ORDERS,
+		CH_DATABASE_STMT_ARCHIVE_COPY_DEVICES,
+		CH_DATABASE_STMT_ARCHIVE_DELETE_DEVICES,
+		CH_DATABASE_STMT_ARCHIVE_DELETE_ORDERS };
+
+	/* the lock is held until the copy is committed */
+	ret = ch_database_begin (database, error);
+	if (!ret)
+		goto out;
+	in_transaction = TRUE;
+	if (!priv->archive_attached) {
+		ret = FALSE;
+		g_set_error_literal (error, 1, 0, "no archive database set");
+		goto out;
+	}
+
+	/* each station archives its own copy when it wants to */
+#ifdef HAVE_SQLITE_SESSION
+	if (priv->session != NULL)
+		sqlite3session_enable (priv->session, 0);
+#endif
+
+	/* orders have no date until they are sent */
+	cutoff = g_get_real_time () - (gint64) age * 24 * 60 * 60 * G_USEC_PER_SEC;
+	stmt = ch_database_get_stmt (database, CH_DATABASE_STMT_ARCHIVE_GET_CUTOFF, error);
+	if (stmt == NULL) {
+		ret = FALSE;
+		goto out;
+	}
+	sqlite3_bind_int64 (stmt, 1, cutoff);
+	if (ch_database_step (database, stmt) != SQLITE_ROW) {
+		ret = FALSE;
+		g_set_error (error, 1, 0,
+			     "failed to find orders to archive: %s",
+			     sqlite3_errmsg (priv->db));
+		goto out;
+	}
+	newest = sqlite3_column_int64 (stmt, 0);
+	sqlite3_reset (stmt);
+	stmt = NULL;
+
+	/* SQLite cannot commit two files atomically in WAL mode, so the copy
+	 * is committed to the archive first, and then only the rows that
+	 * are now in the archive are deleted from the main database */
+	for (i = 0; newest > 0 && i < G_N_ELEMENTS (stmts); i++) {
+		if (stmts[i] == CH_DATABASE_STMT_ARCHIVE_DELETE_DEVICES) {
+			in_transaction = FALSE;
+			ret = ch_database_commit (database, error);
+			if (!ret)
+				goto out;
+			ret = ch_database_begin (database, error);
+			if (!ret)
+				goto out;
+			in_transaction = TRUE;
+		}
+		stmt = ch_database_get_stmt (database, stmts[i], error);
+		if (stmt == NULL) {
+			ret = FALSE;
+			goto out;
+		}
+		sqlite3_bind_int (stmt, 1, CH_ORDER_STATE_SENT);
+		sqlite3_bind_int (stmt, 2, CH_ORDER_STATE_REFUNDED);
+		sqlite3_bind_int64 (stmt, 3, cutoff);
+		sqlite3_bind_int64 (stmt, 4, newest);
+		if (ch_database_step (database, stmt) != SQLITE_DONE) {
+			ret = FALSE;
+			g_set_error (error, 1, 0,
+				     "failed to archive orders: %s",
+				     sqlite3_errmsg (priv->db));
+			goto out;
+		}
+		sqlite3_reset (stmt);
+		stmt = NULL;
+	}
+	if (archived != NULL)
+		*archived = newest > 0 ? sqlite3_changes (priv->db) : 0;
+#ifdef HAVE_SQLITE_SESSION
+	if (priv->session != NULL)
+		sqlite3session_enable (priv->session, 1);
+#endif
+	in_transaction = FALSE;
+	ret = ch_database_commit (database, error);
+	if (!ret)
+		goto out;
+	g_debug ("archived orders up to %" G_GINT64_FORMAT, newest);
+out:
+	if (stmt != NULL)
+		sqlite3_reset (stmt);
+	if (in_transaction)
+		ch_database_rollback (database, NULL);
+#ifdef HAVE_SQLITE_SESSION
+	if (!ret && priv->session != NULL)
+		sqlite3session_enable (priv->session, 1);
+#endif
+	return ret;
+}
+
+/* gets the number of durations and the median */
+static gboolean
+ch_database_get_median (ChDatabase *database,
+			sqlite3_stmt *stmt,
+			guint *count,
+			gint64 *median,
+			GError **error)
+{
+	gint rc;
+
+	rc = ch_database_step (database, stmt);
+	if (rc != SQLITE_ROW) {
+		g_set_error (error, 1, 0,
+			     "failed to get durations: %s",
+			     sqlite3_errmsg (database->priv->db));
+		sqlite3_reset (stmt);
+		return FALSE;
+	}
+	*count = sqlite3_column_int (stmt, 0);
+	*median = sqlite3_column_int64 (stmt, 1);
+	sqlite3_reset (stmt);
+	return TRUE;
+}
+
+/**
+ * ch_database_get_throughput:
+ * @database: a valid #ChDatabase instance
+ * @since: only count orders sent after this time, in us since the epoch
+ * @throughput: (out): a #ChDatabaseThroughput to fill in
+ * @error: A #GError or %NULL
+ *
+ * Works out how long orders and devices take to get through the line from
+ * the recorded state changes, so it is possible to see what is slowing
+ * things down. Only changes made since the events were first recorded are
+ * counted, and devices of archived orders are not included.
+ *
+ * Return value: %TRUE for success
+ **/
+gboolean
+ch_database_get_throughput (ChDatabase *database,
+			    gint64 since,
+			    ChDatabaseThroughput *throughput,
+			    GError **error)
+{
+	gboolean ret;
+	sqlite3_stmt *stmt;
+
+	g_return_val_if_fail (throughput != NULL, FALSE);
+
+	g_rec_mutex_lock (&database->priv->mutex);
+	memset (throughput, 0, sizeof (ChDatabaseThroughput));
+
+	/* ensure db is loaded */
+	ret = ch_database_load (database, error);
+	if (!ret)
+		goto out;
+
+	/* from being added to being sent */
+	stmt = ch_database_get_stmt (database, CH_DATABASE_STMT_GET_ORDER_LEAD_TIME, error);
+	if (stmt == NULL) {
+		ret = FALSE;
+		goto out;
+	}
+	sqlite3_bind_int (stmt, 1, CH_DATABASE_EVENT_KIND_ORDER);
+	sqlite3_bind_int (stmt, 2, CH_ORDER_STATE_SENT);
+	sqlite3_bind_int (stmt, 3, CH_ORDER_STATE_NEW);
+	sqlite3_bind_int64 (stmt, 4, since);
+	ret = ch_database_get_median (database, stmt,
+				      &throughput->orders,
+				      &throughput->order_lead_time,
+				      error);
+	if (!ret)
+		goto out;
+
+	/* from being calibrated to being sent */
+	stmt = ch_database_get_stmt (database, CH_DATABASE_STMT_GET_SHIPPING_TIME, error);
+	if (stmt == NULL) {
+		ret = FALSE;
+		goto out;
+	}
+	sqlite3_bind_int (stmt, 1, CH_DATABASE_EVENT_KIND_ORDER);
+	sqlite3_bind_int (stmt, 2, CH_ORDER_STATE_SENT);
+	sqlite3_bind_int (stmt, 3, CH_DATABASE_EVENT_KIND_DEVICE);
+	sqlite3_bind_int (stmt, 4, CH_DEVICE_STATE_CALIBRATED);
+	sqlite3_bind_int64 (stmt, 5, since);
+	ret = ch_database_get_median (database, stmt,
+				      &throughput->devices,
+				      &throughput->shipping_time,
+				      error);
+	if (!ret)
+		goto out;
+out:
+	g_rec_mutex_unlock (&database->priv->mutex);
+	return ret;
+}
+
+/**
+ * ch_database_check_plans:
+ * @database: a valid #ChDatabase instance
+ * @error: A #GError or %NULL
+ *
+ * Asks SQLite how it would run every statement the database uses, and fails
+ * if any of them would read a whole table rather than use an index. The
+ * statements that need the archive are skipped if it is not attached, as
+ * are the searches that need a full text index that does not exist.
+ *
+ * Return value: %TRUE if no statement has an unexpected full scan
+ **/
+gboolean
+ch_database_check_plans (ChDatabase *database, GError **error)
+{
+	ChDatabasePrivate *priv = database->priv;
+	GPtrArray *scans;
+	GString *str;
+	const gchar *scan;
+	gboolean ret;
+	guint i;
+	guint j;
+	guint k;
+
+	g_rec_mutex_lock (&priv->mutex);
+	str = g_string_new ("");
+	scans = g_ptr_array_new_with_free_func (g_free);
+
+	/* ensure db is loaded */
+	ret = ch_database_load (database, error);
+	if (!ret)
+		goto out;
+
+	for (i = 0; i < CH_DATABASE_STMT_LAST; i++) {
+		if (ch_database_stmt_sql[i] == NULL)
+			continue;
+		if (!priv->archive_attached &&
+		    g_strstr_len (ch_database_stmt_sql[i], -1, "archive.") != NULL)
+			continue;
+		if (!priv->fts &&
+		    g_strstr_len (ch_database_stmt_sql[i], -1, "orders_fts") != NULL)
+			continue;
+		if (!priv->archive_fts &&
+		    g_strstr_len (ch_database_stmt_sql[i], -1, "archive.orders_fts") != NULL)
+			continue;
+		g_ptr_array_set_size (scans, 0);
+		ret = ch_database_get_full_scans (database,
+						  ch_database_stmt_sql[i],
+						  scans, error);
+		if (!ret)
+			goto out;
+		for (j = 0; j < scans->len; j++) {
+			scan = g_ptr_array_index (scans, j);
+			for (k = 0; ch_database_stmt_scans[k].scan != NULL; k++) {
+				if (ch_database_stmt_scans[k].id == i &&
+				    g_strcmp0 (ch_database_stmt_scans[k].scan, scan) == 0)
+					break;
+			}
+			if (ch_database_stmt_scans[k].scan != NULL)
+				continue;
+			g_string_append_printf (str, "\n%s in '%s'",
+						scan, ch_database_stmt_sql[i]);
+		}
+	}
+	if (str->len > 0) {
+		ret = FALSE;
+		g_set_error (error, 1, 0, "unexpected full scans:%s", str->str);
+		goto out;
+	}
+out:
+	g_ptr_array_unref (scans);
+	g_string_free (str, TRUE);
+	g_rec_mutex_unlock (&priv->mutex);
+	return ret;
+}
+
+/**
+ * ch_database_format_from_filename:
+ * @filename: a filename, e.g. "preorders.csv"
+ *
+ * Guesses the format of a file from the extension.
+ *
+ * Return value: a #ChDatabaseFormat
+ **/
+ChDatabaseFormat
+ch_database_format_from_filename (const gchar *filename)
+{
+	if (g_str_has_suffix (filename, ".csv"))
+		return CH_DATABASE_FORMAT_CSV;
+	if (g_str_has_suffix (filename, ".ndjson") ||
+	    g_str_has_suffix (filename, ".jsonl") ||
+	    g_str_has_suffix (filename, ".json"))
+		return CH_DATABASE_FORMAT_NDJSON;
+	return CH_DATABASE_FORMAT_UNKNOWN;
+}
+
+/**
+ * ch_database_report_from_string:
+ * @report: a report name, e.g. "sales"
+ *
+ * Return value: a #ChDatabaseReport, or %CH_DATABASE_REPORT_LAST if unknown
+ **/
+ChDatabaseReport
+ch_database_report_from_string (const gchar *report)
+{
+	if (g_strcmp0 (report, "sales") == 0)
+		return CH_DATABASE_REPORT_SALES;
+	if (g_strcmp0 (report, "calibrations") == 0)
+		return CH_DATABASE_REPORT_CALIBRATIONS;
+	if (g_strcmp0 (report, "orders") == 0)
+		return CH_DATABASE_REPORT_ORDERS;
+	if (g_strcmp0 (report, "calibration-rate") == 0)
+		return CH_DATABASE_REPORT_CALIBRATION_RATE;
+	return CH_DATABASE_REPORT_LAST;
+}
+
+/* appends one value of the current row in the export format */
+static void
+ch_database_export_value (GString *str,
+			  ChDatabaseFormat format,
+			  sqlite3_stmt *stmt,
+			  gint idx)
+{
+	gchar buf[G_ASCII_DTOSTR_BUF_SIZE];
+	const gchar *text;
+
+	switch (sqlite3_column_type (stmt, idx)) {
+	case SQLITE_NULL:
+		if (format == CH_DATABASE_FORMAT_NDJSON)
+			g_string_append (str, "null");
+		break;
+	case SQLITE_INTEGER:
+		g_string_append_printf (str, "%" G_GINT64_FORMAT,
+					(gint64) sqlite3_column_int64 (stmt, idx));
+		break;
+	case SQLITE_FLOAT:
+		/* always a '.' whatever the locale */
+		g_string_append (str, g_ascii_formatd (buf, sizeof (buf), "%.2f",
+						       sqlite3_column_double (stmt, idx)));
+		break;
+	default:
+		text = (const gchar *) sqlite3_column_text (stmt, idx);
+		if (text == NULL)
+			text = "";
+		if (format == CH_DATABASE_FORMAT_NDJSON)
+			ch_shipping_string_append_json (str, text);
+		else
+			ch_shipping_string_append_csv (str, text);
+		break;
+	}
+}
+
+/* formats the current row, or the column names if @header is set */
+static void
+ch_database_export_row (GString *str,
+			ChDatabaseFormat format,
+			sqlite3_stmt *stmt,
+			gboolean header)
+{
+	gint i;
+	gint n_columns = sqlite3_column_count (stmt);
+
+	g_string_truncate (str, 0);
+	if (format == CH_DATABASE_FORMAT_NDJSON)
+		g_string_append_c (str, '{');
+	for (i = 0; i < n_columns; i++) {
+		if (i > 0)
+			g_string_append_c (str, ',');
+		if (format == CH_DATABASE_FORMAT_NDJSON) {
+			ch_shipping_string_append_json (str, sqlite3_column_name (stmt, i));
+			g_string_append_c (str, ':');
+			ch_database_export_value (str, format, stmt, i);
+		} else if (header) {
+			ch_shipping_string_append_csv (str, sqlite3_column_name (stmt, i));
+		} else {
+			ch_database_export_value (str, format, stmt, i);
+		}
+	}
+	if (format == CH_DATABASE_FORMAT_NDJSON)
+		g_string_append_c (str, '}');
+	g_string_append_c (str, '\n');
+}
+
+/**
+ * ch_database_export:
+ * @database: a valid #ChDatabase instance
+ * @report: a #ChDatabaseReport, e.g. %CH_DATABASE_REPORT_SALES
+ * @format: a #ChDatabaseFormat
+ * @stream: a #GOutputStream to write to
+ * @cancellable: a #GCancellable or %NULL
+ * @error: A #GError or %NULL
+ *
+ * Writes a report over the entire history as CSV, with a header line, or
+ * as one JSON object per line.
+ *
+ * %CH_DATABASE_REPORT_SALES has the number of orders and the revenue for
+ * each month and postage kind, using the price of the postage and of each
+ * device, and only counts orders that have been sent and not refunded.
+ * %CH_DATABASE_REPORT_CALIBRATIONS has the number of devices calibrated
+ * each week for each hardware version, and %CH_DATABASE_REPORT_ORDERS has
+ * every order. %CH_DATABASE_REPORT_CALIBRATION_RATE has the number of
+ * devices calibrated each hour by each station.
+ *
+ * The aggregation is done by SQLite and each row is written as soon as it
+ * is read, so this uses the same amount of memory however many orders
+ * there are.
+ *
+ * Return value: %TRUE for success
+ **/
+gboolean
+ch_database_export (ChDatabase *database,
+		    ChDatabaseReport report,
+		    ChDatabaseFormat format,
+		    GOutputStream *stream,
+		    GCancellable *cancellable,
+		    GError **error)
+{
+	ChDatabasePrivate *priv = database->priv;
+	GString *str;
+	gboolean ret;
+	gint rc;
+	sqlite3_stmt *stmt = NULL;
+	const ChDatabaseStmt stmts[] = {
+		[CH_DATABASE_REPORT_SALES] = CH_DATABASE_STMT_REPORT_SALES,
+		[CH_DATABASE_REPORT_CALIBRATIONS] = CH_DATABASE_STMT_REPORT_CALIBRATIONS,
+		[CH_DATABASE_REPORT_ORDERS] = CH_DATABASE_STMT_REPORT_ORDERS,
+		[CH_DATABASE_REPORT_CALIBRATION_RATE] = CH_DATABASE_STMT_REPORT_CALIBRATION_RATE };
+
+	g_return_val_if_fail (report < CH_DATABASE_REPORT_LAST, FALSE);
+	g_return_val_if_fail (format != CH_DATABASE_FORMAT_UNKNOWN, FALSE);
+
+	str = g_string_new ("");
+	g_rec_mutex_lock (&database->priv->mutex);
+
+	/* ensure db is loaded */
+	ret = ch_database_load (database, error);
+	if (!ret)
+		goto out;
+
+	/* get the report */
+	stmt = ch_database_get_stmt (database, stmts[report], error);
+	if (stmt == NULL) {
+		ret = FALSE;
+		goto out;
+	}
+	if (report == CH_DATABASE_REPORT_SALES)
+		sqlite3_bind_int (stmt, 1, CH_ORDER_STATE_REFUNDED);
+	if (report == CH_DATABASE_REPORT_CALIBRATION_RATE) {
+		sqlite3_bind_int (stmt, 1, CH_DATABASE_EVENT_KIND_DEVICE);
+		sqlite3_bind_int (stmt, 2, CH_DEVICE_STATE_CALIBRATED);
+	}
+
+	/* the column names come from the statement */
+	if (format == CH_DATABASE_FORMAT_CSV) {
+		ch_database_export_row (str, format, stmt, TRUE);
+		ret = g_output_stream_write_all (stream, str->str, str->len,
+						 NULL, cancellable, error);
+		if (!ret)
+			goto out;
+	}
+
+	/* write each row as it is read */
+	while ((rc = ch_database_step (database, stmt)) == SQLITE_ROW) {
+		ch_database_export_row (str, format, stmt, FALSE);
+		ret = g_output_stream_write_all (stream, str->str, str->len,
+						 NULL, cancellable, error);
+		if (!ret)
+			goto out;
+	}
+	if (rc != SQLITE_DONE) {
+		ret = FALSE;
+		g_set_error (error, 1, 0,
+			     "failed to export report: %s",
+			     sqlite3_errmsg (priv->db));
+		goto out;
+	}
+out:
+	if (stmt != NULL)
+		sqlite3_reset (stmt);
+	g_rec_mutex_unlock (&database->priv->mutex);
+	g_string_free (str, TRUE);
+	return ret;
+}
+
+/**
+ * ch_database_calibration_free:
+ * @calibration: a #ChDatabaseCalibration
+ *
+ * Frees a calibration returned by ch_database_get_calibration().
+ **/
+void
+ch_database_calibration_free (ChDatabaseCalibration *calibration)
+{
+	if (calibration->ti3 != NULL)
+		g_bytes_unref (calibration->ti3);
+	if (calibration->ccmx != NULL)
+		g_bytes_unref (calibration->ccmx);
+	g_free (calibration);
+}
+
+/* compresses or decompresses @data in one go */
+static GBytes *
+ch_database_convert (GConverter *converter, GBytes *data, GError **error)
+{
+	GBytes *bytes = NULL;
+	GOutputStream *stream_converter;
+	GOutputStream *stream_memory;
+	gsize len;
+	const guint8 *buf;
+
+	stream_memory = g_memory_output_stream_new_resizable ();
+	stream_converter = g_converter_output_stream_new (stream_memory, converter);
+	buf = g_bytes_get_data (data, &len);
+	if (!g_output_stream_write_all (stream_converter, buf, len,
+					NULL, NULL, error))
+		goto out;
+	if (!g_output_stream_close (stream_converter, NULL, error))
+		goto out;
+	bytes = g_memory_output_stream_steal_as_bytes (G_MEMORY_OUTPUT_STREAM (stream_memory));
+out:
+	g_object_unref (stream_converter);
+	g_object_unref (stream_memory);
+	return bytes;
+}
+
+static GBytes *
+ch_database_compress (GBytes *data, GError **error)
+{
+	GBytes *bytes;
+	GZlibCompressor *compressor;
+
+	compressor = g_zlib_compressor_new (G_ZLIB_COMPRESSOR_FORMAT_ZLIB, -1);
+	bytes = ch_database_convert (G_CONVERTER (compressor), data, error);
+	g_object_unref (compressor);
+	return bytes;
+}
+
+static GBytes *
+ch_database_decompress (GBytes *data, GError **error)
+{
+	GBytes *bytes;
+	GZlibDecompressor *decompressor;
+
+	decompressor = g_zlib_decompressor_new (G_ZLIB_COMPRESSOR_FORMAT_ZLIB);
+	bytes = ch_database_convert (G_CONVERTER (decompressor), data, error);
+	g_object_unref (decompressor);
+	return bytes;
+}
+
+static void
+ch_database_bind_bytes (sqlite3_stmt *stmt, gint idx, GBytes *bytes)
+{
+	gsize len;
+	const guint8 *data;
+
+	if (bytes == NULL) {
+		sqlite3_bind_null (stmt, idx);
+		return;
+	}
+	data = g_bytes_get_data (bytes, &len);
+	sqlite3_bind_blob (stmt, idx, data, len, SQLITE_STATIC);
+}
+
+static GBytes *
+ch_database_column_bytes (sqlite3_stmt *stmt, gint idx)
+{
+	if (sqlite3_column_type (stmt, idx) == SQLITE_NULL)
+		return NULL;
+	return g_bytes_new (sqlite3_column_blob (stmt, idx),
+			    sqlite3_column_bytes (stmt, idx));
+}
+
+/* the blobs are left compressed */
+static ChDatabaseCalibration *
+ch_database_calibration_from_stmt (sqlite3_stmt *stmt)
+{
+	ChDatabaseCalibration *calibration;
+
+	calibration = g_new0 (ChDatabaseCalibration, 1);
+	calibration->device_id = sqlite3_column_int (stmt, 0);
+	calibration->hw_ver = sqlite3_column_int (stmt, 1);
+	calibration->created = sqlite3_column_int64 (stmt, 2);
+	calibration->determinant = sqlite3_column_double (stmt, 3);
+	calibration->ti3 = ch_database_column_bytes (stmt, 4);
+	calibration->ccmx = ch_database_column_bytes (stmt, 5);
+	return calibration;
+}
+
+/**
+ * ch_database_add_calibration:
+ * @database: a valid #ChDatabase instance
+ * @calibration: a #ChDatabaseCalibration
+ * @error: A #GError or %NULL
+ *
+ * Saves the measurements and correction matrix for a device, replacing
+ * any from an earlier calibration. The ti3 and ccmx files are compressed
+ * before the database is locked. If @calibration->created is 0 then the
+ * current time is used.
+ *
+ * Return value: %TRUE for success
+ **/
+gboolean
+ch_database_add_calibration (ChDatabase *database,
+			     const ChDatabaseCalibration *calibration,
+			     GError **error)
+{
+	GBytes *ccmx = NULL;
+	GBytes *ti3 = NULL;
+	gboolean ret = TRUE;
+	gint rc;
+	sqlite3_stmt *stmt = NULL;
+
+	g_return_val_if_fail (calibration != NULL, FALSE);
+
+	/* ti3 files are mostly numbers and spaces, so shrink a lot */
+	if (calibration->ti3 != NULL) {
+		ti3 = ch_database_compress (calibration->ti3, error);
+		if (ti3 == NULL)
+			return FALSE;
+	}
+	if (calibration->ccmx != NULL) {
+		ccmx = ch_database_compress (calibration->ccmx, error);
+		if (ccmx == NULL) {
+			if (ti3 != NULL)
+				g_bytes_unref (ti3);
+			return FALSE;
+		}
+	}
+
+	g_rec_mutex_lock (&database->priv->mutex);
+
+	/* ensure db is loaded */
+	ret = ch_database_load (database, error);
+	if (!ret)
+		goto out;
+
+	stmt = ch_database_get_stmt (database, CH_DATABASE_STMT_ADD_CALIBRATION, error);
+	if (stmt == NULL) {
+		ret = FALSE;
+		goto out;
+	}
+	sqlite3_bind_int (stmt, 1, calibration->device_id);
+	sqlite3_bind_int (stmt, 2, calibration->hw_ver);
+	if (calibration->created != 0)
+		sqlite3_bind_int64 (stmt, 3, calibration->created);
+	else
+		sqlite3_bind_int64 (stmt, 3, g_get_real_time ());
+	sqlite3_bind_double (stmt, 4, calibration->determinant);
+	ch_database_bind_bytes (stmt, 5, ti3);
+	ch_database_bind_bytes (stmt, 6, ccmx);
+	rc = ch_database_step (database, stmt);
+	if (rc != SQLITE_DONE) {
+		ret = FALSE;
+		g_set_error (error, 1, 0,
+			     "failed to add calibration for %i: %s",
+			     calibration->device_id,
+			     sqlite3_errmsg (database->priv->db));
+		goto out;
+	}
+out:
+	if (stmt != NULL)
+		sqlite3_reset (stmt);
+	g_rec_mutex_unlock (&database->priv->mutex);
+	if (ti3 != NULL)
+		g_bytes_unref (ti3);
+	if (ccmx != NULL)
+		g_bytes_unref (ccmx);
+	return ret;
+}
+
+/**
+ * ch_database_get_calibration:
+ * @database: a valid #ChDatabase instance
+ * @device_id: the device serial number
+ * @error: A #GError or %NULL
+ *
+ * Gets the last calibration saved for a device.
+ *
+ * Return value: a #ChDatabaseCalibration, free with
+ * ch_database_calibration_free(), or %NULL for error
+ **/
+ChDatabaseCalibration *
+ch_database_get_calibration (ChDatabase *database,
+			     guint32 device_id,
+			     GError **error)
+{
+	ChDatabaseCalibration *calibration = NULL;
+	GBytes *tmp;
+	gboolean ret;
+	gint rc;
+	sqlite3_stmt *stmt = NULL;
+
+	g_rec_mutex_lock (&database->priv->mutex);
+
+	/* ensure db is loaded */
+	ret = ch_database_load (database, error);
+	if (!ret)
+		goto out;
+
+	stmt = ch_database_get_stmt (database, CH_DATABASE_STMT_GET_CALIBRATION, error);
+	if (stmt == NULL)
+		goto out;
+	sqlite3_bind_int (stmt, 1, device_id);
+	rc = ch_database_step (database, stmt);
+	if (rc == SQLITE_DONE) {
+		g_set_error (error, 1, 0,
+			     "no calibration for device %i", device_id);
+		goto out;
+	}
+	if (rc != SQLITE_ROW) {
+		g_set_error (error, 1, 0,
+			     "failed to get calibration for %i: %s",
+			     device_id, sqlite3_errmsg (database->priv->db));
+		goto out;
+	}
+	calibration = ch_database_calibration_from_stmt (stmt);
+out:
+	if (stmt != NULL)
+		sqlite3_reset (stmt);
+	g_rec_mutex_unlock (&database->priv->mutex);
+	if (calibration == NULL)
+		return NULL;
+
+	/* decompress without holding the lock */
+	if (calibration->ti3 != NULL) {
+		tmp = ch_database_decompress (calibration->ti3, error);
+		g_bytes_unref (calibration->ti3);
+		calibration->ti3 = tmp;
+		if (tmp == NULL) {
+			ch_database_calibration_free (calibration);
+			return NULL;
+		}
+	}
+	if (calibration->ccmx != NULL) {
+		tmp = ch_database_decompress (calibration->ccmx, error);
+		g_bytes_unref (calibration->ccmx);
+		calibration->ccmx = tmp;
+		if (tmp == NULL) {
+			ch_database_calibration_free (calibration);
+			return NULL;
+		}
+	}
+	return calibration;
+}
+
+/* decompresses straight into the file, so it is never all in memory */
+static gboolean
+ch_database_export_calibration_file (const gchar *directory,
+				     guint32 device_id,
+				     const gchar *extension,
+				     GBytes *data,
+				     GCancellable *cancellable,
+				     GError **error)
+{
+	GFile *file;
+	GFileOutputStream *stream_file = NULL;
+	GOutputStream *stream_converter = NULL;
+	GZlibDecompressor *decompressor;
+	gboolean ret = FALSE;
+	gchar *basename;
+	gchar *filename;
+	gsize len;
+	const guint8 *buf;
+
+	basename = g_strdup_printf ("calibration-%06i.%s", device_id, extension);
+	filename = g_build_filename (directory, basename, NULL);
+	file = g_file_new_for_path (filename);
+	decompressor = g_zlib_decompressor_new (G_ZLIB_COMPRESSOR_FORMAT_ZLIB);
+	stream_file = g_file_replace (file, NULL, FALSE, G_FILE_CREATE_NONE,
+				      cancellable, error);
+	if (stream_file == NULL)
+		goto out;
+	stream_converter = g_converter_output_stream_new (G_OUTPUT_STREAM (stream_file),
+							  G_CONVERTER (decompressor));
+	buf = g_bytes_get_data (data, &len);
+	if (!g_output_stream_write_all (stream_converter, buf, len,
+					NULL, cancellable, error))
+		goto out;
+	if (!g_output_stream_close (stream_converter, cancellable, error))
+		goto out;
+	ret = TRUE;
+out:
+	if (stream_converter != NULL)
+		g_object_unref (stream_converter);
+	if (stream_file != NULL)
+		g_object_unref (stream_file);
+	g_object_unref (decompressor);
+	g_object_unref (file);
+	g_free (filename);
+	g_free (basename);
+	return ret;
+}
+
+/**
+ * ch_database_export_calibrations:
+ * @database: a valid #ChDatabase instance
+ * @directory: an existing directory to write the files to
+ * @hw_ver: the hardware version, or 0 for all devices
+ * @exported: the number of calibrations written, or %NULL
+ * @cancellable: a #GCancellable or %NULL
+ * @error: A #GError or %NULL
+ *
+ * Writes calibration-NNNNNN.ti3 and calibration-NNNNNN.ccmx for each
+ * calibrated device, in serial number order. The calibrations are read a
+ * batch at a time, and the database is not locked while writing the files.
+ *
+ * Return value: %TRUE for success
+ **/
+gboolean
+ch_database_export_calibrations (ChDatabase *database,
+				 const gchar *directory,
+				 guint hw_ver,
+				 guint *exported,
+				 GCancellable *cancellable,
+				 GError **error)
+{
+	ChDatabaseCalibration *calibration;
+	GPtrArray *array = NULL;
+	gboolean ret = TRUE;
+	gint rc;
+	guint32 last = 0;
+	guint i;
+	guint total = 0;
+	sqlite3_stmt *stmt;
+
+	g_return_val_if_fail (directory != NULL, FALSE);
+
+	do {
+		if (array != NULL)
+			g_ptr_array_unref (array);
+		array = g_ptr_array_new_with_free_func ((GDestroyNotify) ch_database_calibration_free);
+
+		/* get the next batch */
+		g_rec_mutex_lock (&database->priv->mutex);
+		ret = ch_database_load (database, error);
+		if (!ret) {
+			g_rec_mutex_unlock (&database->priv->mutex);
+			goto out;
+		}
+		stmt = ch_database_get_stmt (database, CH_DATABASE_STMT_GET_CALIBRATIONS, error);
+		if (stmt == NULL) {
+			ret = FALSE;
+			g_rec_mutex_unlock (&database->priv->mutex);
+			goto out;
+		}
+		sqlite3_bind_int (stmt, 1, last);
+		sqlite3_bind_int (stmt, 2, hw_ver);
+		sqlite3_bind_int (stmt, 3, CH_DATABASE_CALIBRATION_BATCH);
+		while ((rc = ch_database_step (database, stmt)) == SQLITE_ROW)
+			g_ptr_array_add (array, ch_database_calibration_from_stmt (stmt));
+		if (rc != SQLITE_DONE) {
+			ret = FALSE;
+			g_set_error (error, 1, 0,
+				     "failed to get calibrations: %s",
+				     sqlite3_errmsg (database->priv->db));
+		}
+		sqlite3_reset (stmt);
+		g_rec_mutex_unlock (&database->priv->mutex);
+		if (!ret)
+			goto out;
+
+		/* write them out */
+		for (i = 0; i < array->len; i++) {
+			calibration = g_ptr_array_index (array, i);
+			if (calibration->ti3 != NULL) {
+				ret = ch_database_export_calibration_file (directory,
+									   calibration->device_id,
+									   "ti3",
+									   calibration->ti3,
+									   cancellable,
+									   error);
+				if (!ret)
+					goto out;
+			}
+			if (calibration->ccmx != NULL) {
+				ret = ch_database_export_calibration_file (directory,
+									   calibration->device_id,
+									   "ccmx",
+									   calibration->ccmx,
+									   cancellable,
+									   error);
+				if (!ret)
+					goto out;
+			}
+			last = calibration->device_id;
+			total++;
+		}
+	} while (array->len == CH_DATABASE_CALIBRATION_BATCH);
+out:
+	if (array != NULL)
+		g_ptr_array_unref (array);
+	if (exported != NULL)
+		*exported = total;
+	return ret;
+}
+
+typedef struct {
+	GTaskThreadFunc		 func;
+	guint32			 id;
+	guint32			 before;
+	guint			 limit;
+	guint			 state;
+	guint64			 since;
+	guint64			 generation;
+	gchar			*search;
+	guint			 flags;
+	ChDatabaseCalibration	*calibration;
+} ChDatabaseTaskHelper;
+
+static void
+ch_database_task_helper_free (ChDatabaseTaskHelper *helper)
+{
+	if (helper->calibration != NULL)
+		ch_database_calibration_free (helper->calibration);
+	g_free (helper->search);
+	g_free (helper);
+}
+
+static gboolean
+ch_database_task_unref_cb (gpointer user_data)
+{
+	g_object_unref (G_TASK (user_data));
+	return G_SOURCE_REMOVE;
+}
+
+/* runs each task in turn on the database thread */
+static void
+ch_database_pool_cb (gpointer data, gpointer user_data)
+{
+	ChDatabase *database = CH_DATABASE (user_data);
+	ChDatabaseTaskHelper *helper;
+	GSource *source;
+	GTask *task = G_TASK (data);
+
+	if (g_task_return_error_if_cancelled (task))
+		goto out;
+	helper = g_task_get_task_data (task);
+	g_rec_mutex_lock (&database->priv->mutex);
+	helper->func (task, database, helper, g_task_get_cancellable (task));
+	g_rec_mutex_unlock (&database->priv->mutex);
+out:
+	/* the task holds a reference to the database, and finalizing it on
+	 * this thread would wait for the pool to finish, i.e. forever */
+	source = g_idle_source_new ();
+	g_source_set_callback (source, ch_database_task_unref_cb, task, NULL);
+	g_source_attach (source, g_task_get_context (task));
+	g_source_unref (source);
+}
+
+static ChDatabaseTaskHelper *
+ch_database_task_new (ChDatabase *database,
+		      GTaskThreadFunc func,
+		      gpointer source_tag,
+		      GCancellable *cancellable,
+		      GAsyncReadyCallback callback,
+		      gpointer user_data,
+		      GTask **task)
+{
+	ChDatabaseTaskHelper *helper;
+
+	*task = g_task_new (database, cancellable, callback, user_data);
+	g_task_set_source_tag (*task, source_tag);
+	helper = g_new0 (ChDatabaseTaskHelper, 1);
+	helper->func = func;
+	g_task_set_task_data (*task, helper,
+			      (GDestroyNotify) ch_database_task_helper_free);
+	return helper;
+}
+
+static void
+ch_database_task_push (ChDatabase *database, GTask *task)
+{
+	ChDatabasePrivate *priv = database->priv;
+	GError *error = NULL;
+
+	/* one thread, so queries are never run in parallel */
+	if (priv->pool == NULL) {
+		priv->pool = g_thread_pool_new (ch_database_pool_cb,
+						database, 1, TRUE, &error);
+		if (priv->pool == NULL) {
+			g_task_return_error (task, error);
+			g_object_unref (task);
+			return;
+		}
+	}
+	if (!g_thread_pool_push (priv->pool, task, &error)) {
+		g_task_return_error (task, error);
+		g_object_unref (task);
+	}
+}
+
+static void
+ch_database_get_orders_thread_cb (GTask *task,
+				  gpointer source_object,
+				  gpointer task_data,
+				  GCancellable *cancellable)
+{
+	ChDatabase *database = CH_DATABASE (source_object);
+	ChDatabaseTaskHelper *helper = (ChDatabaseTaskHelper *) task_data;
+	GError *error = NULL;
+	ChDatabaseOrderList *orders;
+
+	/* get this first so nothing can be missed */
+	if (!ch_database_get_orders_generation (database, &helper->generation, &error)) {
+		g_task_return_error (task, error);
+		return;
+	}
+	orders = ch_database_get_orders (database,
+					 helper->before,
+					 helper->limit,
+					 &error);
+	if (orders == NULL) {
+		g_task_return_error (task, error);
+		return;
+	}
+	g_task_return_pointer (task, orders, (GDestroyNotify) ch_database_order_list_free);
+}
+
+/**
+ * ch_database_get_orders_async:
+ * @database: a valid #ChDatabase instance
+ * @before: only return orders older than this order ID, or %G_MAXUINT32
+ * @limit: the maximum number of orders to return
+ * @cancellable: a #GCancellable or %NULL
+ * @callback: the function to run on completion
+ * @user_data: the data to pass to @callback
+ *
+ * Gets a page of orders on the database thread.
+ * See ch_database_get_orders() for details.
+ **/
+void
+ch_database_get_orders_async (ChDatabase *database,
+			      guint32 before,
+			      guint limit,
+			      GCancellable *cancellable,
+			      GAsyncReadyCallback callback,
+			      gpointer user_data)
+{
+	ChDatabaseTaskHelper *helper;
+	GTask *task;
+
+	g_return_if_fail (CH_IS_DATABASE (database));
+
+	helper = ch_database_task_new (database,
+				       ch_database_get_orders_thread_cb,
+				       ch_database_get_orders_async,
+				       cancellable, callback, user_data,
+				       &task);
+	helper->before = before;
+	helper->limit = limit;
+	ch_database_task_push (database, task);
+}
+
+/**
+ * ch_database_get_orders_finish:
+ * @database: a valid #ChDatabase instance
+ * @res: the #GAsyncResult
+ * @generation: (out) (allow-none): the orders generation before the query
+ * @error: A #GError or %NULL
+ *
+ * Gets the result from ch_database_get_orders_async(). The generation
+ * can be passed to ch_database_get_orders_changed_async() to get only
+ * the orders that changed after this page was read.
+ *
+ * Return value: a #ChDatabaseOrderList, or %NULL for error
+ **/
+ChDatabaseOrderList *
+ch_database_get_orders_finish (ChDatabase *database,
+			       GAsyncResult *res,
+			       guint64 *generation,
+			       GError **error)
+{
+	ChDatabaseTaskHelper *helper;
+
+	g_return_val_if_fail (g_task_is_valid (res, database), NULL);
+
+	helper = g_task_get_task_data (G_TASK (res));
+	if (generation != NULL)
+		*generation = helper->generation;
+	return g_task_propagate_pointer (G_TASK (res), error);
+}
+
+static void
+ch_database_search_orders_thread_cb (GTask *task,
+				     gpointer source_object,
+				     gpointer task_data,
+				     GCancellable *cancellable)
+{
+	ChDatabase *database = CH_DATABASE (source_object);
+	ChDatabaseTaskHelper *helper = (ChDatabaseTaskHelper *) task_data;
+	GError *error = NULL;
+	ChDatabaseOrderList *orders;
+
+	orders = ch_database_search_orders (database,
+					    helper->search,
+					    helper->limit,
+					    helper->flags,
+					    &error);
+	if (orders == NULL) {
+		g_task_return_error (task, error);
+		return;
+	}
+	g_task_return_pointer (task, orders, (GDestroyNotify) ch_database_order_list_free);
+}
+
+/**
+ * ch_database_search_orders_async:
+ * @database: a valid #ChDatabase instance
+ * @search: the text to search for
+ * @limit: the maximum number of orders to return
+ * @flags: a #ChDatabaseSearchFlags
+ * @cancellable: a #GCancellable or %NULL
+ * @callback: the function to run on completion
+ * @user_data: the data to pass to @callback
+ *
+ * Searches the orders on the database thread.
+ * See ch_database_search_orders() for details.
+ **/
+void
+ch_database_search_orders_async (ChDatabase *database,
+				 const gchar *search,
+				 guint limit,
+				 ChDatabaseSearchFlags flags,
+				 GCancellable *cancellable,
+				 GAsyncReadyCallback callback,
+				 gpointer user_data)
+{
+	ChDatabaseTaskHelper *helper;
+	GTask *task;
+
+	g_return_if_fail (CH_IS_DATABASE (database));
+
+	helper = ch_database_task_new (database,
+				       ch_database_search_orders_thread_cb,
+				       ch_database_search_orders_async,
+				       cancellable, callback, user_data,
+				       &task);
+	helper->search = g_strdup (search);
+	helper->limit = limit;
+	helper->flags = flags;
+	ch_database_task_push (database, task);
+}
+
+/**
+ * ch_database_search_orders_finish:
+ * @database: a valid #ChDatabase instance
+ * @res: the #GAsyncResult
+ * @error: A #GError or %NULL
+ *
+ * Gets the result from ch_database_search_orders_async().
+ *
+ * Return value: a #ChDatabaseOrderList, or %NULL for error
+ **/
+ChDatabaseOrderList *
+ch_database_search_orders_finish (ChDatabase *database,
+				  GAsyncResult *res,
+				  GError **error)
+{
+	g_return_val_if_fail (g_task_is_valid (res, database), NULL);
+	return g_task_propagate_pointer (G_TASK (res), error);
+}
+
+static void
+ch_database_get_orders_changed_thread_cb (GTask *task,
+					  gpointer source_object,
+					  gpointer task_data,
+					  GCancellable *cancellable)
+{
+	ChDatabase *database = CH_DATABASE (source_object);
+	ChDatabaseTaskHelper *helper = (ChDatabaseTaskHelper *) task_data;
+	GError *error = NULL;
+	ChDatabaseOrderList *orders;
+
+	orders = ch_database_get_orders_changed (database,
+						 helper->since,
+						 &helper->generation,
+						 &error);
+	if (orders == NULL) {
+		g_task_return_error (task, error);
+		return;
+	}
+	g_task_return_pointer (task, orders, (GDestroyNotify) ch_database_order_list_free);
+}
+
+/**
+ * ch_database_get_orders_changed_async:
+ * @database: a valid #ChDatabase instance
+ * @since: a generation from a previous query
+ * @cancellable: a #GCancellable or %NULL
+ * @callback: the function to run on completion
+ * @user_data: the data to pass to @callback
+ *
+ * Gets the changed orders on the database thread.
+ * See ch_database_get_orders_changed() for details.
+ **/
+void
+ch_database_get_orders_changed_async (ChDatabase *database,
+				      guint64 since,
+				      GCancellable *cancellable,
+				      GAsyncReadyCallback callback,
+				      gpointer user_data)
+{
+	ChDatabaseTaskHelper *helper;
+	GTask *task;
+
+	g_return_if_fail (CH_IS_DATABASE (database));
+
+	helper = ch_database_task_new (database,
+				       ch_database_get_orders_changed_thread_cb,
+				       ch_database_get_orders_changed_async,
+				       cancellable, callback, user_data,
+				       &task);
+	helper->since = since;
+	ch_database_task_push (database, task);
+}
+
+/**
+ * ch_database_get_orders_changed_finish:
+ * @database: a valid #ChDatabase instance
+ * @res: the #GAsyncResult
+ * @generation: (out) (allow-none): the generation to use next time
+ * @error: A #GError or %NULL
+ *
+ * Gets the result from ch_database_get_orders_changed_async().
+ *
+ * Return value: a #ChDatabaseOrderList, or %NULL for error
+ **/
+ChDatabaseOrderList *
+ch_database_get_orders_changed_finish (ChDatabase *database,
+				       GAsyncResult *res,
+				       guint64 *generation,
+				       GError **error)
+{
+	ChDatabaseTaskHelper *helper;
+
+	g_return_val_if_fail (g_task_is_valid (res, database), NULL);
+
+	helper = g_task_get_task_data (G_TASK (res));
+	if (generation != NULL)
+		*generation = helper->generation;
+	return g_task_propagate_pointer (G_TASK (res), error);
+}
+
+static void
+ch_database_get_inventory_thread_cb (GTask *task,
+				     gpointer source_object,
+				     gpointer task_data,
+				     GCancellable *cancellable)
+{
+	ChDatabase *database = CH_DATABASE (source_object);
+	GArray *inventory;
+	GError *error = NULL;
+
+	inventory = ch_database_get_inventory (database, &error);
+	if (inventory == NULL) {
+		g_task_return_error (task, error);
+		return;
+	}
+	g_task_return_pointer (task, inventory, (GDestroyNotify) g_array_unref);
+}
+
+/**
+ * ch_database_get_inventory_async:
+ * @database: a valid #ChDatabase instance
+ * @cancellable: a #GCancellable or %NULL
+ * @callback: the function to run on completion
+ * @user_data: the data to pass to @callback
+ *
+ * Gets the device counts on the database thread.
+ **/
+void
+ch_database_get_inventory_async (ChDatabase *database,
+				 GCancellable *cancellable,
+				 GAsyncReadyCallback callback,
+				 gpointer user_data)
+{
+	GTask *task;
+
+	g_return_if_fail (CH_IS_DATABASE (database));
+
+	ch_database_task_new (database,
+			      ch_database_get_inventory_thread_cb,
+			      ch_database_get_inventory_async,
+			      cancellable, callback, user_data,
+			      &task);
+	ch_database_task_push (database, task);
+}
+
+/**
+ * ch_database_get_inventory_finish:
+ * @database: a valid #ChDatabase instance
+ * @res: the #GAsyncResult
+ * @error: A #GError or %NULL
+ *
+ * Gets the result from ch_database_get_inventory_async().
+ *
+ * Return value: an array of #ChDatabaseInventory, or %NULL for error
+ **/
+GArray *
+ch_database_get_inventory_finish (ChDatabase *database,
+				  GAsyncResult *res,
+				  GError **error)
+{
+	g_return_val_if_fail (g_task_is_valid (res, database), NULL);
+	return g_task_propagate_pointer (G_TASK (res), error);
+}
+
+static void
+ch_database_device_set_state_thread_cb (GTask *task,
+					gpointer source_object,
+					gpointer task_data,
+					GCancellable *cancellable)
+{
+	ChDatabase *database = CH_DATABASE (source_object);
+	ChDatabaseTaskHelper *helper = (ChDatabaseTaskHelper *) task_data;
+	GError *error = NULL;
+
+	if (!ch_database_device_set_state (database, helper->id,
+					   helper->state, &error)) {
+		g_task_return_error (task, error);
+		return;
+	}
+	g_task_return_boolean (task, TRUE);
+}
+
+/**
+ * ch_database_device_set_state_async:
+ * @database: a valid #ChDatabase instance
+ * @id: the device serial number
+ * @state: the #ChDeviceState
+ * @cancellable: a #GCancellable or %NULL
+ * @callback: the function to run on completion
+ * @user_data: the data to pass to @callback
+ *
+ * Changes the state on a device on the database thread.
+ **/
+void
+ch_database_device_set_state_async (ChDatabase *database,
+				    guint32 id,
+				    ChDeviceState state,
+				    GCancellable *cancellable,
+				    GAsyncReadyCallback callback,
+				    gpointer user_data)
+{
+	ChDatabaseTaskHelper *helper;
+	GTask *task;
+
+	g_return_if_fail (CH_IS_DATABASE (database));
+
+	helper = ch_database_task_new (database,
+				       ch_database_device_set_state_thread_cb,
+				       ch_database_device_set_state_async,
+				       cancellable, callback, user_data,
+				       &task);
+	helper->id = id;
+	helper->state = state;
+	ch_database_task_push (database, task);
+}
+
+/**
+ * ch_database_device_set_state_finish:
+ * @database: a valid #ChDatabase instance
+ * @res: the #GAsyncResult
+ * @error: A #GError or %NULL
+ *
+ * Gets the result from ch_database_device_set_state_async().
+ *
+ * Return value: %TRUE if the new state was set
+ **/
+gboolean
+ch_database_device_set_state_finish (ChDatabase *database,
+				     GAsyncResult *res,
+				     GError **error)
+{
+	g_return_val_if_fail (g_task_is_valid (res, database), FALSE);
+	return g_task_propagate_boolean (G_TASK (res), error);
+}
+
+static void
+ch_database_add_calibration_thread_cb (GTask *task,
+				       gpointer source_object,
+				       gpointer task_data,
+				       GCancellable *cancellable)
+{
+	ChDatabase *database = CH_DATABASE (source_object);
+	ChDatabaseTaskHelper *helper = (ChDatabaseTaskHelper *) task_data;
+	GError *error = NULL;
+
+	if (!ch_database_add_calibration (database, helper->calibration, &error)) {
+		g_task_return_error (task, error);
+		return;
+	}
+	g_task_return_boolean (task, TRUE);
+}
+
+/**
+ * ch_database_add_calibration_async:
+ * @database: a valid #ChDatabase instance
+ * @calibration: a #ChDatabaseCalibration, which is copied
+ * @cancellable: a #GCancellable or %NULL
+ * @callback: the function to run on completion
+ * @user_data: the data to pass to @callback
+ *
+ * Saves a calibration on the database thread.
+ * See ch_database_add_calibration() for details.
+ **/
+void
+ch_database_add_calibration_async (ChDatabase *database,
+				   const ChDatabaseCalibration *calibration,
+				   GCancellable *cancellable,
+				   GAsyncReadyCallback callback,
+				   gpointer user_data)
+{
+	ChDatabaseTaskHelper *helper;
+	GTask *task;
+
+	g_return_if_fail (CH_IS_DATABASE (database));
+	g_return_if_fail (calibration != NULL);
+
+	helper = ch_database_task_new (database,
+				       ch_database_add_calibration_thread_cb,
+				       ch_database_add_calibration_async,
+				       cancellable, callback, user_data,
+				       &task);
+	helper->calibration = g_new0 (ChDatabaseCalibration, 1);
+	*helper->calibration = *calibration;
+	if (calibration->ti3 != NULL)
+		g_bytes_ref (calibration->ti3);
+	if (calibration->ccmx != NULL)
+		g_bytes_ref (calibration->ccmx);
+	ch_database_task_push (database, task);
+}
+
+/**
+ * ch_database_add_calibration_finish:
+ * @database: a valid #ChDatabase instance
+ * @res: the #GAsyncResult
+ * @error: A #GError or %NULL
+ *
+ * Gets the result from ch_database_add_calibration_async().
+ *
+ * Return value: %TRUE if the calibration was saved
+ **/
+gboolean
+ch_database_add_calibration_finish (ChDatabase *database,
+				    GAsyncResult *res,
+				    GError **error)
+{
+	g_return_val_if_fail (g_task_is_valid (res, database), FALSE);
+	return g_task_propagate_boolean (G_TASK (res), error);
+}
+
+static void
+ch_database_order_set_state_thread_cb (GTask *task,
+				       gpointer source_object,
+				       gpointer task_data,
+				       GCancellable *cancellable)
+{
+	ChDatabase *database = CH_DATABASE (source_object);
+	ChDatabaseTaskHelper *helper = (ChDatabaseTaskHelper *) task_data;
+	GError *error = NULL;
+
+	if (!ch_database_order_set_state (database, helper->id,
+					  helper->state, &error)) {
+		g_task_return_error (task, error);
+		return;
+	}
+	g_task_return_boolean (task, TRUE);
+}
+
+/**
+ * ch_database_order_set_state_async:
+ * @database: a valid #ChDatabase instance
+ * @order_id: the order number
+ * @state: the #ChOrderState
+ * @cancellable: a #GCancellable or %NULL
+ * @callback: the function to run on completion
+ * @user_data: the data to pass to @callback
+ *
+ * Changes the state on an order on the database thread.
+ **/
+void
+ch_database_order_set_state_async (ChDatabase *database,
+				   guint32 order_id,
+				   ChOrderState state,
+				   GCancellable *cancellable,
+				   GAsyncReadyCallback callback,
+				   gpointer user_data)
+{
+	ChDatabaseTaskHelper *helper;
+	GTask *task;
+
+	g_return_if_fail (CH_IS_DATABASE (database));
+
+	helper = ch_database_task_new (database,
+				       ch_database_order_set_state_thread_cb,
+				       ch_database_order_set_state_async,
+				       cancellable, callback, user_data,
+				       &task);
+	helper->id = order_id;
+	helper->state = state;
+	ch_database_task_push (database, task);
+}
+
+/**
+ * ch_database_order_set_state_finish:
+ * @database: a valid #ChDatabase instance
+ * @res: the #GAsyncResult
+ * @error: A #GError or %NULL
+ *
+ * Gets the result from ch_database_order_set_state_async().
+ *
+ * Return value: %TRUE if the new state was set
+ **/
+gboolean
+ch_database_order_set_state_finish (ChDatabase *database,
+				    GAsyncResult *res,
+				    GError **error)
+{
+	g_return_val_if_fail (g_task_is_valid (res, database), FALSE);
+	return g_task_propagate_boolean (G_TASK (res), error);
+}
+
+/**
+ * ch_database_backup:
+ * @database: a valid #ChDatabase instance
+ * @filename: the file to write, which is replaced if it exists
+ * @cancellable: a #GCancellable or %NULL
+ * @error: A #GError or %NULL
+ *
+ * Makes a consistent copy of the database while it is in use. Only a few
+ * pages are copied at a time, and other threads and stations can use the
+ * database in between, so nobody is blocked for long. If another station
+ * writes part way through, SQLite starts again from the beginning.
+ *
+ * The copy is written to a temporary file which is renamed to @filename
+ * when complete, so @filename is never left half-written.
+ *
+ * Return value: %TRUE for success
+ **/
+gboolean
+ch_database_backup (ChDatabase *database,
+		    const gchar *filename,
+		    GCancellable *cancellable,
+		    GError **error)
+{
+	ChDatabasePrivate *priv = database->priv;
+	gboolean ret;
+	gchar *filename_tmp;
+	gint64 start = 0;
+	gint fd;
+	gint rc;
+	guint busy_count = 0;
+	sqlite3 *db = NULL;
+	sqlite3_backup *backup = NULL;
+
+	/* in the same directory so the rename is atomic */
+	filename_tmp = g_strdup_printf ("%s.XXXXXX", filename);
+	fd = g_mkstemp (filename_tmp);
+	if (fd < 0) {
+		ret = FALSE;
+		g_set_error (error, 1, 0,
+			     "failed to create %s: %s",
+			     filename_tmp, g_strerror (errno));
+		g_free (filename_tmp);
+		filename_tmp = NULL;
+		goto out;
+	}
+	close (fd);
+	rc = sqlite3_open (filename_tmp, &db);
+	if (rc != SQLITE_OK) {
+		ret = FALSE;
+		g_set_error (error, 1, 0,
+			     "can't open backup database: %s",
+			     sqlite3_errmsg (db));
+		goto out;
+	}
+
+	g_rec_mutex_lock (&priv->mutex);
+	ret = ch_database_load (database, error);
+	if (ret) {
+		backup = sqlite3_backup_init (db, "main", priv->db, "main");
+		if (backup == NULL) {
+			ret = FALSE;
+			g_set_error (error, 1, 0,
+				     "failed to start backup: %s",
+				     sqlite3_errmsg (db));
+		}
+	}
+	g_rec_mutex_unlock (&priv->mutex);
+	if (!ret)
+		goto out;
+
+	/* the lock is only held while each batch is copied */
+	do {
+		if (g_cancellable_set_error_if_cancelled (cancellable, error)) {
+			ret = FALSE;
+			goto out;
+		}
+		g_rec_mutex_lock (&priv->mutex);
+		rc = sqlite3_backup_step (backup, CH_DATABASE_BACKUP_PAGES);
+		g_rec_mutex_unlock (&priv->mutex);
+		if (rc == SQLITE_BUSY || rc == SQLITE_LOCKED) {
+			if (busy_count == 0)
+				start = g_get_monotonic_time ();
+			if (!ch_database_backoff (database, start, busy_count++))
+				break;
+			continue;
+		}
+		busy_count = 0;
+		if (rc == SQLITE_OK) {
+			g_debug ("backup has %i of %i pages remaining",
+				 sqlite3_backup_remaining (backup),
+				 sqlite3_backup_pagecount (backup));
+			g_usleep (CH_DATABASE_BACKUP_DELAY * 1000);
+		}
+	} while (rc == SQLITE_OK || rc == SQLITE_BUSY || rc == SQLITE_LOCKED);
+	sqlite3_backup_finish (backup);
+	backup = NULL;
+	if (rc != SQLITE_DONE) {
+		ret = FALSE;
+		g_set_error (error, 1, 0,
+			     "failed to back up database: %s",
+			     sqlite3_errstr (rc));
+		goto out;
+	}
+
+	/* make sure it is all on disk before replacing the old backup */
+	rc = sqlite3_close (db);
+	db = NULL;
+	if (rc != SQLITE_OK) {
+		ret = FALSE;
+		g_set_error (error, 1, 0,
+			     "failed to close backup database: %s",
+			     sqlite3_errstr (rc));
+		goto out;
+	}
+	if (g_rename (filename_tmp, filename) != 0) {
+		ret = FALSE;
+		g_set_error (error, 1, 0,
+			     "failed to rename %s to %s: %s",
+			     filename_tmp, filename, g_strerror (errno));
+		goto out;
+	}
+out:
+	if (backup != NULL)
+		sqlite3_backup_finish (backup);
+	if (db != NULL)
+		sqlite3_close (db);
+	if (!ret && filename_tmp != NULL)
+		g_unlink (filename_tmp);
+	g_free (filename_tmp);
+	return ret;
+}
+
+static void
+ch_database_backup_thread_cb (GTask *task,
+			      gpointer source_object,
+			      gpointer task_data,
+			      GCancellable *cancellable)
+{
+	ChDatabase *database = CH_DATABASE (source_object);
+	GError *error = NULL;
+
+	if (!ch_database_backup (database, task_data, cancellable, &error)) {
+		g_task_return_error (task, error);
+		return;
+	}
+	g_task_return_boolean (task, TRUE);
+}
+
+/**
+ * ch_database_backup_async:
+ * @database: a valid #ChDatabase instance
+ * @filename: the file to write, which is replaced if it exists
+ * @cancellable: a #GCancellable or %NULL
+ * @callback: the function to run on completion
+ * @user_data: the data to pass to @callback
+ *
+ * Backs up the database in a thread of its own, rather than the database
+ * thread, so other async calls are not queued behind it.
+ * See ch_database_backup() for details.
+ **/
+void
+ch_database_backup_async (ChDatabase *database,
+			  const gchar *filename,
+			  GCancellable *cancellable,
+			  GAsyncReadyCallback callback,
+			  gpointer user_data)
+{
+	GTask *task;
+
+	g_return_if_fail (CH_IS_DATABASE (database));
+	g_return_if_fail (filename != NULL);
+
+	task = g_task_new (database, cancellable, callback, user_data);
+	g_task_set_source_tag (task, ch_database_backup_async);
+	g_task_set_task_data (task, g_strdup (filename), g_free);
+	g_task_run_in_thread (task, ch_database_backup_thread_cb);
+	g_object_unref (task);
+}
+
+/**
+ * ch_database_backup_finish:
+ * @database: a valid #ChDatabase instance
+ * @res: the #GAsyncResult
+ * @error: A #GError or %NULL
+ *
+ * Gets the result from ch_database_backup_async().
+ *
+ * Return value: %TRUE for success
+ **/
+gboolean
+ch_database_backup_finish (ChDatabase *database,
+			   GAsyncResult *res,
+			   GError **error)
+{
+	g_return_val_if_fail (g_task_is_valid (res, database), FALSE);
+	return g_task_propagate_boolean (G_TASK (res), error);
+}
+
+static void
+ch_database_backup_scheduled_cb (GObject *source, GAsyncResult *res, gpointer user_data)
+{
+	ChDatabase *database = CH_DATABASE (source);
+	GError *error = NULL;
+
+	database->priv->backup_running = FALSE;
+	if (!ch_database_backup_finish (database, res, &error)) {
+		g_warning ("failed to back up database: %s", error->message);
+		g_error_free (error);
+		return;
+	}
+	g_debug ("backed up database to %s", database->priv->backup_filename);
+}
+
+static gboolean
+ch_database_backup_timeout_cb (gpointer user_data)
+{
+	ChDatabase *database = CH_DATABASE (user_data);
+	ChDatabasePrivate *priv = database->priv;
+
+	/* a slow backup is still running */
+	if (priv->backup_running)
+		return G_SOURCE_CONTINUE;
+	priv->backup_running = TRUE;
+	ch_database_backup_async (database, priv->backup_filename, NULL,
+				  ch_database_backup_scheduled_cb, NULL);
+	return G_SOURCE_CONTINUE;
+}
+
+/**
+ * ch_database_set_backup:
+ * @database: a valid #ChDatabase instance
+ * @filename: the file to back up to, or %NULL or "" to disable
+ * @interval: the time between backups in minutes, or 0 to disable
+ *
+ * Backs up the database in the background every @interval minutes.
+ * The first backup is made after @interval, not straight away.
+ **/
+void
+ch_database_set_backup (ChDatabase *database,
+			const gchar *filename,
+			guint interval)
+{
+	ChDatabasePrivate *priv = database->priv;
+
+	g_return_if_fail (CH_IS_DATABASE (database));
+
+	if (priv->backup_id != 0) {
+		g_source_remove (priv->backup_id);
+		priv->backup_id = 0;
+	}
+	g_free (priv->backup_filename);
+	priv->backup_filename = NULL;
+	if (filename == NULL || filename[0] == '\0' || interval == 0)
+		return;
+	priv->backup_filename = g_strdup (filename);
+	priv->backup_id = g_timeout_add_seconds (interval * 60,
+						 ch_database_backup_timeout_cb,
+						 database);
+}
+
+#ifdef HAVE_SQLITE_SESSION
+/* columns are only ever added to the end, so these never move */
+#define CH_DATABASE_DEVICES_COLUMN_ORDER_ID	4
+#define CH_DATABASE_ORDERS_COLUMN_STATE		6
+#define CH_DATABASE_ORDERS_COLUMN_CHANGED	9
+
+typedef struct {
+	ChDatabase	*database;
+	const gchar	*station;	/* that made the changes */
+	gchar		*conflict;	/* why the changeset was abandoned */
+} ChDatabaseApplyHelper;
+
+static gboolean
+ch_database_value_equal (sqlite3_value *value1, sqlite3_value *value2)
+{
+	gint type;
+
+	if (value1 == NULL || value2 == NULL)
+		return value1 == value2;
+	type = sqlite3_value_type (value1);
+	if (type != sqlite3_value_type (value2))
+		return FALSE;
+	switch (type) {
+	case SQLITE_NULL:
+		return TRUE;
+	case SQLITE_INTEGER:
+		return sqlite3_value_int64 (value1) == sqlite3_value_int64 (value2);
+	case SQLITE_FLOAT:
+		return sqlite3_value_double (value1) == sqlite3_value_double (value2);
+	default:
+		if (sqlite3_value_bytes (value1) != sqlite3_value_bytes (value2))
+			return FALSE;
+		return memcmp (sqlite3_value_blob (value1),
+			       sqlite3_value_blob (value2),
+			       sqlite3_value_bytes (value1)) == 0;
+	}
+}
+
+/* whether the row here is not what the other station expected, ignoring
+ * the generation number as that is only meaningful at one station */
+static gboolean
+ch_database_replication_row_differs (sqlite3_changeset_iter *iter)
+{
+	const gchar *table;
+	gint i;
+	gint n_columns;
+	gint op;
+	sqlite3_value *current;
+	sqlite3_value *expected;
+
+	sqlite3changeset_op (iter, &table, &n_columns, &op, NULL);
+	for (i = 0; i < n_columns; i++) {
+		if (i == CH_DATABASE_ORDERS_COLUMN_CHANGED &&
+		    g_strcmp0 (table, "orders") == 0)
+			continue;
+		expected = NULL;
+		if (op == SQLITE_INSERT)
+			sqlite3changeset_new (iter, i, &expected);
+		else
+			sqlite3changeset_old (iter, i, &expected);
+
+		/* not changed by the other station */
+		if (expected == NULL)
+			continue;
+		current = NULL;
+		sqlite3changeset_conflict (iter, i, &current);
+		if (!ch_database_value_equal (expected, current))
+			return TRUE;
+	}
+	return FALSE;
+}
+
+/* the value the other station set, or the one here if it did not set it */
+static gint64
+ch_database_replication_get_new (sqlite3_changeset_iter *iter, gint column)
+{
+	sqlite3_value *value = NULL;
+
+	sqlite3changeset_new (iter, column, &value);
+	if (value == NULL)
+		sqlite3changeset_conflict (iter, column, &value);
+	return value != NULL ? sqlite3_value_int64 (value) : 0;
+}
+
+static gint64
+ch_database_replication_get_current (sqlite3_changeset_iter *iter, gint column)
+{
+	sqlite3_value *value = NULL;
+
+	sqlite3changeset_conflict (iter, column, &value);
+	return value != NULL ? sqlite3_value_int64 (value) : 0;
+}
+
+/* how far along an order is, as the states are not in order */
+static guint
+ch_database_order_state_rank (gint64 state)
+{
+	const guint ranks[] = {
+		[CH_ORDER_STATE_NEW] = 0,
+		[CH_ORDER_STATE_TO_BE_PRINTED] = 1,
+		[CH_ORDER_STATE_PRINTED] = 2,
+		[CH_ORDER_STATE_SENT] = 3,
+		[CH_ORDER_STATE_REFUNDED] = 4 };
+
+	if (state < 0 || state >= CH_ORDER_STATE_LAST)
+		return 0;
+	return ranks[state];
+}
+
+/**
+ * ch_database_replication_conflict_cb:
+ *
+ * Decides what to do when a change from another station does not match
+ * the row here. Every station has to make the same decision so that they
+ * all end up with the same rows, so this only depends on the two rows and
+ * the two station names, never on which station is applying the change.
+ **/
+static gint
+ch_database_replication_conflict_cb (gpointer user_data,
+				     gint conflict,
+				     sqlite3_changeset_iter *iter)
+{
+	ChDatabaseApplyHelper *helper = (ChDatabaseApplyHelper *) user_data;
+	const gchar *station = helper->database->priv->station;
+	const gchar *table;
+	gboolean theirs;
+	gint n_columns;
+	gint op;
+	gint64 order_here;
+	gint64 order_there;
+	guint rank_here;
+	guint rank_there;
+	sqlite3_value *value = NULL;
+
+	sqlite3changeset_op (iter, &table, &n_columns, &op, NULL);
+	switch (conflict) {
+	case SQLITE_CHANGESET_NOTFOUND:
+		/* archived at this station */
+		return SQLITE_CHANGESET_OMIT;
+	case SQLITE_CHANGESET_DATA:
+		break;
+	case SQLITE_CHANGESET_CONFLICT:
+		/* applied before, but not marked as applied */
+		if (!ch_database_replication_row_differs (iter))
+			return SQLITE_CHANGESET_OMIT;
+		sqlite3changeset_new (iter, 0, &value);
+		helper->conflict = g_strdup_printf ("ID %" G_GINT64_FORMAT " was added "
+						    "to %s at both %s and %s, but rows "
+						    "can only be added at one station",
+						    (gint64) sqlite3_value_int64 (value),
+						    table, helper->station, station);
+		return SQLITE_CHANGESET_ABORT;
+	default:
+		helper->conflict = g_strdup_printf ("failed to change %s from %s",
+						    table, helper->station);
+		return SQLITE_CHANGESET_ABORT;
+	}
+
+	/* only archiving deletes rows, and each station does that itself */
+	if (op == SQLITE_DELETE)
+		return SQLITE_CHANGESET_OMIT;
+
+	/* only the generation number is different */
+	if (!ch_database_replication_row_differs (iter))
+		return SQLITE_CHANGESET_REPLACE;
+
+	/* orders only ever move forwards, so the furthest along wins */
+	if (g_strcmp0 (table, "orders") == 0) {
+		rank_here = ch_database_order_state_rank (ch_database_replication_get_current (iter, CH_DATABASE_ORDERS_COLUMN_STATE));
+		rank_there = ch_database_order_state_rank (ch_database_replication_get_new (iter, CH_DATABASE_ORDERS_COLUMN_STATE));
+		if (rank_here != rank_there) {
+			return rank_there > rank_here ? SQLITE_CHANGESET_REPLACE :
+							SQLITE_CHANGESET_OMIT;
+		}
+	}
+
+	/* otherwise the station that sorts first wins */
+	theirs = g_strcmp0 (helper->station, station) < 0;
+
+	/* both stations allocated the same device to different orders */
+	if (g_strcmp0 (table, "devices") == 0) {
+		order_here = ch_database_replication_get_current (iter, CH_DATABASE_DEVICES_COLUMN_ORDER_ID);
+		order_there = ch_database_replication_get_new (iter, CH_DATABASE_DEVICES_COLUMN_ORDER_ID);
+		if (order_here > 0 && order_there > 0 && order_here != order_there) {
+			sqlite3changeset_old (iter, 0, &value);
+			g_warning ("device %" G_GINT64_FORMAT " was allocated to both "
+				   "order %" G_GINT64_FORMAT " and %" G_GINT64_FORMAT
+				   ", so order %" G_GINT64_FORMAT " needs another device",
+				   (gint64) sqlite3_value_int64 (value),
+				   order_here, order_there,
+				   theirs ? order_here : order_there);
+		}
+	}
+	return theirs ? SQLITE_CHANGESET_REPLACE : SQLITE_CHANGESET_OMIT;
+}
+
+/* a station with a newer schema has to be upgraded first */
+static gboolean
+ch_database_replication_check_columns (ChDatabase *database,
+				       const gchar *table,
+				       gint n_columns,
+				       GError **error)
+{
+	gchar *sql;
+	gint rc;
+	gint n_columns_here = 0;
+	sqlite3_stmt *stmt = NULL;
+
+	if (n_columns == 0)
+		return TRUE;
+	sql = g_strdup_printf ("SELECT * FROM main.%s LIMIT 0;", table);
+	rc = sqlite3_prepare_v2 (database->priv->db, sql, -1, &stmt, NULL);
+	g_free (sql);
+	if (rc == SQLITE_OK)
+		n_columns_here = sqlite3_column_count (stmt);
+	sqlite3_finalize (stmt);
+	if (n_columns_here < n_columns) {
+		g_set_error (error, 1, 0,
+			     "the %s table has %i columns but %i are needed "
+			     "for the changes from another station",
+			     table, n_columns_here, n_columns);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/* applies a changeset from another station, and marks it as applied */
+static gboolean
+ch_database_replication_apply (ChDatabase *database,
+			       const gchar *station,
+			       gint64 changeset_id,
+			       gchar *data,
+			       gsize size,
+			       GError **error)
+{
+	ChDatabaseApplyHelper helper;
+	ChDatabasePrivate *priv = database->priv;
+	GArray *order_ids;
+	const gchar *table;
+	gboolean in_transaction = FALSE;
+	gboolean ret;
+	gint64 id;
+	gint n_devices = 0;
+	gint n_orders = 0;
+	gint n_columns;
+	gint op;
+	gint rc;
+	guint i;
+	sqlite3_changeset_iter *iter = NULL;
+	sqlite3_stmt *stmt = NULL;
+	sqlite3_value *value;
+
+	memset (&helper, 0, sizeof (helper));
+	helper.database = database;
+	helper.station = station;
+	order_ids = g_array_new (FALSE, FALSE, sizeof (gint64));
+
+	ret = ch_database_begin (database, error);
+	if (!ret)
+		goto out;
+	in_transaction = TRUE;
+
+	/* find the orders that are changed */
+	rc = sqlite3changeset_start (&iter, size, data);
+	while (rc == SQLITE_OK && sqlite3changeset_next (iter) == SQLITE_ROW) {
+		sqlite3changeset_op (iter, &table, &n_columns, &op, NULL);
+		if (g_strcmp0 (table, "devices") == 0)
+			n_devices = MAX (n_devices, n_columns);
+		if (g_strcmp0 (table, "orders") != 0)
+			continue;
+		n_orders = MAX (n_orders, n_columns);
+		value = NULL;
+		if (op == SQLITE_INSERT)
+			sqlite3changeset_new (iter, 0, &value);
+		else
+			sqlite3changeset_old (iter, 0, &value);
+		if (value == NULL)
+			continue;
+		id = sqlite3_value_int64 (value);
+		g_array_append_val (order_ids, id);
+	}
+	if (rc == SQLITE_OK)
+		rc = sqlite3changeset_finalize (iter);
+	iter = NULL;
+	if (rc != SQLITE_OK) {
+		ret = FALSE;
+		g_set_error (error, 1, 0,
+			     "invalid changeset %" G_GINT64_FORMAT " from %s: %s",
+			     changeset_id, station, sqlite3_errstr (rc));
+		goto out;
+	}
+	ret = ch_database_replication_check_columns (database, "devices", n_devices, error);
+	if (!ret)
+		goto out;
+	ret = ch_database_replication_check_columns (database, "orders", n_orders, error);
+	if (!ret)
+		goto out;
+
+	/* changes from other stations are not sent on again */
+	sqlite3session_enable (priv->session, 0);
+	rc = sqlite3changeset_apply (priv->db, size, data,
+				     ch_database_replication_filter_cb,
+				     ch_database_replication_conflict_cb,
+				     &helper);
+	if (rc != SQLITE_OK) {
+		ret = FALSE;
+		g_set_error (error, 1, 0,
+			     "failed to apply changeset %" G_GINT64_FORMAT " from %s: %s",
+			     changeset_id, station,
+			     helper.conflict != NULL ? helper.conflict :
+						       sqlite3_errmsg (priv->db));
+		goto out;
+	}
+
+	/* the generation numbers are local, so they have to be set here for
+	 * clients to see the changed orders */
+	if (order_ids->len > 0) {
+		ret = ch_database_step_stmt (database, CH_DATABASE_STMT_BUMP_ORDERS_GENERATION, error);
+		if (!ret)
+			goto out;
+		stmt = ch_database_get_stmt (database, CH_DATABASE_STMT_ORDER_TOUCH, error);
+		if (stmt == NULL) {
+			ret = FALSE;
+			goto out;
+		}
+		for (i = 0; i < order_ids->len; i++) {
+			sqlite3_bind_int64 (stmt, 1, g_array_index (order_ids, gint64, i));
+			rc = ch_database_step (database, stmt);
+			sqlite3_reset (stmt);
+			if (rc != SQLITE_DONE) {
+				ret = FALSE;
+				g_set_error (error, 1, 0,
+					     "failed to update order: %s",
+					     sqlite3_errmsg (priv->db));
+				goto out;
+			}
+		}
+		stmt = NULL;
+	}
+
+	/* never apply the same changes twice */
+	stmt = ch_database_get_stmt (database, CH_DATABASE_STMT_SET_APPLIED, error);
+	if (stmt == NULL) {
+		ret = FALSE;
+		goto out;
+	}
+	sqlite3_bind_text (stmt, 1, station, -1, SQLITE_STATIC);
+	sqlite3_bind_int64 (stmt, 2, changeset_id);
+	rc = ch_database_step (database, stmt);
+	if (rc != SQLITE_DONE) {
+		ret = FALSE;
+		g_set_error (error, 1, 0,
+			     "failed to mark changeset as applied: %s",
+			     sqlite3_errmsg (priv->db));
+		goto out;
+	}
+	sqlite3_reset (stmt);
+	stmt = NULL;
+	sqlite3session_enable (priv->session, 1);
+	in_transaction = FALSE;
+	ret = ch_database_commit (database, error);
+out:
+	if (iter != NULL)
+		sqlite3changeset_finalize (iter);
+	if (stmt != NULL)
+		sqlite3_reset (stmt);
+	if (in_transaction) {
+		sqlite3session_enable (priv->session, 1);
+		ch_database_rollback (database, NULL);
+	}
+	g_array_unref (order_ids);
+	g_free (helper.conflict);
+	return ret;
+}
+
+/* writes the changes made here where the other stations can find them */
+static gboolean
+ch_database_replication_export (ChDatabase *database, GError **error)
+{
+	ChDatabasePrivate *priv = database->priv;
+	GArray *changeset_ids;
+	GPtrArray *changesets;
+	GBytes *bytes;
+	gboolean ret;
+	gchar *dirname;
+	gchar *filename;
+	gchar *tmp;
+	gint rc;
+	gint64 changeset_id = 0;
+	guint i;
+	sqlite3_stmt *stmt = NULL;
+
+	changeset_ids = g_array_new (FALSE, FALSE, sizeof (gint64));
+	changesets = g_ptr_array_new_with_free_func ((GDestroyNotify) g_bytes_unref);
+	dirname = g_build_filename (priv->spool_dir, priv->station, NULL);
+	if (g_mkdir_with_parents (dirname, 0755) != 0) {
+		ret = FALSE;
+		g_set_error (error, 1, 0,
+			     "failed to create %s: %s",
+			     dirname, g_strerror (errno));
+		goto out;
+	}
+
+	/* the spool might be slow, so do not hold the lock while writing */
+	g_rec_mutex_lock (&priv->mutex);
+	ret = ch_database_load (database, error);
+	if (ret)
+		stmt = ch_database_get_stmt (database, CH_DATABASE_STMT_GET_CHANGESETS, error);
+	if (stmt == NULL) {
+		g_rec_mutex_unlock (&priv->mutex);
+		ret = FALSE;
+		goto out;
+	}
+	while ((rc = ch_database_step (database, stmt)) == SQLITE_ROW) {
+		changeset_id = sqlite3_column_int64 (stmt, 0);
+		g_array_append_val (changeset_ids, changeset_id);
+		bytes = g_bytes_new (sqlite3_column_blob (stmt, 1),
+				     sqlite3_column_bytes (stmt, 1));
+		g_ptr_array_add (changesets, bytes);
+	}
+	sqlite3_reset (stmt);
+	if (rc != SQLITE_DONE) {
+		g_rec_mutex_unlock (&priv->mutex);
+		ret = FALSE;
+		g_set_error (error, 1, 0,
+			     "failed to get changesets: %s",
+			     sqlite3_errmsg (priv->db));
+		goto out;
+	}
+	g_rec_mutex_unlock (&priv->mutex);
+
+	for (i = 0; i < changesets->len; i++) {
+		bytes = g_ptr_array_index (changesets, i);
+		tmp = g_strdup_printf ("%020" G_GINT64_FORMAT ".changeset",
+				       g_array_index (changeset_ids, gint64, i));
+		filename = g_build_filename (dirname, tmp, NULL);
+		g_free (tmp);
+		ret = g_file_set_contents (filename,
+					   g_bytes_get_data (bytes, NULL),
+					   g_bytes_get_size (bytes),
+					   error);
+		g_free (filename);
+		if (!ret)
+			goto out;
+	}
+
+	/* written again next time if this fails, which is harmless */
+	if (changesets->len > 0) {
+		g_rec_mutex_lock (&priv->mutex);
+		stmt = ch_database_get_stmt (database, CH_DATABASE_STMT_DELETE_CHANGESETS, error);
+		if (stmt != NULL) {
+			sqlite3_bind_int64 (stmt, 1, changeset_id);
+			rc = ch_database_step (database, stmt);
+			sqlite3_reset (stmt);
+			if (rc != SQLITE_DONE) {
+				g_set_error (error, 1, 0,
+					     "failed to delete changesets: %s",
+					     sqlite3_errmsg (priv->db));
+			}
+		}
+		ret = stmt != NULL && rc == SQLITE_DONE;
+		g_rec_mutex_unlock (&priv->mutex);
+	}
+out:
+	g_array_unref (changeset_ids);
+	g_ptr_array_unref (changesets);
+	g_free (dirname);
+	return ret;
+}
+
+static gint
+ch_database_changeset_id_sort_cb (gconstpointer a, gconstpointer b)
+{
+	gint64 tmp = *((const gint64 *) a) - *((const gint64 *) b);
+	if (tmp < 0)
+		return -1;
+	if (tmp > 0)
+		return 1;
+	return 0;
+}
+
+/* applies the changesets from one station that have not been applied */
+static gboolean
+ch_database_replication_import_station (ChDatabase *database,
+					const gchar *station,
+					guint *applied,
+					GCancellable *cancellable,
+					GError **error)
+{
+	ChDatabasePrivate *priv = database->priv;
+	GArray *changeset_ids;
+	GDir *dir = NULL;
+	const gchar *name;
+	gboolean ret = TRUE;
+	gchar *data = NULL;
+	gchar *dirname;
+	gchar *endptr;
+	gchar *filename;
+	gint64 changeset_id;
+	gint64 last = 0;
+	gsize size;
+	guint i;
+	sqlite3_stmt *stmt;
+
+	changeset_ids = g_array_new (FALSE, FALSE, sizeof (gint64));
+	dirname = g_build_filename (priv->spool_dir, station, NULL);
+
+	/* where we got to last time */
+	g_rec_mutex_lock (&priv->mutex);
+	stmt = ch_database_get_stmt (database, CH_DATABASE_STMT_GET_APPLIED, error);
+	if (stmt == NULL) {
+		g_rec_mutex_unlock (&priv->mutex);
+		ret = FALSE;
+		goto out;
+	}
+	sqlite3_bind_text (stmt, 1, station, -1, SQLITE_STATIC);
+	if (ch_database_step (database, stmt) == SQLITE_ROW)
+		last = sqlite3_column_int64 (stmt, 0);
+	sqlite3_reset (stmt);
+	g_rec_mutex_unlock (&priv->mutex);
+
+	/* temporary files from the other station do not match */
+	dir = g_dir_open (dirname, 0, error);
+	if (dir == NULL) {
+		ret = FALSE;
+		goto out;
+	}
+	while ((name = g_dir_read_name (dir)) != NULL) {
+		if (!g_str_has_suffix (name, ".changeset"))
+			continue;
+		changeset_id = g_ascii_strtoll (name, &endptr, 10);
+		if (g_strcmp0 (endptr, ".changeset") != 0 || changeset_id <= last)
+			continue;
+		g_array_append_val (changeset_ids, changeset_id);
+	}
+	g_array_sort (changeset_ids, ch_database_changeset_id_sort_cb);
+
+	for (i = 0; i < changeset_ids->len; i++) {
+		changeset_id = g_array_index (changeset_ids, gint64, i);
+
+		/* a synced folder may not have the earlier ones yet */
+		if (changeset_id != last + 1) {
+			g_debug ("waiting for changeset %" G_GINT64_FORMAT " from %s",
+				 last + 1, station);
+			break;
+		}
+		if (g_cancellable_set_error_if_cancelled (cancellable, error)) {
+			ret = FALSE;
+			goto out;
+		}
+		name = g_strdup_printf ("%020" G_GINT64_FORMAT ".changeset", changeset_id);
+		filename = g_build_filename (dirname, name, NULL);
+		g_free ((gchar *) name);
+		ret = g_file_get_contents (filename, &data, &size, error);
+		g_free (filename);
+		if (!ret)
+			goto out;
+		ret = ch_database_replication_apply (database, station, changeset_id,
+						     data, size, error);
+		g_free (data);
+		data = NULL;
+		if (!ret)
+			goto out;
+		last = changeset_id;
+		(*applied)++;
+	}
+out:
+	if (dir != NULL)
+		g_dir_close (dir);
+	g_array_unref (changeset_ids);
+	g_free (dirname);
+	return ret;
+}
+#endif
+
+/**
+ * ch_database_replicate:
+ * @database: a valid #ChDatabase instance
+ * @applied: (out) (allow-none): the number of changesets applied
+ * @cancellable: a #GCancellable or %NULL
+ * @error: A #GError or %NULL
+ *
+ * Writes the changes made at this station to the spool directory set with
+ * ch_database_set_replication(), and applies the changes that the other
+ * stations have written there since the last time.
+ *
+ * Changes are written and applied in the order they were made, one
+ * transaction at a time. If another station changed the same row, orders
+ * keep the state that is furthest along and otherwise the change from the
+ * station whose name sorts first is kept, so every station ends up with the
+ * same rows whatever order they exchange changes in.
+ *
+ * Return value: %TRUE for success
+ **/
+gboolean
+ch_database_replicate (ChDatabase *database,
+		       guint *applied,
+		       GCancellable *cancellable,
+		       GError **error)
+{
+#ifdef HAVE_SQLITE_SESSION
+	ChDatabasePrivate *priv = database->priv;
+	GDir *dir = NULL;
+	const gchar *name;
+	gboolean ret;
+	gchar *dirname;
+	guint applied_tmp = 0;
+
+	g_return_val_if_fail (CH_IS_DATABASE (database), FALSE);
+
+	if (priv->spool_dir == NULL) {
+		g_set_error_literal (error, 1, 0, "no spool directory set");
+		return FALSE;
+	}
+
+	/* send first, as that works even if the others cannot be applied */
+	ret = ch_database_replication_export (database, error);
+	if (!ret)
+		goto out;
+
+	/* every other directory is another station */
+	dir = g_dir_open (priv->spool_dir, 0, error);
+	if (dir == NULL) {
+		ret = FALSE;
+		goto out;
+	}
+	while ((name = g_dir_read_name (dir)) != NULL) {
+		if (g_strcmp0 (name, priv->station) == 0)
+			continue;
+		dirname = g_build_filename (priv->spool_dir, name, NULL);
+		ret = g_file_test (dirname, G_FILE_TEST_IS_DIR);
+		g_free (dirname);
+		if (!ret)
+			continue;
+		ret = ch_database_replication_import_station (database, name,
+							      &applied_tmp,
+							      cancellable,
+							      error);
+		if (!ret)
+			goto out;
+	}
+	ret = TRUE;
+out:
+	if (dir != NULL)
+		g_dir_close (dir);
+	if (applied != NULL)
+		*applied = applied_tmp;
+	return ret;
+#else
+	g_set_error_literal (error, 1, 0,
+			     "replication needs SQLite built with "
+			     "the session extension");
+	return FALSE;
+#endif
+}
+
+static void
+ch_database_replicate_thread_cb (GTask *task,
+				 gpointer source_object,
+				 gpointer task_data,
+				 GCancellable *cancellable)
+{
+	ChDatabase *database = CH_DATABASE (source_object);
+	GError *error = NULL;
+	guint applied = 0;
+
+	if (!ch_database_replicate (database, &applied, cancellable, &error)) {
+		g_task_return_error (task, error);
+		return;
+	}
+	g_task_return_int (task, applied);
+}
+
+static void
+ch_database_replicate_scheduled_cb (GObject *source, GAsyncResult *res, gpointer user_data)
+{
+	ChDatabase *database = CH_DATABASE (source);
+	ChDatabasePrivate *priv = database->priv;
+	GError *error = NULL;
+	gssize applied;
+
+	priv->replicate_running = FALSE;
+	applied = g_task_propagate_int (G_TASK (res), &error);
+	if (error != NULL) {
+		/* the link being down is expected, so only say so once */
+		if (g_strcmp0 (error->message, priv->replicate_error) != 0)
+			g_warning ("failed to replicate database: %s", error->message);
+		g_free (priv->replicate_error);
+		priv->replicate_error = g_strdup (error->message);
+		g_error_free (error);
+		return;
+	}
+	g_free (priv->replicate_error);
+	priv->replicate_error = NULL;
+	if (applied == 0)
+		return;
+	g_debug ("applied %i changesets from other stations", (gint) applied);
+	g_signal_emit (database, signals[SIGNAL_CHANGED], 0,
+		       CH_DATABASE_CHANGED_ORDERS | CH_DATABASE_CHANGED_DEVICES);
+}
+
+static gboolean
+ch_database_replicate_timeout_cb (gpointer user_data)
+{
+	ChDatabase *database = CH_DATABASE (user_data);
+	ChDatabasePrivate *priv = database->priv;
+	GTask *task;
+
+	/* the spool is still being read */
+	if (priv->replicate_running)
+		return G_SOURCE_CONTINUE;
+	priv->replicate_running = TRUE;
+	task = g_task_new (database, NULL, ch_database_replicate_scheduled_cb, NULL);
+	g_task_set_source_tag (task, ch_database_replicate_timeout_cb);
+	g_task_run_in_thread (task, ch_database_replicate_thread_cb);
+	g_object_unref (task);
+	return G_SOURCE_CONTINUE;
+}
+
+/**
+ * ch_database_set_replication:
+ * @database: a valid #ChDatabase instance
+ * @spool_dir: a directory shared with the other stations, or %NULL or ""
+ * @station: a name for this station, or %NULL or "" to use the hostname
+ * @interval: the time between exchanging changes in seconds, or 0 to only
+ *            do it when ch_database_replicate() is called
+ *
+ * Keeps the devices and orders in step with other stations that each have
+ * their own copy of the database, so queries never have to wait for the
+ * network and each station keeps working when the link is down. The spool
+ * directory can be anything the stations can all get to, for instance a
+ * network share or a synced folder.
+ *
+ * Devices should only be added at one station and orders at one station,
+ * as the IDs are not unique between stations. Nothing else is replicated,
+ * and each station archives old orders itself.
+ *
+ * Only changes are exchanged, so a new station has to start from a copy of
+ * the database of an existing station, for instance one made with
+ * ch_database_backup(), and given a name that has not been used before.
+ * The changes already in the copy are not applied again.
+ *
+ * This has to be set before the database is first used.
+ **/
+void
+ch_database_set_replication (ChDatabase *database,
+			     const gchar *spool_dir,
+			     const gchar *station,
+			     guint interval)
+{
+	ChDatabasePrivate *priv = database->priv;
+
+	g_return_if_fail (CH_IS_DATABASE (database));
+	g_return_if_fail (priv->db == NULL);
+
+	if (priv->replicate_id != 0) {
+		g_source_remove (priv->replicate_id);
+		priv->replicate_id = 0;
+	}
+	g_free (priv->spool_dir);
+	priv->spool_dir = NULL;
+	if (spool_dir == NULL || spool_dir[0] == '\0')
+		return;
+	priv->spool_dir = g_strdup (spool_dir);
+
+	/* also used for the events */
+	if (station != NULL && station[0] != '\0') {
+		g_free (priv->station);
+		priv->station = g_strdup (station);
+	}
+	if (interval == 0)
+		return;
+	priv->replicate_id = g_timeout_add_seconds (interval,
+						    ch_database_replicate_timeout_cb,
+						    database);
+}
+
+/* gets an integer from the metadata table, which is 0 if not set */
+static gboolean
+ch_database_get_metadata (ChDatabase *database,
+			  const gchar *key,
+			  gint64 *value,
+			  GError **error)
+{
+	gint rc;
+	sqlite3_stmt *stmt;
+
+	stmt = ch_database_get_stmt (database, CH_DATABASE_STMT_GET_METADATA, error);
+	if (stmt == NULL)
+		return FALSE;
+	sqlite3_bind_text (stmt, 1, key, -1, SQLITE_STATIC);
+	rc = ch_database_step (database, stmt);
+	if (rc != SQLITE_ROW && rc != SQLITE_DONE) {
+		g_set_error (error, 1, 0,
+			     "failed to get %s: %s",
+			     key, sqlite3_errmsg (database->priv->db));
+		sqlite3_reset (stmt);
+		return FALSE;
+	}
+	*value = rc == SQLITE_ROW ? sqlite3_column_int64 (stmt, 0) : 0;
+	sqlite3_reset (stmt);
+	return TRUE;
+}
+
+static gboolean
+ch_database_set_metadata (ChDatabase *database,
+			  const gchar *key,
+			  gint64 value,
+			  GError **error)
+{
+	gint rc;
+	sqlite3_stmt *stmt;
+
+	stmt = ch_database_get_stmt (database, CH_DATABASE_STMT_SET_METADATA, error);
+	if (stmt == NULL)
+		return FALSE;
+	sqlite3_bind_text (stmt, 1, key, -1, SQLITE_STATIC);
+	sqlite3_bind_int64 (stmt, 2, value);
+	rc = ch_database_step (database, stmt);
+	sqlite3_reset (stmt);
+	if (rc != SQLITE_DONE) {
+		g_set_error (error, 1, 0,
+			     "failed to set %s: %s",
+			     key, sqlite3_errmsg (database->priv->db));
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/* gets the integer a PRAGMA returns, where @name is a static string */
+static gboolean
+ch_database_get_pragma (ChDatabase *database,
+			const gchar *name,
+			gint64 *value,
+			GError **error)
+{
+	gboolean ret = TRUE;
+	gchar *statement;
+	gint rc;
+	sqlite3_stmt *stmt = NULL;
+
+	statement = g_strdup_printf ("PRAGMA main.%s;", name);
+	rc = sqlite3_prepare_v2 (database->priv->db, statement, -1, &stmt, NULL);
+	if (rc == SQLITE_OK)
+		rc = ch_database_step (database, stmt);
+	if (rc != SQLITE_ROW) {
+		ret = FALSE;
+		g_set_error (error, 1, 0,
+			     "failed to get %s: %s",
+			     name, sqlite3_errmsg (database->priv->db));
 		goto out;
 	}
+	*value = sqlite3_column_int64 (stmt, 0);
 out:
+	if (stmt != NULL)
+		sqlite3_finalize (stmt);
 	g_free (statement);
 	return ret;
 }
 
-static gint
-ch_database_device_get_number_cb (void *data, gint argc, gchar **argv, gchar **col_name)
-{
-	guint *len = (guint *) data;
-	(*len)++;
-	return 0;
-}
-
 /**
- * ch_database_device_get_number:
+ * ch_database_get_maintenance:
  * @database: a valid #ChDatabase instance
- * @state: A #ChDeviceState
+ * @maintenance: the #ChDatabaseMaintenance to fill in
  * @error: A #GError or %NULL
  *
- * Finds the oldest device of a known state
+ * Gets when the database was last maintained, by any station, and how much
+ * space is still waiting to be given back.
  *
- * Return value: The device serial number or G_MAXUINT32 for error
+ * Return value: %TRUE for success
  **/
-guint
-ch_database_device_get_number (ChDatabase *database,
-			       ChDeviceState state,
-			       guint hw_ver,
-			       GError **error)
+gboolean
+ch_database_get_maintenance (ChDatabase *database,
+			     ChDatabaseMaintenance *maintenance,
+			     GError **error)
 {
-	ChDatabasePrivate *priv = database->priv;
 	gboolean ret;
-	gchar *error_msg = NULL;
-	gchar *statement = NULL;
-	gint rc;
-	guint len = 0;
+	gint64 free_pages = 0;
+	gint64 pages = 0;
+
+	g_return_val_if_fail (maintenance != NULL, FALSE);
+
+	g_rec_mutex_lock (&database->priv->mutex);
+	memset (maintenance, 0, sizeof (ChDatabaseMaintenance));
 
 	/* ensure db is loaded */
 	ret = ch_database_load (database, error);
-	if (!ret) {
-		len = G_MAXUINT32;
+	if (!ret)
 		goto out;
-	}
-
-	/* find */
-	statement = g_strdup_printf ("SELECT device_id "
-				     "FROM devices WHERE state = '%i' and hw_ver = '%i';", state, hw_ver);
-	rc = sqlite3_exec (priv->db,
-			   statement,
-			   ch_database_device_get_number_cb,
-			   &len,
-			   &error_msg);
-	if (rc != SQLITE_OK) {
-		len = G_MAXUINT32;
-		g_set_error (error, 1, 0,
-			     "failed to find entry: %s",
-			     sqlite3_errmsg (priv->db));
+	ret = ch_database_get_metadata (database, "maintenance_analyzed",
+					&maintenance->analyzed, error);
+	if (!ret)
 		goto out;
-	}
+	ret = ch_database_get_metadata (database, "maintenance_vacuumed",
+					&maintenance->vacuumed, error);
+	if (!ret)
+		goto out;
+	ret = ch_database_get_pragma (database, "page_count", &pages, error);
+	if (!ret)
+		goto out;
+	ret = ch_database_get_pragma (database, "freelist_count", &free_pages, error);
+	if (!ret)
+		goto out;
+	maintenance->pages = pages;
+	maintenance->free_pages = free_pages;
 out:
-	g_free (statement);
-	return len;
-}
-
-static gint
-ch_database_device_find_oldest_cb (void *data, gint argc, gchar **argv, gchar **col_name)
-{
-	guint32 *id = (guint32 *) data;
-	*id = atoi (argv[0]);
-	return 0;
+	g_rec_mutex_unlock (&database->priv->mutex);
+	return ret;
 }
 
 /**
- * ch_database_device_find_oldest:
+ * ch_database_maintain:
  * @database: a valid #ChDatabase instance
- * @state: A #ChDeviceState
+ * @flags: #ChDatabaseMaintainFlags, e.g. %CH_DATABASE_MAINTAIN_FLAG_REBUILD
+ * @finished: set to %TRUE if there is nothing more to do, or %NULL
  * @error: A #GError or %NULL
  *
- * Finds the oldest device of a known state
+ * Does the next small step of keeping the database fast and compact, in
+ * this order:
  *
- * Return value: The device serial number or G_MAXUINT32 for error
+ * - updating the statistics the query planner uses, once a day
+ * - giving back pages freed by refunds and archiving, a few at a time
+ * - copying the write-ahead log back into the database
+ *
+ * Call this again until @finished is set to do everything that is due.
+ * With %CH_DATABASE_MAINTAIN_FLAG_REBUILD a database made before
+ * incremental vacuum was turned on is also rebuilt once if a quarter of it
+ * is unused. This locks out every other station until it is done, so it is
+ * never done by the background maintenance.
+ *
+ * This cannot be called during a transaction.
+ *
+ * Return value: %TRUE for success
  **/
-guint32
-ch_database_device_find_oldest (ChDatabase *database,
-				ChDeviceState state,
-				guint hw_ver,
-				GError **error)
+gboolean
+ch_database_maintain (ChDatabase *database,
+		      ChDatabaseMaintainFlags flags,
+		      gboolean *finished,
+		      GError **error)
 {
 	ChDatabasePrivate *priv = database->priv;
 	gboolean ret;
-	gchar *error_msg = NULL;
-	gchar *statement = NULL;
+	gint64 analyzed = 0;
+	gint64 auto_vacuum = 0;
+	gint64 free_pages = 0;
+	gint64 now;
+	gint64 pages = 0;
 	gint rc;
-	guint32 id = G_MAXUINT32;
+
+	g_rec_mutex_lock (&priv->mutex);
+	priv->maintaining = TRUE;
+	if (finished != NULL)
+		*finished = FALSE;
 
 	/* ensure db is loaded */
 	ret = ch_database_load (database, error);
 	if (!ret)
 		goto out;
-
-	/* find */
-	statement = g_strdup_printf ("SELECT device_id "
-				     "FROM devices WHERE state = '%i' AND hw_ver = '%i' "
-				     "ORDER BY device_id ASC LIMIT 1", state, hw_ver);
-	rc = sqlite3_exec (priv->db,
-			   statement,
-			   ch_database_device_find_oldest_cb,
-			   &id,
-			   &error_msg);
-	if (rc != SQLITE_OK) {
-		g_set_error (error, 1, 0,
-			     "failed to find entry: %s",
-			     sqlite3_errmsg (priv->db));
+	if (priv->transaction_depth > 0) {
+		ret = FALSE;
+		g_set_error_literal (error, 1, 0,
+				     "cannot maintain the database in a transaction");
 		goto out;
 	}
-	if (id == G_MAXUINT32) {
-		g_set_error (error, 1, 0,
-			     "No devices in state %s",
-			     ch_database_state_to_string (state));
+
+	/* sampling each index keeps this quick */
+	now = g_get_real_time ();
+	ret = ch_database_get_metadata (database, "maintenance_analyzed",
+					&analyzed, error);
+	if (!ret)
+		goto out;
+	if (now - analyzed > CH_DATABASE_ANALYZE_INTERVAL) {
+		g_debug ("updating the database statistics");
+		ret = ch_database_exec (database,
+					"PRAGMA analysis_limit="
+					CH_DATABASE_ANALYZE_LIMIT ";"
+					"ANALYZE main;",
+					error);
+		if (!ret)
+			goto out;
+		ret = ch_database_set_metadata (database, "maintenance_analyzed",
+						now, error);
 		goto out;
 	}
-out:
-	g_free (statement);
-	return id;
-}
-
-static gint
-ch_database_order_get_device_ids_cb (void *data, gint argc, gchar **argv, gchar **col_name)
-{
-	GArray *array = (GArray *) data;
-	guint32 tmp;
-	tmp = atoi (argv[0]);
-	g_array_append_val (array, tmp);
-	return 0;
-}
-
-GArray *
-ch_database_order_get_device_ids (ChDatabase *database,
-				 guint32 order_id,
-				 GError **error)
-{
-	ChDatabasePrivate *priv = database->priv;
-	GArray *array = NULL;
-	GArray *array_tmp = NULL;
-	gboolean ret;
-	gchar *error_msg = NULL;
-	gchar *statement = NULL;
-	gint rc;
 
-	/* ensure db is loaded */
-	ret = ch_database_load (database, error);
+	/* each page given back is a write, so only do a few at a time */
+	ret = ch_database_get_pragma (database, "auto_vacuum", &auto_vacuum, error);
 	if (!ret)
 		goto out;
+	ret = ch_database_get_pragma (database, "page_count", &pages, error);
+	if (!ret)
+		goto out;
+	ret = ch_database_get_pragma (database, "freelist_count", &free_pages, error);
+	if (!ret)
+		goto out;
+	if (auto_vacuum == 2 && free_pages > 0) {
+		g_debug ("giving back %" G_GINT64_FORMAT " free pages", free_pages);
+		ret = ch_database_exec (database,
+					"PRAGMA main.incremental_vacuum("
+					CH_DATABASE_VACUUM_PAGES ");",
+					error);
+		if (!ret)
+			goto out;
+		ret = ch_database_set_metadata (database, "maintenance_vacuumed",
+						now, error);
+		goto out;
+	}
 
-	/* find */
-	array_tmp = g_array_new (FALSE, FALSE, sizeof (guint32));
-	statement = g_strdup_printf ("SELECT device_id "
-				     "FROM devices WHERE order_id = '%i' "
-				     "ORDER BY device_id DESC", order_id);
-	rc = sqlite3_exec (priv->db,
-			   statement,
-			   ch_database_order_get_device_ids_cb,
-			   array_tmp,
-			   &error_msg);
-	if (rc != SQLITE_OK) {
-		g_set_error (error, 1, 0,
-			     "failed to find entry: %s",
-			     sqlite3_errmsg (priv->db));
+	/* this picks up the auto_vacuum mode set when loading */
+	if ((flags & CH_DATABASE_MAINTAIN_FLAG_REBUILD) > 0 &&
+	    auto_vacuum == 0 && free_pages * 4 > pages) {
+		g_message ("rebuilding database to give back %" G_GINT64_FORMAT
+			   " of %" G_GINT64_FORMAT " pages", free_pages, pages);
+		ret = ch_database_exec (database, "VACUUM main;", error);
+		if (!ret)
+			goto out;
+		ret = ch_database_set_metadata (database, "maintenance_vacuumed",
+						now, error);
 		goto out;
 	}
-	if (array_tmp->len == 0) {
+
+	/* this does not wait for readers, so some may be left until later */
+	rc = sqlite3_wal_checkpoint_v2 (priv->db, "main",
+					SQLITE_CHECKPOINT_PASSIVE, NULL, NULL);
+	if (rc != SQLITE_OK && rc != SQLITE_BUSY) {
+		ret = FALSE;
 		g_set_error (error, 1, 0,
-			     "No devices for order %i", order_id);
+			     "failed to checkpoint: %s",
+			     sqlite3_errmsg (priv->db));
 		goto out;
 	}
-	array = g_array_ref (array_tmp);
+	if (finished != NULL)
+		*finished = TRUE;
 out:
-	if (array_tmp != NULL)
-		g_array_unref (array_tmp);
-	g_free (statement);
-	return array;
+	priv->maintaining = FALSE;
+	g_rec_mutex_unlock (&priv->mutex);
+	return ret;
 }
 
-static gint
-ch_database_order_get_comment_cb (void *data, gint argc, gchar **argv, gchar **col_name)
+static void
+ch_database_maintain_thread_cb (GTask *task,
+				gpointer source_object,
+				gpointer task_data,
+				GCancellable *cancellable)
 {
-	gchar **comment = (gchar **) data;
-	*comment = g_strdup (argv[0]);
-	return 0;
+	ChDatabase *database = CH_DATABASE (source_object);
+	GError *error = NULL;
+	gboolean finished = FALSE;
+
+	/* a rebuild would stop every station for too long */
+	if (!ch_database_maintain (database, CH_DATABASE_MAINTAIN_FLAG_NONE,
+				   &finished, &error)) {
+		g_task_return_error (task, error);
+		return;
+	}
+	g_task_return_boolean (task, finished);
 }
 
-gchar *
-ch_database_order_get_comment (ChDatabase *database,
-				guint32 order_id,
-				GError **error)
+static void
+ch_database_maintain_cb (GObject *source, GAsyncResult *res, gpointer user_data)
 {
+	ChDatabase *database = CH_DATABASE (source);
 	ChDatabasePrivate *priv = database->priv;
-	gboolean ret;
-	gchar *error_msg = NULL;
-	gchar *statement = NULL;
-	gint rc;
-	gchar *comment = NULL;
-
-	/* ensure db is loaded */
-	ret = ch_database_load (database, error);
-	if (!ret)
-		goto out;
+	GError *error = NULL;
+	gboolean finished;
 
-	/* find */
-	statement = g_strdup_printf ("SELECT comment "
-				     "FROM orders WHERE order_id = '%i';", order_id);
-	rc = sqlite3_exec (priv->db,
-			   statement,
-			   ch_database_order_get_comment_cb,
-			   &comment,
-			   &error_msg);
-	if (rc != SQLITE_OK) {
-		g_set_error (error, 1, 0,
-			     "failed to find entry: %s",
-			     sqlite3_errmsg (priv->db));
-		goto out;
+	priv->maintenance_pending = FALSE;
+	finished = g_task_propagate_boolean (G_TASK (res), &error);
+	if (error != NULL) {
+		g_warning ("failed to maintain database: %s", error->message);
+		g_error_free (error);
+		finished = TRUE;
 	}
 
-	/* don't return NULL for success */
-	if (comment == NULL)
-		comment = g_strdup ("");
-out:
-	g_free (statement);
-	return comment;
+	/* nothing more to do until the database is next used */
+	if (finished)
+		priv->maintained = g_get_monotonic_time ();
 }
 
-static gint
-ch_database_get_all_orders_cb (void *data, gint argc, gchar **argv, gchar **col_name)
+static gboolean
+ch_database_maintenance_timeout_cb (gpointer user_data)
 {
-	GPtrArray *array = (GPtrArray *) data;
-	ChDatabaseOrder *order;
-	order = g_new0 (ChDatabaseOrder, 1);
-	order->order_id = atoi (argv[0]);
-	order->name = g_strdup (argv[1]);
-	order->address = g_strdup (argv[2]);
-	order->email = g_strdup (argv[3]);
-	order->postage = atoi (argv[4]);
-	order->tracking_number = g_strdup (argv[5]);
-	order->sent_date = g_ascii_strtoll (argv[6], NULL, 10);
-	order->comment = g_strdup (argv[7]);
-	order->state = argv[8] != NULL ? atoi (argv[8]) : 0;
-	g_ptr_array_add (array, order);
-	return 0;
+	ChDatabase *database = CH_DATABASE (user_data);
+	ChDatabasePrivate *priv = database->priv;
+	GTask *task;
+
+	if (priv->maintenance_pending)
+		return G_SOURCE_CONTINUE;
+	if (priv->used < priv->maintained)
+		return G_SOURCE_CONTINUE;
+	if (g_get_monotonic_time () - priv->used <
+	    (gint64) priv->maintenance_idle * G_USEC_PER_SEC)
+		return G_SOURCE_CONTINUE;
+	priv->maintenance_pending = TRUE;
+	ch_database_task_new (database,
+			      ch_database_maintain_thread_cb,
+			      ch_database_maintenance_timeout_cb,
+			      NULL, ch_database_maintain_cb, NULL,
+			      &task);
+	ch_database_task_push (database, task);
+	return G_SOURCE_CONTINUE;
 }
 
 /**
- * ch_database_get_all_orders:
+ * ch_database_set_maintenance:
  * @database: a valid #ChDatabase instance
- * @error: A #GError or %NULL
- *
- * xxxxxxxxxxxxxxxx
+ * @idle: how long the database has to be unused before maintaining it,
+ *        in seconds, or 0 to disable
  *
- * Return value: xxxxxxxxxxxxxxxxxxxxxxxxx
+ * Runs ch_database_maintain() in the background, one step at a time, when
+ * nothing has used the database for @idle seconds. Using the database
+ * stops the maintenance after the current step until it is idle again, as
+ * does another station changing it if ch_database_watch() has been called.
  **/
-GPtrArray *
-ch_database_get_all_orders (ChDatabase *database,
-			    GError **error)
+void
+ch_database_set_maintenance (ChDatabase *database, guint idle)
 {
 	ChDatabasePrivate *priv = database->priv;
-	gboolean ret;
-	gchar *error_msg = NULL;
-	gchar *statement = NULL;
-	gint rc;
-	GPtrArray *orders = NULL;
-	GPtrArray *orders_tmp = NULL;
 
-	/* ensure db is loaded */
-	ret = ch_database_load (database, error);
-	if (!ret)
-		goto out;
+	g_return_if_fail (CH_IS_DATABASE (database));
 
-	/* find */
-	orders_tmp = g_ptr_array_new ();
-	statement = g_strdup ("SELECT order_id, name, address, email, "
-			      "postage, tracking_number, sent_date, "
-			      "comment, state "
-			      "FROM orders "
-			      "ORDER BY order_id DESC LIMIT 1500");
-	rc = sqlite3_exec (priv->db,
-			   statement,
-			   ch_database_get_all_orders_cb,
-			   orders_tmp,
-			   &error_msg);
-	if (rc != SQLITE_OK) {
-		g_set_error (error, 1, 0,
-			     "failed to find entry: %s",
-			     sqlite3_errmsg (priv->db));
-		goto out;
+	if (priv->maintenance_id != 0) {
+		g_source_remove (priv->maintenance_id);
+		priv->maintenance_id = 0;
 	}
+	priv->maintenance_idle = idle;
+	if (idle == 0)
+		return;
+	priv->maintenance_id = g_timeout_add_seconds_full (G_PRIORITY_LOW,
+							   CH_DATABASE_MAINTENANCE_INTERVAL,
+							   ch_database_maintenance_timeout_cb,
+							   database, NULL);
+}
 
-	/* success */
-	orders = g_ptr_array_ref (orders_tmp);
-out:
-	if (orders_tmp != NULL)
-		g_ptr_array_unref (orders_tmp);
-	g_free (statement);
-	return orders;
+/* gets a single integer from a statement */
+static gboolean
+ch_database_get_stmt_value (ChDatabase *database,
+			    ChDatabaseStmt id,
+			    gint64 *value,
+			    GError **error)
+{
+	gint rc;
+	sqlite3_stmt *stmt;
+
+	stmt = ch_database_get_stmt (database, id, error);
+	if (stmt == NULL)
+		return FALSE;
+	rc = ch_database_step (database, stmt);
+	if (rc != SQLITE_ROW) {
+		g_set_error (error, 1, 0,
+			     "failed to run '%s': %s",
+			     ch_database_stmt_sql[id],
+			     sqlite3_errmsg (database->priv->db));
+		sqlite3_reset (stmt);
+		return FALSE;
+	}
+	*value = sqlite3_column_int64 (stmt, 0);
+	sqlite3_reset (stmt);
+	return TRUE;
 }
 
-/**
- * ch_database_add_order:
- * @database: a valid #ChDatabase instance
- * @error: A #GError or %NULL
- *
- * Add a new order to the database
- *
- * Return value: The new device serial number or 0 for error
- **/
-guint32
-ch_database_add_order (ChDatabase *database,
-		       const gchar *name,
-		       const gchar *address,
-		       const gchar *email,
-		       ChShippingKind postage,
-		       GError **error)
+static void
+ch_database_check_changed_thread_cb (GTask *task,
+				     gpointer source_object,
+				     gpointer task_data,
+				     GCancellable *cancellable)
 {
+	ChDatabase *database = CH_DATABASE (source_object);
 	ChDatabasePrivate *priv = database->priv;
-	gboolean ret;
-	gchar *error_msg = NULL;
-	gchar *statement = NULL;
+	ChDatabaseChangedFlags flags = CH_DATABASE_CHANGED_NONE;
+	const gchar *key;
+	GError *error = NULL;
+	gint64 data_version;
+	gint64 devices_generation = 0;
+	gint64 orders_generation = 0;
 	gint rc;
-	guint32 id = G_MAXUINT32;
+	sqlite3_stmt *stmt = NULL;
 
-	/* ensure db is loaded */
-	ret = ch_database_load (database, error);
-	if (!ret)
-		goto out;
+	if (!ch_database_load (database, &error)) {
+		g_task_return_error (task, error);
+		return;
+	}
 
-	/* add newest */
-	statement = sqlite3_mprintf ("INSERT INTO orders (name, address, email, postage, tracking_number, sent_date) "
-				     "VALUES ('%q', '%q', '%q', '%i', '', '');",
-				     name,
-				     address,
-				     email,
-				     postage);
-	rc = sqlite3_exec (priv->db, statement, NULL, NULL, &error_msg);
-	if (rc != SQLITE_OK) {
-		g_set_error (error, 1, 0,
-			     "failed to add entry: %s",
-			     sqlite3_errmsg (priv->db));
+	/* this only changes when another connection commits */
+	if (!ch_database_get_stmt_value (database, CH_DATABASE_STMT_DATA_VERSION,
+					 &data_version, &error)) {
+		g_task_return_error (task, error);
+		return;
+	}
+	if (priv->changed_valid && data_version == priv->data_version)
 		goto out;
+
+	/* another station is busy, so leave any maintenance until later */
+	if (priv->changed_valid)
+		priv->used = g_get_monotonic_time ();
+
+	/* find out what changed */
+	stmt = ch_database_get_stmt (database, CH_DATABASE_STMT_GET_GENERATIONS, &error);
+	if (stmt == NULL) {
+		g_task_return_error (task, error);
+		return;
+	}
+	while ((rc = ch_database_step (database, stmt)) == SQLITE_ROW) {
+		key = (const gchar *) sqlite3_column_text (stmt, 0);
+		if (g_strcmp0 (key, "orders_generation") == 0)
+			orders_generation = sqlite3_column_int64 (stmt, 1);
+		else if (g_strcmp0 (key, "devices_generation") == 0)
+			devices_generation = sqlite3_column_int64 (stmt, 1);
+	}
+	sqlite3_reset (stmt);
+	if (rc != SQLITE_DONE) {
+		g_task_return_new_error (task, 1, 0,
+					 "failed to get generations: %s",
+					 sqlite3_errmsg (priv->db));
+		return;
 	}
 
-	/* yay, atomic serial number */
-	id = sqlite3_last_insert_rowid (priv->db);
+	/* the first check just sets the baseline */
+	if (priv->changed_valid) {
+		if (orders_generation != priv->orders_generation)
+			flags |= CH_DATABASE_CHANGED_ORDERS;
+		if (devices_generation != priv->devices_generation)
+			flags |= CH_DATABASE_CHANGED_DEVICES;
+	}
+	priv->data_version = data_version;
+	priv->orders_generation = orders_generation;
+	priv->devices_generation = devices_generation;
+	priv->changed_valid = TRUE;
 out:
-	sqlite3_free (statement);
-	return id;
+	g_task_return_int (task, flags);
+}
+
+static void
+ch_database_check_changed_cb (GObject *source, GAsyncResult *res, gpointer user_data)
+{
+	ChDatabase *database = CH_DATABASE (source);
+	ChDatabaseChangedFlags flags;
+	GError *error = NULL;
+
+	database->priv->changed_pending = FALSE;
+	flags = g_task_propagate_int (G_TASK (res), &error);
+	if (error != NULL) {
+		g_debug ("failed to check for changes: %s", error->message);
+		g_error_free (error);
+		return;
+	}
+	if (flags == CH_DATABASE_CHANGED_NONE)
+		return;
+	g_debug ("database changed by another process: 0x%02x", flags);
+	g_signal_emit (database, signals[SIGNAL_CHANGED], 0, flags);
+}
+
+static void
+ch_database_check_changed (ChDatabase *database)
+{
+	GTask *task;
+
+	/* already checking */
+	if (database->priv->changed_pending)
+		return;
+	database->priv->changed_pending = TRUE;
+	ch_database_task_new (database,
+			      ch_database_check_changed_thread_cb,
+			      ch_database_check_changed,
+			      NULL, ch_database_check_changed_cb, NULL,
+			      &task);
+	ch_database_task_push (database, task);
 }
 
 static void
@@ -801,6 +6808,22 @@ ch_database_class_init (ChDatabaseClass *klass)
 {
 	GObjectClass *object_class = G_OBJECT_CLASS (klass);
 	object_class->finalize = ch_database_finalize;
+
+	/**
+	 * ChDatabase::changed:
+	 * @database: the #ChDatabase instance that emitted the signal
+	 * @flags: the #ChDatabaseChangedFlags
+	 *
+	 * The ::changed signal is emitted when another process, for instance
+	 * the other station, has changed the database.
+	 **/
+	signals[SIGNAL_CHANGED] =
+		g_signal_new ("changed",
+			      G_TYPE_FROM_CLASS (object_class), G_SIGNAL_RUN_LAST,
+			      G_STRUCT_OFFSET (ChDatabaseClass, changed),
+			      NULL, NULL, g_cclosure_marshal_VOID__UINT,
+			      G_TYPE_NONE, 1, G_TYPE_UINT);
+
 	g_type_class_add_private (klass, sizeof (ChDatabasePrivate));
 }
 
@@ -808,6 +6831,10 @@ static void
 ch_database_init (ChDatabase *database)
 {
 	database->priv = CH_DATABASE_GET_PRIVATE (database);
+	database->priv->journal_mode = g_strdup ("delete");
+	g_rec_mutex_init (&database->priv->mutex);
+	database->priv->busy_timeout = 10000;
+	database->priv->station = g_strdup (g_get_host_name ());
 }
 
 static void
@@ -815,12 +6842,54 @@ ch_database_finalize (GObject *object)
 {
 	ChDatabase *database = CH_DATABASE (object);
 	ChDatabasePrivate *priv = database->priv;
+	guint i;
 
+	/* tasks hold a reference and are released on the main context, so
+	 * the queue is already empty and this is not the database thread */
+	if (priv->pool != NULL)
+		g_thread_pool_free (priv->pool, TRUE, TRUE);
+	if (priv->profile != NULL) {
+		/* nothing run from here on is added to the profile */
+		if (priv->db != NULL)
+			sqlite3_trace_v2 (priv->db, 0, NULL, NULL);
+		ch_database_profile_dump (database);
+		g_source_remove (priv->profile_signal_id);
+		g_hash_table_unref (priv->profile);
+		priv->profile = NULL;
+	}
 	g_free (priv->uri);
-	if (priv->db != NULL)
+	g_free (priv->journal_mode);
+	for (i = 0; i < CH_DATABASE_STMT_LAST; i++)
+		sqlite3_finalize (priv->stmts[i]);
+#ifdef HAVE_SQLITE_SESSION
+	if (priv->session != NULL)
+		sqlite3session_delete (priv->session);
+#endif
+	if (priv->db != NULL) {
+		/* updates the statistics for what this connection used */
+		sqlite3_exec (priv->db, "PRAGMA optimize;", NULL, NULL, NULL);
 		sqlite3_close (priv->db);
+	}
+	if (priv->changed_id != 0)
+		g_source_remove (priv->changed_id);
+	if (priv->poll_id != 0)
+		g_source_remove (priv->poll_id);
+	if (priv->backup_id != 0)
+		g_source_remove (priv->backup_id);
+	if (priv->replicate_id != 0)
+		g_source_remove (priv->replicate_id);
+	if (priv->maintenance_id != 0)
+		g_source_remove (priv->maintenance_id);
+	g_free (priv->backup_filename);
+	g_free (priv->spool_dir);
+	g_free (priv->replicate_error);
+	g_free (priv->archive_uri);
+	g_free (priv->station);
 	if (priv->file_monitor != NULL)
 		g_object_unref (priv->file_monitor);
+	if (priv->file_monitor_wal != NULL)
+		g_object_unref (priv->file_monitor_wal);
+	g_rec_mutex_clear (&priv->mutex);
 
 	G_OBJECT_CLASS (ch_database_parent_class)->finalize (object);
 }
@@ -832,4 +6901,3 @@ ch_database_new (void)
 	database = g_object_new (CH_TYPE_DATABASE, NULL);
 	return CH_DATABASE (database);
 }
-
@@ -23,6 +23,7 @@
 #define __CH_DATABASE_H
 
 #include <glib-object.h>
+#include <gio/gio.h>
 
 #include "ch-shipping-common.h"
 
@@ -42,28 +43,155 @@ struct _ChDatabase
 	 ChDatabasePrivate		*priv;
 };
 
+typedef enum {
+	CH_DATABASE_CHANGED_NONE	= 0,
+	CH_DATABASE_CHANGED_ORDERS	= 1 << 0,
+	CH_DATABASE_CHANGED_DEVICES	= 1 << 1,
+	CH_DATABASE_CHANGED_LAST
+} ChDatabaseChangedFlags;
+
 struct _ChDatabaseClass
 {
 	GObjectClass			 parent_class;
+	void				(*changed)	(ChDatabase		*database,
+							 ChDatabaseChangedFlags	 flags);
 };
 
 typedef struct {
 	ChShippingKind postage;
-	gchar		*address;
-	gchar		*email;
-	gchar		*name;
-	gchar		*tracking_number;
+	const gchar	*address;
+	const gchar	*email;
+	const gchar	*name;
+	const gchar	*tracking_number;
 	gint64		 sent_date;
 	guint32		 order_id;
-	gchar		*comment;
+	const gchar	*comment;
 	ChOrderState	 state;
+	const guint32	*device_ids;
+	guint		 device_ids_len;
+	gboolean	 archived;
+	const gchar	*address_lines;
+	const gchar	*postcode;
+	const gchar	*country;
+	const gchar	*address_latex;
 } ChDatabaseOrder;
 
+typedef struct {
+	ChDatabaseOrder	*orders;
+	guint		 len;
+	/*< private >*/
+	GArray		*orders_array;
+	GArray		*device_ids;
+	GStringChunk	*strings;
+} ChDatabaseOrderList;
+
+typedef struct {
+	guint32		 email_id;
+	guint32		 order_id;
+	gchar		*recipient;
+	gchar		*subject;
+	gchar		*body;
+} ChDatabaseEmail;
+
+typedef struct {
+	guint		 hw_ver;
+	ChDeviceState	 state;
+	guint		 count;
+} ChDatabaseInventory;
+
+typedef enum {
+	CH_DATABASE_REPORT_SALES,
+	CH_DATABASE_REPORT_CALIBRATIONS,
+	CH_DATABASE_REPORT_ORDERS,
+	CH_DATABASE_REPORT_CALIBRATION_RATE,
+	CH_DATABASE_REPORT_LAST
+} ChDatabaseReport;
+
+typedef struct {
+	guint		 orders;
+	gint64		 order_lead_time;	/* median, in us */
+	guint		 devices;
+	gint64		 shipping_time;		/* median, in us */
+} ChDatabaseThroughput;
+
+typedef struct {
+	gint64		 analyzed;	/* real time in us, or 0 for never */
+	gint64		 vacuumed;	/* real time in us, or 0 for never */
+	guint		 pages;
+	guint		 free_pages;	/* still to be given back */
+} ChDatabaseMaintenance;
+
+typedef struct {
+	guint32		 device_id;
+	guint		 hw_ver;
+	gint64		 created;	/* real time in us */
+	gdouble		 determinant;
+	GBytes		*ti3;
+	GBytes		*ccmx;
+} ChDatabaseCalibration;
+
+typedef enum {
+	CH_DATABASE_SEARCH_FLAG_NONE	= 0,
+	CH_DATABASE_SEARCH_FLAG_ARCHIVE	= 1 << 0,
+	CH_DATABASE_SEARCH_FLAG_LAST
+} ChDatabaseSearchFlags;
+
+typedef enum {
+	CH_DATABASE_MAINTAIN_FLAG_NONE		= 0,
+	CH_DATABASE_MAINTAIN_FLAG_REBUILD	= 1 << 0,
+	CH_DATABASE_MAINTAIN_FLAG_LAST
+} ChDatabaseMaintainFlags;
+
+typedef enum {
+	CH_DATABASE_FORMAT_UNKNOWN,
+	CH_DATABASE_FORMAT_CSV,
+	CH_DATABASE_FORMAT_NDJSON,
+	CH_DATABASE_FORMAT_LAST
+} ChDatabaseFormat;
+
 GType		 ch_database_get_type		(void);
 ChDatabase	*ch_database_new		(void);
 void		 ch_database_set_uri		(ChDatabase	*database,
 						 const gchar	*uri);
+void		 ch_database_watch		(ChDatabase	*database);
+void		 ch_database_set_archive_uri	(ChDatabase	*database,
+						 const gchar	*uri);
+void		 ch_database_set_journal_mode	(ChDatabase	*database,
+						 const gchar	*journal_mode);
+void		 ch_database_set_busy_timeout	(ChDatabase	*database,
+						 guint		 busy_timeout);
+void		 ch_database_set_backup		(ChDatabase	*database,
+						 const gchar	*filename,
+						 guint		 interval);
+void		 ch_database_set_replication	(ChDatabase	*database,
+						 const gchar	*spool_dir,
+						 const gchar	*station,
+						 guint		 interval);
+gboolean	 ch_database_replicate		(ChDatabase	*database,
+						 guint		*applied,
+						 GCancellable	*cancellable,
+						 GError		**error);
+void		 ch_database_set_maintenance	(ChDatabase	*database,
+						 guint		 idle);
+gboolean	 ch_database_maintain		(ChDatabase	*database,
+						 ChDatabaseMaintainFlags flags,
+						 gboolean	*finished,
+						 GError		**error);
+gboolean	 ch_database_get_maintenance	(ChDatabase	*database,
+						 ChDatabaseMaintenance *maintenance,
+						 GError		**error);
+gboolean	 ch_database_backup		(ChDatabase	*database,
+						 const gchar	*filename,
+						 GCancellable	*cancellable,
+						 GError		**error);
 const gchar	*ch_database_state_to_string	(ChDeviceState state);
+ChDeviceState	 ch_database_state_from_string	(const gchar	*state);
+gboolean	 ch_database_begin		(ChDatabase	*database,
+						 GError		**error);
+gboolean	 ch_database_commit		(ChDatabase	*database,
+						 GError		**error);
+gboolean	 ch_database_rollback		(ChDatabase	*database,
+						 GError		**error);
 guint32		 ch_database_add_device		(ChDatabase	*database,
 						 guint		 hw_ver,
 						 GError		**error);
@@ -75,6 +203,10 @@ gboolean	 ch_database_device_set_state	(ChDatabase	*database,
 						 guint32	 device_id,
 						 ChDeviceState	 state,
 						 GError		**error);
+gboolean	 ch_database_devices_set_state	(ChDatabase	*database,
+						 GArray		*device_ids,
+						 ChDeviceState	 state,
+						 GError		**error);
 ChDeviceState	 ch_database_device_get_state	(ChDatabase	*database,
 						 guint32	 device_id,
 						 GError		**error);
@@ -90,6 +222,10 @@ gboolean	 ch_database_order_set_state	(ChDatabase	*database,
 						 guint32	 order_id,
 						 ChOrderState	 state,
 						 GError		**error);
+gboolean	 ch_database_orders_set_state	(ChDatabase	*database,
+						 GArray		*order_ids,
+						 ChOrderState	 state,
+						 GError		**error);
 gchar		*ch_database_order_get_comment	(ChDatabase	*database,
 						 guint32	 order_id,
 						 GError		**error);
@@ -97,6 +233,11 @@ guint32		 ch_database_device_find_oldest	(ChDatabase	*database,
 						 ChDeviceState state,
 						 guint		 hw_ver,
 						 GError		**error);
+GArray		*ch_database_allocate_devices	(ChDatabase	*database,
+						 guint32	 order_id,
+						 guint		 hw_ver,
+						 guint		 count,
+						 GError		**error);
 GArray		*ch_database_order_get_device_ids (ChDatabase	*database,
 						 guint32	 order_id,
 						 GError		**error);
@@ -104,7 +245,44 @@ guint		 ch_database_device_get_number	(ChDatabase	*database,
 						 ChDeviceState	 state,
 						 guint		 hw_ver,
 						 GError		**error);
-GPtrArray	*ch_database_get_all_orders	(ChDatabase	*database,
+GArray		*ch_database_get_inventory	(ChDatabase	*database,
+						 GError		**error);
+void		 ch_database_order_list_free	(ChDatabaseOrderList *list);
+ChDatabaseOrderList *ch_database_get_all_orders	(ChDatabase	*database,
+						 GError		**error);
+ChDatabaseOrderList *ch_database_get_orders	(ChDatabase	*database,
+						 guint32	 before,
+						 guint		 limit,
+						 GError		**error);
+gboolean	 ch_database_get_orders_generation (ChDatabase	*database,
+						 guint64	*generation,
+						 GError		**error);
+ChDatabaseOrderList *ch_database_get_orders_changed (ChDatabase	*database,
+						 guint64	 since,
+						 guint64	*generation,
+						 GError		**error);
+ChDatabaseOrderList *ch_database_search_orders	(ChDatabase	*database,
+						 const gchar	*search,
+						 guint		 limit,
+						 ChDatabaseSearchFlags flags,
+						 GError		**error);
+gboolean	 ch_database_archive_orders	(ChDatabase	*database,
+						 guint		 age,
+						 guint		*archived,
+						 GError		**error);
+gboolean	 ch_database_get_throughput	(ChDatabase	*database,
+						 gint64		 since,
+						 ChDatabaseThroughput *throughput,
+						 GError		**error);
+gboolean	 ch_database_check_plans	(ChDatabase	*database,
+						 GError		**error);
+ChDatabaseFormat ch_database_format_from_filename (const gchar	*filename);
+ChDatabaseReport ch_database_report_from_string	(const gchar	*report);
+gboolean	 ch_database_export		(ChDatabase	*database,
+						 ChDatabaseReport report,
+						 ChDatabaseFormat format,
+						 GOutputStream	*stream,
+						 GCancellable	*cancellable,
 						 GError		**error);
 guint32		 ch_database_add_order		(ChDatabase	*database,
 						 const gchar	*name,
@@ -112,6 +290,103 @@ guint32		 ch_database_add_order		(ChDatabase	*database,
 						 const gchar	*email,
 						 ChShippingKind postage,
 						 GError		**error);
+guint32		 ch_database_add_email		(ChDatabase	*database,
+						 guint32	 order_id,
+						 const gchar	*recipient,
+						 const gchar	*subject,
+						 const gchar	*body,
+						 GError		**error);
+void		 ch_database_calibration_free	(ChDatabaseCalibration *calibration);
+gboolean	 ch_database_add_calibration	(ChDatabase	*database,
+						 const ChDatabaseCalibration *calibration,
+						 GError		**error);
+ChDatabaseCalibration *ch_database_get_calibration (ChDatabase	*database,
+						 guint32	 device_id,
+						 GError		**error);
+gboolean	 ch_database_export_calibrations (ChDatabase	*database,
+						 const gchar	*directory,
+						 guint		 hw_ver,
+						 guint		*exported,
+						 GCancellable	*cancellable,
+						 GError		**error);
+void		 ch_database_email_free		(ChDatabaseEmail *email);
+GPtrArray	*ch_database_get_queued_emails	(ChDatabase	*database,
+						 GError		**error);
+gboolean	 ch_database_email_set_sent	(ChDatabase	*database,
+						 guint32	 email_id,
+						 GError		**error);
+
+/* async versions, run on the database thread */
+void		 ch_database_get_orders_async	(ChDatabase	*database,
+						 guint32	 before,
+						 guint		 limit,
+						 GCancellable	*cancellable,
+						 GAsyncReadyCallback callback,
+						 gpointer	 user_data);
+ChDatabaseOrderList *ch_database_get_orders_finish (ChDatabase	*database,
+						 GAsyncResult	*res,
+						 guint64	*generation,
+						 GError		**error);
+void		 ch_database_search_orders_async (ChDatabase	*database,
+						 const gchar	*search,
+						 guint		 limit,
+						 ChDatabaseSearchFlags flags,
+						 GCancellable	*cancellable,
+						 GAsyncReadyCallback callback,
+						 gpointer	 user_data);
+ChDatabaseOrderList *ch_database_search_orders_finish (ChDatabase *database,
+						 GAsyncResult	*res,
+						 GError		**error);
+void		 ch_database_get_orders_changed_async (ChDatabase *database,
+						 guint64	 since,
+						 GCancellable	*cancellable,
+						 GAsyncReadyCallback callback,
+						 gpointer	 user_data);
+ChDatabaseOrderList *ch_database_get_orders_changed_finish (ChDatabase *database,
+						 GAsyncResult	*res,
+						 guint64	*generation,
+						 GError		**error);
+void		 ch_database_get_inventory_async (ChDatabase	*database,
+						 GCancellable	*cancellable,
+						 GAsyncReadyCallback callback,
+						 gpointer	 user_data);
+GArray		*ch_database_get_inventory_finish (ChDatabase	*database,
+						 GAsyncResult	*res,
+						 GError		**error);
+void		 ch_database_device_set_state_async (ChDatabase *database,
+						 guint32	 id,
+						 ChDeviceState	 state,
+						 GCancellable	*cancellable,
+						 GAsyncReadyCallback callback,
+						 gpointer	 user_data);
+gboolean	 ch_database_device_set_state_finish (ChDatabase *database,
+						 GAsyncResult	*res,
+						 GError		**error);
+void		 ch_database_add_calibration_async (ChDatabase *database,
+						 const ChDatabaseCalibration *calibration,
+						 GCancellable	*cancellable,
+						 GAsyncReadyCallback callback,
+						 gpointer	 user_data);
+gboolean	 ch_database_add_calibration_finish (ChDatabase *database,
+						 GAsyncResult	*res,
+						 GError		**error);
+void		 ch_database_order_set_state_async (ChDatabase	*database,
+						 guint32	 order_id,
+						 ChOrderState	 state,
+						 GCancellable	*cancellable,
+						 GAsyncReadyCallback callback,
+						 gpointer	 user_data);
+gboolean	 ch_database_order_set_state_finish (ChDatabase *database,
+						 GAsyncResult	*res,
+						 GError		**error);
+void		 ch_database_backup_async	(ChDatabase	*database,
+						 const gchar	*filename,
+						 GCancellable	*cancellable,
+						 GAsyncReadyCallback callback,
+						 gpointer	 user_data);
+gboolean	 ch_database_backup_finish	(ChDatabase	*database,
+						 GAsyncResult	*res,
+						 GError		**error);
 
 G_END_DECLS
 
@@ -0,0 +1,949 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*-
+ *
+ * Copyright (C) 2011-2012 Richard Hughes <richard@hughsie.com>
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "config.h"
+
+#include <glib/gi18n.h>
+#include <gio/gio.h>
+#include <gio/gunixinputstream.h>
+#include <gio/gunixoutputstream.h>
+#include <locale.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ch-database.h"
+
+/* the number of orders to show when no limit is given */
+#define CH_DB_DEFAULT_LIMIT		100
+
+typedef struct {
+	ChDatabase		*database;
+	ChDatabaseFormat	 format;
+	GOutputStream		*output;
+	GPtrArray		*cmd_array;
+} ChDbPrivate;
+
+typedef gboolean (*ChDbPrivateCb)	(ChDbPrivate	*priv,
+					 gchar		**values,
+					 GError		**error);
+
+typedef struct {
+	gchar		*name;
+	gchar		*arguments;
+	gchar		*description;
+	ChDbPrivateCb	 callback;
+} ChDbItem;
+
+static void
+ch_db_item_free (ChDbItem *item)
+{
+	g_free (item->name);
+	g_free (item->arguments);
+	g_free (item->description);
+	g_free (item);
+}
+
+static gint
+ch_db_sort_command_name_cb (ChDbItem **item1, ChDbItem **item2)
+{
+	return g_strcmp0 ((*item1)->name, (*item2)->name);
+}
+
+static void
+ch_db_add (GPtrArray *array,
+	   const gchar *name,
+	   const gchar *arguments,
+	   const gchar *description,
+	   ChDbPrivateCb callback)
+{
+	ChDbItem *item;
+
+	item = g_new0 (ChDbItem, 1);
+	item->name = g_strdup (name);
+	item->arguments = g_strdup (arguments);
+	item->description = g_strdup (description);
+	item->callback = callback;
+	g_ptr_array_add (array, item);
+}
+
+static gchar *
+ch_db_get_descriptions (GPtrArray *array)
+{
+	ChDbItem *item;
+	GString *string;
+	guint i;
+	guint j;
+	guint len;
+	const guint max_len = 35;
+
+	string = g_string_new ("");
+	for (i = 0; i < array->len; i++) {
+		item = g_ptr_array_index (array, i);
+		g_string_append (string, "  ");
+		g_string_append (string, item->name);
+		len = strlen (item->name) + 2;
+		if (item->arguments != NULL) {
+			g_string_append (string, " ");
+			g_string_append (string, item->arguments);
+			len += strlen (item->arguments) + 1;
+		}
+		if (len < max_len) {
+			for (j = len; j < max_len + 1; j++)
+				g_string_append_c (string, ' ');
+		} else {
+			g_string_append_c (string, '\n');
+			for (j = 0; j < max_len + 1; j++)
+				g_string_append_c (string, ' ');
+		}
+		g_string_append (string, item->description);
+		g_string_append_c (string, '\n');
+	}
+
+	/* remove trailing newline */
+	if (string->len > 0)
+		g_string_set_size (string, string->len - 1);
+
+	return g_string_free (string, FALSE);
+}
+
+static gboolean
+ch_db_run (ChDbPrivate *priv, const gchar *command, gchar **values, GError **error)
+{
+	ChDbItem *item;
+	GString *string;
+	guint i;
+
+	for (i = 0; i < priv->cmd_array->len; i++) {
+		item = g_ptr_array_index (priv->cmd_array, i);
+		if (g_strcmp0 (item->name, command) == 0)
+			return item->callback (priv, values, error);
+	}
+
+	/* not found */
+	string = g_string_new ("");
+	/* TRANSLATORS: error message */
+	g_string_append_printf (string, "%s\n",
+				_("Command not found, valid commands are:"));
+	for (i = 0; i < priv->cmd_array->len; i++) {
+		item = g_ptr_array_index (priv->cmd_array, i);
+		g_string_append_printf (string, " * %s %s\n",
+					item->name,
+					item->arguments ? item->arguments : "");
+	}
+	g_set_error_literal (error, 1, 0, string->str);
+	g_string_free (string, TRUE);
+	return FALSE;
+}
+
+static gboolean
+ch_db_parse_uint (const gchar *text, guint64 max, guint64 *value, GError **error)
+{
+	gchar *endptr = NULL;
+	guint64 tmp;
+
+	tmp = g_ascii_strtoull (text, &endptr, 10);
+	if (text[0] == '\0' || endptr[0] != '\0' || tmp > max) {
+		g_set_error (error, 1, 0, "invalid number '%s'", text);
+		return FALSE;
+	}
+	*value = tmp;
+	return TRUE;
+}
+
+/* adds IDs from the arguments, or one per line from stdin if there are none */
+static GArray *
+ch_db_get_ids (gchar **values, GError **error)
+{
+	GArray *ids;
+	GDataInputStream *data = NULL;
+	GError *error_local = NULL;
+	GInputStream *stream = NULL;
+	gboolean ret = TRUE;
+	gchar *line = NULL;
+	guint64 tmp;
+	guint32 id;
+	guint i;
+
+	ids = g_array_new (FALSE, FALSE, sizeof (guint32));
+	if (g_strv_length (values) > 0) {
+		for (i = 0; values[i] != NULL; i++) {
+			ret = ch_db_parse_uint (values[i], G_MAXUINT32, &tmp, error);
+			if (!ret)
+				goto out;
+			id = tmp;
+			g_array_append_val (ids, id);
+		}
+		goto out;
+	}
+
+	/* so that `... | colorhug-db set-device-state calibrated` works */
+	stream = g_unix_input_stream_new (STDIN_FILENO, FALSE);
+	data = g_data_input_stream_new (stream);
+	while ((line = g_data_input_stream_read_line (data, NULL, NULL, &error_local)) != NULL) {
+		g_strstrip (line);
+		if (line[0] != '\0') {
+			ret = ch_db_parse_uint (line, G_MAXUINT32, &tmp, error);
+			if (!ret)
+				goto out;
+			id = tmp;
+			g_array_append_val (ids, id);
+		}
+		g_free (line);
+	}
+	if (error_local != NULL) {
+		ret = FALSE;
+		g_propagate_error (error, error_local);
+	}
+out:
+	g_free (line);
+	if (data != NULL)
+		g_object_unref (data);
+	if (stream != NULL)
+		g_object_unref (stream);
+	if (!ret) {
+		g_array_unref (ids);
+		return NULL;
+	}
+	return ids;
+}
+
+/* writes the column names, which is only needed for CSV */
+static gboolean
+ch_db_write_header (ChDbPrivate *priv, const gchar **columns, GError **error)
+{
+	GString *str;
+	gboolean ret;
+	guint i;
+
+	if (priv->format != CH_DATABASE_FORMAT_CSV)
+		return TRUE;
+	str = g_string_new ("");
+	for (i = 0; columns[i] != NULL; i++) {
+		if (i > 0)
+			g_string_append_c (str, ',');
+		ch_shipping_string_append_csv (str, columns[i]);
+	}
+	g_string_append_c (str, '\n');
+	ret = g_output_stream_write_all (priv->output, str->str, str->len,
+					 NULL, NULL, error);
+	g_string_free (str, TRUE);
+	return ret;
+}
+
+static void
+ch_db_row_add_key (ChDbPrivate *priv, GString *str, const gchar *key)
+{
+	if (priv->format == CH_DATABASE_FORMAT_NDJSON) {
+		g_string_append_c (str, str->len == 0 ? '{' : ',');
+		ch_shipping_string_append_json (str, key);
+		g_string_append_c (str, ':');
+		return;
+	}
+	if (str->len > 0)
+		g_string_append_c (str, ',');
+}
+
+static void
+ch_db_row_add_string (ChDbPrivate *priv, GString *str,
+		      const gchar *key, const gchar *value)
+{
+	ch_db_row_add_key (priv, str, key);
+	if (value == NULL) {
+		if (priv->format == CH_DATABASE_FORMAT_NDJSON)
+			g_string_append (str, "null");
+		return;
+	}
+	if (priv->format == CH_DATABASE_FORMAT_NDJSON)
+		ch_shipping_string_append_json (str, value);
+	else
+		ch_shipping_string_append_csv (str, value);
+}
+
+static void
+ch_db_row_add_int (ChDbPrivate *priv, GString *str,
+		   const gchar *key, gint64 value)
+{
+	ch_db_row_add_key (priv, str, key);
+	g_string_append_printf (str, "%" G_GINT64_FORMAT, value);
+}
+
+/* a JSON array, or space separated in one CSV field */
+static void
+ch_db_row_add_ids (ChDbPrivate *priv, GString *str, const gchar *key,
+		   const guint32 *ids, guint ids_len)
+{
+	guint i;
+
+	ch_db_row_add_key (priv, str, key);
+	if (priv->format == CH_DATABASE_FORMAT_NDJSON)
+		g_string_append_c (str, '[');
+	for (i = 0; i < ids_len; i++) {
+		if (i > 0) {
+			g_string_append_c (str,
+					   priv->format == CH_DATABASE_FORMAT_NDJSON ? ',' : ' ');
+		}
+		g_string_append_printf (str, "%" G_GUINT32_FORMAT, ids[i]);
+	}
+	if (priv->format == CH_DATABASE_FORMAT_NDJSON)
+		g_string_append_c (str, ']');
+}
+
+/* writes the row and clears it for the next one */
+static gboolean
+ch_db_row_write (ChDbPrivate *priv, GString *str, GError **error)
+{
+	gboolean ret;
+
+	if (priv->format == CH_DATABASE_FORMAT_NDJSON)
+		g_string_append_c (str, '}');
+	g_string_append_c (str, '\n');
+	ret = g_output_stream_write_all (priv->output, str->str, str->len,
+					 NULL, NULL, error);
+	g_string_truncate (str, 0);
+	return ret;
+}
+
+static gboolean
+ch_db_write_orders (ChDbPrivate *priv, ChDatabaseOrderList *list, GError **error)
+{
+	ChDatabaseOrder *order;
+	GString *str;
+	gboolean ret;
+	guint i;
+	const gchar *columns[] = { "order_id", "name", "address", "email",
+				   "postage", "state", "tracking_number",
+				   "sent", "comment", "device_ids", "archived",
+				   NULL };
+
+	ret = ch_db_write_header (priv, columns, error);
+	if (!ret)
+		return FALSE;
+	str = g_string_new ("");
+	for (i = 0; i < list->len; i++) {
+		order = &list->orders[i];
+		ch_db_row_add_int (priv, str, "order_id", order->order_id);
+		ch_db_row_add_string (priv, str, "name", order->name);
+		ch_db_row_add_string (priv, str, "address", order->address);
+		ch_db_row_add_string (priv, str, "email", order->email);
+		ch_db_row_add_string (priv, str, "postage",
+				      ch_shipping_kind_to_string (order->postage));
+		ch_db_row_add_string (priv, str, "state",
+				      ch_shipping_order_state_to_string (order->state));
+		ch_db_row_add_string (priv, str, "tracking_number",
+				      order->tracking_number);
+		ch_db_row_add_int (priv, str, "sent", order->sent_date / G_USEC_PER_SEC);
+		ch_db_row_add_string (priv, str, "comment", order->comment);
+		ch_db_row_add_ids (priv, str, "device_ids",
+				   order->device_ids, order->device_ids_len);
+		ch_db_row_add_int (priv, str, "archived", order->archived);
+		ret = ch_db_row_write (priv, str, error);
+		if (!ret)
+			break;
+	}
+	g_string_free (str, TRUE);
+	return ret;
+}
+
+/**
+ * ch_db_inventory:
+ **/
+static gboolean
+ch_db_inventory (ChDbPrivate *priv, gchar **values, GError **error)
+{
+	ChDatabaseInventory *item;
+	GArray *array;
+	GString *str;
+	gboolean ret;
+	guint i;
+	const gchar *columns[] = { "hw_ver", "state", "count", NULL };
+
+	array = ch_database_get_inventory (priv->database, error);
+	if (array == NULL)
+		return FALSE;
+	str = g_string_new ("");
+	ret = ch_db_write_header (priv, columns, error);
+	for (i = 0; ret && i < array->len; i++) {
+		item = &g_array_index (array, ChDatabaseInventory, i);
+		ch_db_row_add_int (priv, str, "hw_ver", item->hw_ver);
+		ch_db_row_add_string (priv, str, "state",
+				      ch_database_state_to_string (item->state));
+		ch_db_row_add_int (priv, str, "count", item->count);
+		ret = ch_db_row_write (priv, str, error);
+	}
+	g_string_free (str, TRUE);
+	g_array_unref (array);
+	return ret;
+}
+
+/**
+ * ch_db_list_orders:
+ **/
+static gboolean
+ch_db_list_orders (ChDbPrivate *priv, gchar **values, GError **error)
+{
+	ChDatabaseOrderList *list;
+	gboolean ret;
+	guint64 before = G_MAXUINT32;
+	guint64 limit = CH_DB_DEFAULT_LIMIT;
+
+	if (g_strv_length (values) > 2) {
+		g_set_error_literal (error, 1, 0,
+				     "expected [LIMIT] [BEFORE-ORDER-ID]");
+		return FALSE;
+	}
+	if (values[0] != NULL &&
+	    !ch_db_parse_uint (values[0], G_MAXUINT, &limit, error))
+		return FALSE;
+	if (values[0] != NULL && values[1] != NULL &&
+	    !ch_db_parse_uint (values[1], G_MAXUINT32, &before, error))
+		return FALSE;
+
+	list = ch_database_get_orders (priv->database, before, limit, error);
+	if (list == NULL)
+		return FALSE;
+	ret = ch_db_write_orders (priv, list, error);
+	ch_database_order_list_free (list);
+	return ret;
+}
+
+/**
+ * ch_db_search:
+ **/
+static gboolean
+ch_db_search (ChDbPrivate *priv, gchar **values, GError **error)
+{
+	ChDatabaseOrderList *list;
+	gboolean ret;
+	guint64 limit = CH_DB_DEFAULT_LIMIT;
+
+	if (g_strv_length (values) < 1 || g_strv_length (values) > 2) {
+		g_set_error_literal (error, 1, 0, "expected TEXT [LIMIT]");
+		return FALSE;
+	}
+	if (values[1] != NULL &&
+	    !ch_db_parse_uint (values[1], G_MAXUINT, &limit, error))
+		return FALSE;
+
+	list = ch_database_search_orders (priv->database, values[0], limit,
+					  CH_DATABASE_SEARCH_FLAG_ARCHIVE,
+					  error);
+	if (list == NULL)
+		return FALSE;
+	ret = ch_db_write_orders (priv, list, error);
+	ch_database_order_list_free (list);
+	return ret;
+}
+
+/**
+ * ch_db_set_device_state:
+ **/
+static gboolean
+ch_db_set_device_state (ChDbPrivate *priv, gchar **values, GError **error)
+{
+	ChDeviceState state;
+	GArray *ids;
+	gboolean ret;
+
+	if (g_strv_length (values) < 1) {
+		g_set_error_literal (error, 1, 0, "expected STATE [DEVICE-ID...]");
+		return FALSE;
+	}
+	state = ch_database_state_from_string (values[0]);
+	if (state == CH_DEVICE_STATE_LAST) {
+		g_set_error (error, 1, 0,
+			     "unknown device state %s, expected init, "
+			     "calibrated or allocated", values[0]);
+		return FALSE;
+	}
+	ids = ch_db_get_ids (values + 1, error);
+	if (ids == NULL)
+		return FALSE;
+	ret = ch_database_devices_set_state (priv->database, ids, state, error);
+	g_array_unref (ids);
+	return ret;
+}
+
+/**
+ * ch_db_set_order_state:
+ **/
+static gboolean
+ch_db_set_order_state (ChDbPrivate *priv, gchar **values, GError **error)
+{
+	ChOrderState state;
+	GArray *ids;
+	gboolean ret;
+
+	if (g_strv_length (values) < 1) {
+		g_set_error_literal (error, 1, 0, "expected STATE [ORDER-ID...]");
+		return FALSE;
+	}
+	state = ch_shipping_order_state_from_string (values[0]);
+	if (state == CH_ORDER_STATE_LAST) {
+		g_set_error (error, 1, 0,
+			     "unknown order state %s, expected new, printed, "
+			     "to-be-printed, sent or refunded", values[0]);
+		return FALSE;
+	}
+	ids = ch_db_get_ids (values + 1, error);
+	if (ids == NULL)
+		return FALSE;
+	ret = ch_database_orders_set_state (priv->database, ids, state, error);
+	g_array_unref (ids);
+	return ret;
+}
+
+/**
+ * ch_db_allocate:
+ **/
+static gboolean
+ch_db_allocate (ChDbPrivate *priv, gchar **values, GError **error)
+{
+	GArray *ids;
+	GString *str;
+	gboolean ret = TRUE;
+	guint64 count;
+	guint64 hw_ver;
+	guint64 order_id;
+	guint i;
+	const gchar *columns[] = { "device_id", NULL };
+
+	if (g_strv_length (values) != 3) {
+		g_set_error_literal (error, 1, 0,
+				     "expected ORDER-ID HW-VER COUNT");
+		return FALSE;
+	}
+	if (!ch_db_parse_uint (values[0], G_MAXUINT32, &order_id, error))
+		return FALSE;
+	if (!ch_db_parse_uint (values[1], G_MAXUINT, &hw_ver, error))
+		return FALSE;
+	if (!ch_db_parse_uint (values[2], G_MAXUINT, &count, error))
+		return FALSE;
+
+	/* print the devices to pack */
+	ids = ch_database_allocate_devices (priv->database, order_id,
+					    hw_ver, count, error);
+	if (ids == NULL)
+		return FALSE;
+	str = g_string_new ("");
+	ret = ch_db_write_header (priv, columns, error);
+	for (i = 0; ret && i < ids->len; i++) {
+		ch_db_row_add_int (priv, str, "device_id",
+				   g_array_index (ids, guint32, i));
+		ret = ch_db_row_write (priv, str, error);
+	}
+	g_string_free (str, TRUE);
+	g_array_unref (ids);
+	return ret;
+}
+
+/**
+ * ch_db_calibration:
+ **/
+static gboolean
+ch_db_calibration (ChDbPrivate *priv, gchar **values, GError **error)
+{
+	ChDatabaseCalibration *calibration;
+	GBytes *data;
+	gboolean ret;
+	gsize len;
+	guint64 device_id;
+	const guint8 *buf;
+
+	if (g_strv_length (values) < 1 || g_strv_length (values) > 2) {
+		g_set_error_literal (error, 1, 0, "expected DEVICE-ID [ti3|ccmx]");
+		return FALSE;
+	}
+	if (!ch_db_parse_uint (values[0], G_MAXUINT32, &device_id, error))
+		return FALSE;
+	if (values[1] != NULL &&
+	    g_strcmp0 (values[1], "ti3") != 0 &&
+	    g_strcmp0 (values[1], "ccmx") != 0) {
+		g_set_error (error, 1, 0,
+			     "unknown file %s, expected ti3 or ccmx", values[1]);
+		return FALSE;
+	}
+	calibration = ch_database_get_calibration (priv->database, device_id, error);
+	if (calibration == NULL)
+		return FALSE;
+
+	/* the file as it was saved, not a row */
+	if (g_strcmp0 (values[1], "ti3") == 0)
+		data = calibration->ti3;
+	else
+		data = calibration->ccmx;
+	if (data == NULL) {
+		ch_database_calibration_free (calibration);
+		g_set_error (error, 1, 0,
+			     "no %s saved for device %i",
+			     values[1] != NULL ? values[1] : "ccmx",
+			     (gint) device_id);
+		return FALSE;
+	}
+	buf = g_bytes_get_data (data, &len);
+	ret = g_output_stream_write_all (priv->output, buf, len, NULL, NULL, error);
+	ch_database_calibration_free (calibration);
+	return ret;
+}
+
+/**
+ * ch_db_export_calibrations:
+ **/
+static gboolean
+ch_db_export_calibrations (ChDbPrivate *priv, gchar **values, GError **error)
+{
+	GString *str;
+	gboolean ret;
+	guint64 hw_ver = 0;
+	guint exported = 0;
+	const gchar *columns[] = { "exported", NULL };
+
+	if (g_strv_length (values) < 1 || g_strv_length (values) > 2) {
+		g_set_error_literal (error, 1, 0, "expected DIRECTORY [HW-VER]");
+		return FALSE;
+	}
+	if (values[1] != NULL &&
+	    !ch_db_parse_uint (values[1], G_MAXUINT, &hw_ver, error))
+		return FALSE;
+	ret = ch_database_export_calibrations (priv->database, values[0],
+					       hw_ver, &exported, NULL, error);
+	if (!ret)
+		return FALSE;
+	ret = ch_db_write_header (priv, columns, error);
+	if (!ret)
+		return FALSE;
+	str = g_string_new ("");
+	ch_db_row_add_int (priv, str, "exported", exported);
+	ret = ch_db_row_write (priv, str, error);
+	g_string_free (str, TRUE);
+	return ret;
+}
+
+/**
+ * ch_db_export:
+ **/
+static gboolean
+ch_db_export (ChDbPrivate *priv, gchar **values, GError **error)
+{
+	ChDatabaseReport report;
+
+	if (g_strv_length (values) != 1) {
+		g_set_error_literal (error, 1, 0, "expected REPORT");
+		return FALSE;
+	}
+	report = ch_database_report_from_string (values[0]);
+	if (report == CH_DATABASE_REPORT_LAST) {
+		g_set_error (error, 1, 0,
+			     "unknown report %s, expected sales, calibrations, "
+			     "orders or calibration-rate", values[0]);
+		return FALSE;
+	}
+	return ch_database_export (priv->database, report, priv->format,
+				   priv->output, NULL, error);
+}
+
+/**
+ * ch_db_replicate:
+ **/
+static gboolean
+ch_db_replicate (ChDbPrivate *priv, gchar **values, GError **error)
+{
+	GString *str;
+	gboolean ret;
+	guint applied = 0;
+	const gchar *columns[] = { "applied", NULL };
+
+	if (g_strv_length (values) != 0) {
+		g_set_error_literal (error, 1, 0, "expected no arguments");
+		return FALSE;
+	}
+	ret = ch_database_replicate (priv->database, &applied, NULL, error);
+	if (!ret)
+		return FALSE;
+	ret = ch_db_write_header (priv, columns, error);
+	if (!ret)
+		return FALSE;
+	str = g_string_new ("");
+	ch_db_row_add_int (priv, str, "applied", applied);
+	ret = ch_db_row_write (priv, str, error);
+	g_string_free (str, TRUE);
+	return ret;
+}
+
+/**
+ * ch_db_maintain:
+ **/
+static gboolean
+ch_db_maintain (ChDbPrivate *priv, gchar **values, GError **error)
+{
+	ChDatabaseMaintenance maintenance;
+	GString *str;
+	gboolean finished = FALSE;
+	gboolean ret;
+	const gchar *columns[] = { "analyzed", "vacuumed", "pages",
+				   "free_pages", NULL };
+
+	if (g_strv_length (values) != 0) {
+		g_set_error_literal (error, 1, 0, "expected no arguments");
+		return FALSE;
+	}
+
+	/* everything that is due, not just one step, and this is the only
+	 * place the whole database is allowed to be rebuilt */
+	while (!finished) {
+		ret = ch_database_maintain (priv->database,
+					    CH_DATABASE_MAINTAIN_FLAG_REBUILD,
+					    &finished, error);
+		if (!ret)
+			return FALSE;
+	}
+	ret = ch_database_get_maintenance (priv->database, &maintenance, error);
+	if (!ret)
+		return FALSE;
+	ret = ch_db_write_header (priv, columns, error);
+	if (!ret)
+		return FALSE;
+	str = g_string_new ("");
+	ch_db_row_add_int (priv, str, "analyzed", maintenance.analyzed / G_USEC_PER_SEC);
+	ch_db_row_add_int (priv, str, "vacuumed", maintenance.vacuumed / G_USEC_PER_SEC);
+	ch_db_row_add_int (priv, str, "pages", maintenance.pages);
+	ch_db_row_add_int (priv, str, "free_pages", maintenance.free_pages);
+	ret = ch_db_row_write (priv, str, error);
+	g_string_free (str, TRUE);
+	return ret;
+}
+
+static void
+ch_db_ignore_cb (const gchar *log_domain, GLogLevelFlags log_level,
+		 const gchar *message, gpointer user_data)
+{
+}
+
+/**
+ * main:
+ **/
+int
+main (int argc, char **argv)
+{
+	ChDbPrivate *priv;
+	GError *error = NULL;
+	GOptionContext *context;
+	GOutputStream *stream;
+	GSettings *settings = NULL;
+	gboolean ret;
+	gboolean verbose = FALSE;
+	gchar *archive_uri = NULL;
+	gchar *cmd_descriptions = NULL;
+	gchar *database_uri = NULL;
+	gchar *format = NULL;
+	gchar *journal_mode = NULL;
+	gchar *spool_dir = NULL;
+	gchar *station = NULL;
+	gint retval = EXIT_FAILURE;
+	const GOptionEntry options[] = {
+		{ "verbose", 'v', 0, G_OPTION_ARG_NONE, &verbose,
+			/* TRANSLATORS: command line option */
+			_("Show extra debugging information"), NULL },
+		{ "database", '\0', 0, G_OPTION_ARG_STRING, &database_uri,
+			/* TRANSLATORS: command line option */
+			_("The database to use instead of the configured one"), NULL },
+		{ "format", '\0', 0, G_OPTION_ARG_STRING, &format,
+			/* TRANSLATORS: command line option */
+			_("The output format, either ndjson or csv"), NULL },
+		{ NULL}
+	};
+
+	setlocale (LC_ALL, "");
+
+	bindtextdomain (GETTEXT_PACKAGE, LOCALEDIR);
+	bind_textdomain_codeset (GETTEXT_PACKAGE, "UTF-8");
+	textdomain (GETTEXT_PACKAGE);
+
+	/* add commands */
+	priv = g_new0 (ChDbPrivate, 1);
+	priv->cmd_array = g_ptr_array_new_with_free_func ((GDestroyNotify) ch_db_item_free);
+	ch_db_add (priv->cmd_array,
+		   "inventory",
+		   NULL,
+		   /* TRANSLATORS: command description */
+		   _("Show the number of devices in each state"),
+		   ch_db_inventory);
+	ch_db_add (priv->cmd_array,
+		   "list-orders",
+		   "[LIMIT] [BEFORE-ORDER-ID]",
+		   /* TRANSLATORS: command description */
+		   _("Show the newest orders"),
+		   ch_db_list_orders);
+	ch_db_add (priv->cmd_array,
+		   "search",
+		   "TEXT [LIMIT]",
+		   /* TRANSLATORS: command description */
+		   _("Search all orders, including archived ones"),
+		   ch_db_search);
+	ch_db_add (priv->cmd_array,
+		   "set-device-state",
+		   "STATE [DEVICE-ID...]",
+		   /* TRANSLATORS: command description */
+		   _("Set the state of devices, reading IDs from stdin if none are given"),
+		   ch_db_set_device_state);
+	ch_db_add (priv->cmd_array,
+		   "set-order-state",
+		   "STATE [ORDER-ID...]",
+		   /* TRANSLATORS: command description */
+		   _("Set the state of orders, reading IDs from stdin if none are given"),
+		   ch_db_set_order_state);
+	ch_db_add (priv->cmd_array,
+		   "allocate",
+		   "ORDER-ID HW-VER COUNT",
+		   /* TRANSLATORS: command description */
+		   _("Allocate calibrated devices to an order"),
+		   ch_db_allocate);
+	ch_db_add (priv->cmd_array,
+		   "calibration",
+		   "DEVICE-ID [ti3|ccmx]",
+		   /* TRANSLATORS: command description */
+		   _("Print the saved ccmx or ti3 file for a device"),
+		   ch_db_calibration);
+	ch_db_add (priv->cmd_array,
+		   "export-calibrations",
+		   "DIRECTORY [HW-VER]",
+		   /* TRANSLATORS: command description */
+		   _("Write the saved calibration files to a directory"),
+		   ch_db_export_calibrations);
+	ch_db_add (priv->cmd_array,
+		   "replicate",
+		   NULL,
+		   /* TRANSLATORS: command description */
+		   _("Exchange changes with the other stations"),
+		   ch_db_replicate);
+	ch_db_add (priv->cmd_array,
+		   "maintain",
+		   NULL,
+		   /* TRANSLATORS: command description */
+		   _("Update the statistics and give back free space"),
+		   ch_db_maintain);
+	ch_db_add (priv->cmd_array,
+		   "export",
+		   "REPORT",
+		   /* TRANSLATORS: command description */
+		   _("Write a report, e.g. sales, calibrations or orders"),
+		   ch_db_export);
+
+	/* sort by command name */
+	g_ptr_array_sort (priv->cmd_array,
+			  (GCompareFunc) ch_db_sort_command_name_cb);
+
+	/* get a list of the commands */
+	cmd_descriptions = ch_db_get_descriptions (priv->cmd_array);
+
+	/* TRANSLATORS: A program to query and change the database */
+	context = g_option_context_new (_("ColorHug database tool"));
+	g_option_context_set_summary (context, cmd_descriptions);
+	g_option_context_add_main_entries (context, options, NULL);
+	ret = g_option_context_parse (context, &argc, &argv, &error);
+	g_option_context_free (context);
+	if (!ret) {
+		g_printerr ("%s: %s\n",
+			    _("Failed to parse command line options"),
+			    error->message);
+		g_error_free (error);
+		goto out;
+	}
+	if (verbose) {
+		g_setenv ("COLORHUG_VERBOSE", "1", FALSE);
+	} else {
+		g_log_set_handler (G_LOG_DOMAIN, G_LOG_LEVEL_DEBUG,
+				   ch_db_ignore_cb, NULL);
+	}
+	if (argc < 2) {
+		g_printerr ("%s\n%s\n",
+			    /* TRANSLATORS: no command was given */
+			    _("No command specified, valid commands are:"),
+			    cmd_descriptions);
+		goto out;
+	}
+
+	/* the same as the shipping tool, but nothing else is needed */
+	if (format == NULL || g_strcmp0 (format, "ndjson") == 0) {
+		priv->format = CH_DATABASE_FORMAT_NDJSON;
+	} else if (g_strcmp0 (format, "csv") == 0) {
+		priv->format = CH_DATABASE_FORMAT_CSV;
+	} else {
+		g_printerr ("%s: %s\n",
+			    /* TRANSLATORS: the --format was not known */
+			    _("Unknown output format"), format);
+		goto out;
+	}
+	priv->database = ch_database_new ();
+	if (database_uri == NULL) {
+		settings = g_settings_new ("com.hughski.colorhug-tools");
+		database_uri = g_settings_get_string (settings, "database-uri");
+		journal_mode = g_settings_get_string (settings, "database-journal-mode");
+		ch_database_set_journal_mode (priv->database, journal_mode);
+		ch_database_set_busy_timeout (priv->database,
+					      g_settings_get_uint (settings,
+								   "database-busy-timeout"));
+		archive_uri = g_settings_get_string (settings, "database-archive-uri");
+		ch_database_set_archive_uri (priv->database, archive_uri);
+
+		/* changes are saved for the next exchange, but that is left
+		 * to the stations or to the replicate command */
+		spool_dir = g_settings_get_string (settings, "database-replication-spool");
+		station = g_settings_get_string (settings, "database-replication-station");
+		ch_database_set_replication (priv->database, spool_dir, station, 0);
+	}
+	ch_database_set_uri (priv->database, database_uri);
+
+	/* rows are written as they are read */
+	stream = g_unix_output_stream_new (STDOUT_FILENO, FALSE);
+	priv->output = g_buffered_output_stream_new (stream);
+	g_object_unref (stream);
+
+	/* run the specified command */
+	ret = ch_db_run (priv, argv[1], (gchar **) &argv[2], &error);
+	if (ret)
+		ret = g_output_stream_close (priv->output, NULL, &error);
+	if (!ret) {
+		g_printerr ("%s\n", error->message);
+		g_error_free (error);
+		goto out;
+	}
+
+	/* success */
+	retval = EXIT_SUCCESS;
+out:
+	if (priv->output != NULL)
+		g_object_unref (priv->output);
+	if (priv->database != NULL)
+		g_object_unref (priv->database);
+	if (settings != NULL)
+		g_object_unref (settings);
+	g_ptr_array_unref (priv->cmd_array);
+	g_free (priv);
+	g_free (cmd_descriptions);
+	g_free (archive_uri);
+	g_free (database_uri);
+	g_free (journal_mode);
+	g_free (spool_dir);
+	g_free (station);
+	g_free (format);
+	return retval;
+}
@@ -456,7 +456,13 @@ ch_factory_serial_button_cb (GtkWidget *widget, ChFactoryPrivate *priv)
 	if (response == GTK_RESPONSE_DELETE_EVENT)
 		return;
 
-	/* allocate the serial numbers */
+	/* allocate all the serial numbers in one transaction */
+	if (response == GTK_RESPONSE_YES) {
+		if (!ch_database_begin (priv->database, &error)) {
+			g_warning ("failed to start transaction: %s", error->message);
+			return;
+		}
+	}
 	devices = ch_factory_get_active_devices (priv);
 	for (i = 0; i < devices->len; i++) {
 		g_autofree gchar *description = NULL;
@@ -465,8 +471,9 @@ ch_factory_serial_button_cb (GtkWidget *widget, ChFactoryPrivate *priv)
 		/* yay, atomic serial number */
 		if (response == GTK_RESPONSE_YES) {
 			serial_number = ch_database_add_device (priv->database, priv->hw_version, &error);
-			if (serial_number == 0) {
+			if (serial_number == G_MAXUINT32) {
 				g_warning ("failed to add entry: %s", error->message);
+				ch_database_rollback (priv->database, NULL);
 				return;
 			}
 		} else {
@@ -488,6 +495,14 @@ ch_factory_serial_button_cb (GtkWidget *widget, ChFactoryPrivate *priv)
 		ch_factory_set_device_description (priv, device, description);
 	}
 
+	/* only write the serial numbers once they are safely stored */
+	if (response == GTK_RESPONSE_YES) {
+		if (!ch_database_commit (priv->database, &error)) {
+			g_warning ("failed to save serial numbers: %s", error->message);
+			return;
+		}
+	}
+
 	/* process queue */
 	ch_device_queue_process_async (priv->device_queue,
 				       CH_DEVICE_QUEUE_PROCESS_FLAGS_NONE,
@@ -732,25 +747,111 @@ ch_factory_print_device_label (ChFactoryPrivate *priv, guint32 device_serial)
 	}
 }
 
+typedef struct {
+	ChFactoryPrivate	*priv;
+	GUsbDevice		*device;
+	guint32			 serial_number;
+} ChFactorySaveHelper;
+
+/* saves a copy of the data outside the database */
+static gboolean
+ch_factory_measure_save_file (ChFactoryPrivate *priv,
+			      CdIt8 *it8,
+			      const gchar *subdir,
+			      guint32 serial_number,
+			      const gchar *extension,
+			      GError **error)
+{
+	g_autofree gchar *filename = NULL;
+	g_autoptr(GFile) file = NULL;
+
+	filename = g_strdup_printf ("%s/%s/calibration-%06i.%s",
+				    priv->local_calibration_uri,
+				    subdir, serial_number, extension);
+	g_debug ("backing up to %s", filename);
+	file = g_file_new_for_path (filename);
+	return cd_it8_save_to_file (it8, file, error);
+}
+
+/* the file contents, as saved by cd_it8_save_to_file() */
+static GBytes *
+ch_factory_it8_to_bytes (CdIt8 *it8, GError **error)
+{
+	gchar *data = NULL;
+	gsize size = 0;
+
+	if (!cd_it8_save_to_data (it8, &data, &size, error))
+		return NULL;
+	return g_bytes_new_take (data, size);
+}
+
+static void
+ch_factory_measure_save_device_cb (GObject *source, GAsyncResult *res, gpointer user_data)
+{
+	ChFactorySaveHelper *helper = (ChFactorySaveHelper *) user_data;
+	ChFactoryPrivate *priv = helper->priv;
+	g_autoptr(GError) error = NULL;
+
+	if (!ch_database_device_set_state_finish (CH_DATABASE (source), res, &error)) {
+		ch_factory_device_is_shit (priv, helper->device, error->message);
+		g_warning ("failed to update database: %s", error->message);
+		goto out;
+	}
+
+	/* print device label */
+	ch_factory_print_device_label (priv, helper->serial_number);
+
+	/* success */
+	ch_factory_set_device_state (priv, helper->device, CH_DEVICE_ICON_CALIBRATED);
+out:
+	g_object_unref (helper->device);
+	g_free (helper);
+}
+
+static void
+ch_factory_measure_save_calibration_cb (GObject *source, GAsyncResult *res, gpointer user_data)
+{
+	ChFactorySaveHelper *helper = (ChFactorySaveHelper *) user_data;
+	ChFactoryPrivate *priv = helper->priv;
+	g_autoptr(GError) error = NULL;
+
+	if (!ch_database_add_calibration_finish (CH_DATABASE (source), res, &error)) {
+		ch_factory_device_is_shit (priv, helper->device, error->message);
+		g_warning ("failed to save calibration: %s", error->message);
+		g_object_unref (helper->device);
+		g_free (helper);
+		return;
+	}
+
+	/* allow this device to be sent out */
+	ch_database_device_set_state_async (priv->database,
+					    helper->serial_number,
+					    CH_DEVICE_STATE_CALIBRATED,
+					    NULL,
+					    ch_factory_measure_save_device_cb,
+					    helper);
+}
+
 static void
 ch_factory_measure_save_device (ChFactoryPrivate *priv, GUsbDevice *device)
 {
+	ChDatabaseCalibration db_calibration = { 0 };
+	ChFactorySaveHelper *helper;
 	CdColorRGB *rgb;
 	CdColorXYZ *xyz;
 	const CdMat3x3 *calibration;
 	gboolean ret;
+	gboolean save_files;
 	GPtrArray *results_tmp;
 	guint32 serial_number = 0;
 	guint i;
 	g_autoptr(GError) error = NULL;
-	g_autofree gchar *filename_ccmx = NULL;
-	g_autofree gchar *filename_ti3 = NULL;
 	g_autofree gchar *local_spectral_reference;
 	g_autoptr(CdIt8) it8_device = NULL;
 	g_autoptr(CdIt8) it8_measured = NULL;
 	g_autoptr(CdIt8) it8_reference = NULL;
-	g_autoptr(GFile) file_device = NULL;
-	g_autoptr(GFile) file_measured = NULL;
+	g_autoptr(GBytes) ccmx = NULL;
+	g_autoptr(GBytes) ti3 = NULL;
 	g_autoptr(GFile) file_reference = NULL;
 
 	/* get the ti3 file */
@@ -777,12 +878,7 @@ ch_factory_measure_save_device (ChFactoryPrivate *priv, GUsbDevice *device)
 		g_debug ("failed to get serial number: %s", error->message);
 		return;
 	}
-	filename_ti3 = g_strdup_printf ("%s/data/calibration-%06i.ti3",
-					priv->local_calibration_uri,
-					serial_number);
-	filename_ccmx = g_strdup_printf ("%s/archive/calibration-%06i.ccmx",
-					 priv->local_calibration_uri,
-					 serial_number);
+	save_files = g_settings_get_boolean (priv->settings, "calibration-save-files");
 
 	/* save to file */
 	results_tmp = g_hash_table_lookup (priv->results,
@@ -797,13 +893,14 @@ ch_factory_measure_save_device (ChFactoryPrivate *priv, GUsbDevice *device)
 		xyz = g_ptr_array_index (results_tmp, i);
 		cd_it8_add_data (it8_measured, rgb, xyz);
 	}
-	g_debug ("backing up to %s", filename_ti3);
-	file_measured = g_file_new_for_path (filename_ti3);
-	ret = cd_it8_save_to_file (it8_measured, file_measured, &error);
-	if (!ret) {
-		ch_factory_device_is_shit (priv, device, "save");
-		g_warning ("failed to save to file: %s", "save");
-		return;
+	if (save_files) {
+		ret = ch_factory_measure_save_file (priv, it8_measured, "data",
+						    serial_number, "ti3", &error);
+		if (!ret) {
+			ch_factory_device_is_shit (priv, device, "save");
+			g_warning ("failed to save to file: %s", error->message);
+			return;
+		}
 	}
 
 	/* create ccmx file */
@@ -820,12 +917,14 @@ ch_factory_measure_save_device (ChFactoryPrivate *priv, GUsbDevice *device)
 		g_warning ("failed to generate: %s", error->message);
 		return;
 	}
-	file_device = g_file_new_for_path (filename_ccmx);
-	ret = cd_it8_save_to_file (it8_device, file_device, &error);
-	if (!ret) {
-		ch_factory_device_is_shit (priv, device, error->message);
-		g_warning ("failed to save file: %s", error->message);
-		return;
+	if (save_files) {
+		ret = ch_factory_measure_save_file (priv, it8_device, "archive",
+						    serial_number, "ccmx", &error);
+		if (!ret) {
+			ch_factory_device_is_shit (priv, device, error->message);
+			g_warning ("failed to save file: %s", error->message);
+			return;
+		}
 	}
 
 	/* check the scale is correct */
@@ -838,7 +937,7 @@ ch_factory_measure_save_device (ChFactoryPrivate *priv, GUsbDevice *device)
 	}
 
 	/* save ccmx to slot 0 */
-	g_debug ("writing %s to device", filename_ccmx);
+	g_debug ("writing calibration %06i to device", serial_number);
 	ret = ch_device_queue_set_calibration_ccmx (priv->device_queue,
 						    device,
 						    0,
@@ -859,22 +958,33 @@ ch_factory_measure_save_device (ChFactoryPrivate *priv, GUsbDevice *device)
 		return;
 	}
 
-	/* allow this device to be sent out */
-	ret = ch_database_device_set_state (priv->database,
-					    serial_number,
-					    CH_DEVICE_STATE_CALIBRATED,
-					    &error);
-	if (!ret) {
+	/* keep the measurements and matrix for support */
+	ti3 = ch_factory_it8_to_bytes (it8_measured, &error);
+	if (ti3 == NULL) {
 		ch_factory_device_is_shit (priv, device, error->message);
-		g_warning ("failed to update database: %s", error->message);
+		g_warning ("failed to save ti3 data: %s", error->message);
 		return;
 	}
-
-	/* print device label */
-	ch_factory_print_device_label (priv, serial_number);
-
-	/* success */
-	ch_factory_set_device_state (priv, device, CH_DEVICE_ICON_CALIBRATED);
+	ccmx = ch_factory_it8_to_bytes (it8_device, &error);
+	if (ccmx == NULL) {
+		ch_factory_device_is_shit (priv, device, error->message);
+		g_warning ("failed to save ccmx data: %s", error->message);
+		return;
+	}
+	db_calibration.device_id = serial_number;
+	db_calibration.hw_ver = priv->hw_version;
+	db_calibration.determinant = cd_mat33_determinant (calibration);
+	db_calibration.ti3 = ti3;
+	db_calibration.ccmx = ccmx;
+	helper = g_new0 (ChFactorySaveHelper, 1);
+	helper->priv = priv;
+	helper->device = g_object_ref (device);
+	helper->serial_number = serial_number;
+	ch_database_add_calibration_async (priv->database,
+					   &db_calibration,
+					   NULL,
+					   ch_factory_measure_save_calibration_cb,
+					   helper);
 }
 
 static void
@@ -1400,6 +1510,10 @@ main (int argc, char **argv)
 	int status = 0;
 	g_autoptr(GError) error = NULL;
 	g_autofree gchar *database_uri = NULL;
+	g_autofree gchar *backup_uri = NULL;
+	g_autofree gchar *journal_mode = NULL;
+	g_autofree gchar *spool_dir = NULL;
+	g_autofree gchar *station = NULL;
 	const GOptionEntry options[] = {
 		{ "verbose", 'v', 0, G_OPTION_ARG_NONE, &verbose,
 			/* TRANSLATORS: command line option */
@@ -1457,6 +1571,23 @@ main (int argc, char **argv)
 	/* set the database location */
 	database_uri = g_settings_get_string (priv->settings, "database-uri");
 	ch_database_set_uri (priv->database, database_uri);
+	journal_mode = g_settings_get_string (priv->settings, "database-journal-mode");
+	ch_database_set_journal_mode (priv->database, journal_mode);
+	ch_database_set_busy_timeout (priv->database,
+				      g_settings_get_uint (priv->settings,
+							   "database-busy-timeout"));
+	backup_uri = g_settings_get_string (priv->settings, "database-backup-uri");
+	ch_database_set_backup (priv->database, backup_uri,
+				g_settings_get_uint (priv->settings,
+						     "database-backup-interval"));
+	spool_dir = g_settings_get_string (priv->settings, "database-replication-spool");
+	station = g_settings_get_string (priv->settings, "database-replication-station");
+	ch_database_set_replication (priv->database, spool_dir, station,
+				     g_settings_get_uint (priv->settings,
+							  "database-replication-interval"));
+	ch_database_set_maintenance (priv->database,
+				     g_settings_get_uint (priv->settings,
+							  "database-maintenance-idle"));
 
 	/* ensure single instance */
 	priv->application = gtk_application_new ("com.hughski.ColorHug.Factory", 0);
@@ -0,0 +1,523 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*-
+ *
+ * Copyright (C) 2011-2012 Richard Hughes <richard@hughsie.com>
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "config.h"
+
+#include <gio/gio.h>
+#include <json-glib/json-glib.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ch-import.h"
+#include "ch-shipping-common.h"
+
+/* nobody orders more than this, so it is probably a typo */
+#define CH_IMPORT_DEVICES_MAX		20
+
+typedef struct {
+	gchar		*name;
+	gchar		*email;
+	gchar		*address;
+	gchar		*postage;
+	gchar		*devices;
+	gchar		*comment;
+} ChImportRecord;
+
+static const gchar *ch_import_columns[] = {
+	"name", "email", "address", "postage", "devices", "comment", NULL };
+
+static void
+ch_import_record_clear (ChImportRecord *record)
+{
+	g_free (record->name);
+	g_free (record->email);
+	g_free (record->address);
+	g_free (record->postage);
+	g_free (record->devices);
+	g_free (record->comment);
+	memset (record, 0, sizeof (ChImportRecord));
+}
+
+static gchar **
+ch_import_record_get_field (ChImportRecord *record, guint idx)
+{
+	switch (idx) {
+	case 0:
+		return &record->name;
+	case 1:
+		return &record->email;
+	case 2:
+		return &record->address;
+	case 3:
+		return &record->postage;
+	case 4:
+		return &record->devices;
+	case 5:
+		return &record->comment;
+	default:
+		break;
+	}
+	return NULL;
+}
+
+/* splits a record of RFC 4180 CSV, where fields may be quoted and a
+ * quote inside a quoted field is doubled; a quoted field can span lines,
+ * so more lines are read from the stream until the quote is closed */
+static GPtrArray *
+ch_import_csv_split (GDataInputStream *stream,
+		     const gchar *line,
+		     guint *lineno,
+		     GCancellable *cancellable,
+		     GError **error)
+{
+	GError *error_local = NULL;
+	GPtrArray *fields;
+	GString *field;
+	gboolean quoted = FALSE;
+	gchar *next = NULL;
+	const gchar *p;
+
+	fields = g_ptr_array_new_with_free_func (g_free);
+	field = g_string_new ("");
+	p = line;
+	while (TRUE) {
+		if (*p == '\0') {
+			if (!quoted)
+				break;
+			g_free (next);
+			next = g_data_input_stream_read_line_utf8 (stream, NULL,
+								   cancellable,
+								   &error_local);
+			if (next == NULL) {
+				if (error_local != NULL)
+					g_propagate_error (error, error_local);
+				else
+					g_set_error_literal (error, 1, 0,
+							     "unterminated quoted field");
+				g_string_free (field, TRUE);
+				g_ptr_array_unref (fields);
+				return NULL;
+			}
+			(*lineno)++;
+			g_string_append_c (field, '\n');
+			p = next;
+			continue;
+		}
+		if (quoted) {
+			if (*p != '"') {
+				g_string_append_c (field, *p);
+			} else if (p[1] == '"') {
+				g_string_append_c (field, '"');
+				p++;
+			} else {
+				quoted = FALSE;
+			}
+		} else if (*p == '"' && field->len == 0) {
+			quoted = TRUE;
+		} else if (*p == ',') {
+			g_ptr_array_add (fields, g_string_free (field, FALSE));
+			field = g_string_new ("");
+		} else if (*p != '\r') {
+			g_string_append_c (field, *p);
+		}
+		p++;
+	}
+	g_ptr_array_add (fields, g_string_free (field, FALSE));
+	g_free (next);
+	return fields;
+}
+
+/* maps each CSV column to a record field, or -1 to ignore it */
+static GArray *
+ch_import_csv_header (GDataInputStream *stream,
+		      const gchar *line,
+		      guint *lineno,
+		      GCancellable *cancellable,
+		      GError **error)
+{
+	GArray *columns = NULL;
+	GPtrArray *fields;
+	const gchar *name;
+	gint idx;
+	guint i;
+	guint j;
+
+	fields = ch_import_csv_split (stream, line, lineno, cancellable, error);
+	if (fields == NULL)
+		return NULL;
+	columns = g_array_new (FALSE, FALSE, sizeof (gint));
+	for (i = 0; i < fields->len; i++) {
+		name = g_ptr_array_index (fields, i);
+		idx = -1;
+		for (j = 0; ch_import_columns[j] != NULL; j++) {
+			if (g_ascii_strcasecmp (name, ch_import_columns[j]) == 0) {
+				idx = j;
+				break;
+			}
+		}
+		if (idx < 0)
+			g_debug ("ignoring unknown column '%s'", name);
+		g_array_append_val (columns, idx);
+	}
+	g_ptr_array_unref (fields);
+	return columns;
+}
+
+static gboolean
+ch_import_csv_parse (GDataInputStream *stream,
+		     const gchar *line,
+		     guint *lineno,
+		     GArray *columns,
+		     ChImportRecord *record,
+		     GCancellable *cancellable,
+		     GError **error)
+{
+	GPtrArray *fields;
+	gchar **field;
+	gint idx;
+	guint i;
+
+	fields = ch_import_csv_split (stream, line, lineno, cancellable, error);
+	if (fields == NULL)
+		return FALSE;
+	if (fields->len != columns->len) {
+		g_set_error (error, 1, 0,
+			     "expected %i fields, got %i",
+			     columns->len, fields->len);
+		g_ptr_array_unref (fields);
+		return FALSE;
+	}
+	for (i = 0; i < fields->len; i++) {
+		idx = g_array_index (columns, gint, i);
+		field = ch_import_record_get_field (record, idx);
+		if (field == NULL)
+			continue;
+		g_free (*field);
+		*field = g_strdup (g_ptr_array_index (fields, i));
+	}
+	g_ptr_array_unref (fields);
+	return TRUE;
+}
+
+static gboolean
+ch_import_ndjson_parse (JsonParser *parser,
+			const gchar *line,
+			ChImportRecord *record,
+			GError **error)
+{
+	JsonNode *node;
+	JsonObject *obj;
+	gchar **field;
+	guint i;
+
+	if (!json_parser_load_from_data (parser, line, -1, error))
+		return FALSE;
+	node = json_parser_get_root (parser);
+	if (node == NULL || !JSON_NODE_HOLDS_OBJECT (node)) {
+		g_set_error_literal (error, 1, 0, "expected a JSON object");
+		return FALSE;
+	}
+	obj = json_node_get_object (node);
+	for (i = 0; ch_import_columns[i] != NULL; i++) {
+		if (!json_object_has_member (obj, ch_import_columns[i]))
+			continue;
+		node = json_object_get_member (obj, ch_import_columns[i]);
+		if (JSON_NODE_HOLDS_NULL (node))
+			continue;
+		if (!JSON_NODE_HOLDS_VALUE (node)) {
+			g_set_error (error, 1, 0,
+				     "expected a value for '%s'",
+				     ch_import_columns[i]);
+			return FALSE;
+		}
+		field = ch_import_record_get_field (record, i);
+		g_free (*field);
+		if (json_node_get_value_type (node) == G_TYPE_INT64) {
+			*field = g_strdup_printf ("%" G_GINT64_FORMAT,
+						  json_node_get_int (node));
+		} else {
+			*field = g_strdup (json_node_get_string (node));
+		}
+	}
+	return TRUE;
+}
+
+/* checks everything before the database is touched */
+static gboolean
+ch_import_record_validate (ChImportRecord *record,
+			   ChShippingKind *postage,
+			   guint *devices,
+			   GError **error)
+{
+	gchar *endptr = NULL;
+	guint64 tmp;
+
+	if (record->name == NULL || record->name[0] == '\0') {
+		g_set_error_literal (error, 1, 0, "no name");
+		return FALSE;
+	}
+	if (record->email == NULL || g_strstr_len (record->email, -1, "@") == NULL) {
+		g_set_error (error, 1, 0, "invalid email '%s'",
+			     record->email != NULL ? record->email : "");
+		return FALSE;
+	}
+	if (record->address == NULL || record->address[0] == '\0') {
+		g_set_error_literal (error, 1, 0, "no address");
+		return FALSE;
+	}
+
+	/* the same names as are shown in the order list */
+	*postage = ch_shipping_kind_from_string (record->postage);
+	if (*postage == CH_SHIPPING_KIND_LAST) {
+		g_set_error (error, 1, 0, "invalid postage '%s', expected e.g. CH2-UK-S",
+			     record->postage != NULL ? record->postage : "");
+		return FALSE;
+	}
+
+	/* accessories have no devices, and device orders default to one */
+	*devices = 0;
+	if (ch_shipping_kind_to_hw_ver (*postage) == 0) {
+		if (record->devices != NULL && record->devices[0] != '\0' &&
+		    g_strcmp0 (record->devices, "0") != 0) {
+			g_set_error (error, 1, 0,
+				     "%s orders cannot have devices",
+				     record->postage);
+			return FALSE;
+		}
+		return TRUE;
+	}
+	if (record->devices == NULL || record->devices[0] == '\0') {
+		*devices = 1;
+		return TRUE;
+	}
+	tmp = g_ascii_strtoull (record->devices, &endptr, 10);
+	if (endptr == record->devices || *endptr != '\0' ||
+	    tmp == 0 || tmp > CH_IMPORT_DEVICES_MAX) {
+		g_set_error (error, 1, 0, "invalid number of devices '%s'",
+			     record->devices);
+		return FALSE;
+	}
+	*devices = tmp;
+	return TRUE;
+}
+
+static gboolean
+ch_import_record_add (ChDatabase *database,
+		      ChImportRecord *record,
+		      ChImportFlags flags,
+		      GError **error)
+{
+	ChShippingKind postage;
+	GArray *device_ids = NULL;
+	gboolean ret;
+	gchar *body = NULL;
+	guint32 email_id;
+	guint32 order_id;
+	guint devices;
+
+	ret = ch_import_record_validate (record, &postage, &devices, error);
+	if (!ret)
+		goto out;
+
+	/* the order dialog uses '|' between the lines of the address */
+	g_strdelimit (record->address, "\n", '|');
+	g_strdelimit (record->address, "\r", ' ');
+
+	/* the INSERT is prepared once and reused for every row */
+	order_id = ch_database_add_order (database,
+					  record->name,
+					  record->address,
+					  record->email,
+					  postage,
+					  error);
+	if (order_id == G_MAXUINT32) {
+		ret = FALSE;
+		goto out;
+	}
+	if (record->comment != NULL && record->comment[0] != '\0') {
+		ret = ch_database_order_set_comment (database, order_id,
+						     record->comment, error);
+		if (!ret)
+			goto out;
+	}
+
+	/* this is a savepoint inside the import transaction */
+	if ((flags & CH_IMPORT_FLAG_ALLOCATE) > 0 && devices > 0) {
+		device_ids = ch_database_allocate_devices (database,
+							   order_id,
+							   ch_shipping_kind_to_hw_ver (postage),
+							   devices,
+							   error);
+		if (device_ids == NULL) {
+			ret = FALSE;
+			goto out;
+		}
+	}
+
+	/* only sent if the whole import is committed */
+	if ((flags & CH_IMPORT_FLAG_QUEUE_EMAIL) > 0) {
+		body = ch_shipping_order_confirmation (order_id, postage,
+						       device_ids != NULL ? (const guint32 *) device_ids->data : NULL,
+						       device_ids != NULL ? device_ids->len : 0,
+						       NULL);
+		email_id = ch_database_add_email (database, order_id,
+						  record->email,
+						  CH_SHIPPING_ORDER_CONFIRMATION_SUBJECT,
+						  body, error);
+		if (email_id == G_MAXUINT32) {
+			ret = FALSE;
+			goto out;
+		}
+	}
+out:
+	if (device_ids != NULL)
+		g_array_unref (device_ids);
+	g_free (body);
+	return ret;
+}
+
+/**
+ * ch_import_orders:
+ * @database: a valid #ChDatabase instance
+ * @stream: a #GInputStream of CSV or newline-delimited JSON
+ * @format: a #ChDatabaseFormat
+ * @flags: a #ChImportFlags, e.g. %CH_IMPORT_FLAG_ALLOCATE
+ * @imported: (out) (allow-none): the number of orders imported
+ * @cancellable: a #GCancellable or %NULL
+ * @error: A #GError or %NULL
+ *
+ * Imports orders, reading one line at a time so large files do not have to
+ * fit in memory. CSV files need a header line naming the columns, and a
+ * quoted field such as the address may span lines. JSON files need one
+ * object per line. The fields are name, email, address,
+ * postage, devices and comment, where postage is e.g. "CH2-UK-S".
+ *
+ * Everything is done in one transaction, so if any line is invalid or
+ * there are not enough devices then nothing is imported at all.
+ *
+ * Return value: %TRUE for success
+ **/
+gboolean
+ch_import_orders (ChDatabase *database,
+		  GInputStream *stream,
+		  ChDatabaseFormat format,
+		  ChImportFlags flags,
+		  guint *imported,
+		  GCancellable *cancellable,
+		  GError **error)
+{
+	ChImportRecord record;
+	GArray *columns = NULL;
+	GDataInputStream *data_stream;
+	GError *error_local = NULL;
+	JsonParser *parser = NULL;
+	gboolean in_transaction = FALSE;
+	gboolean ret = TRUE;
+	gchar *line;
+	guint count = 0;
+	guint lineno = 0;
+
+	memset (&record, 0, sizeof (ChImportRecord));
+	data_stream = g_data_input_stream_new (stream);
+	g_data_input_stream_set_newline_type (data_stream, G_DATA_STREAM_NEWLINE_TYPE_ANY);
+	if (format == CH_DATABASE_FORMAT_NDJSON)
+		parser = json_parser_new ();
+
+	ret = ch_database_begin (database, error);
+	if (!ret)
+		goto out;
+	in_transaction = TRUE;
+	while (TRUE) {
+		line = g_data_input_stream_read_line_utf8 (data_stream, NULL,
+							   cancellable, &error_local);
+		if (line == NULL) {
+			if (error_local == NULL)
+				break;
+			ret = FALSE;
+			g_propagate_prefixed_error (error, error_local,
+						    "line %i: ", lineno + 1);
+			goto out;
+		}
+		lineno++;
+
+		/* skip blank lines */
+		g_strstrip (line);
+		if (line[0] == '\0') {
+			g_free (line);
+			continue;
+		}
+
+		/* the first line names the columns */
+		if (format == CH_DATABASE_FORMAT_CSV && columns == NULL) {
+			columns = ch_import_csv_header (data_stream, line, &lineno,
+							cancellable, error);
+			g_free (line);
+			if (columns == NULL) {
+				ret = FALSE;
+				g_prefix_error (error, "line %i: ", lineno);
+				goto out;
+			}
+			continue;
+		}
+
+		/* parse, check and add */
+		switch (format) {
+		case CH_DATABASE_FORMAT_CSV:
+			ret = ch_import_csv_parse (data_stream, line, &lineno,
+						   columns, &record,
+						   cancellable, error);
+			break;
+		case CH_DATABASE_FORMAT_NDJSON:
+			ret = ch_import_ndjson_parse (parser, line, &record, error);
+			break;
+		default:
+			ret = FALSE;
+			g_set_error_literal (error, 1, 0, "unknown import format");
+			break;
+		}
+		g_free (line);
+		if (ret)
+			ret = ch_import_record_add (database, &record, flags, error);
+		ch_import_record_clear (&record);
+		if (!ret) {
+			g_prefix_error (error, "line %i: ", lineno);
+			goto out;
+		}
+		count++;
+	}
+
+	/* all or nothing */
+	in_transaction = FALSE;
+	ret = ch_database_commit (database, error);
+	if (!ret)
+		goto out;
+	if (imported != NULL)
+		*imported = count;
+out:
+	if (in_transaction)
+		ch_database_rollback (database, NULL);
+	if (columns != NULL)
+		g_array_unref (columns);
+	if (parser != NULL)
+		g_object_unref (parser);
+	g_object_unref (data_stream);
+	return ret;
+}
@@ -0,0 +1,48 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*-
+ *
+ * Copyright (C) 2011-2012 Richard Hughes <richard@hughsie.com>
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef CH_IMPORT_H
+#define CH_IMPORT_H
+
+#include <gio/gio.h>
+
+#include "ch-database.h"
+
+G_BEGIN_DECLS
+
+typedef enum {
+	CH_IMPORT_FLAG_NONE		= 0,
+	CH_IMPORT_FLAG_ALLOCATE		= 1 << 0,
+	CH_IMPORT_FLAG_QUEUE_EMAIL	= 1 << 1,
+	CH_IMPORT_FLAG_LAST
+} ChImportFlags;
+
+gboolean	 ch_import_orders		(ChDatabase	*database,
+						 GInputStream	*stream,
+						 ChDatabaseFormat format,
+						 ChImportFlags	 flags,
+						 guint		*imported,
+						 GCancellable	*cancellable,
+						 GError		**error);
+
+G_END_DECLS
+
+#endif /* CH_IMPORT_H */
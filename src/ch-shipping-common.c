@@ -94,6 +94,166 @@ out:
 	return cnt;
 }
 
+/* escapes the characters that mean something to LaTeX */
+void
+ch_shipping_string_append_latex (GString *string, const gchar *text)
+{
+	guint i;
+
+	for (i = 0; text[i] != '\0'; i++) {
+		if (strchr ("$%_{}&#", text[i]) != NULL)
+			g_string_append_c (string, '\\');
+		g_string_append_c (string, text[i]);
+	}
+}
+
+/**
+ * ch_shipping_address_split:
+ * @address: an address as entered, with the lines separated by '|'
+ *
+ * Splits an address into the lines that are not blank. The last line is
+ * the country and the one before is the postcode, if there are enough.
+ *
+ * Return value: the lines, free with g_strfreev()
+ **/
+gchar **
+ch_shipping_address_split (const gchar *address)
+{
+	GPtrArray *array;
+	gchar **split;
+	guint i;
+
+	array = g_ptr_array_new ();
+	split = g_strsplit (address, "|", -1);
+	for (i = 0; split[i] != NULL; i++) {
+		g_strstrip (split[i]);
+		if (split[i][0] == '\0') {
+			g_free (split[i]);
+			continue;
+		}
+		g_ptr_array_add (array, split[i]);
+	}
+	g_ptr_array_add (array, NULL);
+	g_free (split);
+	return (gchar **) g_ptr_array_free (array, FALSE);
+}
+
+/**
+ * ch_shipping_address_parse:
+ * @address: an address as entered, with the lines separated by '|'
+ * @lines: (out) (allow-none): the lines before the postcode and country,
+ *         separated by newlines
+ * @postcode: (out) (allow-none): the postcode, or %NULL for short addresses
+ * @country: (out) (allow-none): the country, or %NULL for short addresses
+ *
+ * Splits an address into the parts that are stored with each order, using
+ * the same rules as ch_shipping_address_split(). Free the parts with g_free().
+ **/
+void
+ch_shipping_address_parse (const gchar *address,
+			   gchar **lines,
+			   gchar **postcode,
+			   gchar **country)
+{
+	gchar **split;
+	guint len;
+
+	split = ch_shipping_address_split (address);
+	len = g_strv_length (split);
+	if (postcode != NULL)
+		*postcode = len >= 3 ? g_strdup (split[len - 2]) : NULL;
+	if (country != NULL)
+		*country = len >= 2 ? g_strdup (split[len - 1]) : NULL;
+	if (lines != NULL) {
+		/* everything before the postcode and country */
+		if (len >= 3)
+			len -= 2;
+		else if (len == 2)
+			len -= 1;
+		g_free (split[len]);
+		split[len] = NULL;
+		*lines = g_strjoinv ("\n", split);
+	}
+	g_strfreev (split);
+}
+
+/**
+ * ch_shipping_address_to_latex:
+ * @address: an address as entered, with the lines separated by '|'
+ *
+ * Escapes the address for the LaTeX templates, one line per row.
+ *
+ * Return value: the address, free with g_free()
+ **/
+gchar *
+ch_shipping_address_to_latex (const gchar *address)
+{
+	GString *latex;
+	gchar **lines;
+	guint i;
+
+	latex = g_string_new ("");
+	lines = ch_shipping_address_split (address);
+	for (i = 0; lines[i] != NULL; i++) {
+		if (i > 0)
+			g_string_append (latex, "\\\\\n");
+		ch_shipping_string_append_latex (latex, lines[i]);
+	}
+	g_strfreev (lines);
+	return g_string_free (latex, FALSE);
+}
+
+/* quotes the field if it contains a separator, as per RFC 4180 */
+void
+ch_shipping_string_append_csv (GString *string, const gchar *text)
+{
+	guint i;
+
+	if (strpbrk (text, ",\"\r\n") == NULL) {
+		g_string_append (string, text);
+		return;
+	}
+	g_string_append_c (string, '"');
+	for (i = 0; text[i] != '\0'; i++) {
+		if (text[i] == '"')
+			g_string_append_c (string, '"');
+		g_string_append_c (string, text[i]);
+	}
+	g_string_append_c (string, '"');
+}
+
+void
+ch_shipping_string_append_json (GString *string, const gchar *text)
+{
+	guint i;
+
+	g_string_append_c (string, '"');
+	for (i = 0; text[i] != '\0'; i++) {
+		switch (text[i]) {
+		case '"':
+			g_string_append (string, "\\\"");
+			break;
+		case '\\':
+			g_string_append (string, "\\\\");
+			break;
+		case '\n':
+			g_string_append (string, "\\n");
+			break;
+		case '\t':
+			g_string_append (string, "\\t");
+			break;
+		default:
+			if ((guchar) text[i] < 0x20) {
+				g_string_append_printf (string, "\\u%04x", (guint) text[i]);
+				break;
+			}
+			g_string_append_c (string, text[i]);
+			break;
+		}
+	}
+	g_string_append_c (string, '"');
+}
+
 gboolean
 ch_shipping_print_latex_doc (const gchar *str, const gchar *printer, GError **error)
 {
@@ -475,3 +635,121 @@ out:
 	return ret;
 }
 
+const gchar *
+ch_shipping_order_state_to_string (ChOrderState state)
+{
+	if (state == CH_ORDER_STATE_NEW)
+		return "new";
+	if (state == CH_ORDER_STATE_PRINTED)
+		return "printed";
+	if (state == CH_ORDER_STATE_SENT)
+		return "sent";
+	if (state == CH_ORDER_STATE_REFUNDED)
+		return "refunded";
+	if (state == CH_ORDER_STATE_TO_BE_PRINTED)
+		return "to-be-printed";
+	return NULL;
+}
+
+ChOrderState
+ch_shipping_order_state_from_string (const gchar *state)
+{
+	guint i;
+	for (i = 0; i < CH_ORDER_STATE_LAST; i++) {
+		if (g_strcmp0 (state, ch_shipping_order_state_to_string (i)) == 0)
+			return i;
+	}
+	return CH_ORDER_STATE_LAST;
+}
+
+ChShippingKind
+ch_shipping_kind_from_string (const gchar *postage)
+{
+	guint i;
+	for (i = CH_SHIPPING_KIND_CH2_UK_SIGNED; i < CH_SHIPPING_KIND_LAST; i++) {
+		if (g_strcmp0 (postage, ch_shipping_kind_to_string (i)) == 0)
+			return i;
+	}
+	return CH_SHIPPING_KIND_LAST;
+}
+
+/* returns 0 for accessories */
+guint
+ch_shipping_kind_to_hw_ver (ChShippingKind postage)
+{
+	switch (postage) {
+	case CH_SHIPPING_KIND_CH2_UK_SIGNED:
+	case CH_SHIPPING_KIND_CH2_EUROPE_SIGNED:
+	case CH_SHIPPING_KIND_CH2_WORLD_SIGNED:
+		return 2;
+	case CH_SHIPPING_KIND_CH1_UK:
+	case CH_SHIPPING_KIND_CH1_EUROPE:
+	case CH_SHIPPING_KIND_CH1_WORLD:
+	case CH_SHIPPING_KIND_CH1_UK_SIGNED:
+	case CH_SHIPPING_KIND_CH1_EUROPE_SIGNED:
+	case CH_SHIPPING_KIND_CH1_WORLD_SIGNED:
+		return 1;
+	default:
+		break;
+	}
+	return 0;
+}
+
+gchar *
+ch_shipping_order_confirmation (guint32 order_id,
+				ChShippingKind postage,
+				const guint32 *device_ids,
+				guint device_ids_len,
+				const gchar *sending_day)
+{
+	GString *str;
+	guint i;
+
+	str = g_string_new ("");
+	if (device_ids_len == 0) {
+		g_string_append_printf (str, "ColorHug order %04i has been created ", order_id);
+	} else if (device_ids_len == 1) {
+		g_string_append_printf (str, "ColorHug order %04i has been created and allocated device number ",
+					order_id);
+	} else {
+		g_string_append_printf (str, "ColorHug order %04i has been created and allocated device numbers ",
+					order_id);
+	}
+
+	/* add the device IDs */
+	for (i = 0; i < device_ids_len; i++)
+		g_string_append_printf (str, "%05i ", device_ids[i]);
+	g_string_set_size (str, str->len - 1);
+	g_string_append (str, ".\n");
+
+	/* when we will send the item */
+	if (sending_day != NULL) {
+		g_string_append_printf (str, "The invoice will be printed and the package will be sent on %s.\n",
+					sending_day);
+	} else {
+		g_string_append (str, "The invoice will be printed and the package will be sent when the payment has completed.\n");
+	}
+	if (postage == CH_SHIPPING_KIND_CH2_UK_SIGNED ||
+	    postage == CH_SHIPPING_KIND_CH2_EUROPE_SIGNED ||
+	    postage == CH_SHIPPING_KIND_CH2_WORLD_SIGNED ||
+	    postage == CH_SHIPPING_KIND_CH1_UK_SIGNED ||
+	    postage == CH_SHIPPING_KIND_CH1_EUROPE_SIGNED ||
+	    postage == CH_SHIPPING_KIND_CH1_WORLD_SIGNED) {
+		if (device_ids_len == 1) {
+			g_string_append (str, "Once the device has been posted we will email again with the tracking number.\n");
+		} else {
+			g_string_append (str, "Once the devices have been posted we will email again with the tracking number.\n");
+		}
+	} else if (postage == CH_SHIPPING_KIND_STRAP_UK ||
+		   postage == CH_SHIPPING_KIND_STRAP_EUROPE ||
+		   postage == CH_SHIPPING_KIND_STRAP_WORLD) {
+		g_string_append (str, "Once the strap and gasket upgrade has been posted a confirmation email will be sent.\n");
+	} else {
+		g_string_append (str, "Once the parcel has been posted a confirmation email will be sent.\n");
+	}
+	g_string_append (str, "\n");
+	g_string_append (str, "Thanks again for your support for this exciting project.\n");
+	g_string_append (str, "\n");
+	g_string_append (str, "Ania Hughes\n");
+	return g_string_free (str, FALSE);
+}
@@ -65,7 +65,14 @@ typedef enum {
 	CH_ORDER_STATE_LAST
 } ChOrderState;
 
+/* the subject of the email sent by ch_shipping_order_confirmation() */
+#define CH_SHIPPING_ORDER_CONFIRMATION_SUBJECT	"Your ColorHug order has been received"
+
 const gchar	*ch_shipping_kind_to_string	(ChShippingKind postage);
+ChShippingKind	 ch_shipping_kind_from_string	(const gchar	*postage);
+const gchar	*ch_shipping_order_state_to_string (ChOrderState state);
+ChOrderState	 ch_shipping_order_state_from_string (const gchar *state);
+guint		 ch_shipping_kind_to_hw_ver	(ChShippingKind postage);
 const gchar	*ch_shipping_kind_to_service	(ChShippingKind postage);
 gdouble		 ch_shipping_kind_to_price	(ChShippingKind postage);
 guint		 ch_shipping_device_to_price	(ChShippingKind postage);
@@ -80,12 +87,29 @@ GString		*ch_shipping_string_load	(const gchar	*filename,
 guint		 ch_shipping_string_replace	(GString	*string,
 						 const gchar	*search,
 						 const gchar	*replace);
+void		 ch_shipping_string_append_csv	(GString	*string,
+						 const gchar	*text);
+void		 ch_shipping_string_append_json	(GString	*string,
+						 const gchar	*text);
+void		 ch_shipping_string_append_latex (GString	*string,
+						 const gchar	*text);
+gchar		**ch_shipping_address_split	(const gchar	*address);
+void		 ch_shipping_address_parse	(const gchar	*address,
+						 gchar		**lines,
+						 gchar		**postcode,
+						 gchar		**country);
+gchar		*ch_shipping_address_to_latex	(const gchar	*address);
 gboolean	 ch_shipping_print_latex_doc	(const gchar	*str,
 						 const gchar	*printer,
 						 GError		**error);
 gboolean	 ch_shipping_print_svg_doc	(const gchar	*str,
 						 const gchar	*printer,
 						 GError		**error);
+gchar		*ch_shipping_order_confirmation	(guint32	 order_id,
+						 ChShippingKind	 postage,
+						 const guint32	*device_ids,
+						 guint		 device_ids_len,
+						 const gchar	*sending_day);
 
 G_END_DECLS
 
@@ -35,6 +35,7 @@
 #include "ch-cell-renderer-uint32.h"
 #include "ch-cell-renderer-order-status.h"
 #include "ch-database.h"
+#include "ch-import.h"
 #include "ch-shipping-common.h"
 
 typedef struct {
@@ -44,8 +45,17 @@ typedef struct {
 	ChDatabase	*database;
 	GMainLoop	*loop;
 	guint32		 order_to_print;
+	gboolean	 orders_loaded;
+	guint32		 orders_oldest;
+	guint64		 orders_generation;
+	gboolean	 orders_refreshing;
+	gboolean	 orders_refresh_pending;
+	GCancellable	*search_cancellable;
 } ChFactoryPrivate;
 
+#define CH_SHIPPING_ORDERS_PAGE_SIZE	1500
+#define CH_SHIPPING_SEARCH_LIMIT	200
+
 enum {
 	COLUMN_CHECKBOX,
 	COLUMN_ORDER_ID,
@@ -59,6 +69,10 @@ enum {
 	COLUMN_DEVICE_IDS,
 	COLUMN_COMMENT,
 	COLUMN_ORDER_STATE,
+	COLUMN_ADDRESS_LATEX,
+	COLUMN_ADDRESS_LINES,
+	COLUMN_POSTCODE,
+	COLUMN_COUNTRY,
 	COLUMN_LAST
 };
 
@@ -121,124 +135,153 @@ ch_shipping_find_by_id (GtkTreeModel *model,
 }
 
 static void
-ch_shipping_refresh_status (ChFactoryPrivate *priv)
+ch_shipping_refresh_status_cb (GObject *source, GAsyncResult *res, gpointer user_data)
 {
+	ChDatabaseInventory *item;
+	ChFactoryPrivate *priv = (ChFactoryPrivate *) user_data;
 	GtkWidget *widget;
-	guint ch1s;
-	guint ch2s;
+	guint ch1s = 0;
+	guint ch2s = 0;
+	guint i;
+	g_autoptr(GArray) inventory = NULL;
 	g_autoptr(GError) error = NULL;
 	g_autofree gchar *label = NULL;
 
 	/* update status */
-	ch1s = ch_database_device_get_number (priv->database, CH_DEVICE_STATE_CALIBRATED, 1, &error);
-	if (ch1s == G_MAXUINT) {
+	inventory = ch_database_get_inventory_finish (CH_DATABASE (source), res, &error);
+	if (inventory == NULL) {
 		ch_shipping_error_dialog (priv, "Failed to get number of devices", error->message);
 		return;
 	}
-	ch2s = ch_database_device_get_number (priv->database, CH_DEVICE_STATE_CALIBRATED, 2, &error);
-	if (ch2s == G_MAXUINT) {
-		ch_shipping_error_dialog (priv, "Failed to get number of devices", error->message);
-		return;
+	for (i = 0; i < inventory->len; i++) {
+		item = &g_array_index (inventory, ChDatabaseInventory, i);
+		if (item->state != CH_DEVICE_STATE_CALIBRATED)
+			continue;
+		if (item->hw_ver == 1)
+			ch1s = item->count;
+		else if (item->hw_ver == 2)
+			ch2s = item->count;
 	}
 	label = g_strdup_printf ("%i ColorHug and %i ColorHug2 remaining to be sold", ch1s, ch2s);
 	widget = GTK_WIDGET (gtk_builder_get_object (priv->builder, "label_status"));
 	gtk_label_set_text (GTK_LABEL (widget), label);
 }
 
+static void
+ch_shipping_refresh_status (ChFactoryPrivate *priv)
+{
+	ch_database_get_inventory_async (priv->database, NULL,
+					 ch_shipping_refresh_status_cb, priv);
+}
+
 static gchar *
-ch_shipping_order_get_device_ids (ChFactoryPrivate *priv,
-				  guint32 order_id,
-				  GError **error)
+ch_shipping_format_device_ids (const ChDatabaseOrder *order)
 {
-	GArray *array;
-	gchar *tmp = NULL;
 	GString *string;
-	guint32 device_id;
 	guint i;
 
-	/* get device IDs */
-	array = ch_database_order_get_device_ids (priv->database,
-						  order_id,
-						  error);
-	if (array == NULL)
-		goto out;
+	/* no devices, e.g. an accessory */
+	if (order->device_ids_len == 0)
+		return g_strdup ("-");
 
 	/* make into a string */
-	string = g_string_new ("");
-	for (i = 0; i < array->len; i++) {
-		device_id = g_array_index (array, guint32, i);
-		g_string_append_printf (string, "%04i,", device_id);
-	}
-	if (string->len > 0)
-		g_string_set_size (string, string->len - 1);
-	tmp = g_string_free (string, FALSE);
-out:
-	if (array != NULL)
-		g_array_unref (array);
-	return tmp;
+	string = g_string_sized_new (order->device_ids_len * 5);
+	for (i = 0; i < order->device_ids_len; i++)
+		g_string_append_printf (string, "%04i,", order->device_ids[i]);
+	g_string_set_size (string, string->len - 1);
+	return g_string_free (string, FALSE);
 }
 
 /* hack */
 static void ch_shipping_print_invoice (ChFactoryPrivate *priv, GtkTreeModel *model, GtkTreeIter *iter);
 static void ch_shipping_print_label (ChFactoryPrivate *priv, GtkTreeModel *model, GtkTreeIter *iter);
 static void ch_shipping_print_cn22 (ChFactoryPrivate *priv, GtkTreeModel *model, GtkTreeIter *iter);
-static void ch_shipping_email_send_email (ChFactoryPrivate *priv, GtkTreeModel *model, GtkTreeIter *iter);
+static gboolean ch_shipping_email_send_email (ChFactoryPrivate *priv, GtkTreeModel *model, GtkTreeIter *iter);
 
 static void
-ch_shipping_refresh_orders (ChFactoryPrivate *priv)
+ch_shipping_set_order (GtkListStore *list_store,
+		       GtkTreeIter *iter,
+		       const ChDatabaseOrder *order)
+{
+	gchar *address_lines = NULL;
+	gchar *country = NULL;
+	gchar *device_ids;
+	gchar *latex = NULL;
+	gchar *name_tmp;
+	gchar *postcode = NULL;
+
+	/* these are already fetched with the order */
+	device_ids = ch_shipping_format_device_ids (order);
+	name_tmp = g_markup_escape_text (order->name, -1);
+
+	/* only orders added by other tools are not parsed already */
+	if (order->address_latex == NULL && order->address != NULL) {
+		latex = ch_shipping_address_to_latex (order->address);
+		ch_shipping_address_parse (order->address, &address_lines,
+					   &postcode, &country);
+	}
+
+	gtk_list_store_set (list_store, iter,
+			    COLUMN_ORDER_ID, order->order_id,
+			    COLUMN_NAME, name_tmp,
+			    COLUMN_EMAIL, order->email,
+			    COLUMN_ADDRESS, order->address,
+			    COLUMN_TRACKING, order->tracking_number,
+			    COLUMN_SHIPPED, order->sent_date,
+			    COLUMN_POSTAGE, order->postage,
+			    COLUMN_COMMENT, order->comment,
+			    COLUMN_ORDER_STATE, order->state,
+			    COLUMN_DEVICE_IDS, device_ids,
+			    COLUMN_CHECKBOX, FALSE,
+			    COLUMN_ADDRESS_LATEX, latex != NULL ? latex : order->address_latex,
+			    COLUMN_ADDRESS_LINES, latex != NULL ? address_lines : order->address_lines,
+			    COLUMN_POSTCODE, latex != NULL ? postcode : order->postcode,
+			    COLUMN_COUNTRY, latex != NULL ? country : order->country,
+			    -1);
+	g_free (address_lines);
+	g_free (country);
+	g_free (device_ids);
+	g_free (latex);
+	g_free (name_tmp);
+	g_free (postcode);
+}
+
+static void
+ch_shipping_add_orders (ChFactoryPrivate *priv, ChDatabaseOrderList *list, gboolean is_page)
 {
 	ChDatabaseOrder *order;
 	gboolean ret;
-	gchar *name_tmp;
-	GError *error = NULL;
-	GPtrArray *array;
 	GtkListStore *list_store;
 	GtkTreeIter iter;
-	gchar *device_ids = NULL;
 	guint i;
 	guint order_id_next = 0;
 
 	list_store = GTK_LIST_STORE (gtk_builder_get_object (priv->builder, "liststore_orders"));
-	array = ch_database_get_all_orders (priv->database, &error);
-	if (array == NULL) {
-		ch_shipping_error_dialog (priv, "Failed to get all orders", error->message);
-		g_error_free (error);
-		goto out;
-	}
-	for (i = 0; i < array->len; i++) {
-		order = g_ptr_array_index (array, i);
-
-		/* verify we've not skipped any */
-		if (order_id_next == 0)
-			order_id_next = order->order_id;
-		if (order->order_id != order_id_next)
-			g_warning ("missing order %i", order_id_next - 1);
-		order_id_next = order->order_id - 1;
-
-		ret = ch_shipping_find_by_id (GTK_TREE_MODEL (list_store), &iter, order->order_id);
-		if (!ret)
+	for (i = 0; i < list->len; i++) {
+		order = &list->orders[i];
+
+		if (is_page) {
+			/* verify we've not skipped any */
+			if (order_id_next == 0)
+				order_id_next = order->order_id;
+			if (order->order_id != order_id_next)
+				g_warning ("missing order %i", order_id_next - 1);
+			order_id_next = order->order_id - 1;
+
+			/* a page is always older than what is shown */
 			gtk_list_store_append (list_store, &iter);
+			priv->orders_oldest = MIN (priv->orders_oldest, order->order_id);
+		} else {
+			/* a changed order that has not been paged in yet */
+			ret = ch_shipping_find_by_id (GTK_TREE_MODEL (list_store), &iter, order->order_id);
+			if (!ret) {
+				if (order->order_id < priv->orders_oldest)
+					continue;
+				gtk_list_store_append (list_store, &iter);
+			}
+		}
 
-		/* get the device IDs if we can */
-		device_ids = ch_shipping_order_get_device_ids (priv,
-							       order->order_id,
-							       NULL);
-		if (device_ids == NULL)
-			device_ids = g_strdup ("-");
-		name_tmp = g_markup_escape_text (order->name, -1);
-		gtk_list_store_set (list_store, &iter,
-				    COLUMN_ORDER_ID, order->order_id,
-				    COLUMN_NAME, name_tmp,
-				    COLUMN_EMAIL, order->email,
-				    COLUMN_ADDRESS, order->address,
-				    COLUMN_TRACKING, order->tracking_number,
-				    COLUMN_SHIPPED, order->sent_date,
-				    COLUMN_POSTAGE, order->postage,
-				    COLUMN_COMMENT, order->comment,
-				    COLUMN_ORDER_STATE, order->state,
-				    COLUMN_DEVICE_IDS, device_ids,
-				    COLUMN_CHECKBOX, FALSE,
-				    -1);
+		ch_shipping_set_order (list_store, &iter, order);
 
 		if (order->order_id == priv->order_to_print) {
 			ch_shipping_print_label (priv, GTK_TREE_MODEL (list_store), &iter);
@@ -246,16 +289,200 @@ ch_shipping_refresh_orders (ChFactoryPrivate *priv)
 			ch_shipping_print_cn22 (priv, GTK_TREE_MODEL (list_store), &iter);
 			priv->order_to_print = G_MAXUINT32;
 		}
+	}
+}
+
+static void
+ch_shipping_search_orders_cb (GObject *source, GAsyncResult *res, gpointer user_data)
+{
+	ChFactoryPrivate *priv = (ChFactoryPrivate *) user_data;
+	ChDatabaseOrderList *list;
+	GError *error = NULL;
+	GtkListStore *list_store;
+	GtkTreeIter iter;
+	GtkTreeView *treeview;
+	guint i;
+
+	list = ch_database_search_orders_finish (CH_DATABASE (source), res, &error);
+	if (list == NULL) {
+		/* the user typed something else */
+		if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+			g_error_free (error);
+			return;
+		}
+		ch_shipping_error_dialog (priv, "Failed to search orders", error->message);
+		g_error_free (error);
+		return;
+	}
+
+	/* results replace the last search */
+	list_store = GTK_LIST_STORE (gtk_builder_get_object (priv->builder, "liststore_search"));
+	gtk_list_store_clear (list_store);
+	for (i = 0; i < list->len; i++) {
+		gtk_list_store_append (list_store, &iter);
+		ch_shipping_set_order (list_store, &iter, &list->orders[i]);
+	}
+	treeview = GTK_TREE_VIEW (gtk_builder_get_object (priv->builder, "treeview_orders"));
+	gtk_tree_view_set_model (treeview, GTK_TREE_MODEL (list_store));
+	ch_database_order_list_free (list);
+}
+
+static void
+ch_shipping_search_orders (ChFactoryPrivate *priv)
+{
+	const gchar *search;
+	GtkTreeView *treeview;
+	GtkWidget *widget;
+
+	/* only the newest search is wanted */
+	if (priv->search_cancellable != NULL) {
+		g_cancellable_cancel (priv->search_cancellable);
+		g_object_unref (priv->search_cancellable);
+		priv->search_cancellable = NULL;
+	}
+
+	/* show all the orders again */
+	widget = GTK_WIDGET (gtk_builder_get_object (priv->builder, "entry_search"));
+	search = gtk_entry_get_text (GTK_ENTRY (widget));
+	if (search[0] == '\0') {
+		treeview = GTK_TREE_VIEW (gtk_builder_get_object (priv->builder, "treeview_orders"));
+		gtk_tree_view_set_model (treeview,
+					 GTK_TREE_MODEL (gtk_builder_get_object (priv->builder, "liststore_orders")));
+		return;
+	}
 
-		g_free (device_ids);
-		g_free (name_tmp);
+	/* this searches all orders, not just the ones paged in */
+	priv->search_cancellable = g_cancellable_new ();
+	ch_database_search_orders_async (priv->database,
+					 search,
+					 CH_SHIPPING_SEARCH_LIMIT,
+					 CH_DATABASE_SEARCH_FLAG_ARCHIVE,
+					 priv->search_cancellable,
+					 ch_shipping_search_orders_cb,
+					 priv);
+}
+
+static void
+ch_shipping_search_changed_cb (GtkSearchEntry *entry, ChFactoryPrivate *priv)
+{
+	ch_shipping_search_orders (priv);
+}
+
+static void ch_shipping_refresh_orders (ChFactoryPrivate *priv);
+
+static void
+ch_shipping_refresh_orders_cb (GObject *source, GAsyncResult *res, gpointer user_data)
+{
+	ChFactoryPrivate *priv = (ChFactoryPrivate *) user_data;
+	gboolean is_page = !priv->orders_loaded;
+	GError *error = NULL;
+	ChDatabaseOrderList *list;
+	guint64 generation = 0;
+
+	priv->orders_refreshing = FALSE;
+	if (is_page) {
+		list = ch_database_get_orders_finish (CH_DATABASE (source), res,
+						       &generation, &error);
+	} else {
+		list = ch_database_get_orders_changed_finish (CH_DATABASE (source), res,
+							       &generation, &error);
+	}
+	if (list == NULL) {
+		ch_shipping_error_dialog (priv, "Failed to get orders", error->message);
+		g_error_free (error);
+		goto out;
 	}
 
+	/* only the first time is a full page */
+	priv->orders_generation = generation;
+	ch_shipping_add_orders (priv, list, is_page);
+	priv->orders_loaded = TRUE;
+
+	/* the search results might have changed too */
+	if (!is_page && list->len > 0 && priv->search_cancellable != NULL)
+		ch_shipping_search_orders (priv);
+	ch_database_order_list_free (list);
+
 	/* and also status */
 	ch_shipping_refresh_status (priv);
 out:
-	if (array != NULL)
-		g_ptr_array_unref (array);
+	/* something was changed while we were busy */
+	if (priv->orders_refresh_pending) {
+		priv->orders_refresh_pending = FALSE;
+		ch_shipping_refresh_orders (priv);
+	}
+}
+
+static void
+ch_shipping_refresh_orders (ChFactoryPrivate *priv)
+{
+	/* already in progress */
+	if (priv->orders_refreshing) {
+		priv->orders_refresh_pending = TRUE;
+		return;
+	}
+	priv->orders_refreshing = TRUE;
+
+	/* only get what has changed since last time */
+	if (priv->orders_loaded) {
+		ch_database_get_orders_changed_async (priv->database,
+						      priv->orders_generation,
+						      NULL,
+						      ch_shipping_refresh_orders_cb,
+						      priv);
+		return;
+	}
+
+	/* get the newest page of orders */
+	priv->orders_oldest = G_MAXUINT32;
+	ch_database_get_orders_async (priv->database,
+				      G_MAXUINT32,
+				      CH_SHIPPING_ORDERS_PAGE_SIZE,
+				      NULL,
+				      ch_shipping_refresh_orders_cb,
+				      priv);
+}
+
+static void
+ch_shipping_older_orders_cb (GObject *source, GAsyncResult *res, gpointer user_data)
+{
+	ChFactoryPrivate *priv = (ChFactoryPrivate *) user_data;
+	GError *error = NULL;
+	ChDatabaseOrderList *list;
+	GtkWidget *widget;
+
+	widget = GTK_WIDGET (gtk_builder_get_object (priv->builder, "button_older"));
+	list = ch_database_get_orders_finish (CH_DATABASE (source), res, NULL, &error);
+	if (list == NULL) {
+		/* let the user try again */
+		gtk_widget_set_sensitive (widget, TRUE);
+		ch_shipping_error_dialog (priv, "Failed to get older orders", error->message);
+		g_error_free (error);
+		return;
+	}
+	ch_shipping_add_orders (priv, list, TRUE);
+
+	/* there might be more to show */
+	if (list->len == CH_SHIPPING_ORDERS_PAGE_SIZE)
+		gtk_widget_set_sensitive (widget, TRUE);
+	ch_database_order_list_free (list);
+}
+
+static void
+ch_shipping_older_button_cb (GtkWidget *widget, ChFactoryPrivate *priv)
+{
+	/* the first page is still loading */
+	if (!priv->orders_loaded)
+		return;
+
+	/* get the next page of history */
+	gtk_widget_set_sensitive (widget, FALSE);
+	ch_database_get_orders_async (priv->database,
+				      priv->orders_oldest,
+				      CH_SHIPPING_ORDERS_PAGE_SIZE,
+				      NULL,
+				      ch_shipping_older_orders_cb,
+				      priv);
 }
 
 static void
@@ -268,9 +495,7 @@ ch_shipping_refund_button_cb (GtkWidget *widget, ChFactoryPrivate *priv)
 	GtkTreeModel *model;
 	GtkTreeSelection *selection;
 	GtkTreeView *treeview;
-	guint32 device_id;
 	guint32 order_id;
-	guint i;
 
 	/* get selected item */
 	treeview = GTK_TREE_VIEW (gtk_builder_get_object (priv->builder, "treeview_orders"));
@@ -282,6 +507,15 @@ ch_shipping_refund_button_cb (GtkWidget *widget, ChFactoryPrivate *priv)
 			    COLUMN_ORDER_ID, &order_id,
 			    -1);
 
+	/* do everything in one transaction */
+	ret = ch_database_begin (priv->database, &error);
+	if (!ret) {
+		ch_shipping_error_dialog (priv, "Failed to start transaction",
+					  error->message);
+		g_error_free (error);
+		goto out;
+	}
+
 	/* set the order state */
 	ret = ch_database_order_set_state (priv->database,
 					   order_id,
@@ -292,6 +526,7 @@ ch_shipping_refund_button_cb (GtkWidget *widget, ChFactoryPrivate *priv)
 		ch_shipping_error_dialog (priv, "Failed to set order state as refunded",
 					  error->message);
 		g_error_free (error);
+		ch_database_rollback (priv->database, NULL);
 		goto out;
 	}
 
@@ -303,44 +538,34 @@ ch_shipping_refund_button_cb (GtkWidget *widget, ChFactoryPrivate *priv)
 		ch_shipping_error_dialog (priv, "Failed to set get device ids for order",
 					  error->message);
 		g_error_free (error);
+		ch_database_rollback (priv->database, NULL);
 		goto out;
 	}
 
 	/* re-allocate devices */
-	for (i = 0; i < array->len; i++) {
-		device_id = g_array_index (array, guint32, i);
-		ret = ch_database_device_set_state (priv->database,
-						    device_id,
-						    CH_DEVICE_STATE_CALIBRATED,
-						    &error);
-		if (!ret) {
-			ch_shipping_error_dialog (priv, "Failed to reset device state",
-						  error->message);
-			g_error_free (error);
-			goto out;
-		}
+	ret = ch_database_devices_set_state (priv->database,
+					     array,
+					     CH_DEVICE_STATE_CALIBRATED,
+					     &error);
+	if (!ret) {
+		ch_shipping_error_dialog (priv, "Failed to reset device state",
+					  error->message);
+		g_error_free (error);
+		ch_database_rollback (priv->database, NULL);
+		goto out;
 	}
-	ch_shipping_refresh_orders (priv);
-out:
-	if (array != NULL)
-		g_array_unref (array);
-}
-
-static gchar *
-ch_shipping_strreplace (const gchar *haystack, const gchar *needle, const gchar *replace)
-{
-	gchar *new;
-	gchar **split = NULL;
 
-	if (g_strstr_len (haystack, -1, needle) == NULL) {
-		new = g_strdup (haystack);
+	ret = ch_database_commit (priv->database, &error);
+	if (!ret) {
+		ch_shipping_error_dialog (priv, "Failed to refund order",
+					  error->message);
+		g_error_free (error);
 		goto out;
 	}
-	split = g_strsplit (haystack, needle, -1);
-	new = g_strjoinv (replace, split);
+	ch_shipping_refresh_orders (priv);
 out:
-	g_strfreev (split);
-	return new;
+	if (array != NULL)
+		g_array_unref (array);
 }
 
 static void
@@ -405,7 +630,6 @@ ch_shipping_print_invoice (ChFactoryPrivate *priv, GtkTreeModel *model, GtkTreeI
 	const gchar *device_name = NULL;
 	gchar *address = NULL;
 	gchar *device_ids = NULL;
-	gchar **address_split = NULL;
 	gchar *name = NULL;
 	GError *error = NULL;
 	GString *str;
@@ -418,19 +642,9 @@ ch_shipping_print_invoice (ChFactoryPrivate *priv, GtkTreeModel *model, GtkTreeI
 			    COLUMN_DEVICE_IDS, &device_ids,
 			    COLUMN_POSTAGE, &postage,
 			    COLUMN_NAME, &name,
-			    COLUMN_ADDRESS, &address,
+			    COLUMN_ADDRESS_LATEX, &address,
 			    -1);
 
-	/* replace escaped chars */
-	address = ch_shipping_strreplace (address, "$", "\\$");
-	address = ch_shipping_strreplace (address, "%", "\\%");
-	address = ch_shipping_strreplace (address, "_", "\\_");
-	address = ch_shipping_strreplace (address, "}", "\\}");
-	address = ch_shipping_strreplace (address, "{", "\\{");
-	address = ch_shipping_strreplace (address, "&", "\\&");
-	address = ch_shipping_strreplace (address, "#", "\\#");
-
-	address_split = g_strsplit (address, "|", -1);
 	postage_price = ch_shipping_kind_to_price (postage);
 	device_price = ch_shipping_device_to_price (postage);
 
@@ -459,11 +673,7 @@ ch_shipping_print_invoice (ChFactoryPrivate *priv, GtkTreeModel *model, GtkTreeI
 		str = ch_shipping_string_load (CH_DATA "/invoice.tex", NULL);
 	}
 	ch_shipping_string_replace (str, "$NAME$", name);
-	ch_shipping_string_replace (str, "$ADDRESS1$", address_split[0]);
-	ch_shipping_string_replace (str, "$ADDRESS2$", address_split[1]);
-	ch_shipping_string_replace (str, "$ADDRESS3$", address_split[2]);
-	ch_shipping_string_replace (str, "$ADDRESS4$", address_split[3]);
-	ch_shipping_string_replace (str, "$ADDRESS5$", address_split[4]);
+	ch_shipping_string_replace (str, "$ADDRESS$", address != NULL ? address : "");
 	ch_shipping_string_replace (str, "$ORDER$", g_strdup_printf ("%04i-1", order_id));
 	ch_shipping_string_replace (str, "$DEVICES$", device_ids);
 	ch_shipping_string_replace (str, "$DEVICE_PRICE$", g_strdup_printf ("%i.00", device_price));
@@ -499,7 +709,6 @@ out:
 	g_free (name);
 	g_free (address);
 	g_free (device_ids);
-	g_strfreev (address_split);
 	g_string_free (str, TRUE);
 }
 
@@ -547,15 +756,60 @@ ch_shipping_print_cn22_button_cb (GtkWidget *widget, ChFactoryPrivate *priv)
 	}
 }
 
+/* saved as soon as the email has gone, so a later failure cannot leave a
+ * customer told about an order that is not marked as sent */
+static gboolean
+ch_shipping_mark_shipped (ChFactoryPrivate *priv,
+			  GtkTreeModel *model,
+			  GtkTreeIter *iter,
+			  GError **error)
+{
+	gboolean ret;
+	gchar *tracking_number = NULL;
+	guint32 order_id;
+
+	gtk_tree_model_get (model, iter,
+			    COLUMN_ORDER_ID, &order_id,
+			    COLUMN_TRACKING, &tracking_number,
+			    -1);
+	ret = ch_database_begin (priv->database, error);
+	if (!ret)
+		goto out;
+	ret = ch_database_order_set_tracking (priv->database,
+					      order_id,
+					      tracking_number,
+					      error);
+	if (!ret) {
+		ch_database_rollback (priv->database, NULL);
+		goto out;
+	}
+	ret = ch_database_order_set_state (priv->database,
+					   order_id,
+					   CH_ORDER_STATE_SENT,
+					   error);
+	if (!ret) {
+		ch_database_rollback (priv->database, NULL);
+		goto out;
+	}
+	ret = ch_database_commit (priv->database, error);
+	if (!ret)
+		goto out;
+out:
+	g_free (tracking_number);
+	return ret;
+}
+
 static void
 ch_shipping_mark_shipped_button_cb (GtkWidget *widget, ChFactoryPrivate *priv)
 {
 	gboolean checkbox;
 	gboolean ret;
+	GError *error = NULL;
 	GtkTreeIter iter;
 	GtkTreeModel *model;
 	GtkTreeView *treeview;
 
+	/* the database is not locked while each email is being sent */
 	treeview = GTK_TREE_VIEW (gtk_builder_get_object (priv->builder, "treeview_orders"));
 	model = gtk_tree_view_get_model (treeview);
 	ret = gtk_tree_model_get_iter_first (model, &iter);
@@ -563,8 +817,14 @@ ch_shipping_mark_shipped_button_cb (GtkWidget *widget, ChFactoryPrivate *priv)
 		gtk_tree_model_get (model, &iter,
 				    COLUMN_CHECKBOX, &checkbox,
 				    -1);
-		if (checkbox)
-			ch_shipping_email_send_email (priv, model, &iter);
+		if (checkbox && ch_shipping_email_send_email (priv, model, &iter)) {
+			if (!ch_shipping_mark_shipped (priv, model, &iter, &error)) {
+				ch_shipping_error_dialog (priv, "Failed to mark order as shipped",
+							  error->message);
+				g_error_free (error);
+				break;
+			}
+		}
 		ret = gtk_tree_model_iter_next (model, &iter);
 	}
 
@@ -576,47 +836,51 @@ static void
 ch_shipping_print_manifest (ChFactoryPrivate *priv, GString *str, GtkTreeModel *model, GtkTreeIter *iter, guint cnt)
 {
 	ChShippingKind postage;
-	gchar *address = NULL;
-	gchar **address_split = NULL;
+	gchar *address_lines = NULL;
+	gchar *building = NULL;
+	gchar *country = NULL;
 	gchar *device_ids = NULL;
 	gchar *name = NULL;
+	gchar *postcode = NULL;
 	gchar *tmp;
 	gchar *tracking;
+	gchar *value;
 	guint32 order_id;
 	guint device_price;
-	guint i;
 
 	gtk_tree_model_get (model, iter,
 			    COLUMN_ORDER_ID, &order_id,
 			    COLUMN_DEVICE_IDS, &device_ids,
 			    COLUMN_POSTAGE, &postage,
 			    COLUMN_NAME, &name,
-			    COLUMN_ADDRESS, &address,
+			    COLUMN_ADDRESS_LINES, &address_lines,
+			    COLUMN_POSTCODE, &postcode,
+			    COLUMN_COUNTRY, &country,
 			    COLUMN_TRACKING, &tracking,
 			    -1);
 
-	/* replace escaped chars */
-//	address = ch_shipping_strreplace (address, "&", "\\&");
-
-	address_split = g_strsplit (address, "|", -1);
 	device_price = ch_shipping_device_to_price (postage);
 
-	i = g_strv_length (address_split);
-	if (g_strcmp0 (address_split[i-1], " ") == 0)
-		i--;
-	if (g_strcmp0 (address_split[i-1], " ") == 0)
-		i--;
-	if (g_strcmp0 (address_split[i-1], " ") == 0)
-		i--;
+	/* the first line is the building, and this is an XML document */
+	if (address_lines != NULL) {
+		tmp = g_utf8_strchr (address_lines, -1, '\n');
+		if (tmp != NULL)
+			*tmp = '\0';
+		building = g_markup_escape_text (address_lines, -1);
+	}
 
 	tmp = g_strdup_printf ("$SERVICE%02i$", cnt);
 	ch_shipping_string_replace (str, tmp, ch_shipping_kind_to_service (postage));
 	g_free (tmp);
 	tmp = g_strdup_printf ("$POSTCODE%02i$", cnt);
-	ch_shipping_string_replace (str, tmp, g_strdup_printf ("%s, %s", address_split[i-2], address_split[i-1]));
+	value = g_markup_printf_escaped ("%s, %s",
+					 postcode != NULL ? postcode : "",
+					 country != NULL ? country : "");
+	ch_shipping_string_replace (str, tmp, value);
+	g_free (value);
 	g_free (tmp);
 	tmp = g_strdup_printf ("$BUILDINGNAME%02i$", cnt);
-	ch_shipping_string_replace (str, tmp, address_split[0]);
+	ch_shipping_string_replace (str, tmp, building != NULL ? building : "");
 	g_free (tmp);
 	tmp = g_strdup_printf ("$VALUE%02i$", cnt);
 	ch_shipping_string_replace (str, tmp, g_strdup_printf ("£%i", device_price));
@@ -627,9 +891,11 @@ ch_shipping_print_manifest (ChFactoryPrivate *priv, GString *str, GtkTreeModel *
 
 	g_free (name);
 	g_free (tracking);
-	g_free (address);
+	g_free (address_lines);
+	g_free (building);
+	g_free (postcode);
+	g_free (country);
 	g_free (device_ids);
-	g_strfreev (address_split);
 }
 
 static void
@@ -719,9 +985,7 @@ ch_shipping_print_label (ChFactoryPrivate *priv, GtkTreeModel *model, GtkTreeIte
 	gboolean ret;
 	gchar *address = NULL;
 	gchar *comment = NULL;
-	gchar **address_split = NULL;
 	gchar *device_ids = NULL;
-	GString *address_escaped = NULL;
 	gchar *name = NULL;
 	GError *error = NULL;
 	guint32 order_id;
@@ -731,22 +995,12 @@ ch_shipping_print_label (ChFactoryPrivate *priv, GtkTreeModel *model, GtkTreeIte
 	gtk_tree_model_get (model, iter,
 			    COLUMN_ORDER_ID, &order_id,
 			    COLUMN_NAME, &name,
-			    COLUMN_ADDRESS, &address,
+			    COLUMN_ADDRESS_LATEX, &address,
 			    COLUMN_POSTAGE, &postage,
 			    COLUMN_COMMENT, &comment,
 			    COLUMN_DEVICE_IDS, &device_ids,
 			    -1);
 
-	/* replace escaped chars */
-	address = ch_shipping_strreplace (address, "$", "\\$");
-	address = ch_shipping_strreplace (address, "%", "\\%");
-	address = ch_shipping_strreplace (address, "_", "\\_");
-	address = ch_shipping_strreplace (address, "}", "\\}");
-	address = ch_shipping_strreplace (address, "{", "\\{");
-	address = ch_shipping_strreplace (address, "&", "\\&");
-	address = ch_shipping_strreplace (address, "#", "\\#");
-
-	address_split = g_strsplit (address, "|", -1);
 
 	/* update order status */
 	ret = ch_database_order_set_state (priv->database,
@@ -770,11 +1024,7 @@ ch_shipping_print_label (ChFactoryPrivate *priv, GtkTreeModel *model, GtkTreeIte
 
 	ch_shipping_string_replace (str, "$LETTER_CLASS$", "SMALL PACKAGE");
 	ch_shipping_string_replace (str, "$NAME$", name);
-	ch_shipping_string_replace (str, "$ADDRESS1$", address_split[0]);
-	ch_shipping_string_replace (str, "$ADDRESS2$", address_split[1]);
-	ch_shipping_string_replace (str, "$ADDRESS3$", address_split[2]);
-	ch_shipping_string_replace (str, "$ADDRESS4$", address_split[3]);
-	ch_shipping_string_replace (str, "$ADDRESS5$", address_split[4]);
+	ch_shipping_string_replace (str, "$ADDRESS$", address != NULL ? address : "");
 	ch_shipping_string_replace (str, "$ORDER$", g_strdup_printf ("%04i", order_id));
 	ch_shipping_string_replace (str, "$DEVICES$", device_ids);
 	ch_shipping_string_replace (str, "$SHIPPING$", ch_shipping_kind_to_string (postage));
@@ -789,9 +1039,6 @@ ch_shipping_print_label (ChFactoryPrivate *priv, GtkTreeModel *model, GtkTreeIte
 out:
 	if (str != NULL)
 		g_string_free (str, TRUE);
-	if (address_escaped != NULL)
-		g_string_free (address_escaped, TRUE);
-	g_strfreev (address_split);
 	g_free (device_ids);
 	g_free (comment);
 	g_free (address);
@@ -941,6 +1188,19 @@ ch_shipping_refresh_cb (GtkWidget *widget, ChFactoryPrivate *priv)
 	ch_shipping_refresh_orders (priv);
 }
 
+static void
+ch_shipping_database_changed_cb (ChDatabase *database,
+				 ChDatabaseChangedFlags flags,
+				 ChFactoryPrivate *priv)
+{
+	/* the factory calibrated some more devices, or another station
+	 * changed some orders */
+	if (flags & CH_DATABASE_CHANGED_ORDERS)
+		ch_shipping_refresh_orders (priv);
+	else if (flags & CH_DATABASE_CHANGED_DEVICES)
+		ch_shipping_refresh_status (priv);
+}
+
 static ChShippingKind
 ch_shipping_order_get_radio_postage (ChFactoryPrivate *priv)
 {
@@ -1003,15 +1263,14 @@ ch_shipping_order_add_button_cb (GtkWidget *widget, ChFactoryPrivate *priv)
 	const gchar *sending_day = NULL;
 	const gchar *tracking = NULL;
 	gboolean ret;
+	gchar *body = NULL;
 	gchar *from = NULL;
+	GArray *devices = NULL;
 	GDateTime *date = NULL;
 	GError *error = NULL;
 	GString *addr = g_string_new ("");
-	GString *str = NULL;
-	guint32 device_id;
 	guint32 hw_ver;
 	guint32 order_id;
-	guint i;
 	guint number_of_devices = 0;
 
 	/* get name */
@@ -1036,103 +1295,49 @@ ch_shipping_order_add_button_cb (GtkWidget *widget, ChFactoryPrivate *priv)
 
 	/* get postage */
 	postage = ch_shipping_order_get_radio_postage (priv);
-	switch (postage) {
-	case CH_SHIPPING_KIND_CH2_UK_SIGNED:
-	case CH_SHIPPING_KIND_CH2_EUROPE_SIGNED:
-	case CH_SHIPPING_KIND_CH2_WORLD_SIGNED:
-		hw_ver = 2;
-		break;
-	case CH_SHIPPING_KIND_CH1_UK:
-	case CH_SHIPPING_KIND_CH1_EUROPE:
-	case CH_SHIPPING_KIND_CH1_WORLD:
-	case CH_SHIPPING_KIND_CH1_UK_SIGNED:
-	case CH_SHIPPING_KIND_CH1_EUROPE_SIGNED:
-	case CH_SHIPPING_KIND_CH1_WORLD_SIGNED:
-		hw_ver = 1;
-		break;
-	default:
-		hw_ver = 0;
-		break;
-	}
+	hw_ver = ch_shipping_kind_to_hw_ver (postage);
 
 	/* get number of devices */
 	widget = GTK_WIDGET (gtk_builder_get_object (priv->builder, "spinbutton_order_devices"));
-	if (postage != CH_SHIPPING_KIND_STRAP_UK &&
-	    postage != CH_SHIPPING_KIND_STRAP_EUROPE &&
-	    postage != CH_SHIPPING_KIND_STRAP_WORLD &&
-	    postage != CH_SHIPPING_KIND_ALS_UK &&
-	    postage != CH_SHIPPING_KIND_ALS_EUROPE &&
-	    postage != CH_SHIPPING_KIND_ALS_WORLD) {
+	if (hw_ver != 0)
 		number_of_devices = gtk_spin_button_get_value_as_int (GTK_SPIN_BUTTON (widget));
-	}
 
-	/* add to database */
+	/* add to database, with the devices or not at all */
+	ret = ch_database_begin (priv->database, &error);
+	if (!ret) {
+		ch_shipping_error_dialog (priv, "Failed to add order", error->message);
+		g_error_free (error);
+		goto out;
+	}
 	order_id = ch_database_add_order (priv->database, name, addr->str, email, postage, &error);
 	if (order_id == G_MAXUINT32) {
+		ch_database_rollback (priv->database, NULL);
 		ch_shipping_error_dialog (priv, "Failed to add order", error->message);
 		g_error_free (error);
 		goto out;
 	}
 
-	/* write message body */
-	str = g_string_new ("");
-	if (number_of_devices == 0) {
-		g_string_append_printf (str, "ColorHug order %04i has been created ", order_id);
-	} else if (number_of_devices == 1) {
-		g_string_append_printf (str, "ColorHug order %04i has been created and allocated device number ",
-					order_id);
-	} else {
-		g_string_append_printf (str, "ColorHug order %04i has been created and allocated device numbers ",
-					order_id);
-	}
-
 	/* get the oldest devices we've got calibrated */
-	for (i = 0; i < number_of_devices; i++) {
-		device_id = ch_database_device_find_oldest (priv->database,
-							    CH_DEVICE_STATE_CALIBRATED,
-							    hw_ver,
-							    &error);
-		if (device_id == G_MAXUINT32) {
-			ch_shipping_error_dialog (priv,
-						  "Failed to get device",
-						  error->message);
-			g_error_free (error);
-			goto out;
-		}
-
-		/* add this device to the order */
-		ret = ch_database_device_set_order_id (priv->database,
-						       device_id,
-						       order_id,
-						       &error);
-		if (!ret) {
+	if (number_of_devices > 0) {
+		devices = ch_database_allocate_devices (priv->database,
+							order_id,
+							hw_ver,
+							number_of_devices,
+							&error);
+		if (devices == NULL) {
+			ch_database_rollback (priv->database, NULL);
 			ch_shipping_error_dialog (priv,
-						  "Failed to assign device to order",
+						  "Failed to allocate devices",
 						  error->message);
 			g_error_free (error);
 			goto out;
 		}
-
-		/* mark the device as allocated */
-		ret = ch_database_device_set_state (priv->database,
-						    device_id,
-						    CH_DEVICE_STATE_ALLOCATED,
-						    &error);
-		if (!ret) {
-			ch_shipping_error_dialog (priv,
-						  "Failed to allocate device",
-						  error->message);
-			g_error_free (error);
-			goto out;
-		}
-
-		/* add the device ID */
-		g_string_append_printf (str, "%05i ",
-					device_id);
 	}
-	if (str->len > 0) {
-		g_string_set_size (str, str->len - 1);
-		g_string_append (str, ".\n");
+	ret = ch_database_commit (priv->database, &error);
+	if (!ret) {
+		ch_shipping_error_dialog (priv, "Failed to add order", error->message);
+		g_error_free (error);
+		goto out;
 	}
 
 	/* get the day */
@@ -1151,36 +1356,12 @@ ch_shipping_order_add_button_cb (GtkWidget *widget, ChFactoryPrivate *priv)
 	widget = GTK_WIDGET (gtk_builder_get_object (priv->builder, "radiobutton_sending_friday"));
 	if (gtk_toggle_button_get_active (GTK_TOGGLE_BUTTON (widget)))
 		sending_day = "Friday";
-	if (sending_day != NULL) {
-		g_string_append_printf (str, "The invoice will be printed and the package will be sent on %s.\n",
-					sending_day);
-	} else {
-		g_string_append (str, "The invoice will be printed and the package will be sent when the payment has completed.\n");
-	}
 
-	/* print when we will send the item */
-	if (postage == CH_SHIPPING_KIND_CH2_UK_SIGNED ||
-	    postage == CH_SHIPPING_KIND_CH2_EUROPE_SIGNED ||
-	    postage == CH_SHIPPING_KIND_CH2_WORLD_SIGNED ||
-	    postage == CH_SHIPPING_KIND_CH1_UK_SIGNED ||
-	    postage == CH_SHIPPING_KIND_CH1_EUROPE_SIGNED ||
-	    postage == CH_SHIPPING_KIND_CH1_WORLD_SIGNED) {
-		if (number_of_devices == 1) {
-			g_string_append (str, "Once the device has been posted we will email again with the tracking number.\n");
-		} else {
-			g_string_append (str, "Once the devices have been posted we will email again with the tracking number.\n");
-		}
-	} else if (postage == CH_SHIPPING_KIND_STRAP_UK ||
-		   postage == CH_SHIPPING_KIND_STRAP_EUROPE ||
-		   postage == CH_SHIPPING_KIND_STRAP_WORLD) {
-		g_string_append (str, "Once the strap and gasket upgrade has been posted a confirmation email will be sent.\n");
-	} else {
-		g_string_append (str, "Once the parcel has been posted a confirmation email will be sent.\n");
-	}
-	g_string_append (str, "\n");
-	g_string_append (str, "Thanks again for your support for this exciting project.\n");
-	g_string_append (str, "\n");
-	g_string_append (str, "Ania Hughes\n");
+	/* write message body */
+	body = ch_shipping_order_confirmation (order_id, postage,
+					       devices != NULL ? (const guint32 *) devices->data : NULL,
+					       devices != NULL ? devices->len : 0,
+					       sending_day);
 
 	/* get tracking number */
 	widget = GTK_WIDGET (gtk_builder_get_object (priv->builder, "entry_tracking"));
@@ -1201,8 +1382,8 @@ ch_shipping_order_add_button_cb (GtkWidget *widget, ChFactoryPrivate *priv)
 	from = g_settings_get_string (priv->settings, "invoice-sender");
 	ret = ch_shipping_send_email (from,
 				      email,
-				      "Your ColorHug order has been received",
-				      str->str,
+				      CH_SHIPPING_ORDER_CONFIRMATION_SUBJECT,
+				      body,
 				      g_settings_get_string (priv->settings, "invoice-auth"),
 				      &error);
 	if (!ret) {
@@ -1217,8 +1398,9 @@ ch_shipping_order_add_button_cb (GtkWidget *widget, ChFactoryPrivate *priv)
 out:
 	if (date != NULL)
 		g_date_time_unref (date);
-	if (str != NULL)
-		g_string_free (str, TRUE);
+	if (devices != NULL)
+		g_array_unref (devices);
+	g_free (body);
 	g_free (from);
 
 	/* buttons */
@@ -1226,7 +1408,7 @@ out:
 	gtk_widget_hide (widget);
 }
 
-static void
+static gboolean
 ch_shipping_email_send_email (ChFactoryPrivate *priv, GtkTreeModel *model, GtkTreeIter *iter)
 {
 	ChShippingKind postage;
@@ -1239,7 +1421,6 @@ ch_shipping_email_send_email (ChFactoryPrivate *priv, GtkTreeModel *model, GtkTr
 	gchar *from = NULL;
 	GError *error = NULL;
 	GString *str = NULL;
-	guint32 order_id;
 
 	switch (postage) {
 	case CH_SHIPPING_KIND_CH2_UK_SIGNED:
@@ -1252,9 +1433,8 @@ ch_shipping_email_send_email (ChFactoryPrivate *priv, GtkTreeModel *model, GtkTr
 		break;
 	}
 
-	/* get the order id of the selected item */
+	/* get the details of the selected item */
 	gtk_tree_model_get (model, iter,
-			    COLUMN_ORDER_ID, &order_id,
 			    COLUMN_POSTAGE, &postage,
 			    COLUMN_EMAIL, &email,
 			    COLUMN_DEVICE_IDS, &device_ids,
@@ -1312,29 +1492,6 @@ ch_shipping_email_send_email (ChFactoryPrivate *priv, GtkTreeModel *model, GtkTr
 		g_error_free (error);
 		goto out;
 	}
-
-	/* save to the database */
-	ret = ch_database_order_set_tracking (priv->database,
-					      order_id,
-					      tracking_number,
-					      &error);
-	if (!ret) {
-		ch_shipping_error_dialog (priv, "Failed to mark order as shipped", error->message);
-		g_error_free (error);
-		goto out;
-	}
-
-	/* update order status */
-	ret = ch_database_order_set_state (priv->database,
-					   order_id,
-					   CH_ORDER_STATE_SENT,
-					   &error);
-	if (!ret) {
-		ch_shipping_error_dialog (priv, "Failed to update order state",
-					  error->message);
-		g_error_free (error);
-		goto out;
-	}
 out:
 	g_free (device_ids);
 	g_free (from);
@@ -1342,6 +1499,7 @@ out:
 	g_free (cmd);
 	if (str != NULL)
 		g_string_free (str, TRUE);
+	return ret;
 }
 
 static void
@@ -1676,6 +1834,9 @@ ch_shipping_startup_cb (GApplication *application, ChFactoryPrivate *priv)
 
 	/* sorted */
 	sortable = GTK_TREE_SORTABLE (gtk_builder_get_object (priv->builder, "liststore_orders"));
+	gtk_tree_sortable_set_sort_column_id (sortable,
+					      COLUMN_ORDER_ID, GTK_SORT_DESCENDING);
+	sortable = GTK_TREE_SORTABLE (gtk_builder_get_object (priv->builder, "liststore_search"));
 	gtk_tree_sortable_set_sort_column_id (sortable,
 					      COLUMN_ORDER_ID, GTK_SORT_DESCENDING);
 
@@ -1723,6 +1884,12 @@ ch_shipping_startup_cb (GApplication *application, ChFactoryPrivate *priv)
 	widget = GTK_WIDGET (gtk_builder_get_object (priv->builder, "button_refresh"));
 	g_signal_connect (widget, "clicked",
 			  G_CALLBACK (ch_shipping_refresh_cb), priv);
+	widget = GTK_WIDGET (gtk_builder_get_object (priv->builder, "button_older"));
+	g_signal_connect (widget, "clicked",
+			  G_CALLBACK (ch_shipping_older_button_cb), priv);
+	widget = GTK_WIDGET (gtk_builder_get_object (priv->builder, "entry_search"));
+	g_signal_connect (widget, "search-changed",
+			  G_CALLBACK (ch_shipping_search_changed_cb), priv);
 	widget = GTK_WIDGET (gtk_builder_get_object (priv->builder, "radiobutton_shipping4"));
 	g_signal_connect (widget, "toggled",
 			  G_CALLBACK (ch_shipping_radio_shippping_changed_cb), priv);
@@ -1807,6 +1974,160 @@ out:
 	g_free (filename);
 }
 
+/**
+ * ch_shipping_import_orders:
+ **/
+static gboolean
+ch_shipping_import_orders (ChFactoryPrivate *priv,
+			   const gchar *filename,
+			   ChImportFlags flags,
+			   GError **error)
+{
+	ChDatabaseFormat format;
+	GFile *file;
+	GFileInputStream *stream = NULL;
+	gboolean ret = TRUE;
+	guint imported = 0;
+
+	format = ch_database_format_from_filename (filename);
+	if (format == CH_DATABASE_FORMAT_UNKNOWN) {
+		ret = FALSE;
+		g_set_error (error, 1, 0,
+			     "cannot import %s, expected .csv or .ndjson",
+			     filename);
+		goto out;
+	}
+	file = g_file_new_for_commandline_arg (filename);
+	stream = g_file_read (file, NULL, error);
+	g_object_unref (file);
+	if (stream == NULL) {
+		ret = FALSE;
+		goto out;
+	}
+	ret = ch_import_orders (priv->database,
+				G_INPUT_STREAM (stream),
+				format,
+				flags,
+				&imported,
+				NULL,
+				error);
+	if (!ret)
+		goto out;
+	/* TRANSLATORS: the number of orders added from a file */
+	g_print ("%s: %i\n", _("Imported orders"), imported);
+out:
+	if (stream != NULL)
+		g_object_unref (stream);
+	return ret;
+}
+
+/**
+ * ch_shipping_send_queued_emails:
+ **/
+static gboolean
+ch_shipping_send_queued_emails (ChFactoryPrivate *priv, GError **error)
+{
+	ChDatabaseEmail *email;
+	GPtrArray *emails;
+	gboolean ret = TRUE;
+	gchar *authtoken = NULL;
+	gchar *from = NULL;
+	guint i;
+
+	emails = ch_database_get_queued_emails (priv->database, error);
+	if (emails == NULL) {
+		ret = FALSE;
+		goto out;
+	}
+	from = g_settings_get_string (priv->settings, "invoice-sender");
+	authtoken = g_settings_get_string (priv->settings, "invoice-auth");
+	for (i = 0; i < emails->len; i++) {
+		email = g_ptr_array_index (emails, i);
+		g_debug ("sending email %i to %s", email->email_id, email->recipient);
+		ret = ch_shipping_send_email (from,
+					      email->recipient,
+					      email->subject,
+					      email->body,
+					      authtoken,
+					      error);
+		if (!ret)
+			goto out;
+
+		/* a failure later on does not send this one again */
+		ret = ch_database_email_set_sent (priv->database,
+						  email->email_id,
+						  error);
+		if (!ret)
+			goto out;
+	}
+	/* TRANSLATORS: the number of emails sent from the outbox */
+	g_print ("%s: %i\n", _("Sent emails"), emails->len);
+out:
+	if (emails != NULL)
+		g_ptr_array_unref (emails);
+	g_free (authtoken);
+	g_free (from);
+	return ret;
+}
+
+/**
+ * ch_shipping_export_report:
+ **/
+static gboolean
+ch_shipping_export_report (ChFactoryPrivate *priv,
+			   const gchar *report_name,
+			   const gchar *filename,
+			   GError **error)
+{
+	ChDatabaseFormat format;
+	ChDatabaseReport report;
+	GFile *file = NULL;
+	GFileOutputStream *stream = NULL;
+	gboolean ret = TRUE;
+
+	report = ch_database_report_from_string (report_name);
+	if (report == CH_DATABASE_REPORT_LAST) {
+		ret = FALSE;
+		g_set_error (error, 1, 0,
+			     "unknown report %s, expected sales, calibrations, "
+			     "orders or calibration-rate",
+			     report_name);
+		goto out;
+	}
+	if (filename == NULL) {
+		ret = FALSE;
+		g_set_error_literal (error, 1, 0, "no --output file specified");
+		goto out;
+	}
+	format = ch_database_format_from_filename (filename);
+	if (format == CH_DATABASE_FORMAT_UNKNOWN) {
+		ret = FALSE;
+		g_set_error (error, 1, 0,
+			     "cannot export %s, expected .csv or .ndjson",
+			     filename);
+		goto out;
+	}
+	file = g_file_new_for_commandline_arg (filename);
+	stream = g_file_replace (file, NULL, FALSE, G_FILE_CREATE_NONE, NULL, error);
+	if (stream == NULL) {
+		ret = FALSE;
+		goto out;
+	}
+	ret = ch_database_export (priv->database, report, format,
+				  G_OUTPUT_STREAM (stream), NULL, error);
+	if (!ret)
+		goto out;
+	ret = g_output_stream_close (G_OUTPUT_STREAM (stream), NULL, error);
+	if (!ret)
+		goto out;
+out:
+	if (stream != NULL)
+		g_object_unref (stream);
+	if (file != NULL)
+		g_object_unref (file);
+	return ret;
+}
+
 static void
 ch_shipping_ignore_cb (const gchar *log_domain, GLogLevelFlags log_level,
 		      const gchar *message, gpointer user_data)
@@ -1818,15 +2139,50 @@ main (int argc, char **argv)
 {
 	ChFactoryPrivate *priv;
 	gboolean ret;
+	ChImportFlags import_flags = CH_IMPORT_FLAG_QUEUE_EMAIL;
+	gboolean allocate = FALSE;
+	gboolean archive = FALSE;
+	gboolean send_emails = FALSE;
 	gboolean verbose = FALSE;
 	gchar *database_uri = NULL;
+	gchar *backup_filename = NULL;
+	gchar *import_filename = NULL;
+	gchar *output_filename = NULL;
+	gchar *report = NULL;
+	gchar *archive_uri = NULL;
+	gchar *backup_uri = NULL;
+	gchar *journal_mode = NULL;
+	gchar *spool_dir = NULL;
+	gchar *station = NULL;
 	GError *error = NULL;
 	GOptionContext *context;
+	guint archived = 0;
 	int status = 0;
 	const GOptionEntry options[] = {
 		{ "verbose", 'v', 0, G_OPTION_ARG_NONE, &verbose,
 			/* TRANSLATORS: command line option */
 			_("Show extra debugging information"), NULL },
+		{ "backup", '\0', 0, G_OPTION_ARG_FILENAME, &backup_filename,
+			/* TRANSLATORS: command line option */
+			_("Back up the database to a file and exit"), NULL },
+		{ "archive", '\0', 0, G_OPTION_ARG_NONE, &archive,
+			/* TRANSLATORS: command line option */
+			_("Move old orders into the archive and exit"), NULL },
+		{ "import", '\0', 0, G_OPTION_ARG_FILENAME, &import_filename,
+			/* TRANSLATORS: command line option */
+			_("Import orders from a CSV or NDJSON file and exit"), NULL },
+		{ "allocate", '\0', 0, G_OPTION_ARG_NONE, &allocate,
+			/* TRANSLATORS: command line option */
+			_("Allocate devices to the imported orders"), NULL },
+		{ "send-emails", '\0', 0, G_OPTION_ARG_NONE, &send_emails,
+			/* TRANSLATORS: command line option */
+			_("Send the queued order emails and exit"), NULL },
+		{ "report", '\0', 0, G_OPTION_ARG_STRING, &report,
+			/* TRANSLATORS: command line option */
+			_("Export a report, e.g. sales, calibrations, orders or calibration-rate, and exit"), NULL },
+		{ "output", '\0', 0, G_OPTION_ARG_FILENAME, &output_filename,
+			/* TRANSLATORS: command line option */
+			_("The CSV or NDJSON file to write the report to"), NULL },
 		{ NULL}
 	};
 
@@ -1860,6 +2216,28 @@ main (int argc, char **argv)
 	/* set the database location */
 	database_uri = g_settings_get_string (priv->settings, "database-uri");
 	ch_database_set_uri (priv->database, database_uri);
+	journal_mode = g_settings_get_string (priv->settings, "database-journal-mode");
+	ch_database_set_journal_mode (priv->database, journal_mode);
+	ch_database_set_busy_timeout (priv->database,
+				      g_settings_get_uint (priv->settings,
+							   "database-busy-timeout"));
+	archive_uri = g_settings_get_string (priv->settings, "database-archive-uri");
+	ch_database_set_archive_uri (priv->database, archive_uri);
+	backup_uri = g_settings_get_string (priv->settings, "database-backup-uri");
+	ch_database_set_backup (priv->database, backup_uri,
+				g_settings_get_uint (priv->settings,
+						     "database-backup-interval"));
+	spool_dir = g_settings_get_string (priv->settings, "database-replication-spool");
+	station = g_settings_get_string (priv->settings, "database-replication-station");
+	ch_database_set_replication (priv->database, spool_dir, station,
+				     g_settings_get_uint (priv->settings,
+							  "database-replication-interval"));
+	ch_database_set_maintenance (priv->database,
+				     g_settings_get_uint (priv->settings,
+							  "database-maintenance-idle"));
+	g_signal_connect (priv->database, "changed",
+			  G_CALLBACK (ch_shipping_database_changed_cb), priv);
+	ch_database_watch (priv->database);
 
 	/* ensure single instance */
 	priv->application = gtk_application_new ("com.hughski.ColorHug.Shipping", 0);
@@ -1875,18 +2253,106 @@ main (int argc, char **argv)
 				   ch_shipping_ignore_cb, NULL);
 	}
 
+	/* copy the database while the stations are using it */
+	if (backup_filename != NULL) {
+		ret = ch_database_backup (priv->database, backup_filename, NULL, &error);
+		if (!ret) {
+			g_printerr ("%s: %s\n",
+				    _("Failed to back up database"),
+				    error->message);
+			g_error_free (error);
+			status = 1;
+		}
+		goto out;
+	}
+
+	/* keep the order list fast */
+	if (archive) {
+		ret = ch_database_archive_orders (priv->database,
+						  g_settings_get_uint (priv->settings,
+								       "database-archive-age"),
+						  &archived,
+						  &error);
+		if (!ret) {
+			g_printerr ("%s: %s\n",
+				    _("Failed to archive orders"),
+				    error->message);
+			g_error_free (error);
+			status = 1;
+			goto out;
+		}
+		/* TRANSLATORS: the number of orders moved to the archive */
+		g_print ("%s: %i\n", _("Archived orders"), archived);
+		goto out;
+	}
+
+	/* write out the whole history */
+	if (report != NULL) {
+		ret = ch_shipping_export_report (priv, report, output_filename, &error);
+		if (!ret) {
+			g_printerr ("%s: %s\n",
+				    _("Failed to export report"),
+				    error->message);
+			g_error_free (error);
+			status = 1;
+		}
+		goto out;
+	}
+
+	/* add lots of orders at once, queuing the emails */
+	if (import_filename != NULL) {
+		if (allocate)
+			import_flags |= CH_IMPORT_FLAG_ALLOCATE;
+		ret = ch_shipping_import_orders (priv, import_filename,
+						 import_flags, &error);
+		if (!ret) {
+			g_printerr ("%s: %s\n",
+				    _("Failed to import orders"),
+				    error->message);
+			g_error_free (error);
+			status = 1;
+			goto out;
+		}
+	}
+
+	/* send what was queued by an import */
+	if (send_emails) {
+		ret = ch_shipping_send_queued_emails (priv, &error);
+		if (!ret) {
+			g_printerr ("%s: %s\n",
+				    _("Failed to send emails"),
+				    error->message);
+			g_error_free (error);
+			status = 1;
+		}
+		goto out;
+	}
+	if (import_filename != NULL)
+		goto out;
+
 	/* wait */
 	status = g_application_run (G_APPLICATION (priv->application), argc, argv);
-
+out:
 	g_main_loop_unref (priv->loop);
 	g_object_unref (priv->application);
 	if (priv->builder != NULL)
 		g_object_unref (priv->builder);
 	if (priv->settings != NULL)
 		g_object_unref (priv->settings);
+	if (priv->search_cancellable != NULL)
+		g_object_unref (priv->search_cancellable);
 	if (priv->database != NULL)
 		g_object_unref (priv->database);
 	g_free (database_uri);
+	g_free (journal_mode);
+	g_free (archive_uri);
+	g_free (backup_uri);
+	g_free (spool_dir);
+	g_free (station);
+	g_free (backup_filename);
+	g_free (import_filename);
+	g_free (output_filename);
+	g_free (report);
 	g_free (priv);
 	return status;
 }